@@ -7,6 +7,11 @@
 
 #include "string.h"
 #include "img.h"
+#include <vector>
+
+#if defined(__AVX512VPOPCNTDQ__)
+#include <immintrin.h>
+#endif
 
 
 
@@ -83,7 +88,8 @@ static float *malloc_floating_census_joint_channels(float *x, int w, int h, int
 	uint8_t *y = (uint8_t*) malloc(w * h * nbytes);
 	color_census_transform(y, nbytes, x, w, h, pd, winradius);
 
-	float *fy = (float*) malloc(w * h * nfloats * sizeof*fy);
+	// calloc: the bytes of the last float that are not used must be 0
+	float *fy = (float*) calloc(w * h * nfloats, sizeof*fy);
 	for (int i = 0; i < w*h; i++)
 	{
 		float *to = fy + nfloats * i;
@@ -151,3 +157,110 @@ struct Img census_transform(struct Img &bx, int winradius)
 }
 
 
+
+/************ NATIVE CENSUS **************/
+// The census bits of each pixel are packed into nwords 64 bit words.
+// The order of the bits is not the same as in census_transform, but it is
+// irrelevant for the Hamming distance. The unused bits of the last word are 0.
+
+// number of census bits of an image with pd channels
+static inline int census_nbits(int pd, int winradius)
+{
+	int side = 2 * winradius + 1;
+	return pd * (side * side - 1);
+}
+
+// number of floats used by census_transform to store the same bits
+// (this is the number of channels of the census transformed Img)
+static inline int census_nfloats(int pd, int winradius)
+{
+	int nbytes = census_nbits(pd, winradius) / 8;
+	return ceil(nbytes / (float)sizeof(float));
+}
+
+// generates the native census codes of an image bx
+// (nwords words per pixel, stored at codes[(w*j + i)*nwords])
+std::vector<uint64_t> census_transform_bits(struct Img &bx, int winradius, int *out_nwords)
+{
+	int w  = bx.nx;
+	int h  = bx.ny;
+	int pd = bx.nch;
+	int nbits = census_nbits(pd, winradius);
+	int nwords = (nbits + 63) / 64;
+	std::vector<uint64_t> codes((size_t) w * h * nwords, 0);
+
+#pragma omp parallel for
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		uint64_t *out = &codes[((size_t) w * j + i) * nwords];
+		int cx = 0;
+		for (int l = 0; l < pd; l++)
+		{
+			float a = bx[(w*h)*l + j*w + i];
+			for (int jj = j - winradius; jj <= j + winradius; jj++)
+			for (int ii = i - winradius; ii <= i + winradius; ii++)
+			{
+				if (ii == i && jj == j) continue;
+				// outside samples are NAN, that is: a < b is false
+				if (ii >= 0 && ii < w && jj >= 0 && jj < h &&
+						a < bx[(w*h)*l + jj*w + ii])
+					out[cx / 64] |= (uint64_t) 1 << (cx % 64);
+				cx++;
+			}
+		}
+		assert(cx == nbits);
+	}
+
+	*out_nwords = nwords;
+	return codes;
+}
+
+
+// number of bits set in x
+static inline int popcount64(uint64_t x)
+{
+#if defined(__POPCNT__) || !defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	// table-free fallback (the builtin would call a table based libgcc routine)
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (x * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+
+// Hamming distances between the census code a and n consecutive codes of b:
+//    out[k] = | a XOR b[k] |     (each code has nwords words)
+static void census_hamming_row(int *out, const uint64_t *a, const uint64_t *b,
+		int n, int nwords)
+{
+	int k = 0;
+	if (nwords == 1)
+	{
+		uint64_t a0 = a[0];
+#if defined(__AVX512VPOPCNTDQ__)
+		__m512i va = _mm512_set1_epi64(a0);
+		for (; k + 8 <= n; k += 8)
+		{
+			__m512i vb = _mm512_loadu_si512((const void*)(b + k));
+			__m512i c = _mm512_popcnt_epi64(_mm512_xor_si512(va, vb));
+			// masked form: same vpmovqd, without the undefined operand
+			_mm256_storeu_si256((__m256i*)(out + k), _mm512_maskz_cvtepi64_epi32((__mmask8) -1, c));
+		}
+#endif
+		for (; k < n; k++)
+			out[k] = popcount64(a0 ^ b[k]);
+		return;
+	}
+
+	for (; k < n; k++)
+	{
+		int r = 0;
+		for (int t = 0; t < nwords; t++)
+			r += popcount64(a[t] ^ b[k*nwords + t]);
+		out[k] = r;
+	}
+}
@@ -4,10 +4,13 @@
 
 #include "img.h"
 #include <algorithm>
+#include <stdint.h>
+#include <string.h>
 #include "point.h"
 extern "C" {
 #include "iio.h"
 }
+#include "median_filter.c"
 
 /************ IMG IO  **************/
 
@@ -30,10 +33,25 @@ void iio_write_vector_split(char *nm, struct Img &out)
 }
 
 
+// isfinite that is not optimized away by -ffast-math (which assumes finite values)
+inline int isfinite_safe(float x) {
+   uint32_t b;
+   memcpy(&b, &x, sizeof b);
+   return (b & 0x7f800000) != 0x7f800000;
+}
+
+// isnan that is not optimized away by -ffast-math
+inline int isnan_safe(float x) {
+   uint32_t b;
+   memcpy(&b, &x, sizeof b);
+   return (b & 0x7fffffff) > 0x7f800000;
+}
+
+
 void remove_nonfinite_values_Img(struct Img &u, float newval) 
 {
    for(int i=0;i<u.npix*u.nch;i++) 
-      if (!isfinite(u[i])) u[i] = newval; 
+      if (!isfinite_safe(u[i])) u[i] = newval; 
 }
 
 
@@ -186,7 +204,7 @@ std::pair<float, float> image_minmax(struct Img &u){
    for (int j=0;j<ny;j++)
    for (int i=0;i<nx;i++) {
       float v = val(u,Point(i,j), c);
-      if (isfinite(v)) { 
+      if (isfinite_safe(v)) { 
          if (v < gmin) gmin = v;   
          if (v > gmax) gmax = v;
       }
@@ -195,26 +213,35 @@ std::pair<float, float> image_minmax(struct Img &u){
    return std::pair<float, float> (gmin, gmax);
 }
 
-/// Median filter
+/// Median filter (sliding window, see median_filter.c)
+/// the non-finite values are skipped and, for an even number of values,
+/// the upper of the two central ones is returned
 struct Img median_filter(struct Img &u, int radius) {
     struct Img M(u);
-    int size=2*radius+1;
-    size *= size;
-    std::vector<float> v(size);
     for(int k=0; k<M.nch; k++) 
-    for(int y=0; y<M.ny; y++)
-    for(int x=0; x<M.nx; x++)
+       median_filter_square(&M.data[k*M.npix], &u.data[k*u.npix], u.nx, u.ny,
+                            radius, MEDIAN_UPPER);
+    return M;
+}
+
+/// Downsampling by a factor 2: each pixel is the average of a 2x2 block
+/// (the blocks are clipped at the borders of images with odd sizes)
+struct Img downsample2x(struct Img &u) {
+    struct Img D((u.nx+1)/2, (u.ny+1)/2, u.nch);
+    for(int k=0; k<D.nch; k++) 
+    for(int y=0; y<D.ny; y++)
+    for(int x=0; x<D.nx; x++)
     {
-       int n=0;
-       for(int j=-radius; j<=radius; j++)
-          if(0<=j+y && j+y<u.ny)
-             for(int i=-radius; i<=radius; i++)
-                if(0<=i+x && i+x<u.nx)
-                   v[n++] = M.val(i+x,j+y,k);
-       std::nth_element(v.begin(), v.begin()+n/2, v.end());
-       M.val(x,y,k) = v[n/2];
+       float s = 0;
+       int n = 0;
+       for(int j=2*y; j<std::min(2*y+2, u.ny); j++)
+       for(int i=2*x; i<std::min(2*x+2, u.nx); i++) {
+          s += u.val(i,j,k);
+          n++;
+       }
+       D.val(x,y,k) = s/n;
     }
-    return M;
+    return D;
 }
 
 #endif // IMG_TOOLS_H_
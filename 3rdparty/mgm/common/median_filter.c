@@ -0,0 +1,483 @@
+// Sliding window median filter over an arbitrary structuring element.
+//
+// The element is given as horizontal runs: the run k covers the offsets
+// (dx, dy) = (a_k..b_k, dy_k) from the center.  When the window moves one
+// pixel to the right each run loses its leftmost pixel and gains a new one
+// on its right, so only 2*nruns values change.  The values of the window
+// are kept in a sorted array: the outgoing value is located by a (vectorized)
+// count and the incoming one takes its place, shifting only the values
+// between them.  The cost per pixel is O(nruns * (n/V + d)), where V is the
+// vector width and d is the rank difference of the two values (small on
+// smooth images like disparity maps), instead of a full sort (or a
+// selection) of the n values.  The 3x3 square has its own branch free path.
+//
+// The larger squares of images with at most MEDIAN_HIST_LEVELS distinct
+// finite values (integer disparities, masks, 8 bit images) use instead the
+// constant time median of Perreault and Hebert ("Median filtering in
+// constant time", 2007) on the indices of the values: the histograms of the
+// columns of the window are slid down the image, and the histogram of the
+// window along the rows, so that the cost per pixel does not depend on the
+// radius.  The histograms have two levels (coarse and fine bins) and the
+// fine bins of the window are only updated for the coarse bins that hold the
+// median.  The other images use the sorted array.
+//
+// The pixels outside the image and the non-finite values are skipped.
+// The rows are independent and are processed in parallel.
+//
+// This file is included by img_tools.h and by c/morsi.c (the makefile of s2p
+// gives the include path), so it must compile as C99 and as C++.
+
+#ifndef MEDIAN_FILTER_C
+#define MEDIAN_FILTER_C
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// statistic returned for windows with an even number of values
+#define MEDIAN_UPPER   0  // the upper of the two central values
+#define MEDIAN_AVERAGE 1  // the average of the two central values
+
+// a run of the structuring element
+struct median_run { int dy, a, b; };
+
+// isfinite that survives -ffast-math
+static int median_isgood(float x)
+{
+	uint32_t b;
+	memcpy(&b, &x, sizeof b);
+	return (b & 0x7f800000) != 0x7f800000;
+}
+
+// number of values of the sorted array t (of n values) smaller than v,
+// this is the position of the first copy of v (or where v would be inserted)
+// the count is branch free and vectorized: faster than a binary search
+// on the small arrays of the usual windows
+static int median_find(const float *t, int n, float v)
+{
+	int c = 0;
+	for (int k = 0; k < n; k++)
+		c += t[k] < v;
+	return c;
+}
+
+// insert v in the sorted array t of n values
+static void median_insert(float *t, int n, float v)
+{
+	int i = median_find(t, n, v);
+	memmove(t + i + 1, t + i, (n - i) * sizeof*t);
+	t[i] = v;
+}
+
+// remove one copy of v from the sorted array t of n values
+static void median_remove(float *t, int n, float v)
+{
+	int i = median_find(t, n, v);
+	if (i < n && t[i] == v)
+		memmove(t + i, t + i + 1, (n - i - 1) * sizeof*t);
+}
+
+// replace one copy of vout by vin in the sorted array t of n values
+static void median_replace(float *t, int n, float vout, float vin)
+{
+	int i = median_find(t, n, vout);
+	if (i >= n) i = n - 1;  // not reached, vout is in t
+	int j = median_find(t, n, vin);  // t[j-1] < vin <= t[j]
+	if (j > i) {
+		memmove(t + i, t + i + 1, (j - i - 1) * sizeof*t);
+		t[j-1] = vin;
+	} else {
+		memmove(t + j + 1, t + j, (i - j) * sizeof*t);
+		t[j] = vin;
+	}
+}
+
+static float median_of_sorted(const float *t, int n, int even)
+{
+	if (n < 1) return NAN;
+	if (n % 2 || even == MEDIAN_UPPER) return t[n/2];
+	return (t[n/2-1] + t[n/2]) / 2;
+}
+
+static int compare_median_runs_offsets(const void *aa, const void *bb)
+{
+	const int *a = (const int *)aa;
+	const int *b = (const int *)bb;
+	if (a[1] != b[1]) return a[1] - b[1];
+	return a[0] - b[0];
+}
+
+// decompose a list of n offsets (dx,dy) into runs, r must hold n runs
+// (repeated offsets start new runs, so they are counted several times)
+inline // to avoid unused warnings
+static int median_runs_from_offsets(struct median_run *r, const int *offsets, int n)
+{
+	int *o = (int *) malloc(2 * (n > 0 ? n : 1) * sizeof*o);
+	memcpy(o, offsets, 2 * n * sizeof*o);
+	qsort(o, n, 2 * sizeof*o, compare_median_runs_offsets);
+	int nruns = 0;
+	for (int k = 0; k < n; k++)
+		if (nruns > 0 && r[nruns-1].dy == o[2*k+1]
+				&& r[nruns-1].b + 1 == o[2*k])
+			r[nruns-1].b += 1;
+		else {
+			r[nruns].dy = o[2*k+1];
+			r[nruns].a = r[nruns].b = o[2*k];
+			nruns += 1;
+		}
+	free(o);
+	return nruns;
+}
+
+#define MEDIAN_MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MEDIAN_MAX(a,b) ((a) < (b) ? (b) : (a))
+
+static float median3(float a, float b, float c)
+{
+	return MEDIAN_MAX(MEDIAN_MIN(a, b), MEDIAN_MIN(MEDIAN_MAX(a, b), c));
+}
+
+// median of the finite values of the 3x3 window around (i,j) (slow path)
+static float median_3x3_at(const float *x, int w, int h, int i, int j, int even)
+{
+	float t[9];
+	int n = 0;
+	for (int jj = j - 1; jj <= j + 1; jj++)
+	for (int ii = i - 1; ii <= i + 1; ii++)
+		if (ii >= 0 && ii < w && jj >= 0 && jj < h
+				&& median_isgood(x[jj*w+ii]))
+			median_insert(t, n++, x[jj*w+ii]);
+	return median_of_sorted(t, n, even);
+}
+
+// 3x3 median: the columns of 3 values are sorted once (they are shared by
+// 3 windows) and the median of the 9 values is
+//     median3(max of the minima, median of the medians, min of the maxima)
+// this is branch free and vectorized.  The windows at the border of the
+// image or with non-finite values are done by median_3x3_at.
+static void median_filter_3x3(float *y, const float *x, int w, int h, int even)
+{
+#pragma omp parallel
+	{
+		float *lo = (float *) malloc(3 * w * sizeof*lo);
+		float *me = lo + w, *hi = me + w;
+		unsigned char *good = (unsigned char *) malloc(w);
+
+#pragma omp for schedule(dynamic)
+		for (int j = 0; j < h; j++)
+		{
+			if (j == 0 || j == h - 1 || w < 3) {
+				for (int i = 0; i < w; i++)
+					y[j*w+i] = median_3x3_at(x, w, h, i, j, even);
+				continue;
+			}
+
+			// sorted columns
+			const float *a = x + (j-1)*w, *b = x + j*w, *c = x + (j+1)*w;
+			for (int i = 0; i < w; i++)
+			{
+				float l = MEDIAN_MIN(a[i], b[i]), u = MEDIAN_MAX(a[i], b[i]);
+				lo[i] = MEDIAN_MIN(l, c[i]);
+				hi[i] = MEDIAN_MAX(u, c[i]);
+				me[i] = MEDIAN_MAX(l, MEDIAN_MIN(u, c[i]));
+			}
+			for (int i = 0; i < w; i++)
+				good[i] = median_isgood(a[i]) & median_isgood(b[i])
+					& median_isgood(c[i]);
+
+			float *yj = y + j*w;
+			for (int i = 1; i < w - 1; i++)
+			{
+				float l = MEDIAN_MAX(MEDIAN_MAX(lo[i-1], lo[i]), lo[i+1]);
+				float m = median3(me[i-1], me[i], me[i+1]);
+				float u = MEDIAN_MIN(MEDIAN_MIN(hi[i-1], hi[i]), hi[i+1]);
+				yj[i] = median3(l, m, u);
+			}
+			for (int i = 0; i < w; i++)
+				if (i == 0 || i == w - 1 || !(good[i-1] & good[i] & good[i+1]))
+					yj[i] = median_3x3_at(x, w, h, i, j, even);
+		}
+		free(good);
+		free(lo);
+	}
+}
+
+// radius of the element r if it is a square, 0 otherwise
+static int median_runs_square_radius(const struct median_run *r, int nruns)
+{
+	int radius = nruns / 2;
+	if (nruns % 2 == 0) return 0;
+	for (int k = 0; k < nruns; k++)
+		if (r[k].dy != k - radius || r[k].a != -radius || r[k].b != radius)
+			return 0;
+	return radius;
+}
+
+#define MEDIAN_HIST_FINE   32     // fine bins per coarse bin
+#define MEDIAN_HIST_LEVELS 1024   // distinct values (32 coarse bins)
+#define MEDIAN_HIST_NONE   0xffff // index of the non-finite values
+#define MEDIAN_HIST_BLOCK  64     // rows of the blocks processed in parallel
+
+// first index of the sorted array t of n values whose value is >= v
+static int median_lower_bound(const float *t, int n, float v)
+{
+	int a = 0, b = n;
+	while (a < b) {
+		int m = (a + b) / 2;
+		if (t[m] < v) a = m + 1;
+		else b = m;
+	}
+	return a;
+}
+
+// the sorted distinct finite values of x (of n pixels) and the index in
+// levels of the value of each pixel (MEDIAN_HIST_NONE if it is not finite),
+// returns the number of levels or -1 if there are more than
+// MEDIAN_HIST_LEVELS
+static int median_levels(uint16_t *q, float *levels, const float *x, int n)
+{
+	int nlevels = 0;
+	float prev = NAN;
+	for (int i = 0; i < n; i++)
+	{
+		if (!median_isgood(x[i]) || x[i] == prev) continue;
+		prev = x[i];
+		int k = median_lower_bound(levels, nlevels, x[i]);
+		if (k < nlevels && levels[k] == x[i]) continue;
+		if (nlevels == MEDIAN_HIST_LEVELS) return -1;
+		memmove(levels + k + 1, levels + k, (nlevels - k) * sizeof*levels);
+		levels[k] = x[i];
+		nlevels += 1;
+	}
+	for (int i = 0; i < n; i++)
+		q[i] = median_isgood(x[i]) ?
+			median_lower_bound(levels, nlevels, x[i]) : MEDIAN_HIST_NONE;
+	return nlevels;
+}
+
+// histograms of the sliding window of median_filter_square_hist
+struct median_hist {
+	int w, r, nbins, ncoarse;
+	uint16_t *cf, *cc; // of the columns (w x nbins fine, w x ncoarse coarse)
+	int *hf, *hc;      // of the window (nbins fine, ncoarse coarse)
+	int *last;         // the fine bins of the coarse bin k are those of the
+	                   // window of the pixel last[k] of the row
+};
+
+// add s (1 or -1) to the histograms of the columns for the row q
+static void median_hist_row(struct median_hist *H, const uint16_t *q, int s)
+{
+	for (int i = 0; i < H->w; i++)
+		if (q[i] != MEDIAN_HIST_NONE) {
+			H->cf[i*H->nbins + q[i]] += s;
+			H->cc[i*H->ncoarse + q[i]/MEDIAN_HIST_FINE] += s;
+		}
+}
+
+// add s (1 or -1) to the fine bins of the coarse bin k of the window for the
+// column i
+static void median_hist_fine(struct median_hist *H, int k, int i, int s)
+{
+	int *hf = H->hf + k*MEDIAN_HIST_FINE;
+	const uint16_t *cf = H->cf + i*H->nbins + k*MEDIAN_HIST_FINE;
+	for (int f = 0; f < MEDIAN_HIST_FINE; f++)
+		hf[f] += s * cf[f];
+}
+
+// index of the value of rank m of the window of the pixel i
+static int median_hist_rank(struct median_hist *H, int i, int m)
+{
+	int k = 0, acc = 0;
+	while (acc + H->hc[k] <= m)
+		acc += H->hc[k++];
+
+	// bring the fine bins of the coarse bin k to the window of i
+	int r = H->r;
+	if (i - H->last[k] > 2*r + 1) {
+		memset(H->hf + k*MEDIAN_HIST_FINE, 0, MEDIAN_HIST_FINE*sizeof*H->hf);
+		for (int p = MEDIAN_MAX(0, i - r); p <= MEDIAN_MIN(H->w - 1, i + r); p++)
+			median_hist_fine(H, k, p, 1);
+	} else
+		for (int p = H->last[k] + 1; p <= i; p++) {
+			if (p + r < H->w)   median_hist_fine(H, k, p + r, 1);
+			if (p - r - 1 >= 0) median_hist_fine(H, k, p - r - 1, -1);
+		}
+	H->last[k] = i;
+
+	const int *hf = H->hf + k*MEDIAN_HIST_FINE;
+	int f = 0;
+	while (acc + hf[f] <= m)
+		acc += hf[f++];
+	return k*MEDIAN_HIST_FINE + f;
+}
+
+// median over the (2*r+1)x(2*r+1) square of the image q of indices of the
+// values levels (see median_levels)
+static void median_filter_square_hist(float *y, const uint16_t *q, int w,
+		int h, int r, const float *levels, int nlevels, int even)
+{
+	int ncoarse = (nlevels + MEDIAN_HIST_FINE - 1) / MEDIAN_HIST_FINE;
+	int nbins = ncoarse * MEDIAN_HIST_FINE;
+	int nblocks = (h + MEDIAN_HIST_BLOCK - 1) / MEDIAN_HIST_BLOCK;
+
+#pragma omp parallel
+	{
+		struct median_hist H[1];
+		H->w = w;
+		H->r = r;
+		H->nbins = nbins;
+		H->ncoarse = ncoarse;
+		H->cf = (uint16_t *) malloc((size_t) w * nbins * sizeof*H->cf);
+		H->cc = (uint16_t *) malloc((size_t) w * ncoarse * sizeof*H->cc);
+		H->hf = (int *) malloc((nbins + 2*ncoarse) * sizeof*H->hf);
+		H->hc = H->hf + nbins;
+		H->last = H->hc + ncoarse;
+
+#pragma omp for schedule(dynamic)
+		for (int b = 0; b < nblocks; b++)
+		{
+			// histograms of the columns for the rows [j0-r, j0+r-1]
+			int j0 = b * MEDIAN_HIST_BLOCK;
+			int j1 = MEDIAN_MIN(h, j0 + MEDIAN_HIST_BLOCK);
+			memset(H->cf, 0, (size_t) w * nbins * sizeof*H->cf);
+			memset(H->cc, 0, (size_t) w * ncoarse * sizeof*H->cc);
+			for (int jj = MEDIAN_MAX(0, j0 - r); jj < MEDIAN_MIN(h, j0 + r); jj++)
+				median_hist_row(H, q + (size_t) jj*w, 1);
+
+			for (int j = j0; j < j1; j++)
+			{
+				// slide the columns down to the rows [j-r, j+r]
+				if (j > j0 && j - r - 1 >= 0)
+					median_hist_row(H, q + (size_t) (j-r-1)*w, -1);
+				if (j + r < h)
+					median_hist_row(H, q + (size_t) (j+r)*w, 1);
+
+				// slide the window along the row
+				memset(H->hc, 0, ncoarse * sizeof*H->hc);
+				for (int k = 0; k < ncoarse; k++)
+					H->last[k] = -(1 << 30);
+				for (int p = 0; p < MEDIAN_MIN(w, r); p++)
+					for (int k = 0; k < ncoarse; k++)
+						H->hc[k] += H->cc[p*ncoarse + k];
+				for (int i = 0; i < w; i++)
+				{
+					int n = 0;
+					for (int k = 0; k < ncoarse; k++) {
+						if (i + r < w)
+							H->hc[k] += H->cc[(i+r)*ncoarse + k];
+						if (i - r - 1 >= 0)
+							H->hc[k] -= H->cc[(i-r-1)*ncoarse + k];
+						n += H->hc[k];
+					}
+					float v = NAN;
+					if (n > 0)
+						v = levels[median_hist_rank(H, i, n/2)];
+					if (n > 0 && n % 2 == 0 && even == MEDIAN_AVERAGE)
+						v = (levels[median_hist_rank(H, i, n/2-1)] + v) / 2;
+					y[(size_t) j*w + i] = v;
+				}
+			}
+		}
+		free(H->hf);
+		free(H->cc);
+		free(H->cf);
+	}
+}
+
+// median of the square of the given radius (> 1) by the histograms of
+// median_filter_square_hist, returns 0 (and does nothing) if the image has
+// too many distinct values
+static int median_filter_square_try_hist(float *y, const float *x, int w,
+		int h, int radius, int even)
+{
+	if ((size_t) w * MEDIAN_HIST_LEVELS > (1 << 24))
+		return 0;  // the histograms of the columns would be too large
+	uint16_t *q = (uint16_t *) malloc((size_t) w * h * sizeof*q);
+	float *levels = (float *) malloc(MEDIAN_HIST_LEVELS * sizeof*levels);
+	int nlevels = median_levels(q, levels, x, w * h);
+	if (nlevels > 0)
+		median_filter_square_hist(y, q, w, h, radius, levels, nlevels, even);
+	free(levels);
+	free(q);
+	return nlevels > 0;
+}
+
+// median of the finite values of x around each pixel, the window is the
+// union of the runs r (see above) and even is MEDIAN_UPPER or MEDIAN_AVERAGE
+static void median_filter_runs(float *y, const float *x, int w, int h,
+		const struct median_run *r, int nruns, int even)
+{
+	int radius = median_runs_square_radius(r, nruns);
+	if (radius == 1) {
+		median_filter_3x3(y, x, w, h, even);
+		return;
+	}
+	if (radius > 1 && median_filter_square_try_hist(y, x, w, h, radius, even))
+		return;
+
+	int cap = 0;
+	for (int k = 0; k < nruns; k++)
+		cap += r[k].b - r[k].a + 1;
+
+#pragma omp parallel
+	{
+		float *t = (float *) malloc((cap > 0 ? cap : 1) * sizeof*t);
+
+#pragma omp for schedule(dynamic)
+		for (int j = 0; j < h; j++)
+		{
+			// window of the first pixel of the row
+			int n = 0;
+			for (int k = 0; k < nruns; k++)
+			{
+				int jj = j + r[k].dy;
+				if (jj < 0 || jj >= h) continue;
+				for (int ii = r[k].a; ii <= r[k].b; ii++)
+					if (ii >= 0 && ii < w && median_isgood(x[jj*w+ii]))
+						median_insert(t, n++, x[jj*w+ii]);
+			}
+			y[j*w] = median_of_sorted(t, n, even);
+
+			// slide it to the right
+			for (int i = 1; i < w; i++)
+			{
+				for (int k = 0; k < nruns; k++)
+				{
+					int jj = j + r[k].dy;
+					if (jj < 0 || jj >= h) continue;
+					int iout = i - 1 + r[k].a;
+					int iin  = i + r[k].b;
+					int out = iout >= 0 && iout < w && median_isgood(x[jj*w+iout]);
+					int in  = iin  >= 0 && iin  < w && median_isgood(x[jj*w+iin]);
+					if (out && in)
+						median_replace(t, n, x[jj*w+iout], x[jj*w+iin]);
+					else if (out)
+						median_remove(t, n--, x[jj*w+iout]);
+					else if (in)
+						median_insert(t, n++, x[jj*w+iin]);
+				}
+				y[j*w+i] = median_of_sorted(t, n, even);
+			}
+		}
+		free(t);
+	}
+}
+
+// median over the (2*radius+1)x(2*radius+1) square
+inline // to avoid unused warnings
+static void median_filter_square(float *y, const float *x, int w, int h,
+		int radius, int even)
+{
+	int nruns = 2 * radius + 1;
+	struct median_run *r = (struct median_run *) malloc(nruns * sizeof*r);
+	for (int k = 0; k < nruns; k++) {
+		r[k].dy = k - radius;
+		r[k].a = -radius;
+		r[k].b = radius;
+	}
+	median_filter_runs(y, x, w, h, r, nruns, even);
+	free(r);
+}
+
+#endif//MEDIAN_FILTER_C
@@ -123,7 +123,11 @@ struct Dvec
       }
    }
 
-   inline float operator[](int i)       { if (i>=this->min && i<=this->max) return this->data[i-this->min]; else return INFINITY;}
+   // pointer to the contiguous values of the range [min,max]
+   inline float       *values()       { return &data[0]; }
+   inline const float *values() const { return &data[0]; }
+
+   inline float operator[](int i) const { if (i>=this->min && i<=this->max) return this->data[i-this->min]; else return INFINITY;}
 
 };
 
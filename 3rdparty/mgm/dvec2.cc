@@ -0,0 +1,94 @@
+#ifndef DVEC2_H_
+#define DVEC2_H_
+#include <assert.h>
+#include <stdio.h>
+#include <math.h>
+
+
+// Dvec variant that does not own its data:
+// the values live in a contiguous arena owned by the costvolume_t
+// (see DVEC_ALLOCATION_HACK in mgm_costvolume.h) and the Dvec is only
+// a view over the range [min,max] of one pixel.
+// The interface is the same as the one of dvec.cc
+
+template<typename T>
+struct DvecT
+{
+   T *data;
+   int min,max;
+   T minval; // minimum value cache
+
+   inline int init(int min, int max, T *data)
+   {
+      assert(min<max);
+   	this->min = min;
+   	this->max = max;
+      this->data = data;
+      this->minval = cost_traits<T>::inf();  // by default cache is invalid
+      return 0;
+   }
+
+   inline DvecT()
+   {
+      data = NULL;
+      min = max = 0;
+      minval = cost_traits<T>::inf();
+   }
+
+   inline T get_minvalue() {
+      if (minval == cost_traits<T>::inf())
+         for(int o=min;o<=max;o++)
+            if (this->operator[](o) < minval)
+               minval=this->operator[](o);
+      return minval;
+
+   }
+
+
+   inline void set(int i, T value) {
+      if (i>=this->min && i<=this->max)
+      {
+         int idx = i-this->min;
+            data[idx]=value;
+         minval=cost_traits<T>::inf();  // invalidate  minval cache
+      }
+   }
+
+   inline void increment(int i, T value) {
+      if (i>=this->min && i<=this->max)
+      {
+         int idx = i-this->min;
+            data[idx]+=value;
+         minval=cost_traits<T>::inf();  // invalidate minval cache
+      }
+   }
+
+   inline void set_nolock(int i, T value) {
+      if (i>=this->min && i<=this->max)
+      {
+         int idx = i-this->min;
+         data[idx]=value;
+         minval=cost_traits<T>::inf();  // invalidate  minval cache
+      }
+   }
+
+   inline void increment_nolock(int i, T value) {
+      if (i>=this->min && i<=this->max)
+      {
+         int idx = i-this->min;
+         data[idx]+=value;
+         minval=cost_traits<T>::inf();  // invalidate minval cache
+      }
+   }
+
+   // pointer to the contiguous values of the range [min,max]
+   inline T       *values()       { return data; }
+   inline const T *values() const { return data; }
+
+   inline T operator[](int i) const { if (i>=this->min && i<=this->max) return this->data[i-this->min]; else return cost_traits<T>::inf();}
+
+};
+
+typedef DvecT<float> Dvec;
+
+#endif /* DVEC2_H_ */
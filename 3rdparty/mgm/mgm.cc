@@ -8,6 +8,9 @@
 #include <vector>
 #include <cstring>
 #include "assert.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "smartparameter.h"
 
@@ -37,12 +40,14 @@ struct costvolume_t allocate_and_fill_sgm_costvolume (struct Img &in_u, // sourc
 /********************** MGM *****************************/
 
 #include "mgm_core.cc"
-struct costvolume_t mgm(struct costvolume_t CC, const struct Img &in_w, 
+template<typename T>
+struct costvolume_t mgm(const struct costvolume_T<T> &CC, const struct Img &in_w, 
                         const struct Img &dminI, const struct Img &dmaxI, 
                         struct Img *out, struct Img *outcost, 
                         const float P1, const float P2, const int NDIR, const int MGM, 
                         const int USE_FELZENSZWALB_POTENTIALS, // USE SGM(0) or FELZENSZWALB(1) POTENTIALS
-                        int SGM_FIX_OVERCOUNT);                // fix the overcounting in SGM following (Drory etal. 2014)
+                        int SGM_FIX_OVERCOUNT,                 // fix the overcounting in SGM following (Drory etal. 2014)
+                        const float scale);                    // scale of the fixed point costs
 
 #include "mgm_weights.h"
 struct Img compute_mgm_weights(struct Img &u, float aP, float aThresh);
@@ -56,8 +61,19 @@ void subpixel_refinement_sgm(struct costvolume_t &S,       // modifies out and o
                              char *refinement); //none, vfit, parabola, cubic, parabolaOCV
 
 #include "mgm_print_energy.h"
+template<typename T>
 void print_solution_energy(const struct Img &in_u, std::vector<float > &disp, 
-                           struct costvolume_t &CC, float P1, float P2);
+                           const struct costvolume_T<T> &CC, float P1, float P2, float scale);
+
+/******************** MEMORY BOUNDED MGM **************************/
+
+#include "mgm_stream.h"
+void mgm_stream(const struct costvolume_filler &F, const struct Img &in_w,
+                const struct Img &dminI, const struct Img &dmaxI,
+                struct Img *out, struct Img *outcost,
+                const float P1, const float P2, const int MGM,
+                const int USE_FELZENSZWALB_POTENTIALS, int SGM_FIX_OVERCOUNT,
+                char *refinement);
 
 /********************** OTHERSTUFF  *****************************/
 
@@ -114,6 +130,16 @@ void leftright_test_bleyer(struct Img &dx, struct Img &Rdx)
 }
 
 
+// peak resident memory of the process in MB
+#include <sys/resource.h>
+double peak_memory_MB()
+{
+   struct rusage r;
+   getrusage(RUSAGE_SELF, &r);
+   return r.ru_maxrss / 1024.0;  // ru_maxrss is in KB on Linux
+}
+
+
 std::pair<float, float> update_dmin_dmax(struct Img outoff, struct Img *dminI, struct Img *dmaxI, int slack=3, int radius=2) {
    struct Img dminI2(*dminI);
    struct Img dmaxI2(*dmaxI);
@@ -135,7 +161,7 @@ std::pair<float, float> update_dmin_dmax(struct Img outoff, struct Img *dminI, s
       for (int di=-r;di<=r;di++)
       {
          float v = valneumann(outoff, i+di, j+dj);
-         if (isfinite(v)) {
+         if (isfinite_safe(v)) {
             dmin = fmin( dmin, v - slack );
             dmax = fmax( dmax, v + slack );
          } else {
@@ -143,7 +169,7 @@ std::pair<float, float> update_dmin_dmax(struct Img outoff, struct Img *dminI, s
             dmax = fmax( dmax, gmax + slack );
          }
       }
-      if (isfinite(dmin)) { 
+      if (isfinite_safe(dmin)) { 
          dminI2[i+j*nx] = dmin; dmaxI2[i+j*nx] = dmax; 
       }
 
@@ -190,8 +216,158 @@ SMART_PARAMETER(WITH_MGM2,0);
 SMART_PARAMETER(TSGM_ITER,1)
 SMART_PARAMETER(TESTLRRL,1)
 SMART_PARAMETER(MEDIAN,0)
+SMART_PARAMETER(MGM_UINT16,0)
+
+
+// aggregation of the float costs with mgm or mgm2
+struct costvolume_t mgm_aggregate(const struct costvolume_t &CC, const struct Img &u_w,
+                                  const struct Img &dminI, const struct Img &dmaxI,
+                                  struct Img *outoff, struct Img *outcost,
+                                  float P1, float P2, int NDIR, float scale)
+{
+   return WITH_MGM2() ?  
+             mgm2(CC, u_w, dminI, dmaxI, outoff, outcost, P1, P2, 
+                NDIR, TSGM(), USE_TRUNCATED_LINEAR_POTENTIALS(), TSGM_FIX_OVERCOUNT()) :
+             mgm(CC, u_w, dminI, dmaxI, outoff, outcost, P1, P2, 
+                NDIR, TSGM(), USE_TRUNCATED_LINEAR_POTENTIALS(), TSGM_FIX_OVERCOUNT(), scale) ;
+}
+
+#ifdef DVEC_ALLOCATION_HACK
+// aggregation of the fixed point costs (only mgm)
+struct costvolume_t mgm_aggregate(const struct costvolume_T<uint16_t> &CC, const struct Img &u_w,
+                                  const struct Img &dminI, const struct Img &dmaxI,
+                                  struct Img *outoff, struct Img *outcost,
+                                  float P1, float P2, int NDIR, float scale)
+{
+   return mgm(CC, u_w, dminI, dmaxI, outoff, outcost, P1, P2, 
+              NDIR, TSGM(), 0, TSGM_FIX_OVERCOUNT(), scale);
+}
+#endif
+
+
+// TSGM_ITER iterations of mgm (or mgm2) and subpixel refinement,
+// after each iteration the ranges dminI and dmaxI are reduced around the solution
+// CC is a costvolume_t, or a costvolume_T<uint16_t> with the costs multiplied by scale
+template<typename V>
+void mgm_iterations(V &CC, const struct Img &u, const struct Img &u_w,
+                    struct Img &dminI, struct Img &dmaxI,
+                    struct Img *outoff, struct Img *outcost,
+                    float P1, float P2, int NDIR, char *refine, float scale = 1)
+{
+   for(int i = 0; i < TSGM_ITER(); i++) {
+      struct costvolume_t S = mgm_aggregate(CC, u_w, dminI, dmaxI, outoff, outcost, P1, P2, NDIR, scale);
+      print_solution_energy(u, outoff->data, CC, P1, P2, scale);
+      // call subpixel refinement  (modifies out and outcost)
+      subpixel_refinement_sgm(S, outoff->data, outcost->data, refine);
+      std::pair<float,float>gminmax = update_dmin_dmax(*outoff, &dminI, &dmaxI);
+      remove_nonfinite_values_Img(dminI, gminmax.first);
+      remove_nonfinite_values_Img(dmaxI, gminmax.second);
+//       char name[200]; sprintf(name, "/tmp/%02d.tif", i); // DEBUG
+//	      iio_write_vector_split(name, *outoff); // DEBUG
+//         // dump disp range
+//       struct Img rr = Img(dmaxI);
+//       for(int i=0;i<rr.npix;i++) rr[i] -= dminI[i];
+//	      iio_write_vector_split(name, rr); // DEBUG
+   }
+}
+
+
+
+
+// allocate and fill the cost volumes of the LR (and RL if CCR) problems
+// V is costvolume_t or costvolume_T<uint16_t>, the costs are multiplied by scale
+template<typename V>
+void allocate_and_fill_lrrl(const struct costvolume_filler &F, float scale,
+                            const struct Img &dminI, const struct Img &dmaxI,
+                            const struct Img &dminRI, const struct Img &dmaxRI,
+                            V *CC, V *CCR)
+{
+   V tmp(dminI, dmaxI);
+   CC->swap(tmp);
+   if (CCR) {
+      V tmpR(dminRI, dmaxRI);
+      CCR->swap(tmpR);
+      fill_sgm_costvolume_lrrl(F, *CC, *CCR, scale);
+   }
+   else
+      fill_sgm_costvolume(F, *CC, scale);
+}
+
+
+// Scale of the fixed point costs (MGM_UINT16): the largest power of two
+// such that the sum of the NDIR messages, each bounded by maxcost+P2,
+// and the sum of the MGM edge terms, each bounded by P2, fit in 16 bits
+float fixed_point_scale(float maxcost, float P2, int NDIR, int MGM)
+{
+   float bound = __min(65534 / (NDIR * (maxcost + P2)), 65534 / (__max(MGM,1) * P2));
+   return exp2f(floorf(log2f(bound)));
+}
+
+
+// check if the weights w are all 1
+static int all_ones(const struct Img &w)
+{
+   for (int i=0; i<w.ncol*w.nrow*w.nch; i++)
+      if (w[i] != 1.0) return 0;
+   return 1;
+}
 
 
+// Coarse-to-fine search ranges. The pair is solved at half resolution over
+// the ranges dminI, dmaxI (recursively, with nscales levels) and then the
+// ranges are narrowed around the upsampled solution, as in the TSGM_ITER loop.
+// The new ranges are always contained in the original ones.
+void multiscale_ranges(struct Img &u, struct Img &v, struct Img &dminI, struct Img &dmaxI,
+                       int nscales, float P1, float P2, float aP2, float aThresh, int NDIR,
+                       char *prefilter, char *distance, float truncDist, char *refine)
+{
+   if (nscales <= 1 || u.nx < 2 || u.ny < 2) return;
+   int nx = u.nx;
+   int ny = u.ny;
+
+   // coarse pair and ranges, a coarse pixel covers the ranges of its 2x2 block
+   struct Img su = downsample2x(u);
+   struct Img sv = downsample2x(v);
+   struct Img sdminI(su.nx, su.ny);
+   struct Img sdmaxI(su.nx, su.ny);
+   for(int i=0;i<su.npix;i++) {sdminI[i] = INFINITY; sdmaxI[i] = -INFINITY;}
+   for (int j=0;j<ny;j++)
+   for (int i=0;i<nx;i++) {
+      int si = i/2 + (j/2)*su.nx;
+      sdminI[si] = fmin(sdminI[si], floor(dminI[i+j*nx]/2));
+      sdmaxI[si] = fmax(sdmaxI[si], ceil (dmaxI[i+j*nx]/2));
+   }
+
+   multiscale_ranges(su, sv, sdminI, sdmaxI, nscales-1, P1, P2, aP2, aThresh, NDIR,
+                     prefilter, distance, truncDist, refine);
+
+   if (TSGM_DEBUG()) printf("multiscale: solving at %dx%d\n", su.nx, su.ny);
+   struct Img su_w = compute_mgm_weights(su, aP2, aThresh);
+   struct Img soutoff(su.nx, su.ny);
+   struct Img soutcost(su.nx, su.ny);
+   {
+      struct costvolume_t CC = allocate_and_fill_sgm_costvolume (su, sv, sdminI, sdmaxI, prefilter, distance, truncDist);
+      mgm_iterations(CC, su, su_w, sdminI, sdmaxI, &soutoff, &soutcost, P1, P2, NDIR, refine);
+   }
+
+   // upsample the solution and narrow the ranges around it
+   struct Img outoff(nx, ny);
+   for (int j=0;j<ny;j++)
+   for (int i=0;i<nx;i++)
+      outoff[i+j*nx] = 2*soutoff[i/2 + (j/2)*su.nx];
+   struct Img ndminI(dminI);
+   struct Img ndmaxI(dmaxI);
+   update_dmin_dmax(outoff, &ndminI, &ndmaxI);
+
+   for (int i=0;i<u.npix;i++) {
+      float dmin = fmax(dminI[i], floor(ndminI[i]));
+      float dmax = fmin(dmaxI[i], ceil (ndmaxI[i]));
+      if (dmax >= dmin + 1) {
+         dminI[i] = dmin;
+         dmaxI[i] = dmax;
+      }
+   }
+}
 
 int main(int argc, char* argv[]) 
 {
@@ -209,6 +385,11 @@ int main(int argc, char* argv[])
 		fprintf (stderr, "        [-aP2         (1)]:    \\sum |I1 - I2|^2 < nch*aThresh^2\n");
 		fprintf (stderr, "        [-aThresh     (5)]: Threshold for the multiplier factor (default 5)\n");
 		fprintf (stderr, "        [-l   FILE (none)]: write disparity without LR test (default none)\n");
+		fprintf (stderr, "        [-stream         ]: memory bounded mode, the cost volume is computed row by row\n");
+		fprintf (stderr, "                          : only the passes (I) and (V) are used, -O and TSGM_ITER are ignored\n");
+		fprintf (stderr, "                          : the aggregation of a row is sequential, it uses one thread per pass\n");
+		fprintf (stderr, "        [-scales      (1)]: coarse-to-fine: solve at 2^-(scales-1) of the resolution, then\n");
+		fprintf (stderr, "                          : restrict the ranges around the upsampled solution at each scale\n");
 		fprintf (stderr, "        ENV: CENSUS_NCC_WIN=3   : size of the window for census and NCC\n");
 		fprintf (stderr, "        ENV: TESTLRRL=1   : lrrl\n");
 		fprintf (stderr, "        ENV: MEDIAN=0     : radius of the median filter postprocess\n");
@@ -216,6 +397,9 @@ int main(int argc, char* argv[])
 		fprintf (stderr, "        ENV: TSGM_ITER=1  : iterations\n");
 		fprintf (stderr, "        ENV: TSGM_FIX_OVERCOUNT=1   : fix overcounting of the data term in the energy\n");
 		fprintf (stderr, "        ENV: TSGM_DEBUG=0 : prints debug informtion\n");
+		fprintf (stderr, "        ENV: MGM_BLOCKSIZE=16 : side of the blocks of the parallel scan of mgm\n");
+		fprintf (stderr, "        ENV: MGM_UINT16=0 : aggregate 16 bit fixed point costs (when=1), only for mgm\n");
+		fprintf (stderr, "                          : without image dependent weights, the others use float\n");
 		fprintf (stderr, "        ENV: TSGM_2LMIN=0 : use the improved TSGM cost only for TSGM=2. Overrides TSGM value\n");
 		fprintf (stderr, "        ENV: USE_TRUNCATED_LINEAR_POTENTIALS=0 : use the Felzenszwalb-Huttenlocher\n");
 		fprintf (stderr, "                          : truncated linear potential (when=1). P1 and P2 change meaning\n");
@@ -242,6 +426,8 @@ int main(int argc, char* argv[])
    char* refine    = pick_option(&argc, &argv, (char*) "s", (char*) "none"); //{none|vfit|parabola|cubic}
    float truncDist = atof(pick_option(&argc, &argv, (char*) "truncDist",  (char*) "inf"));
    char *nolr_disp_file = pick_option(&argc, &argv, (char*) "l", (char*) "");
+   int STREAM = pick_option(&argc, &argv, (char*) "stream", NULL) != NULL;
+   int NSCALES = atoi(pick_option(&argc, &argv, (char*) "scales", (char*) "1"));
 
 	char* f_u     = (argc>i) ? argv[i] : NULL;      i++;
 	char* f_v     = (argc>i) ? argv[i] : NULL;      i++;
@@ -293,31 +479,89 @@ int main(int argc, char* argv[])
 
 
 
+   // coarse-to-fine narrowing of the search ranges
+   if (NSCALES > 1) {
+      multiscale_ranges(u, v, dminI, dmaxI, NSCALES, P1, P2, aP2, aThresh, NDIR,
+                        prefilter, distance, truncDist, refine);
+      if (TESTLRRL())
+         multiscale_ranges(v, u, dminRI, dmaxRI, NSCALES, P1, P2, aP2, aThresh, NDIR,
+                           prefilter, distance, truncDist, refine);
+   }
+
    struct Img u_w = compute_mgm_weights(u, aP2, aThresh); // missing aP1 !! TODO
    struct Img v_w = compute_mgm_weights(v, aP2, aThresh);
 
 
-   struct costvolume_t CC = allocate_and_fill_sgm_costvolume (u, v, dminI, dmaxI, prefilter, distance, truncDist);
-   for(int i = 0; i < TSGM_ITER(); i++) {
-      struct costvolume_t S = WITH_MGM2() ?  
-                                 mgm2(CC, u_w, dminI, dmaxI, &outoff, &outcost, P1, P2, 
-                                    NDIR, TSGM(), USE_TRUNCATED_LINEAR_POTENTIALS(), TSGM_FIX_OVERCOUNT()) :
-                                 mgm(CC, u_w, dminI, dmaxI, &outoff, &outcost, P1, P2, 
-                                    NDIR, TSGM(), USE_TRUNCATED_LINEAR_POTENTIALS(), TSGM_FIX_OVERCOUNT()) ;
-      print_solution_energy(u, outoff.data, CC, P1, P2);
-      // call subpixel refinement  (modifies out and outcost)
-      subpixel_refinement_sgm(S, outoff.data, outcost.data, refine);
-      std::pair<float,float>gminmax = update_dmin_dmax(outoff, &dminI, &dmaxI);
-      remove_nonfinite_values_Img(dminI, gminmax.first);
-      remove_nonfinite_values_Img(dmaxI, gminmax.second);
-//       char name[200]; sprintf(name, "/tmp/%02d.tif", i); // DEBUG
-//	      iio_write_vector_split(name, outoff); // DEBUG
-//         // dump disp range
-//       struct Img rr = Img(dmaxI);
-//       for(int i=0;i<rr.npix;i++) rr[i] -= dminI[i];
-//	      iio_write_vector_split(name, rr); // DEBUG
+   // The LR and RL problems share the cost computation (the RL volume is
+   // a shear of the LR one) and then are solved concurrently. Each one uses
+   // half of the threads for its own parallel loops (nested parallelism).
+   struct costvolume_filler *F = new costvolume_filler(u, v, prefilter, distance, truncDist);
+   struct costvolume_filler *FR = NULL;
+   if (STREAM && TESTLRRL()) FR = new costvolume_filler(F->swapped());
+
+   // fixed point costs: half the memory and twice the SIMD lanes
+   int FIXED = 0;
+   float scale = 1;
+#ifdef DVEC_ALLOCATION_HACK
+   if (MGM_UINT16() && !STREAM) {
+      scale = fixed_point_scale(F->max_cost(), P2, NDIR, TSGM());
+      FIXED = !WITH_MGM2() && !USE_TRUNCATED_LINEAR_POTENTIALS() &&
+              all_ones(u_w) && (!TESTLRRL() || all_ones(v_w)) && scale >= 1;
+      if (!FIXED) scale = 1;
+      if (TSGM_DEBUG() || !FIXED)
+         printf("MGM_UINT16: %s (scale %g)\n", FIXED ? "using 16 bit costs" : "not available, using float costs", scale);
    }
-   if(MEDIAN()) outoff = median_filter(outoff,MEDIAN());
+   struct costvolume_T<uint16_t> CC16, CCR16;
+   if (FIXED)
+      allocate_and_fill_lrrl(*F, scale, dminI, dmaxI, dminRI, dmaxRI, &CC16, TESTLRRL() ? &CCR16 : NULL);
+#endif
+   struct costvolume_t CC, CCR;
+   if (!STREAM && !FIXED)
+      allocate_and_fill_lrrl(*F, scale, dminI, dmaxI, dminRI, dmaxRI, &CC, TESTLRRL() ? &CCR : NULL);
+
+   int nthreads = 1;
+#ifdef _OPENMP
+   nthreads = omp_get_max_threads();
+   if (TESTLRRL()) omp_set_max_active_levels(2);
+#endif
+   #pragma omp parallel sections num_threads(2) if(TESTLRRL())
+   {
+      #pragma omp section
+      {
+#ifdef _OPENMP
+         if (TESTLRRL()) omp_set_num_threads(__max(1, (nthreads+1)/2));
+#endif
+         if (STREAM)
+            mgm_stream(*F, u_w, dminI, dmaxI, &outoff, &outcost, P1, P2,
+                  TSGM(), USE_TRUNCATED_LINEAR_POTENTIALS(), TSGM_FIX_OVERCOUNT(), refine);
+#ifdef DVEC_ALLOCATION_HACK
+         else if (FIXED)
+            mgm_iterations(CC16, u, u_w, dminI, dmaxI, &outoff, &outcost, P1, P2, NDIR, refine, scale);
+#endif
+         else
+            mgm_iterations(CC, u, u_w, dminI, dmaxI, &outoff, &outcost, P1, P2, NDIR, refine);
+         if(MEDIAN()) outoff = median_filter(outoff,MEDIAN());
+      }
+
+      #pragma omp section
+      if (TESTLRRL()) {
+#ifdef _OPENMP
+         omp_set_num_threads(__max(1, nthreads/2));
+#endif
+         if (STREAM)
+            mgm_stream(*FR, v_w, dminRI, dmaxRI, &outoffR, &outcostR, P1, P2,
+                  TSGM(), USE_TRUNCATED_LINEAR_POTENTIALS(), TSGM_FIX_OVERCOUNT(), refine);
+#ifdef DVEC_ALLOCATION_HACK
+         else if (FIXED)
+            mgm_iterations(CCR16, v, v_w, dminRI, dmaxRI, &outoffR, &outcostR, P1, P2, NDIR, refine, scale);
+#endif
+         else
+            mgm_iterations(CCR, v, v_w, dminRI, dmaxRI, &outoffR, &outcostR, P1, P2, NDIR, refine);
+         if(MEDIAN()) outoffR = median_filter(outoffR,MEDIAN());
+      }
+   }
+   delete F;
+   delete FR;
 
 
 	// save the disparity without LR
@@ -326,21 +570,6 @@ int main(int argc, char* argv[])
 
    
    if(TESTLRRL()) {
-      struct costvolume_t CC = allocate_and_fill_sgm_costvolume (v, u, dminRI, dmaxRI, prefilter, distance, truncDist);
-      for(int i = 0; i < TSGM_ITER(); i++) {
-         struct costvolume_t S = WITH_MGM2() ?  
-                                    mgm2(CC, v_w, dminRI, dmaxRI, &outoffR, &outcostR, P1, P2, 
-                                       NDIR, TSGM(), USE_TRUNCATED_LINEAR_POTENTIALS(), TSGM_FIX_OVERCOUNT()) :
-                                    mgm(CC, v_w, dminRI, dmaxRI, &outoffR, &outcostR, P1, P2, 
-                                       NDIR, TSGM(), USE_TRUNCATED_LINEAR_POTENTIALS(), TSGM_FIX_OVERCOUNT()) ;
-         print_solution_energy(v, outoffR.data, CC, P1, P2);
-         // call subpixel refinement  (modifies out and outcost)
-         subpixel_refinement_sgm(S, outoffR.data, outcostR.data, refine);
-         std::pair<float,float>gminmax = update_dmin_dmax(outoffR, &dminRI, &dmaxRI);
-         remove_nonfinite_values_Img(dminRI, gminmax.first);
-         remove_nonfinite_values_Img(dmaxRI, gminmax.second);
-      }
-      if(MEDIAN()) outoffR = median_filter(outoffR,MEDIAN());
       Img tmpL(outoff);
       Img tmpR(outoffR);
       leftright_test(outoffR, tmpL); // R-L
@@ -369,6 +598,8 @@ int main(int argc, char* argv[])
 	iio_write_vector_split(f_out, out);
 	if(f_cost) iio_write_vector_split(f_cost, outcost);
 	if(f_back) iio_write_vector_split(f_back, syn);
+
+	if (TSGM_DEBUG()) printf("peak memory: %.1f MB\n", peak_memory_MB());
 	
 	return 0;
 }
@@ -37,7 +37,7 @@
 //      cv[i].init(min[i], max[i]);
 //   return cv;
 //}
-struct costvolume_t allocate_costvolume (struct Img min, struct Img max);
+struct costvolume_t allocate_costvolume (const struct Img &min, const struct Img &max);
 
 
 /********************** MGM *****************************/
@@ -57,88 +57,56 @@ static inline float fmin3(float a, float b, float c)
    return m;
 }
 
+// vectorized kernels for the message updates
+#include "mgm_simd.h"
+
 
 // intervening points p,q,r 
 // faster variant for the case 2
 // THIS IS THE SIMPLEST MGM WEIGHT UPDATE FUNCTION
-inline void update_cost2(Dvec &Lp, Dvec &CCp, Dvec &Lq, Dvec &Lr, const float P1, const float P2) {
+inline void update_cost2(Dvec &Lp, const Dvec &CCp, Dvec &Lq, Dvec &Lr, const float P1, const float P2) {
 
-            float min1L_all = Lq.get_minvalue();
-            float min2L_all = Lr.get_minvalue();
+            float minL[2] = {Lq.get_minvalue(), Lr.get_minvalue()};
+            float P1s[2]  = {P1, P1};
+            float P2s[2]  = {P2, P2};
 
-            for(int o=Lp.min;o<=Lp.max;o++) {
-               float C    = CCp[o];  // the matching cost for p <-> p+d
+            // padded neighbor rows: the label o-1, o, o+1 are read without bound checks
+            int n = Lp.max-Lp.min+1;
+            float buf1[n+2], buf2[n+2];
+            const float *q[2] = {padded_row(Lq, Lp, buf1), padded_row(Lr, Lp, buf2)};
 
-               float vL0  = Lq[o];	// the neighbor has the same label
-               float vLP1 = __min( Lq[o-1],  Lq[o+1]) + P1;		// the neighbour has a similar (+-1) label
-               float vLP2 = min1L_all + P2;  // the minimum label of the neighbour
-
-               float v2L0  = Lr[o];	// the neighbor has the same label
-               float v2LP1 = __min( Lr[o-1],  Lr[o+1]) + P1;		// the neighbour has a similar (+-1) label
-               float v2LP2 = min2L_all + P2;  // the minimum label of the neighbour
-
-               float edge_potentials = 0;
-               edge_potentials += (fmin3(vL0 , vLP1 , vLP2 ) - min1L_all) / 2;
-               edge_potentials += (fmin3(v2L0, v2LP1, v2LP2) - min2L_all) / 2;
-
-
-               Lp.set_nolock(o,  C + edge_potentials);
-            }
+            //    edge_potentials = (fmin3(vL0 , vLP1 , vLP2 ) - min1L_all) / 2
+            //                    + (fmin3(v2L0, v2LP1, v2LP2) - min2L_all) / 2
+            //    Lp[o] = C + edge_potentials
+            Lp.minval = mgm_simd_update_row(Lp.values(), CCp.values(), n, q, P1s, P2s, minL, 2);
 
 }
 
 
 // intervening points p,q,r 
 // THIS FUNCTION CONSIDERS 4 NEIGHBORS AND WEIGHTED EDGES
-inline void update_costW(Dvec &Lp, Dvec &CCp, Dvec &Lq, Dvec &Lr, Dvec &Ls, Dvec &Lt, const float P1, const float P2,
+inline void update_costW(Dvec &Lp, const Dvec &CCp, Dvec &Lq, Dvec &Lr, Dvec &Ls, Dvec &Lt, const float P1, const float P2,
       const float DeltaI1, const float DeltaI2, const float DeltaI3, const float DeltaI4, const int howmany) {
 
-            float minL_all  = INFINITY;
-            float min2L_all = INFINITY;
-            float min3L_all = INFINITY;
-            float min4L_all = INFINITY;
+            Dvec *L[4] = {&Lq, &Lr, &Ls, &Lt};
+            float DeltaI[4] = {DeltaI1, DeltaI2, DeltaI3, DeltaI4};
+            float minL[4], P1s[4], P2s[4];
 
-            minL_all = Lq.get_minvalue();
-            if (howmany >= 2) min2L_all = Lr.get_minvalue();
-            if (howmany >= 3) min3L_all = Ls.get_minvalue();
-            if (howmany >= 4) min4L_all = Lt.get_minvalue();
-
-            for(int o=Lp.min;o<=Lp.max;o++) {
-               float C    = CCp[o];  // the matching cost for p <-> p+d
-               //float C    = computeC( p,p+Point(o,0), u,v);  // the matching cost for p <-> p+d // SLOWER
-               float edge_potentials = 0;
-               
-               float vL0  = Lq[o];	// the neighbor has the same label
-               float vLP1 = __min( Lq[o-1],  Lq[o+1]) + P1*DeltaI1;		// the neighbour has a similar (+-1) label
-               float vLP2 = minL_all + P2*DeltaI1;  // the minimum label of the neighbour
-               edge_potentials += fmin3(vL0 , vLP1 , vLP2 ) - minL_all;
+            int n = Lp.max-Lp.min+1;
+            float buf[4][n+2];
+            const float *q[4];
 
-               if (howmany >= 2) {
-                  float v2L0  = Lr[o];	// the neighbor has the same label
-                  float v2LP1 = __min( Lr[o-1],  Lr[o+1]) + P1*DeltaI2;		// the neighbour has a similar (+-1) label
-                  float v2LP2 = min2L_all + P2*DeltaI2;  // the minimum label of the neighbour
-
-                  edge_potentials += fmin3(v2L0, v2LP1, v2LP2) - min2L_all;
-               }
-
-               if (howmany >= 3) {
-                  float v3L0  = Ls[o];	// the neighbor has the same label
-                  float v3LP1 = __min( Ls[o-1],  Ls[o+1]) + P1*DeltaI3;		// the neighbour has a similar (+-1) label
-                  float v3LP2 = min3L_all + P2*DeltaI3;  // the minimum label of the neighbour
-
-                  edge_potentials += fmin3(v3L0, v3LP1, v3LP2) - min3L_all;
-               }
-
-               if (howmany >= 4) {
-                  float v4L0  = Lt[o];	// the neighbor has the same label
-                  float v4LP1 = __min( Lt[o-1],  Lt[o+1]) + P1*DeltaI4; // the neighbour has a similar (+-1) label
-                  float v4LP2 = min4L_all + P2*DeltaI4;  // the minimum label of the neighbour
-                  edge_potentials += fmin3(v4L0, v4LP1, v4LP2) - min4L_all;
-               }
-
-               Lp.set_nolock(o,  C + edge_potentials / howmany);
+            for (int k = 0; k < howmany; k++) {
+               minL[k] = L[k]->get_minvalue();
+               P1s[k]  = P1*DeltaI[k];
+               P2s[k]  = P2*DeltaI[k];
+               q[k]    = padded_row(*L[k], Lp, buf[k]);
             }
 
+            //    edge_potentials = sum_k fmin3(vkL0, vkLP1, vkLP2) - minkL_all
+            //    Lp[o] = C + edge_potentials / howmany
+            Lp.minval = mgm_simd_update_row(Lp.values(), CCp.values(), n, q, P1s, P2s, minL, howmany);
+
 }
 
 
@@ -192,27 +160,28 @@ static void FixBounrady_for_minConvTruncatedLinear(const float I[], const int im
 // see: "Efficient Belief Propagation for Early Vision"
 // P1 and P2 ARE USED WITH A DIFFERENT MEANING
 // HERE THE COST IS:   V(p,q) = min(P2,  P1*|p-q|)
-inline void update_cost2_trunclinear(Dvec &Lp, Dvec &CCp, Dvec &Lq, Dvec &Lr, const float P1, const float P2) {
+inline void update_cost2_trunclinear(Dvec &Lp, const Dvec &CCp, Dvec &Lq, Dvec &Lr, const float P1, const float P2) {
 
             float min1L_all = Lq.get_minvalue();
             float min2L_all = Lr.get_minvalue();
 
-            float M1[Lp.max-Lp.min+1];
-            float M2[Lp.max-Lp.min+1];
-            int mm = Lp.min;
+            int NN = Lp.max-Lp.min+1;
+            float M1[NN];
+            float M2[NN];
 
             // initialize copying the values
-            for(int o=Lp.min;o<=Lp.max;o++)  M1[o-mm] = Lq[o];
-            FixBounrady_for_minConvTruncatedLinear(&(Lq.data[0]), Lq.min, Lq.max, M1, Lp.min, Lp.max, P1);
-            minConvTruncatedLinear(M1, Lp.max-Lp.min+1, min1L_all, P1, P2);
+            copy_row(Lq, Lp.min, Lp.max, M1);
+            FixBounrady_for_minConvTruncatedLinear(Lq.values(), Lq.min, Lq.max, M1, Lp.min, Lp.max, P1);
+            minConvTruncatedLinear(M1, NN, min1L_all, P1, P2);
 
-            for(int o=Lp.min;o<=Lp.max;o++)  M2[o-mm] = Lr[o];
-            FixBounrady_for_minConvTruncatedLinear(&(Lr.data[0]), Lr.min, Lr.max, M2, Lp.min, Lp.max, P1);
-            minConvTruncatedLinear(M2, Lp.max-Lp.min+1, min2L_all, P1, P2);
+            copy_row(Lr, Lp.min, Lp.max, M2);
+            FixBounrady_for_minConvTruncatedLinear(Lr.values(), Lr.min, Lr.max, M2, Lp.min, Lp.max, P1);
+            minConvTruncatedLinear(M2, NN, min2L_all, P1, P2);
 
-            for(int o=Lp.min;o<=Lp.max;o++) {
-               Lp.set_nolock(o, CCp[o] + (M1[o-mm] -min1L_all + M2[o-mm] - min2L_all)/2);
-            }
+            //    Lp[o] = CCp[o] + (M1[o] - min1L_all + M2[o] - min2L_all)/2
+            const float *M[2] = {M1, M2};
+            float minM[2] = {min1L_all, min2L_all};
+            Lp.minval = mgm_simd_combine_row(Lp.values(), CCp.values(), NN, M, minM, 2);
 
 }
 
@@ -224,7 +193,7 @@ inline void update_cost2_trunclinear(Dvec &Lp, Dvec &CCp, Dvec &Lq, Dvec &Lr, co
 // P1 and P2 ARE USED WITH A DIFFERENT MEANING
 // HERE THE COST IS:   V(p,q) = min(P2,  P1*|p-q|)
 // THIS FUNCTION CONSIDERS 4 NEIGHBORS AND WEIGHTED EDGES
-inline void update_costW_trunclinear(Dvec &Lp, Dvec &CCp, Dvec &Lq, Dvec &Lr, Dvec &Ls, Dvec &Lt, const float P1, const float P2, 
+inline void update_costW_trunclinear(Dvec &Lp, const Dvec &CCp, Dvec &Lq, Dvec &Lr, Dvec &Ls, Dvec &Lt, const float P1, const float P2, 
       const float DeltaI1, const float DeltaI2, const float DeltaI3, const float DeltaI4, const int howmany) {
 
             float min1L_all = INFINITY;
@@ -237,7 +206,6 @@ inline void update_costW_trunclinear(Dvec &Lp, Dvec &CCp, Dvec &Lq, Dvec &Lr, Dv
             if (howmany >= 3) min3L_all = Ls.get_minvalue();
             if (howmany >= 4) min4L_all = Lt.get_minvalue();
 
-            int mm = Lp.min;
             int NN = Lp.max-Lp.min+1;
             float M1[NN];
             float M2[NN];
@@ -245,41 +213,38 @@ inline void update_costW_trunclinear(Dvec &Lp, Dvec &CCp, Dvec &Lq, Dvec &Lr, Dv
             float M4[NN];
 
             // initialize copying the values
-            for(int o=Lp.min;o<=Lp.max;o++) M1[o-mm] = Lq[o];
+            copy_row(Lq, Lp.min, Lp.max, M1);
             minConvTruncatedLinear(M1, NN, min1L_all, P1*DeltaI1, P2*DeltaI1);
 
 
             if (howmany >= 2) {
                // initialize copying the values
-               for(int o=Lp.min;o<=Lp.max;o++) M2[o-mm] = Lr[o];
+               copy_row(Lr, Lp.min, Lp.max, M2);
                minConvTruncatedLinear(M2, NN, min2L_all, P1*DeltaI2, P2*DeltaI2);
             }
 
             if (howmany >= 3) {
                // initialize copying the values
-               for(int o=Lp.min;o<=Lp.max;o++) M3[o-mm] = Ls[o];
+               copy_row(Ls, Lp.min, Lp.max, M3);
                minConvTruncatedLinear(M3, NN, min3L_all, P1*DeltaI3, P2*DeltaI3);
             }
 
             if (howmany >= 4) {
                // initialize copying the values
-               for(int o=Lp.min;o<=Lp.max;o++) M4[o-mm] = Lt[o];
+               copy_row(Lt, Lp.min, Lp.max, M4);
                minConvTruncatedLinear(M4, NN, min4L_all, P1*DeltaI4, P2*DeltaI4);
             }
 
             // compute the cost
-            for(int o=Lp.min;o<=Lp.max;o++) {
-               float edge_potentials              = M1[o-mm] - min1L_all;
-               if (howmany >= 2) edge_potentials += M2[o-mm] - min2L_all;
-               if (howmany >= 3) edge_potentials += M3[o-mm] - min3L_all;
-               if (howmany >= 4) edge_potentials += M4[o-mm] - min4L_all;
-               Lp.set_nolock(o, CCp[o] + edge_potentials/howmany);
-            }
+            //    Lp[o] = CCp[o] + (sum_k Mk[o] - minkL_all) / howmany
+            const float *M[4] = {M1, M2, M3, M4};
+            float minM[4] = {min1L_all, min2L_all, min3L_all, min4L_all};
+            Lp.minval = mgm_simd_combine_row(Lp.values(), CCp.values(), NN, M, minM, howmany);
 
 }
 
 
-inline void update_cost2Lmin(Dvec &Lp, Dvec &CCp, Dvec &Lq, Dvec &Lr, float P1, float P2) {
+inline void update_cost2Lmin(Dvec &Lp, const Dvec &CCp, Dvec &Lq, Dvec &Lr, float P1, float P2) {
    // The profiles of the 1D cost functions are of this form
    //
    //                    P2 --------------------------
@@ -373,6 +338,77 @@ inline void update_cost2Lmin(Dvec &Lp, Dvec &CCp, Dvec &Lq, Dvec &Lr, float P1,
 
 
 
+// update the message Lp of the current pixel from the messages of its
+// neighbors Lq (#1), Lr (#2), Ls (#3) and Lt (#4) with the selected potentials
+// DeltaI1..4 are the edge weights (only used with image dependent weights)
+inline void update_pixel(Dvec &Lp, const Dvec &CCp, Dvec &Lq, Dvec &Lr, Dvec &Ls, Dvec &Lt,
+      const float P1, const float P2,
+      const float DeltaI1, const float DeltaI2, const float DeltaI3, const float DeltaI4,
+      const int MGM, const int USE_IMAGE_DEPENDENT_WEIGHTS, const int USE_FELZENSZWALB_POTENTIALS)
+{
+         int TSGM_2LMIN = 0;
+         if(TSGM_2LMIN>0) { // THIS IS A LEGACY FEATURE (DISABLED)
+            //   update_cost2L2(Lp, CCp, Lq, Lr, P1, P2);
+            update_cost2Lmin(Lp, CCp, Lq, Lr, P1, P2);
+         } 
+         else if(USE_IMAGE_DEPENDENT_WEIGHTS) {      // IMAGE DEPENDENT WEIGHTS
+            if(USE_FELZENSZWALB_POTENTIALS>0) 
+               update_costW_trunclinear(Lp, CCp, Lq, Lr, Ls, Lt, P1, P2, 
+                     DeltaI1, DeltaI2, DeltaI3, DeltaI4, MGM);
+            else
+               update_costW(Lp, CCp, Lq, Lr, Ls, Lt, P1, P2,
+                  DeltaI1, DeltaI2, DeltaI3, DeltaI4, MGM);
+         }
+         else {                                 // WITHOUT IMAGE DEPENDENT WEIGHTS
+            if(USE_FELZENSZWALB_POTENTIALS>0) {
+               if(MGM==2)
+                  update_cost2_trunclinear(Lp, CCp, Lq, Lr, P1, P2);
+               else 
+                  update_costW_trunclinear(Lp, CCp, Lq, Lr, Ls, Lt, P1, P2, 
+                        1.0, 1.0, 1.0, 1.0, MGM);
+            }
+            else if(MGM==2) 
+               update_cost2(Lp, CCp, Lq, Lr, P1, P2);
+            else
+               update_costW(Lp, CCp, Lq, Lr, Ls, Lt, P1, P2, 
+                     1.0, 1.0, 1.0, 1.0, MGM);
+         }
+}
+
+
+
+#ifdef DVEC_ALLOCATION_HACK
+// fixed point version of update_pixel (costs of type uint16_t)
+// only the SGM/MGM potentials without image dependent weights are available,
+// P1 and P2 are already multiplied by the scale of the costs
+inline void update_pixel(DvecT<uint16_t> &Lp, const DvecT<uint16_t> &CCp,
+      DvecT<uint16_t> &Lq, DvecT<uint16_t> &Lr, DvecT<uint16_t> &Ls, DvecT<uint16_t> &Lt,
+      const float P1, const float P2,
+      const float DeltaI1, const float DeltaI2, const float DeltaI3, const float DeltaI4,
+      const int MGM, const int USE_IMAGE_DEPENDENT_WEIGHTS, const int USE_FELZENSZWALB_POTENTIALS)
+{
+   assert(!USE_IMAGE_DEPENDENT_WEIGHTS && !USE_FELZENSZWALB_POTENTIALS);
+   DvecT<uint16_t> *L[4] = {&Lq, &Lr, &Ls, &Lt};
+   uint16_t minL[4], P1s[4], P2s[4];
+
+   int n = Lp.max-Lp.min+1;
+   uint16_t buf[4][n+2];
+   const uint16_t *q[4];
+
+   for (int k = 0; k < MGM; k++) {
+      minL[k] = L[k]->get_minvalue();
+      P1s[k]  = to_cost<uint16_t>(P1, 1);
+      P2s[k]  = to_cost<uint16_t>(P2, 1);
+      q[k]    = padded_row(*L[k], Lp, buf[k]);
+   }
+   Lp.minval = mgm_simd_update_row_u16(Lp.values(), CCp.values(), n, q, P1s, P2s, minL, MGM);
+}
+#endif
+
+
+// side of the blocks of pixels processed by one task in the passes of mgm
+SMART_PARAMETER(MGM_BLOCKSIZE,16)
+
 
 struct Pass_setup {
    int row_major;
@@ -400,12 +436,18 @@ struct Pass_setup {
 
 
 // mgm returns the "aggregated" cost volume, out, and outcost without any other refinement
-struct costvolume_t mgm(struct costvolume_t CC, const struct Img &in_w, 
+// The costs CC are of type T, float or uint16_t (fixed point costs multiplied
+// by scale, see cost_traits). The messages and their sum are also of type T,
+// the returned volume is float. With uint16_t the scale must be small enough
+// for NDIR*(max(CC)+P2*scale) to fit in 16 bits.
+template<typename T>
+struct costvolume_t mgm(const struct costvolume_T<T> &CC, const struct Img &in_w, 
                         const struct Img &dminI, const struct Img &dmaxI, 
                         struct Img *out, struct Img *outcost, 
                         const float P1, const float P2, const int NDIR, const int MGM, 
-                        const int USE_FELZENSZWALB_POTENTIALS = 0, // USE SGM(0) or FELZENSZWALB(1) POTENTIALS
-                        int SGM_FIX_OVERCOUNT = 1)                 // fix the overcounting in SGM following (Drory etal. 2014)
+                        const int USE_FELZENSZWALB_POTENTIALS, // USE SGM(0) or FELZENSZWALB(1) POTENTIALS
+                        int SGM_FIX_OVERCOUNT,                 // fix the overcounting in SGM following (Drory etal. 2014)
+                        const float scale)
 {
 
    int nx = dminI.nx;
@@ -416,9 +458,10 @@ struct costvolume_t mgm(struct costvolume_t CC, const struct Img &in_w,
    for (int i=0; i<in_w.ncol*in_w.nrow*in_w.nch; i++) 
       if (in_w[i] != 1.0) USE_IMAGE_DEPENDENT_WEIGHTS = 1;
    if (USE_IMAGE_DEPENDENT_WEIGHTS) printf(" USING IMAGE DEPENDENT WEIGHTS\n");
+   if (TSGM_DEBUG()) printf("mgm: using %s aggregation kernels\n", MGM_SIMD_NAME);
 
    // run SGM              // ALLOCATED AND INITIALIZED TO 0 (THIS IS THE costvolume THAT IS RETURNED!)
-   struct costvolume_t S = allocate_costvolume(dminI, dmaxI);
+   struct costvolume_T<T> ST(dminI, dmaxI);
 
    std::vector<Pass_setup > direct;
    //                         PASSES
@@ -479,121 +522,128 @@ struct costvolume_t mgm(struct costvolume_t CC, const struct Img &in_w,
    int pass_to_channel_4[] = {5,7,4,6,1,2,0,3};
 
    // local Lr (could be implemented with a couple of line buffers)
-   struct costvolume_t Lr(CC);
+   struct costvolume_T<T> Lr(CC);
+
+   // side of the blocks of the wavefront scan
+   const int BS = __max(1, (int) MGM_BLOCKSIZE());
 
    for(int pass=0;pass<NDIR;pass++)
    {
       printf("%d", pass); fflush(stdout);
       Pass_setup dir = direct[pass];
 
-      // reset the values of Lr for this passage
-      #pragma omp parallel for
-      for(int pidx=0; pidx<nx*ny; pidx++) 
-         for(int o=Lr[pidx].min;o<=Lr[pidx].max;o++) 
-            Lr[pidx].set_nolock(o, CC[pidx][o] ); // no omp critic is inside set_nolock
-
       int maxii = nx, maxjj = ny;
       if( !dir.row_major ) { maxii = ny; maxjj = nx; }
-      
 
-      // scan in the horizontal direction left to right
-      for(int ii=0; ii<maxii+2*maxjj; ii++) {
-      #pragma omp parallel for schedule(static,1)
-      for(int jj=0; jj<maxjj; jj++) 
+      // The scan is done by blocks of pixels. In the scan frame (ii,jj) the
+      // neighbors of a pixel are (ii-1,jj), (ii-1,jj-1), (ii,jj-1) and
+      // (ii+1,jj-1), so with the skewed coordinate ss = ii+jj all of them
+      // have ss' <= ss and jj' <= jj. The blocks are BS x BS squares in
+      // (ss,jj), parallelograms in the image, and a block can be processed
+      // as soon as its left and top blocks are done. Each block is an OpenMP
+      // task and these dependencies are tracked by the runtime: the blocks of
+      // several anti-diagonals are processed at the same time, without a
+      // barrier per diagonal. Each pixel belongs to one block, so the reset
+      // of Lr and the accumulation into S are done in the same task, lock-free.
+      int nbs = (maxii+maxjj-1 + BS-1)/BS;
+      int nbj = (maxjj + BS-1)/BS;
+      // dependency tokens (padded with a border of unused ones)
+      std::vector<char> done((nbs+1)*(nbj+1));
+
+      #pragma omp parallel
+      #pragma omp single
+      for(int bj=0; bj<nbj; bj++) 
+      for(int bs=0; bs<nbs; bs++) 
       {
-         // ensure diagonal scan (slope 2)
-         int x=ii -2*jj, y=jj;
-         if(x < 0 || x >= maxii) continue;
-
-         int maxnx = maxii, maxny = maxjj;
-         // swap the indices if we are in column major 
-         #define SWAPi(a,b) {int swap=a;a=b;b=swap;}
-         if (!dir.row_major) {
-            SWAPi(x, y);
-            SWAPi(maxnx, maxny);
-         }
-
-         // reverse the direction
-         if(dir.inc_x==0) x = (maxnx-1)-x;
-         if(dir.inc_y==0) y = (maxny-1)-y;
-
-         Point p(x,y);				   // current point
-         Point pr  = p + dir.dir1;  // dir1 neighbor
-         Point pr2 = p + dir.dir2;  // dir2 neighbor
-         Point pr3 = p + dir.dir3;  // dir3 neighbor
-         Point pr4 = p + dir.dir4;  // dir4 neighbor
-
-         // base index of the neighbor
-         int pidx   = (p.x +p.y *nx);
-         int pridx  = (pr.x+pr.y*nx);
-         int pr2idx = (pr2.x+pr2.y*nx);
-         int pr3idx = (pr3.x+pr3.y*nx);
-         int pr4idx = (pr4.x+pr4.y*nx);
-
-         if (!check_inside_image(pr ,dminI)) continue;
-         if (!check_inside_image(pr2,dminI)) continue;
-         if (!check_inside_image(pr3,dminI)) continue;
-         if (!check_inside_image(pr4,dminI)) continue;
+         char *self = &done[(bj+1)*(nbs+1) + bs+1];
+         char *left = self - 1;
+         char *top  = self - (nbs+1);
+
+         #pragma omp task depend(in: left[0], top[0]) depend(out: self[0])
+         for(int jj=bj*BS; jj<__min((bj+1)*BS, maxjj); jj++) 
+         for(int ii=__max(bs*BS-jj, 0); ii<__min((bs+1)*BS-jj, maxii); ii++) 
+         {
+            int x=ii, y=jj;
+
+            int maxnx = maxii, maxny = maxjj;
+            // swap the indices if we are in column major 
+            #define SWAPi(a,b) {int swap=a;a=b;b=swap;}
+            if (!dir.row_major) {
+               SWAPi(x, y);
+               SWAPi(maxnx, maxny);
+            }
 
-         int TSGM_2LMIN = 0;
-         if(TSGM_2LMIN>0) { // THIS IS A LEGACY FEATURE
-            //   update_cost2L2(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], P1, P2);
-            update_cost2Lmin(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], P1, P2);
-         } 
-         else if(USE_IMAGE_DEPENDENT_WEIGHTS) {      // IMAGE DEPENDENT WEIGHTS
+            // reverse the direction
+            if(dir.inc_x==0) x = (maxnx-1)-x;
+            if(dir.inc_y==0) y = (maxny-1)-y;
+
+            Point p(x,y);				   // current point
+            Point pr  = p + dir.dir1;  // dir1 neighbor
+            Point pr2 = p + dir.dir2;  // dir2 neighbor
+            Point pr3 = p + dir.dir3;  // dir3 neighbor
+            Point pr4 = p + dir.dir4;  // dir4 neighbor
+
+            // base index of the neighbor
+            int pidx   = (p.x +p.y *nx);
+            int pridx  = (pr.x+pr.y*nx);
+            int pr2idx = (pr2.x+pr2.y*nx);
+            int pr3idx = (pr3.x+pr3.y*nx);
+            int pr4idx = (pr4.x+pr4.y*nx);
+
+            // reset the value of Lr for this passage (Lr has the ranges of CC)
+            DvecT<T> &Lp = Lr[pidx];
+            memcpy(Lp.values(), CC[pidx].values(), sizeof(T)*(Lp.max-Lp.min+1));
+            Lp.minval = cost_traits<T>::inf();  // invalidate minval cache
+
+            if (check_inside_image(pr ,dminI) && check_inside_image(pr2,dminI) &&
+                check_inside_image(pr3,dminI) && check_inside_image(pr4,dminI)) {
+
+               float DeltaI1 = 1, DeltaI2 = 1, DeltaI3 = 1, DeltaI4 = 1;
+               if(USE_IMAGE_DEPENDENT_WEIGHTS) {      // IMAGE DEPENDENT WEIGHTS
+                  #define val(u, p, ch)  u.data[(p.x) + (u.nx)*(p.y) + (ch)*(u.npix)]
+                  DeltaI1 = val(in_w, p, pass_to_channel_1[pass]);
+                  DeltaI2 = val(in_w, p, pass_to_channel_2[pass]);
+                  DeltaI3 = val(in_w, p, pass_to_channel_3[pass]);
+                  DeltaI4 = val(in_w, p, pass_to_channel_4[pass]);
+                  #undef val
+               }
+               update_pixel(Lp, CC[pidx], Lr[pridx], Lr[pr2idx], Lr[pr3idx], Lr[pr4idx], P1*scale, P2*scale,
+                     DeltaI1, DeltaI2, DeltaI3, DeltaI4, MGM, USE_IMAGE_DEPENDENT_WEIGHTS, USE_FELZENSZWALB_POTENTIALS);
+            }
 
-            #define val(u, p, ch)  u.data[(p.x) + (u.nx)*(p.y) + (ch)*(u.npix)]
-            float DeltaI1 = val(in_w, p, pass_to_channel_1[pass]);
-            float DeltaI2 = val(in_w, p, pass_to_channel_2[pass]);
-            float DeltaI3 = val(in_w, p, pass_to_channel_3[pass]);
-            float DeltaI4 = val(in_w, p, pass_to_channel_4[pass]);
-            #undef val
-            if(USE_FELZENSZWALB_POTENTIALS>0) 
-               update_costW_trunclinear(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], Lr[pr3idx], Lr[pr4idx], P1, P2, 
-                     DeltaI1, DeltaI2, DeltaI3, DeltaI4, MGM);
-            else
-               update_costW(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], Lr[pr3idx], Lr[pr4idx], P1, P2,
-                  DeltaI1, DeltaI2, DeltaI3, DeltaI4, MGM);
-         }
-         else {                                 // WITHOUT IMAGE DEPENDENT WEIGHTS
-            if(USE_FELZENSZWALB_POTENTIALS>0) {
-               if(MGM==2)
-                  update_cost2_trunclinear(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], P1, P2);
-               else 
-                  update_costW_trunclinear(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], Lr[pr3idx], Lr[pr4idx], P1, P2, 
-                        1.0, 1.0, 1.0, 1.0, MGM);
+            // accumulate S for the current orientation
+            DvecT<T> &Sp = ST[pidx];
+            if (Sp.min == Lp.min && Sp.max == Lp.max) {
+               T *s = Sp.values();
+               const T *l = Lp.values();
+               for(int k=0; k<=Lp.max-Lp.min; k++) 
+                  s[k] = cost_add(s[k], l[k]);
+               Sp.minval = cost_traits<T>::inf();  // invalidate minval cache
             }
-            else if(MGM==2) 
-               update_cost2(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], P1, P2);
             else
-               update_costW(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], Lr[pr3idx], Lr[pr4idx], P1, P2, 
-                     1.0, 1.0, 1.0, 1.0, MGM);
+               for(int o=Lp.min;o<=Lp.max;o++) 
+                  Sp.set_nolock(o, cost_add(Sp[o], Lp[o]));
          }
-
       }
    }
 
-      // accumulate S for the current orientation
-      #pragma omp parallel for
-      for(int i=0; i<nx*ny; i++) {
-         for(int o=Lr[i].min;o<=Lr[i].max;o++) {
-            S[i].increment_nolock(o, Lr[i][o]); // pragma omp critic is inside set
-         }
-      }
-   }
+   // the returned volume is float
+   Lr = costvolume_T<T>();
+   struct costvolume_t S;
+   take_costvolume_as_float(ST, scale, &S);
 
 
    // WTA 
    #pragma omp parallel for
    for(int i=0;i<nx*ny;i++) {
-      float minP;
+      float minP = S[i].min;   // when no cost is finite (as in mgm_stream)
       float minL=INFINITY;
       for(int o=S[i].min;o<=S[i].max;o++) {
          // overcounting correction (Drory etal. 2014) 
          if (SGM_FIX_OVERCOUNT==1)
-            S[i].set_nolock(o, S[i][o] - (NDIR -1) * CC[i][o]);
+            S[i].set_nolock(o, S[i][o] - (NDIR -1) * cost_to_float(CC[i][o], scale));
 
-         if(isfinite(S[i][o]))
+         if(isfinite_safe(S[i][o]))
          if(minL > S[i][o]) {
             minL = S[i][o];
             minP = o;
@@ -622,7 +672,7 @@ struct costvolume_t mgm(struct costvolume_t CC, const struct Img &in_w,
 
 
 // mgm returns the "aggregated" cost volume, out, and outcost without any other refinement
-struct costvolume_t mgm2(struct costvolume_t CC, const struct Img &in_w, 
+struct costvolume_t mgm2(const struct costvolume_t &CC, const struct Img &in_w, 
                         const struct Img &dminI, const struct Img &dmaxI, 
                         struct Img *out, struct Img *outcost, 
                         const float P1, const float P2, const int NDIR, const int MGM, 
@@ -638,6 +688,7 @@ struct costvolume_t mgm2(struct costvolume_t CC, const struct Img &in_w,
    for (int i=0; i<in_w.ncol*in_w.nrow*in_w.nch; i++) 
       if (in_w[i] != 1.0) USE_IMAGE_DEPENDENT_WEIGHTS = 1;
    if (USE_IMAGE_DEPENDENT_WEIGHTS) printf(" USING IMAGE DEPENDENT WEIGHTS\n");
+   if (TSGM_DEBUG()) printf("mgm: using %s aggregation kernels\n", MGM_SIMD_NAME);
 
    // run SGM              // ALLOCATED AND INITIALIZED TO 0 (THIS IS THE costvolume THAT IS RETURNED!)
    struct costvolume_t S = allocate_costvolume(dminI, dmaxI);
@@ -749,40 +800,17 @@ struct costvolume_t mgm2(struct costvolume_t CC, const struct Img &in_w,
          if (!check_inside_image(pr3,dminI)) continue;
          if (!check_inside_image(pr4,dminI)) continue;
 
-         int TSGM_2LMIN = 0;
-         if(TSGM_2LMIN>0) { // THIS IS A LEGACY FEATURE (DISABLED)
-            //   update_cost2L2(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], P1, P2);
-            update_cost2Lmin(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], P1, P2);
-         } 
-         else if(USE_IMAGE_DEPENDENT_WEIGHTS) {      // IMAGE DEPENDENT WEIGHTS
-
+         float DeltaI1 = 1, DeltaI2 = 1, DeltaI3 = 1, DeltaI4 = 1;
+         if(USE_IMAGE_DEPENDENT_WEIGHTS) {      // IMAGE DEPENDENT WEIGHTS
             #define val(u, p, ch)  u.data[(p.x) + (u.nx)*(p.y) + (ch)*(u.npix)]
-            float DeltaI1 = val(in_w, p, pass_to_channel_1[pass]);
-            float DeltaI2 = val(in_w, p, pass_to_channel_2[pass]);
-            float DeltaI3 = val(in_w, p, pass_to_channel_3[pass]);
-            float DeltaI4 = val(in_w, p, pass_to_channel_4[pass]);
+            DeltaI1 = val(in_w, p, pass_to_channel_1[pass]);
+            DeltaI2 = val(in_w, p, pass_to_channel_2[pass]);
+            DeltaI3 = val(in_w, p, pass_to_channel_3[pass]);
+            DeltaI4 = val(in_w, p, pass_to_channel_4[pass]);
             #undef val
-            if(USE_FELZENSZWALB_POTENTIALS>0) 
-               update_costW_trunclinear(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], Lr[pr3idx], Lr[pr4idx], P1, P2, 
-                     DeltaI1, DeltaI2, DeltaI3, DeltaI4, MGM);
-            else
-               update_costW(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], Lr[pr3idx], Lr[pr4idx], P1, P2,
-                  DeltaI1, DeltaI2, DeltaI3, DeltaI4, MGM);
-         }
-         else {                                 // WITHOUT IMAGE DEPENDENT WEIGHTS
-            if(USE_FELZENSZWALB_POTENTIALS>0) {
-               if(MGM==2)
-                  update_cost2_trunclinear(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], P1, P2);
-               else 
-                  update_costW_trunclinear(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], Lr[pr3idx], Lr[pr4idx], P1, P2, 
-                        1.0, 1.0, 1.0, 1.0, MGM);
-            }
-            else if(MGM==2) 
-               update_cost2(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], P1, P2);
-            else
-               update_costW(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], Lr[pr3idx], Lr[pr4idx], P1, P2, 
-                     1.0, 1.0, 1.0, 1.0, MGM);
          }
+         update_pixel(Lr[pidx], CC[pidx], Lr[pridx], Lr[pr2idx], Lr[pr3idx], Lr[pr4idx], P1, P2,
+               DeltaI1, DeltaI2, DeltaI3, DeltaI4, MGM, USE_IMAGE_DEPENDENT_WEIGHTS, USE_FELZENSZWALB_POTENTIALS);
 
       }
    }
@@ -802,14 +830,14 @@ struct costvolume_t mgm2(struct costvolume_t CC, const struct Img &in_w,
    // WTA 
    #pragma omp parallel for
    for(int i=0;i<nx*ny;i++) {
-      float minP;
+      float minP = S[i].min;   // when no cost is finite (as in mgm_stream)
       float minL=INFINITY;
       for(int o=S[i].min;o<=S[i].max;o++) {
          // overcounting correction (Drory etal. 2014) 
          if (SGM_FIX_OVERCOUNT==1)
             S[i].set_nolock(o, S[i][o] - (NDIR -1) * CC[i][o]);
 
-         if(isfinite(S[i][o]))
+         if(isfinite_safe(S[i][o]))
          if(minL > S[i][o]) {
             minL = S[i][o];
             minP = o;
@@ -156,7 +156,7 @@ inline float computeC_clippedNCC( Point p, Point q, const struct Img &u, const s
 		{
 			float v1 = valnan(u, p + Point(i, j), t);
 			float v2 = valnan(v, q + Point(i, j), t);
-         if (isnan(v1) || isnan(v2)) return INFINITY;
+         if (isnan_safe(v1) || isnan_safe(v2)) return INFINITY;
          mu1+=v1;    mu2+=v2;
          s1 +=v1*v1; s2 +=v2*v2; prod+=v1*v2;
          n++;
@@ -172,21 +172,189 @@ inline float computeC_clippedNCC( Point p, Point q, const struct Img &u, const s
 
 
 
+/************ ROW KERNELS **************/
+// The kernels compute the same costs as the functions above, but for all the
+// hypotheses of a pixel at once: the costs of the pixel p=(x,y) of u against
+// the n consecutive pixels of v starting at (x+lo,y) are stored in out[0..n-1].
+// These pixels must be inside v. The sweep over the hypotheses reads
+// contiguous rows and is vectorized by the compiler. Each cost is accumulated
+// in the order of the function that it replaces, so the values are the same.
+
+// absolute (SQUARED=0) or squared (SQUARED=1) differences, see computeC_AD/SD
+template<int SQUARED>
+static inline void cost_row_ad(float *out, int n, int x, int y, int lo,
+                               const struct Img &u, const struct Img &v)
+{
+   for(int k=0;k<n;k++) out[k] = 0;
+   for(int t=0;t<u.nch;t++) {
+      const float a  = u.data[x + y*u.nx + t*u.npix];
+      const float *b = &v.data[x+lo + y*v.nx + t*v.npix];
+      for(int k=0;k<n;k++) {
+         float d = a - b[k];
+         d = __max(d,-d);
+         out[k] += SQUARED ? d*d : d;
+      }
+   }
+}
+
+
+// Birchfield and Tomasi: extrema of each pixel and of its linear
+// interpolations with the left and right neighbors (see BTAD)
+struct bt_extrema {
+   struct Img lo, hi;
+
+   bt_extrema() {}
+   bt_extrema(const struct Img &u) : lo(u.nx, u.ny, u.nch), hi(u.nx, u.ny, u.nch)
+   {
+      #pragma omp parallel for
+      for(int y=0;y<u.ny;y++)
+      for(int t=0;t<u.nch;t++)
+      for(int x=0;x<u.nx;x++) {
+         Point p(x,y);
+         float I = val(u,p,t);
+         float Ip = I, Im = I;
+         if (x<u.nx-1) Ip = (I + val(u,p+Point(1,0),t))/2.0;
+         if (x >= 1  ) Im = (I + val(u,p+Point(-1,0),t))/2.0;
+         lo.val(x,y,t) = min3(Im,Ip,I);
+         hi.val(x,y,t) = max3(Im,Ip,I);
+      }
+   }
+};
+
+// Birchfield and Tomasi absolute (SQUARED=0) or squared (SQUARED=1)
+// differences, see computeC_BTAD/BTSD. eu and ev are the extrema of u and v
+template<int SQUARED>
+static inline void cost_row_bt(float *out, int n, int x, int y, int lo,
+                               const struct Img &u, const struct Img &v,
+                               const struct bt_extrema &eu, const struct bt_extrema &ev)
+{
+   for(int k=0;k<n;k++) out[k] = 0;
+   for(int t=0;t<u.nch;t++) {
+      int iu = x + y*u.nx + t*u.npix;
+      int iv = x+lo + y*v.nx + t*v.npix;
+      const float IL    = u.data[iu];
+      const float IminL = eu.lo.data[iu];
+      const float ImaxL = eu.hi.data[iu];
+      const float *IR    = &v.data[iv];
+      const float *IminR = &ev.lo.data[iv];
+      const float *ImaxR = &ev.hi.data[iv];
+      for(int k=0;k<n;k++) {
+         float dLR =  max3( 0, IL - ImaxR[k], IminR[k] - IL);
+         float dRL =  max3( 0, IR[k] - ImaxL, IminL - IR[k]);
+         float BT = fabs(__min(dLR, dRL));
+         out[k] += SQUARED ? BT*BT : BT;
+      }
+   }
+}
+
+
+// Clipped NCC: the means and the means of the squares of the windows of
+// each image are computed once per pixel (instead of once per hypothesis),
+// ok[i] is 0 if the window of the pixel i is not inside the image or if it
+// contains a NAN (the cost is then INFINITY), see computeC_clippedNCC
+struct ncc_window_stats {
+   int hwindow;
+   struct Img mu, s;
+   std::vector<unsigned char> ok;
+
+   ncc_window_stats() : hwindow(0) {}
+   ncc_window_stats(const struct Img &u, int hwindow) :
+      hwindow(hwindow), mu(u.nx, u.ny, u.nch), s(u.nx, u.ny, u.nch), ok(u.npix, 1)
+   {
+      #pragma omp parallel for
+      for(int y=0;y<u.ny;y++)
+      for(int x=0;x<u.nx;x++)
+      for(int t=0;t<u.nch;t++) {
+         Point p(x,y);
+         float mu1 = 0, s1 = 0;
+         int n = 0;
+         for (int i = -hwindow; i <= hwindow; i++)
+         for (int j = -hwindow; j <= hwindow; j++)
+         {
+            float v1 = valnan(u, p + Point(i, j), t);
+            if (isnan_safe(v1)) ok[x + y*u.nx] = 0;
+            mu1+=v1;
+            s1 +=v1*v1;
+            n++;
+         }
+         mu1/=n;
+         s1 /=n;
+         mu.val(x,y,t) = mu1;
+         s.val(x,y,t)  = s1;
+      }
+   }
+};
+
+// su and sv are the window statistics of u and v
+static inline void cost_row_ncc(float *out, int n, int x, int y, int lo,
+                                const struct Img &u, const struct Img &v,
+                                const struct ncc_window_stats &su,
+                                const struct ncc_window_stats &sv)
+{
+   int hwindow = su.hwindow;
+   for(int k=0;k<n;k++) out[k] = INFINITY;
+   if (!su.ok[x + y*u.nx] || y-hwindow < 0 || y+hwindow >= v.ny) return;
+
+   // hypotheses whose window is inside v
+   int k0 = __max(0, hwindow - x - lo);
+   int k1 = __min(n-1, v.nx-1-hwindow - x - lo);
+   if (k0 > k1) return;
+
+   float NCC[n], prod[n];
+   for(int k=k0;k<=k1;k++) NCC[k] = 0;
+   for (int t = 0; t < u.nch; t++)
+   {
+      for(int k=k0;k<=k1;k++) prod[k] = 0;
+      int nw = 0;
+      for (int i = -hwindow; i <= hwindow; i++)
+      for (int j = -hwindow; j <= hwindow; j++)
+      {
+         const float v1 = u.data[x+i + (y+j)*u.nx + t*u.npix];
+         const float *v2 = &v.data[x+lo+i + (y+j)*v.nx + t*v.npix];
+         for(int k=k0;k<=k1;k++)
+            prod[k]+=v1*v2[k];
+         nw++;
+      }
+
+      const float mu1 = su.mu.data[x + y*u.nx + t*u.npix];
+      const float s1  = su.s.data [x + y*u.nx + t*u.npix];
+      const float *mu2 = &sv.mu.data[x+lo + y*v.nx + t*v.npix];
+      const float *s2  = &sv.s.data [x+lo + y*v.nx + t*v.npix];
+      for(int k=k0;k<=k1;k++) {
+         float p = prod[k]/nw;
+         NCC[k] += (p - mu1*mu2[k]) / sqrt( __max(0.0000001,(s1 - mu1*mu1)*(s2[k] - mu2[k]*mu2[k])) );
+      }
+   }
+
+   const unsigned char *ok = &sv.ok[x+lo + y*v.nx];
+   for(int k=k0;k<=k1;k++)
+      if (ok[k]) {
+         float clippedNCC = u.nch - __max(0,__min(NCC[k],u.nch));
+         out[k] = clippedNCC*64;
+      }
+}
+
+
+
+// the row kernel that replaces each cost function (ROW_NONE: call the function)
+enum row_kernel { ROW_NONE, ROW_AD, ROW_SD, ROW_BTAD, ROW_BTSD, ROW_NCC };
+
 //// global table of all the cost functions
 struct distance_functions{
    cost_t f;
    const char *name;
+   enum row_kernel kernel;
 } global_table_of_distance_functions[] = {
-         #define REGISTER_FUNCTIONN(x,xn) {x, xn}
-         REGISTER_FUNCTIONN(computeC_AD,"ad"),
-         REGISTER_FUNCTIONN(computeC_SD,"sd"),
-         REGISTER_FUNCTIONN(computeC_census_on_preprocessed_images,"census"),
-         REGISTER_FUNCTIONN(computeC_clippedNCC,"ncc"),
-         REGISTER_FUNCTIONN(computeC_BTAD,"btad"),
-         REGISTER_FUNCTIONN(computeC_BTSD,"btsd"),
-         REGISTER_FUNCTIONN(computeC_AD_sub,"ad_sub"),
+         #define REGISTER_FUNCTIONN(x,xn,k) {x, xn, k}
+         REGISTER_FUNCTIONN(computeC_AD,"ad",ROW_AD),
+         REGISTER_FUNCTIONN(computeC_SD,"sd",ROW_SD),
+         REGISTER_FUNCTIONN(computeC_census_on_preprocessed_images,"census",ROW_NONE),
+         REGISTER_FUNCTIONN(computeC_clippedNCC,"ncc",ROW_NCC),
+         REGISTER_FUNCTIONN(computeC_BTAD,"btad",ROW_BTAD),
+         REGISTER_FUNCTIONN(computeC_BTSD,"btsd",ROW_BTSD),
+         REGISTER_FUNCTIONN(computeC_AD_sub,"ad_sub",ROW_NONE),
          #undef REGISTER_FUNCTIONN
-         {NULL, ""},
+         {NULL, "", ROW_NONE},
 };
 int get_distance_index(const char *name) {
    int r=0; // default cost function is computeC_AD (first in table distance_functions)
@@ -221,79 +389,190 @@ int get_prefilter_index(const char *name) {
 //////////////////////////////////////////////
 //////////////////////////////////////////////
 //////////////////////////////////////////////
+// The cost type T of the volumes is float, or uint16_t for the fixed point
+// aggregation (mgm_core.cc). With uint16_t the costs are stored multiplied
+// by a scale factor, the arithmetic is saturating and 0xFFFF is the infinity.
+template<typename T> struct cost_traits;
+
+template<> struct cost_traits<float> {
+   static inline float inf() { return INFINITY; }
+};
+
+template<> struct cost_traits<uint16_t> {
+   static inline uint16_t inf() { return 0xFFFF; }
+};
+
+// The packed layout is the default: all the per-pixel cost vectors live in a
+// single aligned arena, indexed by a prefix sum of the per-pixel ranges.
+// Define DVEC_STD_VECTOR to fall back to one std::vector per pixel.
+#ifndef DVEC_STD_VECTOR
+#define DVEC_ALLOCATION_HACK
+#endif
+
 #ifdef DVEC_ALLOCATION_HACK
 
 #include "dvec2.cc"
 
-struct costvolume_t {
+// alignment (in bytes) of the cost volume arena
+#define COSTVOLUME_ALIGN 64
+// number of INFINITY values stored before and after each per-pixel vector,
+// they allow the aggregation kernels (mgm_simd.h) to read the labels
+// min-1 and max+1 without bound checks
+#define COSTVOLUME_GUARD 1
+
+template<typename T>
+static T *costvolume_arena_alloc(long ndata)
+{
+   void *p = NULL;
+   size_t nbytes = sizeof(T) * (ndata > 0 ? ndata : 1);
+   if (posix_memalign(&p, COSTVOLUME_ALIGN, nbytes) != 0) {
+      fprintf(stderr, "costvolume: could not allocate %zu bytes\n", nbytes);
+      abort();
+   }
+   return (T*) p;
+}
+
+template<typename T>
+struct costvolume_T {
    int npix;
-   int ndata;
-   struct Dvec *vectors;
-   float       *alldata;
+   long ndata;
+   long capacity;          // number of values that the arena can hold
+   DvecT<T> *vectors;      // per pixel view: range and pointer into alldata
+   long     *offsets;      // prefix sum of the ranges plus guards (npix+1 entries)
+   T        *alldata;      // the arena
 
 
-   inline Dvec  operator[](int i) const  { 
+   inline const DvecT<T>& operator[](int i) const  {
       return this->vectors[i];
    }
-   inline Dvec& operator[](int i)        { 
+   inline DvecT<T>& operator[](int i)        {
       return this->vectors[i];
    }
 
-   costvolume_t() {
-      int npix=0;
-      int ndata=0;
+   costvolume_T() {
+      this->npix  = 0;
+      this->ndata = 0;
+      this->capacity = 0;
       this->vectors = NULL;
+      this->offsets = NULL;
       this->alldata = NULL;
    }
 
-   costvolume_t(const struct costvolume_t &src)
+   // allocate and zero a volume with the per pixel ranges [min[i],max[i]]
+   costvolume_T(const struct Img &min, const struct Img &max)
    {
-      npix =src.npix;
-      ndata=src.ndata;
-      vectors = (struct Dvec*) malloc(sizeof(struct Dvec)*npix);
-      alldata = (float*)       calloc(ndata, sizeof(float));
-      float *baseptr = alldata;
-      memcpy(vectors, src.vectors, sizeof(struct Dvec)*npix);
-      memcpy(alldata, src.alldata, sizeof(float)*ndata);
-
-      int size = 0;
-      for (int i=0; i<npix; i++)  {
-         vectors[i].data = baseptr + size;
-         size += (int)((int) vectors[i].max - (int) vectors[i].min + 1);
+      npix = 0; ndata = 0; capacity = 0;
+      vectors = NULL; offsets = NULL; alldata = NULL;
+      set_ranges(min, max);
+   }
+
+   // set the per pixel ranges to [min[i],max[i]] and zero the volume,
+   // the buffers are only reallocated if they are too small, so that the
+   // volumes of the rows of mgm_stream are allocated once
+   void set_ranges(const struct Img &min, const struct Img &max)
+   {
+      if (npix != min.npix) {
+         free(vectors);
+         free(offsets);
+         npix = min.npix;
+         vectors = (DvecT<T>*) malloc(sizeof(DvecT<T>)*npix);
+         offsets = (long*)     malloc(sizeof(long)*(npix+1));
+      }
+      offsets[0] = 0;
+      for (int i=0; i<npix; i++)
+         offsets[i+1] = offsets[i] + (int)((int) max[i] - (int) min[i] + 1) + 2*COSTVOLUME_GUARD;
+      ndata = offsets[npix];
+      if (ndata > capacity) {
+         free(alldata);
+         alldata = costvolume_arena_alloc<T>(ndata);
+         capacity = ndata;
+      }
+
+      // first touch from the threads that will use the data
+      #pragma omp parallel for
+      for (int i=0; i<npix; i++) {
+         T *row = alldata + offsets[i];
+         int n = offsets[i+1] - offsets[i];
+         vectors[i].init(min[i], max[i], row + COSTVOLUME_GUARD);
+         memset(row, 0, sizeof(T)*n);
+         for (int g=0; g<COSTVOLUME_GUARD; g++)
+            row[g] = row[n-1-g] = cost_traits<T>::inf();
       }
    }
 
-   ~costvolume_t(void)
+   costvolume_T(const struct costvolume_T &src)
    {
-         if(this->vectors!=NULL) free(this->vectors);
-         if(this->alldata!=NULL) free(this->alldata);
+      npix = 0; ndata = 0; capacity = 0;
+      vectors = NULL; offsets = NULL; alldata = NULL;
+      copy_from(src);
    }
 
-};
+   // copy the ranges and the costs of src, in the buffers of this volume
+   // if they are large enough
+   void copy_from(const struct costvolume_T &src)
+   {
+      if (src.vectors == NULL) {
+         *this = costvolume_T();
+         return;
+      }
+      if (npix != src.npix) {
+         free(vectors);
+         free(offsets);
+         npix = src.npix;
+         vectors = (DvecT<T>*) malloc(sizeof(DvecT<T>)*npix);
+         offsets = (long*)     malloc(sizeof(long)*(npix+1));
+      }
+      ndata = src.ndata;
+      if (ndata > capacity) {
+         free(alldata);
+         alldata = costvolume_arena_alloc<T>(ndata);
+         capacity = ndata;
+      }
+      memcpy(vectors, src.vectors, sizeof(DvecT<T>)*npix);
+      memcpy(offsets, src.offsets, sizeof(long)*(npix+1));
 
-struct costvolume_t allocate_costvolume (struct Img min, struct Img max) 
-{
-   int npix=min.nx*min.ny;
-   int size=0;
-   std::vector< int > pos(npix);
-   for (int i=0; i<npix; i++)  {
-      pos[i] = size;
-      size += (int)((int) max[i] - (int) min[i] + 1);
+      #pragma omp parallel for
+      for (int i=0; i<npix; i++)  {
+         vectors[i].data = alldata + offsets[i] + COSTVOLUME_GUARD;
+         memcpy(alldata + offsets[i], src.alldata + offsets[i], sizeof(T)*(offsets[i+1]-offsets[i]));
+      }
+   }
+
+   void swap(struct costvolume_T &src)
+   {
+      std::swap(npix,    src.npix);
+      std::swap(ndata,   src.ndata);
+      std::swap(capacity, src.capacity);
+      std::swap(vectors, src.vectors);
+      std::swap(offsets, src.offsets);
+      std::swap(alldata, src.alldata);
    }
 
-   struct costvolume_t cv;
-   cv.npix =npix;
-   cv.ndata=size;
-   cv.vectors = (struct Dvec*) malloc(sizeof(struct Dvec)*npix);
-   cv.alldata = (float*)       calloc(size, sizeof(float));
-   float *baseptr = cv.alldata;
+   struct costvolume_T& operator=(struct costvolume_T src)
+   {
+      // copy and swap
+      swap(src);
+      return *this;
+   }
 
-#pragma omp parallel for
-   for (int i=0;i< npix;i++) {
-      cv.vectors[i].init(min[i], max[i], baseptr + pos[i]);
+   ~costvolume_T(void)
+   {
+         if(this->vectors!=NULL) free(this->vectors);
+         if(this->offsets!=NULL) free(this->offsets);
+         if(this->alldata!=NULL) free(this->alldata);
    }
 
-   return cv;
+};
+
+// the float cost volume
+struct costvolume_t : public costvolume_T<float> {
+   costvolume_t() {}
+   costvolume_t(const struct Img &min, const struct Img &max) : costvolume_T<float>(min, max) {}
+};
+
+struct costvolume_t allocate_costvolume (const struct Img &min, const struct Img &max)
+{
+   return costvolume_t(min, max);
 }
 
 
@@ -306,32 +585,380 @@ struct costvolume_t allocate_costvolume (struct Img min, struct Img max)
 
 #include "dvec.cc"
 
-struct costvolume_t {
+// only float volumes are available in this mode
+template<typename T> using DvecT = Dvec;
+
+template<typename T>
+struct costvolume_T {
    std::vector< Dvec > vectors;
-   inline Dvec  operator[](int i) const  { return this->vectors[i];}
+   inline const Dvec& operator[](int i) const  { return this->vectors[i];}
    inline Dvec& operator[](int i)        { return this->vectors[i];}
-};
+   void swap(struct costvolume_T &src) { vectors.swap(src.vectors); }
 
+   costvolume_T() {}
+   costvolume_T(const struct Img &min, const struct Img &max)
+   {
+      set_ranges(min, max);
+   }
 
-struct costvolume_t allocate_costvolume (struct Img min, struct Img max) 
-{
-   struct costvolume_t cv;
-   cv.vectors = std::vector< Dvec >(min.npix);
-   for (int i=0;i< min.npix;i++) {
-      cv[i].init(min[i], max[i]);
+   void set_ranges(const struct Img &min, const struct Img &max)
+   {
+      vectors.resize(min.npix);
+      for (int i=0;i< min.npix;i++) {
+         vectors[i].init(min[i], max[i]);
+      }
    }
 
-   return cv;
+   void copy_from(const struct costvolume_T &src) { vectors = src.vectors; }
+};
+
+struct costvolume_t : public costvolume_T<float> {
+   costvolume_t() {}
+   costvolume_t(const struct Img &min, const struct Img &max) : costvolume_T<float>(min, max) {}
+};
+
+
+struct costvolume_t allocate_costvolume (const struct Img &min, const struct Img &max) 
+{
+   return costvolume_t(min, max);
 }
 
 
 #endif // DVEC_ALLOCATION_HACK
+
+
+// conversions and arithmetic of the costs of type T (see cost_traits)
+template<typename T> static inline T to_cost(float c, float scale);
+// (the scale only applies to the fixed point costs)
+template<> inline float to_cost<float>(float c, float /*scale*/) { return c; }
+static inline float cost_to_float(float c, float /*scale*/)       { return c; }
+static inline int   cost_is_finite(float c)                        { return isfinite_safe(c); }
+static inline float cost_add(float a, float b)                     { return a + b; }
+
+// moves the volume src to dst, with the costs converted to float
+static inline void take_costvolume_as_float(struct costvolume_T<float> &src, float /*scale*/,
+                                            struct costvolume_t *dst)
+{
+   dst->swap(src);
+}
+
+#ifdef DVEC_ALLOCATION_HACK
+// fixed point costs: round(c*scale), saturated at 0xFFFE (0xFFFF is the infinity)
+template<> inline uint16_t to_cost<uint16_t>(float c, float scale) {
+   if (!isfinite_safe(c)) return 0xFFFF;
+   float q = c*scale + 0.5f;
+   return q < 0xFFFE ? (uint16_t) q : 0xFFFE;
+}
+static inline float cost_to_float(uint16_t c, float scale) { return c == 0xFFFF ? INFINITY : c / scale; }
+static inline int   cost_is_finite(uint16_t c)             { return c != 0xFFFF; }
+static inline uint16_t cost_add(uint16_t a, uint16_t b) {
+   unsigned r = (unsigned) a + b;
+   return r < 0xFFFF ? r : 0xFFFF;
+}
+
+static inline void take_costvolume_as_float(struct costvolume_T<uint16_t> &src, float scale,
+                                            struct costvolume_t *dst)
+{
+   // same layout as src
+   struct costvolume_T<float> D;
+   D.npix  = src.npix;
+   D.ndata = src.ndata;
+   D.capacity = src.ndata;
+   D.vectors = (Dvec*) malloc(sizeof(Dvec)*D.npix);
+   D.offsets = (long*) malloc(sizeof(long)*(D.npix+1));
+   D.alldata = costvolume_arena_alloc<float>(D.ndata);
+   memcpy(D.offsets, src.offsets, sizeof(long)*(D.npix+1));
+
+   #pragma omp parallel for
+   for (int i=0; i<D.npix; i++) {
+      D.vectors[i].init(src[i].min, src[i].max, D.alldata + D.offsets[i] + COSTVOLUME_GUARD);
+      for (long k=D.offsets[i]; k<D.offsets[i+1]; k++)
+         D.alldata[k] = cost_to_float(src.alldata[k], scale);
+   }
+   src = costvolume_T<uint16_t>();
+   dst->swap(D);
+}
+#endif
 //////////////////////////////////////////////
 //////////////////////////////////////////////
 //////////////////////////////////////////////
 //////////////////////////////////////////////
 //////////////////////////////////////////////
 
+// The costvolume_filler holds the prefiltered images and the cost function,
+// it computes the matching costs of one pixel at a time so that the cost
+// volume can be filled entirely (allocate_and_fill_sgm_costvolume) or
+// one row at a time (mgm_stream). The costs of a pixel are computed by the
+// row kernel of the cost function, if it has one.
+struct costvolume_filler {
+   struct Img u, v;    // prefiltered images
+   cost_t cost;        // cost function
+   int distance_index; // index of cost in global_table_of_distance_functions
+   enum row_kernel kernel;
+   float maxcost;      // truncation of the costs: truncDist * nch
+
+   // data precomputed for the row kernels
+   struct bt_extrema btu, btv;
+   struct ncc_window_stats nccu, nccv;
+
+   // native census: codes, and cost of each possible Hamming distance
+   int census;
+   int nwords;
+   std::vector<uint64_t> cu, cv;
+   std::vector<float> hamming_to_cost;
+
+   costvolume_filler(struct Img &in_u, // source (reference) image
+                     struct Img &in_v, // destination (match) image
+                     char* prefilter,  // none, sobel, census(WxW)
+                     char* distance,   // census, l1, l2, ncc(WxW), btl1, btl2
+                     float truncDist)  // truncated differences
+   {
+      // 0. pick the prefilter and cost functions
+      distance_index  = get_distance_index(distance);
+      int prefilter_index = get_prefilter_index(prefilter);
+
+      // 1. parameter consistency check
+      if (distance_index == get_distance_index("census") || prefilter_index == get_prefilter_index("census")) {
+          if (TSGM_DEBUG()) printf("costvolume: changing both distance and prefilter to CENSUS\n");
+          distance_index  = get_distance_index("census");
+          prefilter_index = get_prefilter_index("census");
+      }
+      cost = global_table_of_distance_functions[distance_index].f;
+      kernel = global_table_of_distance_functions[distance_index].kernel;
+      census = 0;
+      nwords = 0;
+      if (TSGM_DEBUG()) printf("costvolume: selecting distance  %s\n", global_table_of_distance_functions[distance_index].name);
+      if (TSGM_DEBUG()) printf("costvolume: selecting prefilter %s\n", global_table_of_prefilters[prefilter_index]);
+      if (TSGM_DEBUG()) printf("costvolume: truncate distances at %f\n", truncDist);
+
+      // 2. apply prefilters if needed
+      u = in_u;
+      v = in_v;
+      if (prefilter_index == get_prefilter_index("census")) {
+         int winradius = CENSUS_NCC_WIN() / 2;
+         if (TSGM_DEBUG()) printf("costvolume: applying census with window of size %d\n", winradius*2+1);
+         // native census codes and XOR+POPCNT distances
+         // the costs are the same as computeC_census_on_preprocessed_images:
+         // the Hamming distance divided by the number of channels of census_transform
+         int nwordsv;
+         census = 1;
+         cu = census_transform_bits(in_u, winradius, &nwords);
+         cv = census_transform_bits(in_v, winradius, &nwordsv);
+         assert(nwords == nwordsv);
+         int nch   = census_nfloats(in_u.nch, winradius);
+         int nbits = census_nbits(in_u.nch, winradius);
+         maxcost = truncDist * nch;
+         hamming_to_cost.resize(nbits+1);
+         for (int h = 0; h <= nbits; h++)
+            hamming_to_cost[h] = __min( (float) (h * 1.0 / nch), maxcost );
+         return;
+      }
+      if (prefilter_index == get_prefilter_index("sobelx")) {
+         if (TSGM_DEBUG()) printf("costvolume: applying sobel filter\n" );
+         float sobel_x[] = {-1,0,1, -2,0,2, -1,0,1};
+         u = apply_filter(in_u, sobel_x, 3, 3, 1);
+         v = apply_filter(in_v, sobel_x, 3, 3, 1);
+      }
+      if (prefilter_index == get_prefilter_index("gblur")) {
+         if (TSGM_DEBUG()) printf("costvolume: applying gblur(s=1) filter\n" );
+         u = gblur_truncated(in_u, 1.0);
+         v = gblur_truncated(in_v, 1.0);
+      }
+      maxcost = truncDist * u.nch;
+
+      // 3. precompute the data of the row kernels
+      if (kernel == ROW_BTAD || kernel == ROW_BTSD) {
+         btu = bt_extrema(u);
+         btv = bt_extrema(v);
+      }
+      if (kernel == ROW_NCC) {
+         nccu = ncc_window_stats(u, CENSUS_NCC_WIN()/2);
+         nccv = ncc_window_stats(v, CENSUS_NCC_WIN()/2);
+      }
+   }
+
+   // upper bound of the finite costs (used to choose a fixed point scale)
+   float max_cost() const
+   {
+      if (census) return hamming_to_cost.back();
+      if (isfinite_safe(maxcost)) return maxcost;
+      const char *name = global_table_of_distance_functions[distance_index].name;
+      if (strcmp(name, "ncc") == 0) return 64.0 * u.nch;
+      // AD and SD like costs: sum over the channels of the range of u and v
+      int sq = strcmp(name, "sd") == 0 || strcmp(name, "btsd") == 0;
+      float r = 0;
+      for (int t = 0; t < u.nch; t++) {
+         float lo = INFINITY, hi = -INFINITY;
+         for (int k = 0; k < 2; k++) {
+            const struct Img &w = k ? v : u;
+            for (int i = 0; i < w.npix; i++) {
+               float x = w[i + t*w.npix];
+               if (!isfinite_safe(x)) continue;
+               lo = __min(lo, x);
+               hi = __max(hi, x);
+            }
+         }
+         if (lo > hi) continue;
+         r += sq ? (hi-lo)*(hi-lo) : hi-lo;
+      }
+      return r;
+   }
+
+   // filler of the reversed pair (v,u), the prefilters are not recomputed
+   struct costvolume_filler swapped() const
+   {
+      struct costvolume_filler F(*this);
+      std::swap(F.u, F.v);
+      std::swap(F.cu, F.cv);
+      std::swap(F.btu, F.btv);
+      std::swap(F.nccu, F.nccv);
+      return F;
+   }
+
+   // fill the costs of the pixel (ii,jj) in CCp
+   // ham is a buffer of at least CCp.max-CCp.min+1 ints
+   // returns 1 if the pixel has no valid hypothesis (the costs are then set to 0)
+   inline int fill_pixel(int ii, int jj, Dvec &CCp, int *ham) const
+   {
+      int nx = u.nx;
+      int pidx = (ii + jj*nx);
+      float *row = CCp.values();
+      int allinvalid = 1;
+
+      if (census) {
+         // the hypotheses o in [lo,hi] fall inside the target image
+         int lo = __max(CCp.min, -ii);
+         int hi = __min(CCp.max, v.nx-1-ii);
+
+         for(int o=CCp.min; o<__min(lo, CCp.max+1); o++)
+            row[o-CCp.min] = maxcost;
+         if (lo <= hi) {
+            census_hamming_row(ham, &cu[(size_t) pidx*nwords],
+                               &cv[(size_t) (ii+lo + jj*v.nx)*nwords], hi-lo+1, nwords);
+            for(int o=lo; o<=hi; o++)
+               row[o-CCp.min] = hamming_to_cost[ham[o-lo]];
+            allinvalid = 0;
+         }
+         for(int o=__max(hi+1, CCp.min); o<=CCp.max; o++)
+            row[o-CCp.min] = maxcost;
+         if (isfinite_safe(maxcost)) allinvalid = 0;
+      }
+      else if (kernel != ROW_NONE) {
+         // the hypotheses o in [lo,hi] fall inside the target image
+         int lo = __max(CCp.min, -ii);
+         int hi = __min(CCp.max, v.nx-1-ii);
+         if (jj >= v.ny) hi = lo - 1;
+
+         for(int o=CCp.min; o<__min(lo, CCp.max+1); o++)
+            row[o-CCp.min] = maxcost;
+         if (lo <= hi) {
+            float *out = row + lo-CCp.min;
+            int n = hi-lo+1;
+            switch (kernel) {
+               case ROW_AD:   cost_row_ad<0>(out, n, ii, jj, lo, u, v); break;
+               case ROW_SD:   cost_row_ad<1>(out, n, ii, jj, lo, u, v); break;
+               case ROW_BTAD: cost_row_bt<0>(out, n, ii, jj, lo, u, v, btu, btv); break;
+               case ROW_BTSD: cost_row_bt<1>(out, n, ii, jj, lo, u, v, btu, btv); break;
+               case ROW_NCC:  cost_row_ncc(out, n, ii, jj, lo, u, v, nccu, nccv); break;
+               default: break;
+            }
+         }
+         for(int o=__max(hi+1, CCp.min); o<=CCp.max; o++)
+            row[o-CCp.min] = maxcost;
+
+         // truncate the costs (if needed)
+         for(int o=CCp.min;o<=CCp.max;o++) {
+            float e = __min(row[o-CCp.min], maxcost);
+            row[o-CCp.min] = e;
+            if(isfinite_safe(e)) allinvalid=0;
+         }
+      }
+      else {
+         for(int o=CCp.min;o<=CCp.max;o++) 
+         {
+            Point p(ii,jj);      // current point on left image
+            Point q = p + Point(o,0); // other point on right image
+            // 4.1 compute the cost 
+            float e = maxcost;
+            if (check_inside_image(q, v)) 
+               e = cost(p, q, u, v);
+            // 4.2 truncate the cost (if needed)
+            e = __min(e, maxcost);
+            // 4.3 store it in the costvolume
+            row[o-CCp.min] = e;
+            if(isfinite_safe(e)) allinvalid=0;
+         }
+      }
+      CCp.minval = INFINITY;  // invalidate minval cache
+
+      // SAFETY MEASURE: If there are no valid hypotheses for this pixel 
+      // (ie all hypotheses fall outside the target image or are invalid in some way)
+      // then the cost must be set to 0, for all the available hypotheses
+      // Leaving inf would be propagated and invalidate the entire solution 
+      if (allinvalid) {
+         for(int o=CCp.min;o<=CCp.max;o++) 
+            row[o-CCp.min] = 0;
+      }
+      return allinvalid;
+   }
+};
+
+
+// fill the costs of the pixel (ii,jj) of a volume of type T
+// buf is a buffer of CCp.max-CCp.min+1 floats used for the conversion
+// (float costs need neither buf nor scale)
+static inline int fill_pixel_as(const struct costvolume_filler &F, int ii, int jj,
+                                Dvec &CCp, float * /*buf*/, int *ham, float /*scale*/)
+{
+   return F.fill_pixel(ii, jj, CCp, ham);
+}
+
+#ifdef DVEC_ALLOCATION_HACK
+static inline int fill_pixel_as(const struct costvolume_filler &F, int ii, int jj,
+                                DvecT<uint16_t> &CCp, float *buf, int *ham, float scale)
+{
+   Dvec tmp;
+   tmp.init(CCp.min, CCp.max, buf);
+   int allinvalid = F.fill_pixel(ii, jj, tmp, ham);
+   for(int k=0; k<=CCp.max-CCp.min; k++)
+      CCp.values()[k] = to_cost<uint16_t>(buf[k], scale);
+   CCp.minval = cost_traits<uint16_t>::inf();  // invalidate minval cache
+   return allinvalid;
+}
+#endif
+
+
+// largest number of hypotheses of a pixel
+template<typename T>
+static int costvolume_maxrange(const struct costvolume_T<T> &CC, int npix)
+{
+   int maxrange = 1;
+   for(int i=0; i<npix; i++)
+      maxrange = __max(maxrange, CC[i].max - CC[i].min + 1);
+   return maxrange;
+}
+
+
+// fill the volume CC (allocated with the ranges of the pixels of F.u)
+// the costs are converted to T with the given scale
+template<typename T>
+void fill_sgm_costvolume(const struct costvolume_filler &F, struct costvolume_T<T> &CC, float scale = 1)
+{
+   int nx = F.u.nx; 
+   int ny = F.u.ny;
+   int maxrange = costvolume_maxrange(CC, nx*ny);
+
+   #pragma omp parallel for
+   for(int jj=0; jj<ny; jj++) 
+   {
+      int ham[maxrange];
+      float buf[maxrange];
+      for(int ii=0; ii<nx; ii++)
+         fill_pixel_as(F, ii, jj, CC[ii + jj*nx], buf, ham, scale);
+   }
+}
+
+
 struct costvolume_t allocate_and_fill_sgm_costvolume (struct Img &in_u, // source (reference) image                      
                                                       struct Img &in_v, // destination (match) image                  
                                                       struct Img &dminI,// per pixel max&min disparity
@@ -340,85 +967,85 @@ struct costvolume_t allocate_and_fill_sgm_costvolume (struct Img &in_u, // sourc
                                                       char* distance,         // census, l1, l2, ncc(WxW), btl1, btl2
                                                       float truncDist)        // truncated differences
 {
-   int nx = in_u.nx; 
-   int ny = in_u.ny;
-   int nch= in_u.nch;
-
-   struct Img u(in_u);
-   struct Img v(in_v);
-
-   // 0. pick the prefilter and cost functions
-   int distance_index  = get_distance_index(distance);
-   int prefilter_index = get_prefilter_index(prefilter);
-   cost_t cost = global_table_of_distance_functions[distance_index].f;
-
-   // 1. parameter consistency check
-   if (distance_index == get_distance_index("census") || prefilter_index == get_prefilter_index("census")) {
-       if (TSGM_DEBUG()) printf("costvolume: changing both distance and prefilter to CENSUS\n");
-       distance_index  = get_distance_index("census");
-       prefilter_index = get_prefilter_index("census");
-   }
-   if (TSGM_DEBUG()) printf("costvolume: selecting distance  %s\n", global_table_of_distance_functions[distance_index].name);
-   if (TSGM_DEBUG()) printf("costvolume: selecting prefilter %s\n", global_table_of_prefilters[prefilter_index]);
-   if (TSGM_DEBUG()) printf("costvolume: truncate distances at %f\n", truncDist);
-
-   // 2. apply prefilters if needed
-   if (prefilter_index == get_prefilter_index("census")) {
-      int winradius = CENSUS_NCC_WIN() / 2;
-      if (TSGM_DEBUG()) printf("costvolume: applying census with window of size %d\n", winradius*2+1);
-      u = census_transform(in_u, winradius);
-      v = census_transform(in_v, winradius);
-   }
-   if (prefilter_index == get_prefilter_index("sobelx")) {
-      if (TSGM_DEBUG()) printf("costvolume: applying sobel filter\n" );
-      float sobel_x[] = {-1,0,1, -2,0,2, -1,0,1};
-      u = apply_filter(in_u, sobel_x, 3, 3, 1);
-      v = apply_filter(in_v, sobel_x, 3, 3, 1);
-   }
-   if (prefilter_index == get_prefilter_index("gblur")) {
-      if (TSGM_DEBUG()) printf("costvolume: applying gblur(s=1) filter\n" );
-      u = gblur_truncated(in_u, 1.0);
-      v = gblur_truncated(in_v, 1.0);
-   }
+   // 0.-2. pick the prefilter and cost functions and apply the prefilters
+   struct costvolume_filler F(in_u, in_v, prefilter, distance, truncDist);
 
    // 3. allocate the cost volume 
    struct costvolume_t CC = allocate_costvolume(dminI, dmaxI);
 
    // 4. apply it 
+   fill_sgm_costvolume(F, CC);
+   return CC;
+}
+
+
+// Fills the cost volumes of the left-right (CL) and right-left (CR) problems
+// in a single pass. Since the costs are symmetric the right volume is a shear
+// of the left one:
+//    CR(x,y,d) = CL(x+d,y,-d)
+// so each cost is computed once and stored in both volumes. Only the
+// hypotheses of CR that are not in the range of CL are computed separately.
+// CL and CR must be allocated with the ranges of the pixels of F.u and F.v.
+template<typename T>
+void fill_sgm_costvolume_lrrl(const struct costvolume_filler &F,
+                              struct costvolume_T<T> &CL, struct costvolume_T<T> &CR,
+                              float scale = 1)
+{
+   int nx = F.u.nx, ny = F.u.ny;
+   int nxR = F.v.nx, nyR = F.v.ny;
+
+   struct costvolume_filler FR = F.swapped();
+   const T maxcostR = to_cost<T>(FR.maxcost, scale);
+   int maxrange = __max(costvolume_maxrange(CL, nx*ny), costvolume_maxrange(CR, nxR*nyR));
+
+   // the rows are independent
    #pragma omp parallel for
-   for(int jj=0; jj<ny; jj++) for(int ii=0; ii<nx; ii++)
+   for(int jj=0; jj<__max(ny, nyR); jj++) 
    {
-      int pidx = (ii + jj*nx);
-      int allinvalid = 1;
-
-      for(int o=CC[pidx].min;o<=CC[pidx].max;o++) 
-      {
-         Point p(ii,jj);      // current point on left image
-         Point q = p + Point(o,0); // other point on right image
-         // 4.1 compute the cost 
-         float e = truncDist * u.nch;
-         if (check_inside_image(q, v)) 
-            e = cost(p, q, u, v);
-         // 4.2 truncate the cost (if needed)
-         e = __min(e, truncDist * u.nch);
-         // 4.3 store it in the costvolume
-         CC[pidx].set_nolock(o, e); // pragma omp critic is inside set
-         if(isfinite(e)) allinvalid=0;
+      int ham[maxrange];
+      float buf[maxrange];
+
+      // fill the row of CL and scatter the costs to the row of CR
+      if (jj < ny)
+      for(int ii=0; ii<nx; ii++) {
+         DvecT<T> &CLp = CL[ii + jj*nx];
+         int allinvalid = fill_pixel_as(F, ii, jj, CLp, buf, ham, scale);
+         if (jj >= nyR) continue;
+         for(int o=__max(CLp.min, -ii); o<=__min(CLp.max, nxR-1-ii); o++) {
+            DvecT<T> &CRq = CR[ii+o + jj*nxR];
+            if (-o >= CRq.min && -o <= CRq.max)
+               CRq.values()[-o-CRq.min] = allinvalid ? cost_traits<T>::inf() : CLp.values()[o-CLp.min];
+         }
       }
-      // SAFETY MEASURE: If there are no valid hypotheses for this pixel 
-      // (ie all hypotheses fall outside the target image or are invalid in some way)
-      // then the cost must be set to 0, for all the available hypotheses
-      // Leaving inf would be propagated and invalidate the entire solution 
-      if (allinvalid) {
-         for(int o=CC[pidx].min;o<=CC[pidx].max;o++) 
-         {
-            Point p(ii,jj);      // current point on left image
-            Point q = p + Point(o,0); // other point on right image
-            CC[pidx].set_nolock(o, 0); // pragma omp critic is inside set
+
+      // complete the row of CR
+      if (jj < nyR)
+      for(int ii=0; ii<nxR; ii++) {
+         DvecT<T> &CRp = CR[ii + jj*nxR];
+         T *row = CRp.values();
+         int complete = 1;
+         int allinvalid = 1;
+         for(int o=CRp.min; o<=CRp.max; o++) {
+            int x = ii+o;
+            if (x < 0 || x >= nx || jj >= ny)
+               row[o-CRp.min] = maxcostR;     // outside the target image
+            else if (-o < CL[x + jj*nx].min || -o > CL[x + jj*nx].max) {
+               complete = 0;                  // not computed by the LR pass
+               break;
+            }
+            if (cost_is_finite(row[o-CRp.min])) allinvalid = 0;
+         }
+         if (!complete) {
+            fill_pixel_as(FR, ii, jj, CRp, buf, ham, scale);
+            continue;
          }
+         CRp.minval = cost_traits<T>::inf();  // invalidate minval cache
+         // SAFETY MEASURE: same as in costvolume_filler::fill_pixel
+         if (allinvalid)
+            for(int o=CRp.min;o<=CRp.max;o++) 
+               row[o-CRp.min] = 0;
       }
    }
-   return CC;
 }
 
 
@@ -10,7 +10,9 @@
 // type==0 : truncated L1
 // type==1 : L1
 // type==2 : L2
-float evaluate_energy_4connected(const struct Img &u, std::vector<float > &outdisp, struct costvolume_t &CC, struct Img *E_out, float P1, float P2, int type) {
+// the costs CC of type T are divided by scale (see mgm_costvolume.h)
+template<typename T>
+float evaluate_energy_4connected(const struct Img &u, std::vector<float > &outdisp, const struct costvolume_T<T> &CC, struct Img *E_out, float P1, float P2, int type, float scale) {
    int nx=u.nx;
    int ny=u.ny;
 
@@ -39,9 +41,9 @@ float evaluate_energy_4connected(const struct Img &u, std::vector<float > &outdi
 
       // DATA TERM
       int o = outdisp[pidx];
-      G      += CC[pidx][o];
-      GL2      += CC[pidx][o];
-      Gtrunc += CC[pidx][o];
+      G      += cost_to_float(CC[pidx][o], scale);
+      GL2      += cost_to_float(CC[pidx][o], scale);
+      Gtrunc += cost_to_float(CC[pidx][o], scale);
 
       // EDGE POTENTIALS
       Point directions[] = {Point(-1,0) , Point(0,1), 
@@ -93,14 +95,15 @@ float evaluate_energy_4connected(const struct Img &u, std::vector<float > &outdi
 
 
 
-void print_solution_energy(const struct Img &in_u, std::vector<float > &disp, struct costvolume_t &CC, float P1, float P2) {
+template<typename T>
+void print_solution_energy(const struct Img &in_u, std::vector<float > &disp, const struct costvolume_T<T> &CC, float P1, float P2, float scale) {
    if (TSGM_DEBUG()) {
       // DEBUG INFORMATION
       struct Img E;
-      printf(" ENERGY L1trunc: %.9e\t", evaluate_energy_4connected(in_u,disp,CC,&E,P1,P2,0));
+      printf(" ENERGY L1trunc: %.9e\t", evaluate_energy_4connected(in_u,disp,CC,&E,P1,P2,0,scale));
       iio_write_vector_split((char*)"/tmp/ENERGY_L1trunc.tif", E);
-      printf("L1: %.9e\t", evaluate_energy_4connected(in_u,disp,CC,&E,P1,P2,1));
-      printf("L2: %.9e\n", evaluate_energy_4connected(in_u,disp,CC,&E,P1,P2,2));
+      printf("L1: %.9e\t", evaluate_energy_4connected(in_u,disp,CC,&E,P1,P2,1,scale));
+      printf("L2: %.9e\n", evaluate_energy_4connected(in_u,disp,CC,&E,P1,P2,2,scale));
    }
    else {
       printf("\n");
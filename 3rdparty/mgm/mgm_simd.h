@@ -0,0 +1,346 @@
+#ifndef MGM_SIMD_H_
+#define MGM_SIMD_H_
+/* vectorized kernels for the SGM/MGM message update
+ *
+ * The kernels operate on contiguous disparity rows. The neighbor rows are
+ * padded: q[-1] and q[n] are valid (INFINITY) so that the +-1 labels can be
+ * read without bound checks. With the packed cost volume (dvec2.cc) the rows
+ * already have these guards, otherwise a padded copy is made.
+ * The running minimum of the output row is computed in the same pass,
+ * so the minimum value cache of Lp remains valid after the update.
+ *
+ * The instruction set is selected at compile time: AVX-512, AVX, SSE2 or
+ * plain scalar code.
+ * The fixed point variant (uint16 costs, saturating arithmetic, 0xFFFF is
+ * the infinity) processes twice as many labels per instruction. */
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define MGM_SIMD_NAME "avx512"
+#define VLEN 16
+typedef __m512 vfloat;
+#define vload(p)      _mm512_loadu_ps(p)
+#define vstore(p,a)   _mm512_storeu_ps(p,a)
+#define vset1(x)      _mm512_set1_ps(x)
+#define vadd(a,b)     _mm512_add_ps(a,b)
+#define vsub(a,b)     _mm512_sub_ps(a,b)
+#define vdiv(a,b)     _mm512_div_ps(a,b)
+// the masked form compiles to the same vminps, gcc 12 warns about the
+// undefined source operand of _mm512_min_ps (-Wmaybe-uninitialized)
+#define vmin(a,b)     _mm512_maskz_min_ps((__mmask16) -1, a, b)
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define MGM_SIMD_NAME "avx"
+#define VLEN 8
+typedef __m256 vfloat;
+#define vload(p)      _mm256_loadu_ps(p)
+#define vstore(p,a)   _mm256_storeu_ps(p,a)
+#define vset1(x)      _mm256_set1_ps(x)
+#define vadd(a,b)     _mm256_add_ps(a,b)
+#define vsub(a,b)     _mm256_sub_ps(a,b)
+#define vdiv(a,b)     _mm256_div_ps(a,b)
+#define vmin(a,b)     _mm256_min_ps(a,b)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MGM_SIMD_NAME "sse2"
+#define VLEN 4
+typedef __m128 vfloat;
+#define vload(p)      _mm_loadu_ps(p)
+#define vstore(p,a)   _mm_storeu_ps(p,a)
+#define vset1(x)      _mm_set1_ps(x)
+#define vadd(a,b)     _mm_add_ps(a,b)
+#define vsub(a,b)     _mm_sub_ps(a,b)
+#define vdiv(a,b)     _mm_div_ps(a,b)
+#define vmin(a,b)     _mm_min_ps(a,b)
+#else
+#define MGM_SIMD_NAME "scalar"
+#define VLEN 1
+typedef float vfloat;
+#define vload(p)      (*(p))
+#define vstore(p,a)   (*(p)=(a))
+#define vset1(x)      ((float)(x))
+#define vadd(a,b)     ((a)+(b))
+#define vsub(a,b)     ((a)-(b))
+#define vdiv(a,b)     ((a)/(b))
+#define vmin(a,b)     (((a) < (b)) ? (a) : (b))
+#endif
+
+// vmin(a,b) is (a<b)?a:b for all the variants, this is the same as __min
+// and the order of the arguments matters when a NaN is involved
+
+
+// reduce a vector to the minimum of its lanes
+static inline float vhmin(vfloat a)
+{
+   float t[VLEN];
+   vstore(t, a);
+   float m = t[0];
+   for (int i = 1; i < VLEN; i++)
+      if (t[i] < m) m = t[i];
+   return m;
+}
+
+
+// returns a pointer to the values of Lq over the range [Lp.min-1, Lp.max+1]
+// (INFINITY outside the range of Lq), buf must hold Lp.max-Lp.min+3 values
+// when the ranges of Lq and Lp coincide no copy is needed
+template<typename T>
+static inline const T *padded_row(const DvecT<T> &Lq, const DvecT<T> &Lp, T *buf)
+{
+#ifdef COSTVOLUME_GUARD
+   if (Lq.min == Lp.min && Lq.max == Lp.max)
+      return Lq.values() - 1;
+#endif
+   for (int o = Lp.min-1; o <= Lp.max+1; o++)
+      buf[o-Lp.min+1] = Lq[o];
+   return buf;
+}
+
+
+// copy the values of Lq over the range [mmin, mmax] (INFINITY outside of the range of Lq)
+static inline void copy_row(const Dvec &Lq, int mmin, int mmax, float *M)
+{
+   if (Lq.min <= mmin && Lq.max >= mmax) {
+      memcpy(M, Lq.values() + (mmin-Lq.min), sizeof(float)*(mmax-mmin+1));
+      return;
+   }
+   for (int o = mmin; o <= mmax; o++)
+      M[o-mmin] = Lq[o];
+}
+
+
+// SGM/MGM message update for one pixel with howmany (1 to 4) neighbors
+//    Lp[o] = C[o] + 1/howmany sum_k  min(q_k[o], min(q_k[o-1],q_k[o+1]) + P1_k, minq_k + P2_k) - minq_k
+// q[k] are padded rows: q[k][o] corresponds to the label o-1 (see padded_row)
+// returns the minimum of Lp
+static inline float mgm_simd_update_row(float *Lp, const float *C, const int n,
+      const float *const *q, const float *P1, const float *P2, const float *minq,
+      const int howmany)
+{
+   vfloat vP1[4], vP2m[4], vminq[4];
+   for (int k = 0; k < howmany; k++) {
+      vP1[k]   = vset1(P1[k]);
+      vP2m[k]  = vset1(minq[k] + P2[k]);
+      vminq[k] = vset1(minq[k]);
+   }
+   const vfloat vh = vset1((float) howmany);
+   vfloat vmn = vset1(INFINITY);
+
+   int o = 0;
+   for (; o + VLEN <= n; o += VLEN) {
+      vfloat e = vset1(0);
+      for (int k = 0; k < howmany; k++) {
+         vfloat L0  = vload(q[k] + o + 1);
+         vfloat LP1 = vadd(vmin(vload(q[k] + o), vload(q[k] + o + 2)), vP1[k]);
+         e = vadd(e, vsub(vmin(vP2m[k], vmin(LP1, L0)), vminq[k]));
+      }
+      vfloat r = vadd(vload(C + o), vdiv(e, vh));
+      vstore(Lp + o, r);
+      vmn = vmin(r, vmn);
+   }
+   float mn = vhmin(vmn);
+
+   // remainder
+   for (; o < n; o++) {
+      float e = 0;
+      for (int k = 0; k < howmany; k++) {
+         float L0  = q[k][o+1];
+         float LP1 = __min(q[k][o], q[k][o+2]) + P1[k];
+         float LP2 = minq[k] + P2[k];
+         float m = LP1 < L0 ? LP1 : L0;
+         m = LP2 < m ? LP2 : m;
+         e += m - minq[k];
+      }
+      float r = C[o] + e / howmany;
+      Lp[o] = r;
+      if (r < mn) mn = r;
+   }
+   return mn;
+}
+
+
+// combine the min-convolved messages M[k] of the Felzenszwalb-Huttenlocher update
+//    Lp[o] = C[o] + 1/howmany sum_k  M_k[o] - minM_k
+// returns the minimum of Lp
+static inline float mgm_simd_combine_row(float *Lp, const float *C, const int n,
+      const float *const *M, const float *minM, const int howmany)
+{
+   vfloat vminM[4];
+   for (int k = 0; k < howmany; k++)
+      vminM[k] = vset1(minM[k]);
+   const vfloat vh = vset1((float) howmany);
+   vfloat vmn = vset1(INFINITY);
+
+   int o = 0;
+   for (; o + VLEN <= n; o += VLEN) {
+      vfloat e = vsub(vload(M[0] + o), vminM[0]);
+      for (int k = 1; k < howmany; k++)
+         e = vadd(e, vsub(vload(M[k] + o), vminM[k]));
+      vfloat r = vadd(vload(C + o), vdiv(e, vh));
+      vstore(Lp + o, r);
+      vmn = vmin(r, vmn);
+   }
+   float mn = vhmin(vmn);
+
+   // remainder
+   for (; o < n; o++) {
+      float e = M[0][o] - minM[0];
+      for (int k = 1; k < howmany; k++)
+         e += M[k][o] - minM[k];
+      float r = C[o] + e / howmany;
+      Lp[o] = r;
+      if (r < mn) mn = r;
+   }
+   return mn;
+}
+
+
+/* fixed point kernels */
+#if defined(__AVX512BW__)
+#define VLEN16 32
+typedef __m512i vu16;
+#define vu16load(p)      _mm512_loadu_si512((const void*)(p))
+#define vu16store(p,a)   _mm512_storeu_si512((void*)(p),a)
+#define vu16set1(x)      _mm512_set1_epi16((short)(x))
+#define vu16adds(a,b)    _mm512_adds_epu16(a,b)
+#define vu16subs(a,b)    _mm512_subs_epu16(a,b)
+#define vu16min(a,b)     _mm512_min_epu16(a,b)
+#define vu16srli(a,s)    _mm512_srli_epi16(a,s)
+#define vu16mulhi(a,b)   _mm512_mulhi_epu16(a,b)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define VLEN16 16
+typedef __m256i vu16;
+#define vu16load(p)      _mm256_loadu_si256((const __m256i*)(p))
+#define vu16store(p,a)   _mm256_storeu_si256((__m256i*)(p),a)
+#define vu16set1(x)      _mm256_set1_epi16((short)(x))
+#define vu16adds(a,b)    _mm256_adds_epu16(a,b)
+#define vu16subs(a,b)    _mm256_subs_epu16(a,b)
+#define vu16min(a,b)     _mm256_min_epu16(a,b)
+#define vu16srli(a,s)    _mm256_srli_epi16(a,s)
+#define vu16mulhi(a,b)   _mm256_mulhi_epu16(a,b)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VLEN16 8
+typedef __m128i vu16;
+#define vu16load(p)      _mm_loadu_si128((const __m128i*)(p))
+#define vu16store(p,a)   _mm_storeu_si128((__m128i*)(p),a)
+#define vu16set1(x)      _mm_set1_epi16((short)(x))
+#define vu16adds(a,b)    _mm_adds_epu16(a,b)
+#define vu16subs(a,b)    _mm_subs_epu16(a,b)
+#define vu16min(a,b)     _mm_subs_epu16(a, _mm_subs_epu16(a,b))  // no _mm_min_epu16 in SSE2
+#define vu16srli(a,s)    _mm_srli_epi16(a,s)
+#define vu16mulhi(a,b)   _mm_mulhi_epu16(a,b)
+#else
+#define VLEN16 1
+typedef uint16_t vu16;
+#define vu16load(p)      (*(p))
+#define vu16store(p,a)   (*(p)=(a))
+#define vu16set1(x)      ((uint16_t)(x))
+#define vu16adds(a,b)    ((uint16_t) __min(0xFFFF, (unsigned)(a)+(b)))
+#define vu16subs(a,b)    ((uint16_t) ((a) > (b) ? (a)-(b) : 0))
+#define vu16min(a,b)     (((a) < (b)) ? (a) : (b))
+#define vu16srli(a,s)    ((uint16_t)((a) >> (s)))
+#define vu16mulhi(a,b)   ((uint16_t)(((unsigned)(a)*(b)) >> 16))
+#endif
+
+
+// saturating uint16 operations on scalars
+static inline uint16_t u16adds(uint16_t a, uint16_t b) { unsigned r = (unsigned) a + b; return r < 0xFFFF ? r : 0xFFFF; }
+static inline uint16_t u16subs(uint16_t a, uint16_t b) { return a > b ? a - b : 0; }
+
+// rounded division by howmany (1 to 4) of the sum of the edge potentials
+// (1/3 is approximated by 21846/65536), a truncated division would bias
+// the messages along the paths
+static inline vu16 vu16divh(vu16 e, const int howmany)
+{
+   if (howmany == 2) return vu16srli(vu16adds(e, vu16set1(1)), 1);
+   if (howmany == 4) return vu16srli(vu16adds(e, vu16set1(2)), 2);
+   if (howmany == 3) return vu16mulhi(vu16adds(e, vu16set1(1)), vu16set1(21846));
+   return e;
+}
+static inline uint16_t u16divh(uint16_t e, const int howmany)
+{
+   if (howmany == 2) return u16adds(e, 1) >> 1;
+   if (howmany == 4) return u16adds(e, 2) >> 2;
+   if (howmany == 3) return ((unsigned) u16adds(e, 1) * 21846) >> 16;
+   return e;
+}
+
+
+// fixed point version of mgm_simd_update_row
+// returns the minimum of Lp
+static inline uint16_t mgm_simd_update_row_u16(uint16_t *Lp, const uint16_t *C, const int n,
+      const uint16_t *const *q, const uint16_t *P1, const uint16_t *P2, const uint16_t *minq,
+      const int howmany)
+{
+   vu16 vP1[4], vP2m[4], vminq[4];
+   uint16_t P2m[4];
+   for (int k = 0; k < howmany; k++) {
+      P2m[k]   = u16adds(minq[k], P2[k]);
+      vP1[k]   = vu16set1(P1[k]);
+      vP2m[k]  = vu16set1(P2m[k]);
+      vminq[k] = vu16set1(minq[k]);
+   }
+   vu16 vmn = vu16set1(0xFFFF);
+
+   int o = 0;
+   for (; o + VLEN16 <= n; o += VLEN16) {
+      vu16 e = vu16set1(0);
+      for (int k = 0; k < howmany; k++) {
+         vu16 L0  = vu16load(q[k] + o + 1);
+         vu16 LP1 = vu16adds(vu16min(vu16load(q[k] + o), vu16load(q[k] + o + 2)), vP1[k]);
+         e = vu16adds(e, vu16subs(vu16min(vP2m[k], vu16min(LP1, L0)), vminq[k]));
+      }
+      vu16 r = vu16adds(vu16load(C + o), vu16divh(e, howmany));
+      vu16store(Lp + o, r);
+      vmn = vu16min(r, vmn);
+   }
+   uint16_t mn = 0xFFFF;
+   {
+      uint16_t t[VLEN16];
+      vu16store(t, vmn);
+      for (int i = 0; i < VLEN16; i++)
+         if (t[i] < mn) mn = t[i];
+   }
+
+   // remainder
+   for (; o < n; o++) {
+      uint16_t e = 0;
+      for (int k = 0; k < howmany; k++) {
+         uint16_t L0  = q[k][o+1];
+         uint16_t LP1 = u16adds(__min(q[k][o], q[k][o+2]), P1[k]);
+         uint16_t m = LP1 < L0 ? LP1 : L0;
+         m = P2m[k] < m ? P2m[k] : m;
+         e = u16adds(e, u16subs(m, minq[k]));
+      }
+      uint16_t r = u16adds(C[o], u16divh(e, howmany));
+      Lp[o] = r;
+      if (r < mn) mn = r;
+   }
+   return mn;
+}
+
+// the short names of the vector operations are local to this file
+#undef VLEN
+#undef vload
+#undef vstore
+#undef vset1
+#undef vadd
+#undef vsub
+#undef vdiv
+#undef vmin
+#undef VLEN16
+#undef vu16load
+#undef vu16store
+#undef vu16set1
+#undef vu16adds
+#undef vu16subs
+#undef vu16min
+#undef vu16srli
+#undef vu16mulhi
+
+#endif //MGM_SIMD_H_
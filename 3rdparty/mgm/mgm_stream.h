@@ -0,0 +1,179 @@
+#ifndef MGM_STREAM_H_
+#define MGM_STREAM_H_
+/******************** STREAMING MGM ********************/
+// Memory bounded variant of mgm, the equivalent of the fullDP=false mode
+// of OpenCV's SGBM (3rdparty/sgbm/stereosgbm.cpp).
+// The image is processed in a single top-down sweep. For each row the
+// matching costs are recomputed on the fly (costvolume_filler) and the
+// messages are kept in a ring buffer with the rows y-1 and y. Therefore
+// the memory is proportional to width * disparity range, not to the area.
+// Only the two passes whose neighbors are all in the previous row or
+// in the current row can be computed in this way:
+//
+//      (I)               (V)
+//
+// O-----------     -----------O
+// ------------     ------------
+// -3--2--4----     ---1--3--2--
+// -1--c                  c--4--
+//
+// so the result is different from mgm with NDIR=2.
+// The subpixel refinement is done row by row.
+// The volumes of a row are allocated once, for the row with the largest
+// ranges, and reused for all the rows.
+// Within a row the messages of a pass depend on those of the previous pixel,
+// so the aggregation runs the two passes in parallel (at most two threads);
+// the costs and the winner selection are computed with all the threads.
+
+#include "mgm_refine.h"
+
+
+void mgm_stream(const struct costvolume_filler &F, const struct Img &in_w,
+                const struct Img &dminI, const struct Img &dmaxI,
+                struct Img *out, struct Img *outcost,
+                const float P1, const float P2, const int MGM,
+                const int USE_FELZENSZWALB_POTENTIALS, // USE SGM(0) or FELZENSZWALB(1) POTENTIALS
+                int SGM_FIX_OVERCOUNT,                 // fix the overcounting in SGM following (Drory etal. 2014)
+                char *refinement)                      // none, vfit, parabola, cubic, parabolaOCV
+{
+   int nx = dminI.nx;
+   int ny = dminI.ny;
+   const int NDIR = 2;
+
+   // check the content of in_w is it all 1?
+   int USE_IMAGE_DEPENDENT_WEIGHTS=0;
+   for (int i=0; i<in_w.ncol*in_w.nrow*in_w.nch; i++)
+      if (in_w[i] != 1.0) USE_IMAGE_DEPENDENT_WEIGHTS = 1;
+   if (USE_IMAGE_DEPENDENT_WEIGHTS) printf(" USING IMAGE DEPENDENT WEIGHTS\n");
+   if (TSGM_DEBUG()) printf("mgm_stream: using %s aggregation kernels\n", MGM_SIMD_NAME);
+
+   // the passes (I) and (V) of mgm, and their edges in the channels of in_w
+   Pass_setup direct[NDIR] = {
+      Pass_setup(Point(-1,0)  , Point(0,-1)  , Point(-1,-1) , Point(1,-1)  ,1,1,1),  // (I)
+      Pass_setup(Point(-1,-1) , Point(1,-1)  , Point(0,-1)  , Point(1,0)   ,0,1,1),  // (V)
+   };
+   int pass_to_channel_1[] = {0,4};
+   int pass_to_channel_2[] = {3,5};
+   int pass_to_channel_3[] = {4,3};
+   int pass_to_channel_4[] = {5,1};
+
+   // the row with the largest ranges
+   int ywidest = 0;
+   long nwidest = -1;
+   for(int y=0; y<ny; y++) {
+      long n = 0;
+      for(int x=0; x<nx; x++)
+         n += (int) dmaxI[x + y*nx] - (int) dminI[x + y*nx] + 1;
+      if (n > nwidest) {
+         nwidest = n;
+         ywidest = y;
+      }
+   }
+   struct Img rowmin(nx,1), rowmax(nx,1);
+   for(int x=0; x<nx; x++) {
+      rowmin[x] = dminI[x + ywidest*nx];
+      rowmax[x] = dmaxI[x + ywidest*nx];
+   }
+
+   // matching costs C, ring buffer of messages L[y%2][pass] and their sum S
+   // of a row, allocated for the widest row
+   struct costvolume_t C = allocate_costvolume(rowmin, rowmax);
+   struct costvolume_t S = allocate_costvolume(rowmin, rowmax);
+   struct costvolume_t L[2][NDIR];
+   for(int k=0; k<2; k++)
+   for(int pass=0; pass<NDIR; pass++)
+      L[k][pass].copy_from(C);
+   std::vector<float > rowout(nx), rowcost(nx);
+
+   for(int y=0; y<ny; y++)
+   {
+      for(int x=0; x<nx; x++) {
+         rowmin[x] = dminI[x + y*nx];
+         rowmax[x] = dmaxI[x + y*nx];
+      }
+
+      // matching costs of the row
+      C.set_ranges(rowmin, rowmax);
+      int maxrange = costvolume_maxrange(C, nx);
+      #pragma omp parallel
+      {
+         int ham[maxrange];
+         #pragma omp for
+         for(int x=0; x<nx; x++)
+            F.fill_pixel(x, y, C[x], ham);
+      }
+
+      // messages of the row for both passes
+      struct costvolume_t *Lcur  = L[y%2];
+      struct costvolume_t *Lprev = L[(y+1)%2];
+      #pragma omp parallel for num_threads(NDIR)
+      for(int pass=0; pass<NDIR; pass++)
+      {
+         Pass_setup dir = direct[pass];
+         Lcur[pass].copy_from(C);
+
+         for(int ii=0; ii<nx; ii++)
+         {
+            int x = dir.inc_x ? ii : nx-1-ii;
+            Point p(x,y);				   // current point
+            Point pr[4] = {p + dir.dir1, p + dir.dir2, p + dir.dir3, p + dir.dir4};
+
+            int inside = 1;
+            for(int k=0; k<4; k++)
+               if (!check_inside_image(pr[k], dminI)) inside = 0;
+            if (!inside) continue;
+
+            // the neighbors are either in the current row or in the previous one
+            Dvec *Ln[4];
+            for(int k=0; k<4; k++)
+               Ln[k] = pr[k].y == y ? &Lcur[pass][pr[k].x] : &Lprev[pass][pr[k].x];
+
+            float DeltaI1 = 1, DeltaI2 = 1, DeltaI3 = 1, DeltaI4 = 1;
+            if(USE_IMAGE_DEPENDENT_WEIGHTS) {      // IMAGE DEPENDENT WEIGHTS
+               #define val(u, p, ch)  u.data[(p.x) + (u.nx)*(p.y) + (ch)*(u.npix)]
+               DeltaI1 = val(in_w, p, pass_to_channel_1[pass]);
+               DeltaI2 = val(in_w, p, pass_to_channel_2[pass]);
+               DeltaI3 = val(in_w, p, pass_to_channel_3[pass]);
+               DeltaI4 = val(in_w, p, pass_to_channel_4[pass]);
+               #undef val
+            }
+            update_pixel(Lcur[pass][x], C[x], *Ln[0], *Ln[1], *Ln[2], *Ln[3], P1, P2,
+                  DeltaI1, DeltaI2, DeltaI3, DeltaI4, MGM, USE_IMAGE_DEPENDENT_WEIGHTS, USE_FELZENSZWALB_POTENTIALS);
+         }
+      }
+
+      // accumulate S for the row and WTA
+      S.set_ranges(rowmin, rowmax);
+      #pragma omp parallel for
+      for(int x=0; x<nx; x++) {
+         float minP = S[x].min;
+         float minL = INFINITY;
+         for(int o=S[x].min;o<=S[x].max;o++) {
+            float s = 0;
+            for(int pass=0; pass<NDIR; pass++)
+               s += Lcur[pass][x][o];
+            // overcounting correction (Drory etal. 2014)
+            if (SGM_FIX_OVERCOUNT==1)
+               s -= (NDIR -1) * C[x][o];
+            S[x].set_nolock(o, s);
+
+            if(isfinite_safe(s))
+            if(minL > s) {
+               minL = s;
+               minP = o;
+            }
+         }
+         rowout[x]  = minP;
+         rowcost[x] = minL;
+      }
+
+      // call subpixel refinement  (modifies rowout and rowcost)
+      subpixel_refinement_sgm(S, rowout, rowcost, refinement);
+      for(int x=0; x<nx; x++) {
+         (*out)[x + y*nx]     = rowout[x];
+         (*outcost)[x + y*nx] = rowcost[x];
+      }
+   }
+}
+
+#endif //MGM_STREAM_H_
@@ -0,0 +1,104 @@
+/* Regression test of the row kernels of the cost volume (mgm_costvolume.h).
+ * For each distance that has a row kernel (ad, sd, btad, btsd and ncc) the
+ * costs of every pixel and hypothesis are computed by the kernel and by the
+ * cost function that it replaces, and they must be bit-identical.
+ * The pair is also tested as a 3-channel pair with 1% of NaN.
+ * The window of ncc is given by CENSUS_NCC_WIN (as for mgm).
+ * It must be built without -ffast-math, which allows the compiler to
+ * evaluate the kernels and the functions differently (see the makefile).
+ *
+ *    test_costvolume left.tif right.tif dmin dmax
+ *
+ * The exit status is the number of tests with differing costs. */
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "math.h"
+#include <vector>
+#include "assert.h"
+
+#include "smartparameter.h"
+#include "img_interp.h"
+#include "point.h"
+#include "img_tools.h"
+
+SMART_PARAMETER(TSGM_DEBUG,0)
+
+#include "mgm_costvolume.h"
+
+
+// number of costs of the pair (u,v) for the hypotheses [dmin,dmax] that
+// differ between the row kernel of the distance and its cost function
+static long compare_row_kernel(struct Img &u, struct Img &v, const char *distance,
+                               int dmin, int dmax)
+{
+   struct costvolume_filler F(u, v, (char*) "none", (char*) distance, INFINITY);
+   struct costvolume_filler G(F);
+   G.kernel = ROW_NONE;
+   int n = dmax - dmin + 1;
+   long ndiff = 0;
+
+   #pragma omp parallel reduction(+:ndiff)
+   {
+      std::vector<float> a(n), b(n);
+      std::vector<int> ham(n);
+      #pragma omp for
+      for(int j=0;j<u.ny;j++)
+      for(int i=0;i<u.nx;i++) {
+         Dvec A, B;
+         A.init(dmin, dmax, &a.front());
+         B.init(dmin, dmax, &b.front());
+         F.fill_pixel(i, j, A, &ham.front());
+         G.fill_pixel(i, j, B, &ham.front());
+         for(int k=0;k<n;k++)
+            if (memcmp(&a[k], &b[k], sizeof(float))) ndiff++;
+      }
+   }
+   return ndiff;
+}
+
+
+// 3-channel copy of u with 1% of NaN
+static struct Img three_channels_with_nan(const struct Img &u, unsigned seed)
+{
+   struct Img r(u.nx, u.ny, 3);
+   for(int i=0;i<u.npix;i++) {
+      float x = u[i];
+      r[i]            = x;
+      r[i + u.npix]   = 0.5*x + 10;
+      r[i + 2*u.npix] = 255 - x;
+   }
+   for(int i=0;i<u.npix;i++) {
+      seed = seed * 1103515245 + 12345;
+      if ((seed >> 16) % 100 == 0)
+         r[i + ((seed >> 8) % 3)*u.npix] = NAN;
+   }
+   return r;
+}
+
+
+int main(int argc, char* argv[])
+{
+   if (argc != 5) {
+      fprintf(stderr, "usage:\n\t%s left.tif right.tif dmin dmax\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+   struct Img u = iio_read_vector_split(argv[1]);
+   struct Img v = iio_read_vector_split(argv[2]);
+   int dmin = atoi(argv[3]);
+   int dmax = atoi(argv[4]);
+   struct Img u3 = three_channels_with_nan(u, 1);
+   struct Img v3 = three_channels_with_nan(v, 2);
+
+   const char *distances[] = {"ad", "sd", "btad", "btsd", "ncc"};
+   int nfail = 0;
+   for(int k=0;k<5;k++)
+   for(int nan=0;nan<2;nan++) {
+      long ndiff = nan ? compare_row_kernel(u3, v3, distances[k], dmin, dmax)
+                       : compare_row_kernel(u, v, distances[k], dmin, dmax);
+      printf("%-4s %-20s ncc window %d: %ld differing costs\n", distances[k],
+             nan ? "3 channels with NaN" : "input pair", (int) CENSUS_NCC_WIN(), ndiff);
+      if (ndiff) nfail++;
+   }
+   return nfail;
+}
@@ -407,6 +407,64 @@ namespace GeographicLib {
     k *= _k0;
   }
 
+  void TransverseMercator::Forward(real lon0, const real* lat,
+                                   const real* lon, real* x, real* y,
+                                   size_t n) const throw() {
+    lon0 = Math::AngNormalize(lon0);
+    for (size_t i = 0; i < n; ++i) {
+      real
+        lati = lat[i],
+        loni = Math::AngDiff(lon0, Math::AngNormalize(lon[i]));
+      int
+        latsign = lati < 0 ? -1 : 1,
+        lonsign = loni < 0 ? -1 : 1;
+      lati *= latsign;
+      loni *= lonsign;
+      if (loni > 90 || lati == 90) {
+        // backside and poles, see Forward
+        Forward(lon0, lat[i], lon[i], x[i], y[i]);
+        continue;
+      }
+      // With r = hypot(tau', c), xi' = atan2(tau', c) and sinh(eta') = q,
+      // see Forward:
+      //   sin(xi') = tau'/r,  cos(xi') = c/r
+      //   sinh(eta') = q = sin(lam)/r,  cosh(eta') = sqrt(1 + q^2)
+      real
+        phi = lati * Math::degree<real>(),
+        lam = loni * Math::degree<real>(),
+        c = max(real(0), cos(lam)),
+        taup = taupf(tan(phi)),
+        r2 = Math::sq(taup) + Math::sq(c),
+        xip = atan2(taup, c),
+        q = sin(lam) / sqrt(r2),
+        etap = Math::asinh(q),
+        c0 = (Math::sq(c) - Math::sq(taup)) / r2, // cos(2*xi')
+        s0 = 2 * taup * c / r2,                   // sin(2*xi')
+        ch0 = 1 + 2 * Math::sq(q),                // cosh(2*eta')
+        sh0 = 2 * q * sqrt(1 + Math::sq(q)),      // sinh(2*eta')
+        ar = 2 * c0 * ch0, ai = -2 * s0 * sh0;    // 2 * cos(2*zeta')
+      // Clenshaw summation, see Forward
+      int k = maxpow_;
+      real
+        xi0 = (k & 1 ? _alp[k--] : 0), eta0 = 0,
+        xi1 = 0, eta1 = 0;
+      while (k) {
+        xi1  = ar * xi0 - ai * eta0 - xi1 + _alp[k];
+        eta1 = ai * xi0 + ar * eta0 - eta1;
+        --k;
+        xi0  = ar * xi1 - ai * eta1 - xi0 + _alp[k];
+        eta0 = ai * xi1 + ar * eta1 - eta0;
+        --k;
+      }
+      ar = s0 * ch0; ai = c0 * sh0; // sin(2*zeta')
+      real
+        xi  = xip  + ar * xi0 - ai * eta0,
+        eta = etap + ai * xi0 + ar * eta0;
+      y[i] = _a1 * _k0 * xi * latsign;
+      x[i] = _a1 * _k0 * eta * lonsign;
+    }
+  }
+
   void TransverseMercator::Reverse(real lon0, real x, real y,
                                    real& lat, real& lon, real& gamma, real& k)
     const throw() {
@@ -39,73 +39,9 @@ static void *fftwf_xmalloc(size_t n)
 
 
 
-#ifndef USE_WISDOM
-void evoke_wisdom(void) {}
-void bequeath_wisdom(void) {}
-#else//USE_WISDOM
 #include "fftwisdom.c"
-#endif//USE_WISDOM
-
-
-
-// wrapper around FFTW3 that computes the complex-valued Fourier transform
-// of a real-valued image
-static void fft_2dfloat(fftwf_complex *fx, float *x, int w, int h)
-{
-	fftwf_complex *a = fftwf_xmalloc(w*h*sizeof*a);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_2d(h, w, a, fx,
-						FFTW_FORWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h) a[i] = x[i]; // complex assignment!
-	fftwf_execute(p);
-
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_cleanup();
-}
 
 #include "smapa.h"
-SMART_PARAMETER_SILENT(FIWARN,1)
-
-// Wrapper around FFTW3 that computes the real-valued inverse Fourier transform
-// of a complex-valued frequantial image.
-// The input data must be hermitic.
-static void ifft_2dfloat(float *ifx,  fftwf_complex *fx, int w, int h)
-{
-	fftwf_complex *a = fftwf_xmalloc(w*h*sizeof*a);
-	fftwf_complex *b = fftwf_xmalloc(w*h*sizeof*b);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_2d(h, w, a, b,
-						FFTW_BACKWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h) a[i] = fx[i];
-	fftwf_execute(p);
-	float scale = 1.0/(w*h);
-	FORI(w*h) {
-		fftwf_complex z = b[i] * scale;
-		ifx[i] = crealf(z);
-		if (FIWARN() > 0)
-		{
-			if (cimagf(z) > 0.001)
-				fail("z is not real {cimagf(z)=%g} (set FIWARN=0 to run anyway)", cimagf(z));
-			//assert(cimagf(z) < 0.001);
-		}
-	}
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_free(b);
-	fftwf_cleanup();
-}
-
 SMART_PARAMETER_SILENT(BLUR_INVERSE,0)
 SMART_PARAMETER_SILENT(BLUR_INVERSE_WIENER,0)
 #define UGLY_HACK_FOR_WIENER_FILTERING 1
@@ -154,17 +90,19 @@ void gblur_gray(float *y, float *x, int w, int h, float s)
 {
 	s = 1/s;
 
-	fftwf_complex *fx = fftwf_xmalloc(w*h*sizeof*fx);
-	fft_2dfloat(fx, x, w, h);
+	int nc = (w/2 + 1) * h;
+
+	fftwf_complex *fx = fftwf_xmalloc(nc*sizeof*fx);
+	fft_r2c_2dfloat(fx, x, w, h);
 
 	float *g = xmalloc(w*h*sizeof*g);
 	fill_2d_gaussian_image(g, w, h, s);
 
-	fftwf_complex *fg = fftwf_xmalloc(w*h*sizeof*fg);
-	fft_2dfloat(fg, g, w, h);
+	fftwf_complex *fg = fftwf_xmalloc(nc*sizeof*fg);
+	fft_r2c_2dfloat(fg, g, w, h);
 
-	pointwise_complex_multiplication(fx, fx, fg, w*h);
-	ifft_2dfloat(y, fx, w, h);
+	pointwise_complex_multiplication(fx, fx, fg, nc);
+	ifft_c2r_2dfloat(y, fx, w, h);
 
 	fftwf_free(fx);
 	fftwf_free(fg);
@@ -291,11 +229,12 @@ static void substract_from_identity(float *k, int w, int h)
 static void gray_fconvolution_2d(float *y, float *x, fftwf_complex *fk,
 		int w, int h)
 {
-	fftwf_complex *fx = fftwf_xmalloc(w*h*sizeof*fx);
-	fft_2dfloat(fx, x, w, h);
+	int nc = (w/2 + 1) * h;
+	fftwf_complex *fx = fftwf_xmalloc(nc*sizeof*fx);
+	fft_r2c_2dfloat(fx, x, w, h);
 
-	pointwise_complex_multiplication(fx, fx, fk, w*h);
-	ifft_2dfloat(y, fx, w, h);
+	pointwise_complex_multiplication(fx, fx, fk, nc);
+	ifft_c2r_2dfloat(y, fx, w, h);
 
 	fftwf_free(fx);
 }
@@ -353,8 +292,8 @@ void blur_2d(float *y, float *x, int w, int h, int pd,
 	//void iio_save_image_float(char*,float*,int,int);
 	//iio_save_image_float("/tmp/blurk.tiff", k, w, h);
 
-	fftwf_complex *fk = fftwf_xmalloc(w*h*sizeof*fk);
-	fft_2dfloat(fk, k, w, h);
+	fftwf_complex *fk = fftwf_xmalloc((w/2 + 1)*h*sizeof*fk);
+	fft_r2c_2dfloat(fk, k, w, h);
 	free(k);
 
 	color_fconvolution_2d(y, x, fk, w, h, pd);
@@ -1,8 +1,10 @@
+#define _POSIX_C_SOURCE 200809L // pwrite, fileno, ftello
 #include <unistd.h>
 #include <ctype.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #ifdef _OPENMP
 #include <omp.h>
@@ -22,18 +24,25 @@
 #include "timing.h"
 
 
-void utm_alt_zone(double *out, double lat, double lon, int zone);
+void utm_alt_zone_batch(double *x, double *y, const double *lat,
+        const double *lon, int n, int zone);
 void utm_zone(int *zone, bool *northp, double lat, double lon);
 
 
-static void getxyz(double xyz[3], struct rpc *r, double i, double j, double h,
-        int zone)
+// utm coordinates of the n points (i[k], j[k], h[k]) of the image, the
+// longitudes and latitudes are stored in lon, lat and projected by a single
+// call to utm_alt_zone_batch
+static void getxy_batch(double *x, double *y, double *lon, double *lat,
+        struct rpc_grid *r, const double *i, const double *j,
+        const double *h, int n, int zone)
 {
-    double lon_lat[2];
-    eval_rpc(lon_lat, r, i, j, h);
-    utm_alt_zone(xyz, lon_lat[1], lon_lat[0], zone);
-    xyz[2] = h;
-    //printf("%f %f\n", xyz[0], xyz[1]);
+    for (int k = 0; k < n; k++) {
+        double lon_lat[2];
+        rpc_grid_eval(lon_lat, r, i[k], j[k], h[k]);
+        lon[k] = lon_lat[0];
+        lat[k] = lon_lat[1];
+    }
+    utm_alt_zone_batch(x, y, lat, lon, n, zone);
 }
 
 
@@ -85,14 +94,21 @@ unsigned char test_little_endian(void)
 }
 
 
+// length of the comment line of the header that holds the bounding box of
+// the points, it is written blank and filled once the points are known
+#define PLY_BBOX_LINE 128
+
+// the offset of the bounding box line is returned in bbox_offset
 void write_ply_header(FILE* f, uint64_t npoints, int zone,
-        bool hem, bool colors, bool normals)
+        bool hem, bool colors, bool normals, off_t *bbox_offset)
 {
     fprintf(f, "ply\n");
     fprintf(f, "format binary_little_endian 1.0\n");
     fprintf(f, "comment created by S2P\n");
     if (zone >= 0)
         fprintf(f, "comment projection: UTM %i%s\n", zone, (hem ? "N" : "S"));
+    *bbox_offset = ftello(f);
+    fprintf(f, "%-*s\n", PLY_BBOX_LINE - 1, "comment bbox:");
     fprintf(f, "element vertex %" PRIu64 "\n", npoints);
     fprintf(f, "property double x\n");
     fprintf(f, "property double y\n");
@@ -137,7 +153,7 @@ static void help(char *s)
     fprintf(stderr, "\t usage: %s out.ply heights.tif rpc.xml "
             "[colors.png] [-h \"h1 ... h9\"] [--utm-zone ZONE] "
             "[--offset_x x0] [--offset_y y0] [--with-normals] "
-            "[--max-memory MB]\n", s);
+            "[--max-memory MB] [--rpc-grid STEP [--rpc-grid-err E]]\n", s);
 
     // offset allows the user to choose the origin of the coordinates system,
     // in order to avoid visualisation problems due to huge values of the
@@ -148,7 +164,7 @@ static void help(char *s)
 
 int main(int c, char *v[])
 {
-    if (c < 4 || c > 17) {
+    if (c < 4 || c > 21) {
         help(*v);
         return 1;
     }
@@ -189,6 +205,11 @@ int main(int c, char *v[])
     char *max_mem = pick_option(&c, &v, "-max-memory", "1024");
     uint64_t buf_size = 1024*1024*atoi(max_mem) / nthreads;
 
+    // approximation of the rpc by a lattice with nodes spaced by STEP pixels
+    // and an interpolation error below E meters (see struct rpc_grid)
+    double rpc_grid_step = atof(pick_option(&c, &v, "-rpc-grid", "0"));
+    double rpc_grid_err = atof(pick_option(&c, &v, "-rpc-grid-err", "0.001"));
+
     // parse the remaining arguments
     char *fname_ply = v[1];
     char *fname_heights = v[2];
@@ -213,42 +234,82 @@ int main(int c, char *v[])
     struct rpc r[1];
     read_rpc_file_xml(r, fname_rpc);
 
-    // count number of valid pixels
-    uint64_t npoints = 0;
+    // the lattice covers the footprint of the height map in the full image
+    // and its range of heights, the error is converted to degrees (111320
+    // meters per degree)
+    struct rpc_grid grid[1] = {{0}};
+    grid->p = r;
+    if (rpc_grid_step > 0) {
+        double bb[4] = {INFINITY, -INFINITY, INFINITY, -INFINITY};
+        double hmin = INFINITY, hmax = -INFINITY;
+        for (int k = 0; k < 4; k++) {
+            double xy[2] = {(k % 2) * (w - 1), (k / 2) * (h - 1)};
+            if (there_is_a_homography)
+                apply_homography(xy, inv_hom, xy);
+            bb[0] = fmin(bb[0], xy[0]);
+            bb[1] = fmax(bb[1], xy[0]);
+            bb[2] = fmin(bb[2], xy[1]);
+            bb[3] = fmax(bb[3], xy[1]);
+        }
+        for (uint64_t pix = 0; pix < (uint64_t) w*h; pix++)
+            if (isfinite(height[pix])) {
+                hmin = fmin(hmin, height[pix]);
+                hmax = fmax(hmax, height[pix]);
+            }
+        if (normals)
+            hmax += 10;
+        double e = NAN;
+        if (hmin <= hmax)
+            e = rpc_grid_init(grid, r, false, bb[0], bb[1], bb[2], bb[3],
+                    hmin, hmax, rpc_grid_step, rpc_grid_err / 111320);
+        if (isfinite(e))
+            printf("rpc grid of %dx%dx%d nodes, estimated error %g m\n",
+                    grid->n[0], grid->n[1], grid->n[2], e * 111320);
+        else
+            printf("rpc grid not used\n");
+    }
+
+    // count the valid pixels of each row, their prefix sums give the position
+    // in the ply file of the points of each row
     printf("counting valid points...\n");
     TIMING_CPUCLOCK_START(0);
+    uint64_t *row_start = malloc((h + 1) * sizeof*row_start);
+    row_start[0] = 0;
+    # pragma omp parallel for
+    for (int row = 0; row < h; row++) {
+        uint64_t n = 0;
+        for (int col = 0; col < w; col++)
+            n += !isnan(height[(uint64_t) row * w + col]);
+        row_start[row + 1] = n;
+    }
     for (int row = 0; row < h; row++)
-    for (int col = 0; col < w; col++) {
-        uint64_t pix = (uint64_t) row * w + col;
+        row_start[row + 1] += row_start[row];
+    uint64_t npoints = row_start[h];
+
+    // UTM Zone will be the zone of first 'not NaN' point
+    for (uint64_t pix = 0; zone < 0 && pix < (uint64_t) w*h; pix++)
         if (!isnan(height[pix])) {
-            npoints++;
-
-            // UTM Zone will be the zone of first 'not NaN' point
-            if (zone < 0) {
-                double xy[2] = {col, row};
-                if (there_is_a_homography)
-                    apply_homography(xy, inv_hom, xy);
-                double lon_lat[2];
-                eval_rpc(lon_lat, r, xy[0], xy[1], height[pix]);
-                utm_zone(&zone, &hem, lon_lat[1], lon_lat[0]);
-            }
+            double xy[2] = {pix % w, pix / w};
+            if (there_is_a_homography)
+                apply_homography(xy, inv_hom, xy);
+            double lon_lat[2];
+            eval_rpc(lon_lat, r, xy[0], xy[1], height[pix]);
+            utm_zone(&zone, &hem, lon_lat[1], lon_lat[0]);
         }
-    }
     TIMING_CPUCLOCK_TOGGLE(0);
     TIMING_PRINTF("CPU time spent counting points: %0.6fs\n", TIMING_CPUCLOCK_S(0));
     printf("found %" PRIu64 " valid points\n", npoints);
 
     // print header for ply file
     FILE *ply_file = fopen(fname_ply, "w");
+    if (!ply_file)
+        fail("can not open file \"%s\"", fname_ply);
+    off_t bbox_offset;
     write_ply_header(ply_file, npoints, zone, hem, there_is_color,
-            normals);
-
-    // prepare one buffer per thread
-    char *buf[nthreads], *ptr[nthreads];
-    for (int i = 0; i < nthreads; i++) {
-        buf[i] = malloc(buf_size);
-        ptr[i] = buf[i];
-    }
+            normals, &bbox_offset);
+    fflush(ply_file);
+    off_t header_size = ftello(ply_file);
+    int fd = fileno(ply_file);
 
     // loop over all the pixels of the input height map
     // a 3D point is produced for each 'non Nan' height
@@ -260,78 +321,152 @@ int main(int c, char *v[])
     if (there_is_color)
         point_size += 3*sizeof(uint8_t);
 
-    # pragma omp parallel for
-    for (int pix = 0; pix < (uint64_t) w*h; pix++) {
-        if (!isnan(height[pix])) {
-
-            // if the buffer is full, write to file and reset
-            int i = 0;
-            #ifdef _OPENMP
-            i = omp_get_thread_num();
-            #endif
-            if (buf[i] + buf_size - ptr[i] < point_size) {
-                int nbytes = ptr[i] - buf[i];
-                # pragma omp critical
-                    fwrite(buf[i], sizeof(char), nbytes, ply_file);
-                ptr[i] = buf[i];
-            }
-
-            // compute coordinates of pix in the big image
-            int col = pix % w;
-            int row = pix / w;
-            double xy[2] = {col, row};
-            if (there_is_a_homography)
-                apply_homography(xy, inv_hom, xy);
-
-            // compute utm coordinates
-            double xyz[3], nrm[3], tmp[3];
-            getxyz(xyz, r, xy[0], xy[1], height[pix], zone);
-
-            if (there_is_an_offset) {
-                xyz[0] -= x0;
-                xyz[1] -= y0;
-            }
-
-            // write to memory
-            double *ptr_double = (double *) ptr[i];
-            ptr_double[0] = xyz[0];
-            ptr_double[1] = xyz[1];
-            ptr_double[2] = xyz[2];
-
-            // normals (unit 3D vector with direction of the camera)
-            if (normals) {
-                getxyz(tmp, r, col, row, height[pix] + 10, zone);
-                nrm[0] = tmp[0] - xyz[0];
-                nrm[1] = tmp[1] - xyz[1];
-                nrm[2] = tmp[2] - xyz[2];
-                normalize_vector_3d(nrm);
-                ptr_double[3] = nrm[0];
-                ptr_double[4] = nrm[1];
-                ptr_double[5] = nrm[2];
+    // the rows are processed by blocks that fit in the buffer of a thread,
+    // and the points of each block are written with pwrite at their final
+    // position: the output does not depend on the number of threads
+    int block_rows = buf_size / (w * point_size);
+    if (block_rows < 1) block_rows = 1;
+    int nblocks = (h + block_rows - 1) / block_rows;
+
+    // bounding box of the (x, y) coordinates of the points
+    double bbox[4] = {INFINITY, -INFINITY, INFINITY, -INFINITY};
+
+    # pragma omp parallel
+    {
+        double bb[4] = {INFINITY, -INFINITY, INFINITY, -INFINITY};
+        char *buf = malloc((size_t) block_rows * w * point_size);
+
+        // points of one row: the valid pixels, followed by the same pixels
+        // 10 meters higher for the normals
+        int m = normals ? 2 * w : w;
+        double *scratch = malloc(7 * (size_t) m * sizeof*scratch);
+        double *pi = scratch, *pj = pi + m, *ph = pj + m;
+        double *px = ph + m, *py = px + m, *plon = py + m, *plat = plon + m;
+        int *pcol = malloc(w * sizeof*pcol);
+
+        # pragma omp for schedule(dynamic)
+        for (int b = 0; b < nblocks; b++) {
+            int row0 = b * block_rows;
+            int row1 = row0 + block_rows < h ? row0 + block_rows : h;
+            char *ptr = buf;
+            for (int row = row0; row < row1; row++) {
+                // compute coordinates of the valid pixels in the big image
+                int n = 0;
+                for (int col = 0; col < w; col++) {
+                    uint64_t pix = (uint64_t) row * w + col;
+                    if (isnan(height[pix]))
+                        continue;
+                    double xy[2] = {col, row};
+                    if (there_is_a_homography)
+                        apply_homography(xy, inv_hom, xy);
+                    pcol[n] = col;
+                    pi[n] = xy[0];
+                    pj[n] = xy[1];
+                    ph[n] = height[pix];
+                    n++;
+                }
+                if (normals)
+                    for (int k = 0; k < n; k++) {
+                        pi[n + k] = pi[k];
+                        pj[n + k] = pj[k];
+                        ph[n + k] = ph[k] + 10;
+                    }
+
+                // compute utm coordinates
+                int npts = normals ? 2 * n : n;
+                getxy_batch(px, py, plon, plat, grid, pi, pj, ph, npts, zone);
+
+                for (int k = 0; k < n; k++) {
+                    uint64_t pix = (uint64_t) row * w + pcol[k];
+                    double xyz[3] = {px[k], py[k], ph[k]}, nrm[3] = {0};
+
+                    // normals (unit 3D vector with direction of the camera)
+                    if (normals) {
+                        nrm[0] = px[n + k] - xyz[0];
+                        nrm[1] = py[n + k] - xyz[1];
+                        nrm[2] = ph[n + k] - xyz[2];
+                        normalize_vector_3d(nrm);
+                    }
+
+                    if (there_is_an_offset) {
+                        xyz[0] -= x0;
+                        xyz[1] -= y0;
+                    }
+                    bb[0] = fmin(bb[0], xyz[0]);
+                    bb[1] = fmax(bb[1], xyz[0]);
+                    bb[2] = fmin(bb[2], xyz[1]);
+                    bb[3] = fmax(bb[3], xyz[1]);
+
+                    // write to memory
+                    double *ptr_double = (double *) ptr;
+                    ptr_double[0] = xyz[0];
+                    ptr_double[1] = xyz[1];
+                    ptr_double[2] = xyz[2];
+                    char *ptr_char = ptr + 3*sizeof(double);
+                    if (normals) {
+                        ptr_double[3] = nrm[0];
+                        ptr_double[4] = nrm[1];
+                        ptr_double[5] = nrm[2];
+                        ptr_char += 3*sizeof(double);
+                    }
+
+                    // colorization: if greyscale, copy the grey on each
+                    // channel
+                    uint8_t rgb[3];
+                    if (there_is_color) {
+                        for (int l = 0; l < pd; l++) rgb[l] = color[l + pd*pix];
+                        for (int l = pd; l < 3; l++) rgb[l] = rgb[l-1];
+                        ptr_char[0] = rgb[0];
+                        ptr_char[1] = rgb[1];
+                        ptr_char[2] = rgb[2];
+                    }
+
+                    ptr += point_size;
+                }
             }
 
-            // colorization: if greyscale, copy the grey on each channel
-            uint8_t rgb[3];
-            if (there_is_color) {
-                for (int k = 0; k < pd; k++) rgb[k] = color[k + pd*pix];
-                for (int k = pd; k < 3; k++) rgb[k] = rgb[k-1];
-                char *ptr_char = ptr[i] + 3*sizeof(double);
-                ptr_char[0] = rgb[0];
-                ptr_char[1] = rgb[1];
-                ptr_char[2] = rgb[2];
+            // write the block at the position of its first point
+            size_t nbytes = ptr - buf;
+            off_t offset = header_size + row_start[row0] * point_size;
+            for (size_t done = 0; done < nbytes; ) {
+                ssize_t n = pwrite(fd, buf + done, nbytes - done,
+                        offset + done);
+                if (n <= 0)
+                    fail("error writing to \"%s\"", fname_ply);
+                done += n;
             }
-
-            ptr[i] += point_size;
+        }
+        free(pcol);
+        free(scratch);
+        free(buf);
+        # pragma omp critical
+        {
+            bbox[0] = fmin(bbox[0], bb[0]);
+            bbox[1] = fmax(bbox[1], bb[1]);
+            bbox[2] = fmin(bbox[2], bb[2]);
+            bbox[3] = fmax(bbox[3], bb[3]);
         }
     }
     TIMING_WALLCLOCK_TOGGLE(0);
     TIMING_PRINTF("WALL time spent computing the points: %0.6fs\n",
             TIMING_WALLCLOCK_S(0));
 
-    // write the last buffers to file
-    for (int i = 0; i < nthreads; i++)
-        fwrite(buf[i], sizeof(char), ptr[i] - buf[i], ply_file);
+    // fill the bounding box line of the header ("xmin xmax ymin ymax", with
+    // enough digits to give back the same doubles), plyflatten reads it
+    // instead of reading all the points
+    if (npoints > 0) {
+        char line[PLY_BBOX_LINE + 1];
+        int n = snprintf(line, sizeof line,
+                "comment bbox: %.17g %.17g %.17g %.17g",
+                bbox[0], bbox[1], bbox[2], bbox[3]);
+        memset(line + n, ' ', PLY_BBOX_LINE - 1 - n);
+        line[PLY_BBOX_LINE - 1] = '\n';
+        if (PLY_BBOX_LINE != pwrite(fd, line, PLY_BBOX_LINE, bbox_offset))
+            fail("error writing to \"%s\"", fname_ply);
+    }
 
+    free(row_start);
+    rpc_grid_free(grid);
     fclose(ply_file);
     return 0;
 }
@@ -8,6 +8,7 @@
 #include "iio.h"
 #include "rpc.h"
 #include "read_matrix.c"
+#include "pickopt.c"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846264338328
@@ -22,6 +23,162 @@ void applyHom(double outv[3], double M[3][3], double v[3]) {
 }
 
 
+// Cache of the epipolar curves on a coarse grid.
+// For each node (i*step, j*step) of a grid over the rectified image a, and
+// for nh heights h_k = h0 + k*dh spanning the validity domain of rpca, the
+// grid stores the location in image b of the point of image a seen at that
+// node, with height h_k.  The epipolar curve of any pixel is then obtained
+// by bilinear interpolation of the curves of the four neighboring nodes,
+// and is linear between two consecutive heights.
+#define RAY_GRID_MAXH 257
+struct ray_grid {
+    int nx, ny, nh;   // number of nodes along x, y and of heights
+    double step;      // spacing of the nodes, in pixels
+    double h0, dh;    // sampled heights
+    double *p;        // p[2*(k + nh*(i + nx*j)) + l], coordinates in image b
+};
+
+// location in image b of the point of the rectified image a at (x, y),
+// with height h
+static void ray_grid_exact(double out[2], struct rpc *rpca, struct rpc *rpcb,
+        double invHa[3][3], double x, double y, double h)
+{
+    double p[3] = {x, y, 1}, q[3], tmp[2];
+    applyHom(q, invHa, p);
+    eval_rpc(tmp, rpca, q[0], q[1], h);
+    eval_rpci(out, rpcb, tmp[0], tmp[1], h);
+}
+
+static void ray_grid_fill(struct ray_grid *g, struct rpc *rpca,
+        struct rpc *rpcb, double invHa[3][3])
+{
+    #pragma omp parallel for schedule(dynamic)
+    for (int j = 0; j < g->ny; j++)
+    for (int i = 0; i < g->nx; i++)
+    for (int k = 0; k < g->nh; k++)
+        ray_grid_exact(g->p + 2*(k + g->nh*(i + g->nx*j)), rpca, rpcb, invHa,
+                i*g->step, j*g->step, g->h0 + k*g->dh);
+}
+
+// sampled epipolar curve of the point (x, y): c[2*k+l] for k = 0..nh-1
+static void ray_grid_curve(double *c, struct ray_grid *g, double x, double y)
+{
+    double u = x / g->step, v = y / g->step;
+    int i = floor(u), j = floor(v);
+    if (i < 0) i = 0;
+    if (j < 0) j = 0;
+    if (i > g->nx - 2) i = g->nx - 2;
+    if (j > g->ny - 2) j = g->ny - 2;
+    u -= i;
+    v -= j;
+    double w[4] = {(1-u)*(1-v), u*(1-v), (1-u)*v, u*v};
+    int n = 2*g->nh;
+    double *p00 = g->p + n*(i + g->nx*j), *p10 = p00 + n;
+    double *p01 = p00 + n*g->nx, *p11 = p01 + n;
+    for (int k = 0; k < n; k++)
+        c[k] = w[0]*p00[k] + w[1]*p10[k] + w[2]*p01[k] + w[3]*p11[k];
+}
+
+// maximum distance between the interpolated and the exact epipolar curves,
+// at the centers of the cells for the sampled heights (*exy) and at the
+// nodes for the heights halfway between the samples (*eh)
+static void ray_grid_check(double *exy, double *eh, struct ray_grid *g,
+        struct rpc *rpca, struct rpc *rpcb, double invHa[3][3])
+{
+    double mxy = 0, mh = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(max:mxy,mh)
+    for (int j = 0; j < g->ny; j++)
+    for (int i = 0; i < g->nx; i++)
+    {
+        double c[2*RAY_GRID_MAXH], e[2];
+        if (i < g->nx - 1 && j < g->ny - 1) {
+            double x = (i + 0.5)*g->step, y = (j + 0.5)*g->step;
+            ray_grid_curve(c, g, x, y);
+            for (int k = 0; k < g->nh; k++) {
+                ray_grid_exact(e, rpca, rpcb, invHa, x, y, g->h0 + k*g->dh);
+                mxy = fmax(mxy, hypot(c[2*k] - e[0], c[2*k+1] - e[1]));
+            }
+        }
+        double *p = g->p + 2*g->nh*(i + g->nx*j);
+        for (int k = 0; k < g->nh - 1; k++) {
+            ray_grid_exact(e, rpca, rpcb, invHa, i*g->step, j*g->step,
+                    g->h0 + (k + 0.5)*g->dh);
+            mh = fmax(mh, hypot((p[2*k] + p[2*k+2])/2 - e[0],
+                                (p[2*k+1] + p[2*k+3])/2 - e[1]));
+        }
+    }
+    *exy = mxy;
+    *eh = mh;
+}
+
+// build a grid whose interpolation error is below maxerr pixels, starting
+// from the given step and refining the dimension that does not meet the
+// bound, returns the error or NAN if the bound could not be met
+static double ray_grid_build(struct ray_grid *g, struct rpc *rpca,
+        struct rpc *rpcb, double invHa[3][3], int w, int h,
+        double step, double maxerr)
+{
+    int nh = 9;
+    g->p = NULL;
+    for (int t = 0; t < 8; t++) {
+        free(g->p);
+        g->step = step;
+        g->nx = (int) ceil((w - 1) / step) + 1;
+        g->ny = (int) ceil((h - 1) / step) + 1;
+        if (g->nx < 2) g->nx = 2;
+        if (g->ny < 2) g->ny = 2;
+        g->nh = nh;
+        g->h0 = rpca->offset[2] - rpca->scale[2];
+        g->dh = 2 * rpca->scale[2] / (nh - 1);
+        g->p = malloc(2 * sizeof(double) * g->nh * g->nx * g->ny);
+        ray_grid_fill(g, rpca, rpcb, invHa);
+
+        double exy, eh;
+        ray_grid_check(&exy, &eh, g, rpca, rpcb, invHa);
+        if (exy + eh <= maxerr)
+            return exy + eh;
+        if (exy > maxerr / 2) {
+            if (step <= 1) break;
+            step = fmax(1, step / 2);
+        }
+        if (eh > maxerr / 2) {
+            if (2*nh - 1 > RAY_GRID_MAXH) break;
+            nh = 2*nh - 1;
+        }
+    }
+    free(g->p);
+    g->p = NULL;
+    return NAN;
+}
+
+// height of the point of the rectified image a at (x, y) whose projection
+// into image b is (xb, yb): closest point of the interpolated epipolar curve,
+// returns NAN if it is outside the range of sampled heights
+static double ray_grid_height(struct ray_grid *g, double x, double y,
+        double xb, double yb, double *outerr)
+{
+    double c[2*RAY_GRID_MAXH];
+    ray_grid_curve(c, g, x, y);
+    double best = INFINITY, h = NAN;
+    for (int k = 0; k < g->nh - 1; k++) {
+        double a[2] = {c[2*k+2] - c[2*k], c[2*k+3] - c[2*k+1]};
+        double b[2] = {xb - c[2*k], yb - c[2*k+1]};
+        double s = (a[0]*b[0] + a[1]*b[1]) / (a[0]*a[0] + a[1]*a[1]);
+        if (s < 0 && k > 0) s = 0;
+        if (s > 1 && k < g->nh - 2) s = 1;
+        double d = hypot(b[0] - s*a[0], b[1] - s*a[1]);
+        if (d < best) {
+            best = d;
+            h = g->h0 + (k + s)*g->dh;
+        }
+    }
+    if (!(h >= g->h0 && h <= g->h0 + (g->nh - 1)*g->dh))
+        return NAN;
+    *outerr = best;
+    return h;
+}
+
+
 /*// convert geodetic coordinates to mercator using a reference longitude
 static void convert_geodetic_to_mercator(double mercator[2], double
         geodetic[2], double reference_longitude) {
@@ -79,9 +236,18 @@ struct world_point {
 
 int main_disp_to_h(int c, char *v[])
 {
+    // with --gauss-newton the heights are computed by rpc_height_gn, started
+    // at the height of the previous pixel of the row
+    bool gauss_newton = pick_option(&c, &v, "-gauss-newton", NULL);
+    // with --ray-grid STEP the epipolar curves are interpolated from a grid
+    // of nodes spaced by STEP pixels (see struct ray_grid), refined until
+    // the interpolation error is below --ray-grid-err pixels
+    double ray_step = atof(pick_option(&c, &v, "-ray-grid", "0"));
+    double ray_err = atof(pick_option(&c, &v, "-ray-grid-err", "0.01"));
     if (c != 9) {
         fprintf(stderr, "usage:\n\t"
                 "%s rpca rpcb Ha Hb dispAB mskAB out_heights RPCerr"
+                " [--gauss-newton] [--ray-grid STEP [--ray-grid-err E]]"
               // 0   1   2    3   4   5      6       7         8
                 "\n", *v);
         return EXIT_FAILURE;
@@ -117,8 +283,27 @@ int main_disp_to_h(int c, char *v[])
     // allocate structure for the output data
 //    struct world_point *outbuf = malloc(nx * ny * sizeof(*outbuf));
 
-    int npoints = 0;
+    // coarse grid of epipolar curves
+    struct ray_grid grid[1] = {{0}};
+    if (ray_step > 0) {
+        double e = ray_grid_build(grid, rpca, rpcb, invHa, nx, ny,
+                                  ray_step, ray_err);
+        if (isfinite(e))
+            fprintf(stderr, "disp_to_h: ray grid of %dx%d nodes, %d heights "
+                    "(step %g), interpolation error %g pixels\n",
+                    grid->nx, grid->ny, grid->nh, grid->step, e);
+        else
+            fprintf(stderr, "disp_to_h: the ray grid can not reach an "
+                    "interpolation error of %g pixels, not used\n", ray_err);
+    }
+
+    int npoints = 0, nexact = 0;
+    long niter = 0;
+    int maxiter = 0;
+    #pragma omp parallel for schedule(dynamic) \
+        reduction(+:npoints,nexact,niter) reduction(max:maxiter)
     for (int y = 0; y < ny; y++) {
+        double hprev = 0;
         for (int x = 0; x < nx; x++) {
             int pos = x + nx*y;
             if (msk[pos] <= 0) {
@@ -128,18 +313,34 @@ int main_disp_to_h(int c, char *v[])
                 double q0[3], q1[3];
 //                double groundCoords[2], groundCoordsPlus10[2],
 //                       groundCoordsNorm[3];
-                double err, h;
+                double err, h = NAN;
                 double dx = dispx[pos];
                 double dy = dispy[pos];
                 double p0[3] = {x, y, 1};
                 double p1[3] = {x+dx, y+dy, 1};
-                applyHom(q0, invHa, p0);
                 applyHom(q1, invHb, p1);
 
-                // compute the coordinates
-                h = rpc_height(rpca, rpcb, q0[0], q0[1], q1[0], q1[1], &err);
+                // interpolated epipolar curve, or exact computation when
+                // there is no grid or the point is outside of its heights
+                if (grid->p)
+                    h = ray_grid_height(grid, x, y, q1[0], q1[1], &err);
+                if (!isfinite(h)) {
+                    applyHom(q0, invHa, p0);
+                    nexact++;
+                    if (gauss_newton) {
+                        int it;
+                        h = rpc_height_gn(rpca, rpcb, q0[0], q0[1], q1[0],
+                                          q1[1], hprev, &err, &it);
+                        niter += it;
+                        if (it > maxiter) maxiter = it;
+                    } else
+                        h = rpc_height(rpca, rpcb, q0[0], q0[1], q1[0], q1[1],
+                                       &err);
+                }
+                if (isfinite(h)) hprev = h;
                 heightMap[pos] = h;
                 errMap[pos] = err;
+                npoints++;
 
 //                eval_rpc(groundCoords, rpca, q0[0], q0[1], h);
 //                // compute normal
@@ -186,6 +387,15 @@ int main_disp_to_h(int c, char *v[])
             }
         }
     }
+    if (grid->p)
+        fprintf(stderr, "disp_to_h: %d points, %d outside of the ray grid\n",
+                npoints, nexact);
+    if (gauss_newton)
+        fprintf(stderr, "disp_to_h: %d points, %.2f Gauss-Newton iterations "
+                "per point (max %d)\n", nexact,
+                nexact ? niter / (double) nexact : 0.0, maxiter);
+    free(grid->p);
+
     // save the height map and error map
     iio_save_image_float_vec(fout_heights, heightMap, nx, ny, 1);
     iio_save_image_float_vec(fout_err, errMap, nx, ny, 1);
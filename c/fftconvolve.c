@@ -7,76 +7,29 @@
 #include <fftw3.h>
 #include "iio.h"
 
-#define FORI(n) for (int i=0; i<(n); i++)
-
-// wrapper around FFTW3 that computes the complex-valued Fourier transform
-// of a real-valued image
-static void fft_2dfloat(float complex *fx,
-      const float *x, const int w, const int h)
-{
-    float complex *a = fftwf_malloc(w*h*sizeof*a);
-
-    fftwf_plan p = fftwf_plan_dft_2d(h, w, a, fx,
-            FFTW_FORWARD, FFTW_ESTIMATE);
-
-    FORI(w*h) a[i] = x[i]; // complex assignment!
-    fftwf_execute(p);
-
-    fftwf_destroy_plan(p);
-    fftwf_free(a);
-    fftwf_cleanup();
-}
-
-// Wrapper around FFTW3 that computes the real-valued inverse Fourier transform
-// of a complex-valued frequantial image.
-// The input data must be hermitic.
-static void ifft_2dfloat(float *ifx,
-        const float complex *fx, const int w, const int h)
-{
-    float complex *a = fftwf_malloc(w*h*sizeof*a);
-    float complex *b = fftwf_malloc(w*h*sizeof*b);
-
-    fftwf_plan p = fftwf_plan_dft_2d(h, w, a, b,
-    					FFTW_BACKWARD, FFTW_ESTIMATE);
-
-    FORI(w*h) a[i] = fx[i];
-    fftwf_execute(p);
-    float scale = 1.0/(w*h);
-    FORI(w*h) {
-        float complex z = b[i] * scale;
-        ifx[i] = crealf(z);
-        if (cimagf(z) > 0.001) printf("inverse %d %f\n", i, cimagf(z));
-        //assert(cimagf(z) < 0.001);
-    }
-    fftwf_destroy_plan(p);
-    fftwf_free(a);
-    fftwf_free(b);
-    fftwf_cleanup();
-}
-
-
-
+#include "fftwisdom.c"
 
 //fft convolution of input by a filter (MTF ctr at 0)
 void fftconvolve(const float* in, const float* filt, float* out, const int w,
         const int h)
 {
-    // alloc temporary storage for the fft's
-    float complex *fin  = fftwf_malloc(w*h*sizeof*fin);
-    float complex *fout = fftwf_malloc(w*h*sizeof*fout);
+    // alloc temporary storage for the half spectrum
+    const int wc = w/2 + 1;
+    float complex *fin = fftwf_malloc(wc*h*sizeof*fin);
 
     // fft
-    fft_2dfloat(fin,in,w,h);
+    fft_r2c_2dfloat(fin, (float *) in, w, h);
 
-    // product
-    for (int i=0; i<w*h; i++)
-       fout[i]= fin[i] * (filt[i] + 0*I);
+    // product: only the real part of the convolution is kept, that is the
+    // convolution by the symmetric part of the filter
+    for (int j=0; j<h; j++)
+        for (int i=0; i<wc; i++)
+            fin[j*wc+i] *= 0.5f * (filt[j*w+i] + filt[((h-j)%h)*w + (w-i)%w]);
 
     // ifft
-    ifft_2dfloat(out,fout,w,h);
+    ifft_c2r_2dfloat(out, fin, w, h);
 
     fftwf_free(fin);
-    fftwf_free(fout);
 }
 
 
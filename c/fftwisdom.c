@@ -0,0 +1,271 @@
+// real-to-complex FFTW3 transforms with cached plans and persistent wisdom
+//
+// The plans are created once per process and per size, so that transforming
+// all the channels of an image, or an image and its kernel, costs a single
+// planning.  When the environment variable FFTW_CACHE is set to a directory,
+// the plans are measured instead of estimated, and the wisdom of each size is
+// saved in a file of that directory named after the size: the next processes
+// working on images of the same size load it and skip the planning.  The
+// files are written to a temporary file and renamed, so that concurrent
+// processes never read a partial file.  Other data derived from the
+// transforms (e.g. the spectrum of a kernel) can be kept in the same directory
+// with fftwisdom_save and fftwisdom_load.
+//
+// When compiled with OpenMP, the 2D and 3D transforms use the threads of FFTW
+// (link with -lfftw3f_threads), otherwise FFTW is used without threads.
+// It compiles as C99 and as C++98 (it is used by homography/Fourier.cpp).
+//
+// The spectrum of a real image of size w x h (x d) holds w/2+1 coefficients
+// per row (the others are given by the hermitian symmetry).  The inverse
+// transforms are normalized, and destroy their input.
+
+#ifndef _FFTWISDOM_C
+#define _FFTWISDOM_C
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef __cplusplus
+#include <complex.h>
+#endif
+#include <fftw3.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "fail.c"
+
+#define FFTWISDOM_MAX_PLANS 16
+
+enum { FFTWISDOM_R2C, FFTWISDOM_C2R, FFTWISDOM_R2C_1D, FFTWISDOM_C2R_1D };
+
+// a cached plan, with the aligned arrays it was planned on
+struct fftwisdom_plan {
+	int kind, w, h, d;
+	void *plan;
+	void *r, *c;
+};
+
+static struct fftwisdom_plan fftwisdom_plans[FFTWISDOM_MAX_PLANS];
+static int fftwisdom_nplans = 0;
+
+static char *fftwisdom_dir(void)
+{
+	char *dir = getenv("FFTW_CACHE");
+	return dir && *dir ? dir : NULL;
+}
+
+static int fftwisdom_nthreads(void)
+{
+#ifdef _OPENMP
+	static int init = 0;
+	if (!init) {
+		fftwf_init_threads();
+		init = 1;
+	}
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+// a file of the cache directory is written to a temporary file, that is
+// renamed by fftwisdom_rename if it was written successfully
+static void fftwisdom_tmpname(char *tmp, const char *name)
+{
+	snprintf(tmp, FILENAME_MAX + 32, "%s.%ld.tmp", name, (long) getpid());
+	mkdir(fftwisdom_dir(), 0777);
+}
+
+static void fftwisdom_rename(const char *tmp, const char *name, int ok)
+{
+	if (!ok || rename(tmp, name))
+		remove(tmp);
+}
+
+// name of the wisdom file of a plan
+static void fftwisdom_filename(char *out, struct fftwisdom_plan *p, int nt)
+{
+	static const char *kind[] = {"r2c", "c2r", "r2c_1d", "c2r_1d"};
+	snprintf(out, FILENAME_MAX, "%s/%s_%s_%dx%dx%d_t%d.wisdom",
+			fftwisdom_dir(), p->kind < 2 ? "fftwf" : "fftw",
+			kind[p->kind], p->w, p->h, p->d, nt);
+}
+
+static void *fftwisdom_create(struct fftwisdom_plan *p, unsigned flags, int nt)
+{
+	int n[3] = {p->d, p->h, p->w};
+	int rank = p->d > 1 ? 3 : 2;
+	int *dims = n + 3 - rank;
+#ifdef _OPENMP
+	if (p->kind == FFTWISDOM_R2C || p->kind == FFTWISDOM_C2R)
+		fftwf_plan_with_nthreads(nt);
+#else
+	(void) nt;
+#endif
+	switch (p->kind) {
+	case FFTWISDOM_R2C:
+		return fftwf_plan_dft_r2c(rank, dims, (float *) p->r,
+				(fftwf_complex *) p->c, flags);
+	case FFTWISDOM_C2R:
+		return fftwf_plan_dft_c2r(rank, dims, (fftwf_complex *) p->c,
+				(float *) p->r, flags);
+	case FFTWISDOM_R2C_1D:
+		return fftw_plan_dft_r2c_1d(p->w, (double *) p->r,
+				(fftw_complex *) p->c, flags);
+	case FFTWISDOM_C2R_1D:
+		return fftw_plan_dft_c2r_1d(p->w, (fftw_complex *) p->c,
+				(double *) p->r, flags);
+	}
+	return NULL;
+}
+
+// get the plan of a transform, from the cache, the wisdom or the planner
+static struct fftwisdom_plan *fftwisdom_get(int kind, int w, int h, int d)
+{
+	for (int i = 0; i < fftwisdom_nplans; i++) {
+		struct fftwisdom_plan *p = fftwisdom_plans + i;
+		if (p->kind == kind && p->w == w && p->h == h && p->d == d)
+			return p;
+	}
+	if (fftwisdom_nplans == FFTWISDOM_MAX_PLANS)
+		fail("fftwisdom: too many plans");
+	struct fftwisdom_plan *p = fftwisdom_plans + fftwisdom_nplans++;
+	p->kind = kind;
+	p->w = w;
+	p->h = h;
+	p->d = d;
+
+	// the arrays are allocated by fftw_malloc, for the alignment
+	int dbl = kind == FFTWISDOM_R2C_1D || kind == FFTWISDOM_C2R_1D;
+	int nt = dbl ? 1 : fftwisdom_nthreads();
+	size_t nr = (size_t) w * h * d, nc = (size_t) (w/2 + 1) * h * d;
+	size_t s = dbl ? sizeof(double) : sizeof(float);
+	p->r = fftw_malloc(nr * s);
+	p->c = fftw_malloc(nc * 2 * s);
+	if (!p->r || !p->c)
+		fail("fftwisdom: could not allocate %zu bytes", (nr + 2*nc) * s);
+
+	char *dir = fftwisdom_dir();
+	if (!dir) {
+		p->plan = fftwisdom_create(p, FFTW_ESTIMATE, nt);
+		return p;
+	}
+	char name[FILENAME_MAX];
+	fftwisdom_filename(name, p, nt);
+	if (dbl ? fftw_import_wisdom_from_filename(name)
+			: fftwf_import_wisdom_from_filename(name))
+		p->plan = fftwisdom_create(p, FFTW_MEASURE|FFTW_WISDOM_ONLY, nt);
+	if (p->plan)
+		return p;
+
+	// measure the plan, and save the wisdom
+	p->plan = fftwisdom_create(p, FFTW_MEASURE, nt);
+	char tmp[FILENAME_MAX + 32];
+	fftwisdom_tmpname(tmp, name);
+	fftwisdom_rename(tmp, name, dbl ? fftw_export_wisdom_to_filename(tmp)
+			: fftwf_export_wisdom_to_filename(tmp));
+	return p;
+}
+
+// the arrays given to the new-array execute functions must be aligned as the
+// arrays of the plan, otherwise they are copied
+static int fftwisdom_aligned(void *x)
+{
+	return !fftwf_alignment_of((float *) x);
+}
+
+// forward transform of a real image of size w x h x d
+inline // to avoid unused warnings
+static void fft_r2c_float(fftwf_complex *fx, float *x, int w, int h, int d)
+{
+	struct fftwisdom_plan *p = fftwisdom_get(FFTWISDOM_R2C, w, h, d);
+	size_t nr = (size_t) w * h * d, nc = (size_t) (w/2 + 1) * h * d;
+	float *r = fftwisdom_aligned(x) ? x
+		: (float *) memcpy(p->r, x, nr * sizeof*x);
+	fftwf_complex *c = fftwisdom_aligned(fx) ? fx : (fftwf_complex *) p->c;
+	fftwf_execute_dft_r2c((fftwf_plan) p->plan, r, c);
+	if (c != fx)
+		memcpy(fx, c, nc * sizeof*fx);
+}
+
+// normalized inverse transform of the spectrum of a real image of size
+// w x h x d (the spectrum is destroyed)
+inline // to avoid unused warnings
+static void ifft_c2r_float(float *x, fftwf_complex *fx, int w, int h, int d)
+{
+	struct fftwisdom_plan *p = fftwisdom_get(FFTWISDOM_C2R, w, h, d);
+	size_t nr = (size_t) w * h * d, nc = (size_t) (w/2 + 1) * h * d;
+	fftwf_complex *c = fftwisdom_aligned(fx) ? fx
+		: (fftwf_complex *) memcpy(p->c, fx, nc * sizeof*fx);
+	float *r = fftwisdom_aligned(x) ? x : (float *) p->r;
+	fftwf_execute_dft_c2r((fftwf_plan) p->plan, c, r);
+	float scale = 1.0 / nr;
+	for (size_t i = 0; i < nr; i++)
+		x[i] = r[i] * scale;
+}
+
+inline // to avoid unused warnings
+static void fft_r2c_2dfloat(fftwf_complex *fx, float *x, int w, int h)
+{
+	fft_r2c_float(fx, x, w, h, 1);
+}
+
+inline // to avoid unused warnings
+static void ifft_c2r_2dfloat(float *x, fftwf_complex *fx, int w, int h)
+{
+	ifft_c2r_float(x, fx, w, h, 1);
+}
+
+// plans of the 1D transforms of size n, in double precision, to be executed
+// with fftw_execute_dft_r2c and fftw_execute_dft_c2r on arrays allocated by
+// fftw_malloc (these functions are thread-safe, the planning is not)
+inline // to avoid unused warnings
+static fftw_plan fftwisdom_plan_r2c_1d(int n)
+{
+	return (fftw_plan) fftwisdom_get(FFTWISDOM_R2C_1D, n, 1, 1)->plan;
+}
+
+inline // to avoid unused warnings
+static fftw_plan fftwisdom_plan_c2r_1d(int n)
+{
+	return (fftw_plan) fftwisdom_get(FFTWISDOM_C2R_1D, n, 1, 1)->plan;
+}
+
+// read the n bytes of the file of the cache directory named "base" (e.g. the
+// spectrum of a kernel, saved by fftwisdom_save), returns 0 if there is no
+// cache directory or no such file
+inline // to avoid unused warnings
+static int fftwisdom_load(void *x, size_t n, const char *base)
+{
+	char name[FILENAME_MAX];
+	if (!fftwisdom_dir())
+		return 0;
+	snprintf(name, FILENAME_MAX, "%s/%s", fftwisdom_dir(), base);
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return 0;
+	int r = 1 == fread(x, n, 1, f);
+	fclose(f);
+	return r;
+}
+
+// save n bytes to the file of the cache directory named "base", if any
+inline // to avoid unused warnings
+static void fftwisdom_save(const void *x, size_t n, const char *base)
+{
+	char name[FILENAME_MAX], tmp[FILENAME_MAX + 32];
+	if (!fftwisdom_dir())
+		return;
+	snprintf(name, FILENAME_MAX, "%s/%s", fftwisdom_dir(), base);
+	fftwisdom_tmpname(tmp, name);
+	FILE *f = fopen(tmp, "wb");
+	if (f) {
+		int ok = 1 == fwrite(x, n, 1, f);
+		fftwisdom_rename(tmp, name, !fclose(f) && ok);
+	}
+}
+
+#endif//_FFTWISDOM_C
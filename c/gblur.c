@@ -35,114 +35,7 @@ static void *fftwf_xmalloc(size_t n)
 
 
 
-#ifndef USE_WISDOM
-void evoke_wisdom(void) {}
-void bequeath_wisdom(void) {}
-#else//USE_WISDOM
 #include "fftwisdom.c"
-#endif//USE_WISDOM
-
-
-
-// wrapper around FFTW3 that computes the complex-valued Fourier transform
-// of a real-valued image
-static void fft_2dfloat(fftwf_complex *fx, float *x, int w, int h)
-{
-	fftwf_complex *a = fftwf_xmalloc(w*h*sizeof*a);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_2d(h, w, a, fx,
-						FFTW_FORWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h) a[i] = x[i]; // complex assignment!
-	fftwf_execute(p);
-
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_cleanup();
-}
-
-// Wrapper around FFTW3 that computes the real-valued inverse Fourier transform
-// of a complex-valued frequantial image.
-// The input data must be hermitic.
-static void ifft_2dfloat(float *ifx,  fftwf_complex *fx, int w, int h)
-{
-	fftwf_complex *a = fftwf_xmalloc(w*h*sizeof*a);
-	fftwf_complex *b = fftwf_xmalloc(w*h*sizeof*b);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_2d(h, w, a, b,
-						FFTW_BACKWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h) a[i] = fx[i];
-	fftwf_execute(p);
-	float scale = 1.0/(w*h);
-	FORI(w*h) {
-		fftwf_complex z = b[i] * scale;
-		ifx[i] = crealf(z);
-		assert(cimagf(z) < 0.001);
-	}
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_free(b);
-	fftwf_cleanup();
-}
-
-// wrapper around FFTW3 that computes the complex-valued Fourier transform
-// of a real-valued 3D image
-static void fft_3dfloat(fftwf_complex *fx, float *x, int w, int h, int d)
-{
-	fftwf_complex *a = fftwf_xmalloc(w*h*d*sizeof*a);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_3d(d, h, w, a, fx,
-						FFTW_FORWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h*d) a[i] = x[i]; // complex assignment!
-	fftwf_execute(p);
-
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_cleanup();
-}
-
-// Wrapper around FFTW3 that computes the real-valued inverse Fourier transform
-// of a complex-valued frequantial 3D image.
-// The input data must be hermitic.
-static void ifft_3dfloat(float *ifx,  fftwf_complex *fx, int w, int h, int d)
-{
-	fftwf_complex *a = fftwf_xmalloc(w*h*d*sizeof*a);
-	fftwf_complex *b = fftwf_xmalloc(w*h*d*sizeof*b);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_3d(d, h, w, a, b,
-						FFTW_BACKWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h*d) a[i] = fx[i];
-	fftwf_execute(p);
-	float scale = 1.0/(w*h*d);
-	FORI(w*h*d) {
-		fftwf_complex z = b[i] * scale;
-		ifx[i] = crealf(z);
-		//assert(cimagf(z) < 0.001);
-	}
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_free(b);
-	fftwf_cleanup();
-}
 
 //static void pointwise_complex_rmultiplication(fftwf_complex *w,
 //		fftwf_complex *z, float *x, int n)
@@ -231,17 +124,19 @@ void gblur_gray(float *y, float *x, int w, int h, float s)
 {
 	//s = 1/s;
 
-	fftwf_complex *fx = fftwf_xmalloc(w*h*sizeof*fx);
-	fft_2dfloat(fx, x, w, h);
+	int nc = (w/2 + 1) * h;
+
+	fftwf_complex *fx = fftwf_xmalloc(nc*sizeof*fx);
+	fft_r2c_2dfloat(fx, x, w, h);
 
 	float *g = xmalloc(w*h*sizeof*g);
 	fill_2d_gaussian_image(g, w, h, s);
 
-	fftwf_complex *fg = fftwf_xmalloc(w*h*sizeof*fg);
-	fft_2dfloat(fg, g, w, h);
+	fftwf_complex *fg = fftwf_xmalloc(nc*sizeof*fg);
+	fft_r2c_2dfloat(fg, g, w, h);
 
-	pointwise_complex_multiplication(fx, fx, fg, w*h);
-	ifft_2dfloat(y, fx, w, h);
+	pointwise_complex_multiplication(fx, fx, fg, nc);
+	ifft_c2r_2dfloat(y, fx, w, h);
 
 	fftwf_free(fx);
 	fftwf_free(fg);
@@ -253,18 +148,19 @@ void gblur_gray_3d(float *y, float *x, int w, int h, int d, float rs[3])
 {
 	float s[3] = {1/rs[0], 1/rs[1], 1/rs[2]};
 	int n = w * h * d;
+	int nc = (w/2 + 1) * h * d;
 
-	fftwf_complex *fx = fftwf_xmalloc(n*sizeof*fx);
-	fft_3dfloat(fx, x, w, h, d);
+	fftwf_complex *fx = fftwf_xmalloc(nc*sizeof*fx);
+	fft_r2c_float(fx, x, w, h, d);
 
 	float *g = xmalloc(n*sizeof*g);
 	fill_3d_gaussian_image(g, w, h, d, s);
 
-	fftwf_complex *fg = fftwf_xmalloc(n*sizeof*fg);
-	fft_3dfloat(fg, g, w, h, d);
+	fftwf_complex *fg = fftwf_xmalloc(nc*sizeof*fg);
+	fft_r2c_float(fg, g, w, h, d);
 
-	pointwise_complex_multiplication(fx, fx, fg, n);
-	ifft_3dfloat(y, fx, w, h, d);
+	pointwise_complex_multiplication(fx, fx, fg, nc);
+	ifft_c2r_float(y, fx, w, h, d);
 
 	fftwf_free(fx);
 	fftwf_free(fg);
@@ -294,21 +190,22 @@ void invert_symmetric_positive_definite_3x3_matrix(float ia[6], float a[6])
 void gblur_gray_3dm(float *y, float *x, int w, int h, int d, float v[6])
 {
 	int n = w * h * d;
+	int nc = (w/2 + 1) * h * d;
 
 	float iv[6];
 	invert_symmetric_positive_definite_3x3_matrix(iv, v);
 
-	fftwf_complex *fx = fftwf_xmalloc(n*sizeof*fx);
-	fft_3dfloat(fx, x, w, h, d);
+	fftwf_complex *fx = fftwf_xmalloc(nc*sizeof*fx);
+	fft_r2c_float(fx, x, w, h, d);
 
 	float *g = xmalloc(n*sizeof*g);
 	fill_3dm_gaussian_image(g, w, h, d, iv);
 
-	fftwf_complex *fg = fftwf_xmalloc(n*sizeof*fg);
-	fft_3dfloat(fg, g, w, h, d);
+	fftwf_complex *fg = fftwf_xmalloc(nc*sizeof*fg);
+	fft_r2c_float(fg, g, w, h, d);
 
-	pointwise_complex_multiplication(fx, fx, fg, n);
-	ifft_3dfloat(y, fx, w, h, d);
+	pointwise_complex_multiplication(fx, fx, fg, nc);
+	ifft_c2r_float(y, fx, w, h, d);
 
 	fftwf_free(fx);
 	fftwf_free(fg);
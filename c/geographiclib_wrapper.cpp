@@ -1,5 +1,6 @@
 #include <string>
 #include "c/GeographicLib/GeoCoords.hpp"
+#include "c/GeographicLib/TransverseMercator.hpp"
 
 extern "C" void utm(double *out, double lat, double lon)
 {
@@ -22,3 +23,30 @@ extern "C" void utm_zone(int *zone, bool *northp, double lat, double lon)
   zone[0] = p.Zone();
   northp[0] = p.Northp();
 }
+
+// utm_alt_zone on n points: x[i], y[i] are the easting and northing of
+// (lat[i], lon[i]) in the given utm zone.  The points are projected by one
+// call to the batched TransverseMercator::Forward, without building a
+// GeoCoords per point.  x may be the same array as lon.
+extern "C" void utm_alt_zone_batch(double *x, double *y,
+        const double *lat, const double *lon, int n, int zone)
+{
+    using namespace GeographicLib;
+    if (zone < UTMUPS::MINUTMZONE || zone > UTMUPS::MAXUTMZONE) {
+        for (int i = 0; i < n; i++) {
+            double out[2];
+            utm_alt_zone(out, lat[i], lon[i], zone);
+            x[i] = out[0];
+            y[i] = out[1];
+        }
+        return;
+    }
+    double lon0 = 6 * zone - 183;  // UTMUPS::CentralMeridian
+    TransverseMercator::UTM.Forward(lon0, lat, lon, x, y, n);
+    for (int i = 0; i < n; i++) {
+        // same false easting and northing as UTMUPS::Forward
+        x[i] += 500000;
+        if (lat[i] < 0)
+            y[i] += 10000000;
+    }
+}
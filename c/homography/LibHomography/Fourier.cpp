@@ -0,0 +1,421 @@
+/**
+ * @file Fourier.cpp
+ *
+ * @brief Filtering and zoom out of an image in the Fourier domain, with the
+ *        FFTW plans and the zoomed MTF cached between runs by fftwisdom.c.
+ **/
+
+
+//! Global includes
+#include <cmath>
+#include <cfloat>
+#include <cstdio>
+#include <complex>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <fftw3.h>
+
+
+//! Local includes
+#include "Fourier.h"
+#include "../Utilities/Memory.h"
+#include "../Utilities/Utilities.h"
+#include "../../fftwisdom.c"
+
+
+using namespace std;
+
+
+//! Signed frequency of the index p_i of a spectrum of size p_n.
+static int idx2freq(
+  const int p_n,
+  const int p_i) {
+  return p_i < p_n - p_n / 2 ? p_i : p_i - p_n;
+}
+
+
+//! Index of the signed frequency p_f of a spectrum of size p_n.
+static int freq2idx(
+  const int p_n,
+  const int p_f) {
+  return p_f >= 0 ? p_f : p_n + p_f;
+}
+
+
+//! Zero padding of a spectrum of size w x h to ow x oh, which preserves its
+//! conjugated symmetry (see zeropadding_fourier_safe in zoom_zeropadding.c).
+static void zeropaddingFourier(
+  const complex<float>* i_in,
+  const int p_w,
+  const int p_h,
+  complex<float>* o_out,
+  const int p_ow,
+  const int p_oh) {
+
+  //! Signed min and max frequencies of the input and output
+  const int mhw  = -p_w  / 2, hw = p_w + mhw;
+  const int mhh  = -p_h  / 2, hh = p_h + mhh;
+  const int mhow = -p_ow / 2;
+  const int mhoh = -p_oh / 2;
+
+  for (int n = 0; n < p_ow * p_oh; n++) {
+    o_out[n] = 0.f;
+  }
+  for (int j = 0; j < p_oh; j++) {
+    for (int i = 0; i < p_ow; i++) {
+      const int fhor = idx2freq(p_ow, i);
+      const int fver = idx2freq(p_oh, j);
+
+      //! Only the frequencies represented in the input
+      if (fhor < mhw || fhor >= hw || fver < mhh || fver >= hh) {
+        continue;
+      }
+      const int k = freq2idx(p_w, fhor);
+      const int l = freq2idx(p_h, fver);
+      o_out[i + j * p_ow] = i_in[k + l * p_w];
+
+      //! Even sized output smaller than the input: the highest frequency is
+      //! collapsed with its conjugate
+      const int kk = freq2idx(p_w, -fhor);
+      const int ll = freq2idx(p_h, -fver);
+      const bool collapseV = fver == mhoh && p_oh % 2 == 0 && p_oh < p_h;
+      if (collapseV) {
+        o_out[i + j * p_ow] += i_in[k + ll * p_w];
+      }
+      if (fhor == mhow && p_ow % 2 == 0 && p_ow < p_w) {
+        o_out[i + j * p_ow] += i_in[kk + l * p_w];
+        if (collapseV) {
+          o_out[i + j * p_ow] += i_in[kk + ll * p_w];
+        }
+      }
+
+      //! Even sized input smaller than the output: the highest frequency is
+      //! split between itself and its conjugate
+      const int ii = freq2idx(p_ow, -fhor);
+      const int jj = freq2idx(p_oh, -fver);
+      const bool splitV = p_oh > p_h && p_h % 2 == 0 && fver == mhh;
+      const float half = real(i_in[k + l * p_w]) / 2;
+      if (splitV) {
+        o_out[i + j  * p_ow] = half;
+        o_out[i + jj * p_ow] = half;
+      }
+      if (p_ow > p_w && p_w % 2 == 0 && fhor == mhw) {
+        o_out[i  + j * p_ow] = half;
+        o_out[ii + j * p_ow] = half;
+        if (splitV) {
+          o_out[i  + j  * p_ow] = half / 2;
+          o_out[ii + jj * p_ow] = half / 2;
+          o_out[i  + jj * p_ow] = half / 2;
+          o_out[ii + j  * p_ow] = half / 2;
+        }
+      }
+    }
+  }
+}
+
+
+//! Compute the half spectrum of size (w / 2 + 1) x h by which the r2c
+//! transform of an image of size w x h is multiplied: the MTF zoomed to
+//! w x h, symmetrized since only the real part of the convolution is kept
+//! (see fftconvolve.c), and normalized for the transform of the MTF (the
+//! inverse transform of fftwisdom.c is normalized).
+static void computeKernel(
+  const char* p_mtfName,
+  const int p_w,
+  const int p_h,
+  float* o_kernel) {
+
+  //! Spectrum of the MTF
+  Image mtf;
+  mtf.read(p_mtfName);
+  const int mw = mtf.width(), mh = mtf.height();
+  complex<float>* fin  = (complex<float>*) fftwf_malloc(mw  * mh  * sizeof(complex<float>));
+  complex<float>* fout = (complex<float>*) fftwf_malloc(p_w * p_h * sizeof(complex<float>));
+  fftwf_plan plan = fftwf_plan_dft_2d(mh, mw, (fftwf_complex*) fin,
+                                      (fftwf_complex*) fin, FFTW_FORWARD, FFTW_ESTIMATE);
+  for (int i = 0; i < mh; i++) {
+    const float* iM = mtf.getPtr(0, i);
+    for (int j = 0; j < mw; j++) {
+      fin[i * mw + j] = iM[j];
+    }
+  }
+  fftwf_execute(plan);
+  fftwf_destroy_plan(plan);
+
+  //! MTF zoomed to the size of the image, as zoom_zeropadding computes it
+  zeropaddingFourier(fin, mw, mh, fout, p_w, p_h);
+  plan = fftwf_plan_dft_2d(p_h, p_w, (fftwf_complex*) fout,
+                           (fftwf_complex*) fout, FFTW_BACKWARD, FFTW_ESTIMATE);
+  fftwf_execute(plan);
+  fftwf_destroy_plan(plan);
+
+  //! Symmetrization and normalization
+  const int wc = p_w / 2 + 1;
+  const float norm = 1.f / (float(mw) * float(mh));
+  for (int l = 0; l < p_h; l++) {
+    for (int k = 0; k < wc; k++) {
+      const float m  = real(fout[l * p_w + k]);
+      const float mc = real(fout[((p_h - l) % p_h) * p_w + (p_w - k) % p_w]);
+      o_kernel[l * wc + k] = 0.5f * (m + mc) * norm;
+    }
+  }
+  fftwf_free(fin);
+  fftwf_free(fout);
+}
+
+
+//! Name of the kernel of an image of size w x h in the cache directory. It is
+//! named after the FNV-1a hash of the contents of the MTF file, so that a
+//! modified MTF file never gets the kernel of the previous one.
+static string kernelName(
+  const char* p_mtfName,
+  const int p_w,
+  const int p_h) {
+
+  FILE* file = fopen(p_mtfName, "rb");
+  if (file == NULL) {
+    return "";
+  }
+  unsigned long hash = 0xcbf29ce484222325UL;
+  int c;
+  while ((c = getc(file)) != EOF) {
+    hash = (hash ^ (unsigned char) c) * 0x100000001b3UL;
+  }
+  fclose(file);
+
+  ostringstream oss;
+  oss << "mtf_kernel_" << hex << hash << dec << "_" << p_w << "x" << p_h
+      << ".bin";
+  return oss.str();
+}
+
+
+//! Read the kernel from the cache, or compute it and save it.
+static void getKernel(
+  const char* p_mtfName,
+  const int p_w,
+  const int p_h,
+  float* o_kernel) {
+
+  const size_t size = (p_w / 2 + 1) * p_h * sizeof(float);
+  const string name = fftwisdom_dir() != NULL ?
+                      kernelName(p_mtfName, p_w, p_h) : "";
+  if (!name.empty() && fftwisdom_load(o_kernel, size, name.c_str())) {
+    return;
+  }
+  computeKernel(p_mtfName, p_w, p_h, o_kernel);
+  if (!name.empty()) {
+    fftwisdom_save(o_kernel, size, name.c_str());
+  }
+}
+
+
+//! Filter each channel of the image by a MTF.
+void applyMTF(
+  Image& io_im,
+  const char* p_mtfName) {
+
+  //! For convenience
+  const int w  = io_im.width();
+  const int h  = io_im.height();
+  const int wc = w / 2 + 1;
+
+  //! Buffers, aligned as the arrays of the plans of fftwisdom.c
+  float* kernel = (float*) fftwf_malloc(wc * h * sizeof(float));
+  float* im = (float*) fftwf_malloc(w * h * sizeof(float));
+  fftwf_complex* spec = (fftwf_complex*) fftwf_malloc(wc * h * sizeof(fftwf_complex));
+  getKernel(p_mtfName, w, h, kernel);
+
+  for (size_t c = 0; c < io_im.channels(); c++) {
+
+    //! Non finite values are replaced by 0
+    for (int i = 0; i < h; i++) {
+      const float* iI = io_im.getPtr(c, i);
+      for (int j = 0; j < w; j++) {
+        const float v = iI[j];
+        im[i * w + j] = isNumber(v) && fabsf(v) <= FLT_MAX ? v : 0.f;
+      }
+    }
+
+    //! Multiply the spectrum by the kernel
+    fft_r2c_2dfloat(spec, im, w, h);
+    for (int n = 0; n < wc * h; n++) {
+      spec[n][0] *= kernel[n];
+      spec[n][1] *= kernel[n];
+    }
+    ifft_c2r_2dfloat(im, spec, w, h);
+
+    for (int i = 0; i < h; i++) {
+      float* oI = io_im.getPtr(c, i);
+      for (int j = 0; j < w; j++) {
+        oI[j] = im[i * w + j];
+      }
+    }
+  }
+
+  //! Release memory
+  fftwf_free(kernel);
+  fftwf_free(im);
+  fftwf_free(spec);
+}
+
+
+//! Plans and filter of the zoom of rows of size wIn to wOut (see
+//! image_zoom_1d in zoom_2d.c).
+struct RowZoom {
+  size_t wIn, wOut;
+  fftw_plan fwd, bwd;
+  double* filter;
+};
+
+
+//! Initialize the zoom of rows of size wIn to wOut.
+static void initRowZoom(
+  RowZoom& o_zoom,
+  const size_t p_wIn,
+  const size_t p_wOut) {
+
+  o_zoom.wIn  = p_wIn;
+  o_zoom.wOut = p_wOut;
+  const size_t nIn = 2 * p_wIn, nOut = 2 * p_wOut;
+
+  //! The plans, kept by fftwisdom.c, are executed on the buffers of each
+  //! thread, allocated by fftw_malloc with the same alignment as theirs
+  o_zoom.fwd = fftwisdom_plan_r2c_1d(nIn);
+  o_zoom.bwd = fftwisdom_plan_c2r_1d(nOut);
+
+  //! Gaussian filter when zooming out, and normalization of the DFT
+  o_zoom.filter = (double*) memalloc(16, (p_wIn + 1) * sizeof(double));
+  const double s = p_wOut < p_wIn ?
+                   0.8 * sqrt(double((p_wIn / p_wOut) * (p_wIn / p_wOut) - 1)) : 0;
+  for (size_t k = 0; k <= p_wIn; k++) {
+    const double omega = k * 2.0 * M_PI / nIn;
+    o_zoom.filter[k] = (k > 0 ? exp(-0.5 * s * s * omega * omega) : 1.0) / nIn;
+  }
+}
+
+
+//! Release the filter (the plans are kept by fftwisdom.c).
+static void releaseRowZoom(
+  RowZoom& io_zoom) {
+
+  memfree(io_zoom.filter);
+}
+
+
+//! Zoom the p_h rows of i_in, separated by p_stride, to the contiguous rows
+//! of o_out.
+static void zoomRows(
+  const RowZoom& p_zoom,
+  const float* i_in,
+  const size_t p_stride,
+  float* o_out,
+  const size_t p_h) {
+
+  //! For convenience
+  const size_t wIn = p_zoom.wIn, wOut = p_zoom.wOut;
+  const size_t nIn = 2 * wIn;
+  const size_t nCopy = min(wIn, wOut) + 1;
+
+#pragma omp parallel
+  {
+    double* lineIn  = (double*) fftw_malloc(nIn * sizeof(double));
+    double* lineOut = (double*) fftw_malloc(2 * wOut * sizeof(double));
+    fftw_complex* dftIn  = (fftw_complex*) fftw_malloc((wIn  + 1) * sizeof(fftw_complex));
+    fftw_complex* dftOut = (fftw_complex*) fftw_malloc((wOut + 1) * sizeof(fftw_complex));
+
+#pragma omp for schedule(static)
+    for (int i = 0; i < (int) p_h; i++) {
+      const float* iI = i_in + i * p_stride;
+
+      //! Symmetrize the row, without its non finite values
+      for (size_t j = 0; j < wIn; j++) {
+        const float v = iI[j];
+        lineIn[j] = lineIn[nIn - 1 - j] = isNumber(v) && fabsf(v) <= FLT_MAX ? v : 0.f;
+      }
+      fftw_execute_dft_r2c(p_zoom.fwd, lineIn, dftIn);
+
+      //! Filter, then cut or add frequencies
+      for (size_t k = 0; k < nCopy; k++) {
+        dftOut[k][0] = dftIn[k][0] * p_zoom.filter[k];
+        dftOut[k][1] = dftIn[k][1] * p_zoom.filter[k];
+      }
+      for (size_t k = nCopy; k <= wOut; k++) {
+        dftOut[k][0] = dftOut[k][1] = 0.0;
+      }
+      if (wOut <= wIn) {
+        dftOut[wOut][1] = 0.0;
+      }
+      fftw_execute_dft_c2r(p_zoom.bwd, dftOut, lineOut);
+
+      //! Keep the half of the symmetrized row
+      float* oO = o_out + i * wOut;
+      for (size_t j = 0; j < wOut; j++) {
+        oO[j] = lineOut[j];
+      }
+    }
+
+    //! Release memory
+    fftw_free(lineIn);
+    fftw_free(lineOut);
+    fftw_free(dftIn);
+    fftw_free(dftOut);
+  }
+}
+
+
+//! Transpose the image i_in of size w x h, whose rows are separated by
+//! p_stride, to the contiguous rows of o_out.
+static void transpose(
+  const float* i_in,
+  const size_t p_stride,
+  float* o_out,
+  const size_t p_w,
+  const size_t p_h) {
+
+#pragma omp parallel for schedule(static)
+  for (int j = 0; j < (int) p_w; j++) {
+    float* oO = o_out + j * p_h;
+    for (size_t i = 0; i < p_h; i++) {
+      oO[i] = i_in[i * p_stride + j];
+    }
+  }
+}
+
+
+//! Zoom out the image by an integer factor.
+void zoomOutFFT(
+  const Image& i_im,
+  Image& o_im,
+  const size_t p_zoom) {
+
+  //! For convenience
+  const size_t wIn  = i_im.width(), hIn = i_im.height();
+  const size_t wOut = wIn / p_zoom, hOut = hIn / p_zoom;
+  const size_t stride = i_im.getPtr(0, 1) - i_im.getPtr(0, 0);
+  o_im.init(wOut, hOut, i_im.channels());
+
+  //! Plans of the rows and columns, for all the channels
+  RowZoom zoomH, zoomV;
+  initRowZoom(zoomH, wIn, wOut);
+  initRowZoom(zoomV, hIn, hOut);
+
+  //! Zoom the rows, then the columns of the transposed image
+  float* tmp1 = (float*) memalloc(16, wOut * hIn  * sizeof(float));
+  float* tmp2 = (float*) memalloc(16, wOut * hIn  * sizeof(float));
+  float* tmp3 = (float*) memalloc(16, wOut * hOut * sizeof(float));
+  for (size_t c = 0; c < i_im.channels(); c++) {
+    zoomRows(zoomH, i_im.getPtr(c, 0), stride, tmp1, hIn);
+    transpose(tmp1, wOut, tmp2, wOut, hIn);
+    zoomRows(zoomV, tmp2, hIn, tmp3, wOut);
+    transpose(tmp3, hOut, o_im.getPtr(c, 0), hOut, wOut);
+  }
+
+  //! Release memory
+  releaseRowZoom(zoomH);
+  releaseRowZoom(zoomV);
+  memfree(tmp1);
+  memfree(tmp2);
+  memfree(tmp3);
+}
@@ -0,0 +1,40 @@
+#ifndef FOURIER_H_INCLUDED
+#define FOURIER_H_INCLUDED
+
+
+//! Global includes
+
+
+//! Local includes
+#include "../LibImages/LibImages.h"
+
+
+/**
+ * @brief Filter each channel of the image by a MTF, i.e. multiply its
+ *        spectrum by the tiff image p_mtfName, which samples the MTF on the
+ *        frequencies of its own size with the frequency 0 at pixel (0, 0).
+ *        The MTF is zoomed to the size of the image by zero padding of its
+ *        spectrum, as does the zoom_zeropadding + fftconvolve sequence of s2p.
+ *
+ *        When the environment variable FFTW_CACHE is set to a directory, the
+ *        zoomed MTF and the FFTW wisdom are saved in it per image size, and
+ *        the plans are measured instead of estimated (see fftwisdom.c).
+ **/
+void applyMTF(
+  Image& io_im,
+  const char* p_mtfName);
+
+
+/**
+ * @brief Zoom out the image by an integer factor: as in zoom_2d, each row and
+ *        then each column is symmetrized, filtered by a Gaussian and its
+ *        spectrum is truncated. The width and height of the image must be
+ *        multiples of p_zoom. Plans are cached as in applyMTF.
+ **/
+void zoomOutFFT(
+  const Image& i_im,
+  Image& o_im,
+  const size_t p_zoom);
+
+
+#endif // FOURIER_H_INCLUDED
@@ -12,11 +12,14 @@
 //! Global includes
 #include <cmath>
 #include <cfloat>
+#include <algorithm>
+#include <iostream>
 
 
 //! Local includes
 #include "Homography.h"
 #include "Splines.h"
+#include "Fourier.h"
 #include "../Utilities/Time.h"
 #include "../Utilities/Memory.h"
 
@@ -24,6 +27,146 @@
 using namespace std;
 
 
+//! Margin around the preimage of the output, in pixels: the recursive filter
+//! of prepareSpline has decayed below 1e-6 at this distance from the border
+#define WINDOW_MARGIN 16
+
+//! The sides of the windows filtered in the Fourier domain are multiples of it
+#define FFT_QUANTUM 16
+
+
+//! Align a window [x0, x1) on the pixels of the image of size p_n zoomed out by
+//! p_unit, clamped to it and enlarged to a multiple of p_quantum when possible.
+static void alignWindow(
+  int& io_x0,
+  int& io_x1,
+  const size_t p_n,
+  const int p_unit,
+  const int p_quantum) {
+
+  //! Image and window, in pixels of the zoomed out image
+  const int n = p_n / p_unit;
+  int x0 = max(io_x0, 0), x1 = min(io_x1, n);
+  if (x1 <= x0) {
+    x0 = 0;
+    x1 = 1;
+  }
+  const int len = min(((x1 - x0 + p_quantum - 1) / p_quantum) * p_quantum, n);
+  x0 = min(x0, n - len);
+
+  //! Window in the full resolution image
+  io_x0 = x0 * p_unit;
+  io_x1 = (x0 + len) * p_unit;
+}
+
+
+//! Read the part of the input image needed to compute the output image.
+void readInput(
+  const Parameters& p_params,
+  double io_mat[9],
+  Image& o_im) {
+
+  //! Read from an overview if there is one for the zoom out factor,
+  //! otherwise zoom out the window in the Fourier domain
+  const size_t zoom = p_params.zoom();
+  int dir = 0;
+  bool zoomFFT = false;
+  if (zoom > 1) {
+    dir = Image::findOverview(p_params.inpName(), zoom);
+    zoomFFT = dir < 0;
+    dir = max(dir, 0);
+    if (p_params.verbose()) {
+      cout << "Zoom out " << zoom << ": " << (zoomFFT ?
+              "no overview found, zoom in the Fourier domain" :
+              "read from the overview") << endl;
+    }
+  }
+
+  //! Size of the input image
+  size_t w, h;
+  Image::sizeTiff(p_params.inpName(), dir, w, h);
+  const int unit = zoomFFT ? zoom : 1;
+  if (w < (size_t) unit || h < (size_t) unit) {
+    cout << "The image is smaller than the zoom out factor." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  //! Without output size the whole image is read, otherwise only the window
+  //! seen by the output, restricted to the image so that its borders are
+  //! handled as if the whole image was read. The windows filtered in the
+  //! Fourier domain are enlarged to sizes which repeat from a tile to another,
+  //! so that their plans and MTF are cached.
+  int x0 = 0, y0 = 0, x1 = w, y1 = h;
+  if (p_params.oWidth() > 0 && p_params.oHeight() > 0) {
+    getInputWindow(io_mat, p_params.oWidth(), p_params.oHeight(),
+                   WINDOW_MARGIN, x0, y0, x1, y1);
+  }
+  const bool useFFT = zoomFFT || p_params.mtfName() != NULL;
+  alignWindow(x0, x1, w, unit, useFFT ? FFT_QUANTUM : 1);
+  alignWindow(y0, y1, h, unit, useFFT ? FFT_QUANTUM : 1);
+  o_im.readWindow(p_params.inpName(), x0, y0, x1 - x0, y1 - y0, dir);
+  if (p_params.verbose()) {
+    cout << "Read the window " << x1 - x0 << "x" << y1 - y0 << " at (" << x0
+         << ", " << y0 << ") of a " << w << "x" << h << " image" << endl;
+  }
+
+  //! Filtering, then zoom out
+  if (p_params.gray()) {
+    o_im.averageChannels();
+  }
+  if (p_params.mtfName() != NULL) {
+    applyMTF(o_im, p_params.mtfName());
+  }
+  if (zoomFFT) {
+    Image imZ;
+    zoomOutFFT(o_im, imZ, zoom);
+    o_im = imZ;
+  }
+
+  //! Compose the homography with the translation of the window
+  x0 /= unit;
+  y0 /= unit;
+  for (size_t k = 0; k < 9; k += 3) {
+    io_mat[k + 2] += io_mat[k] * x0 + io_mat[k + 1] * y0;
+  }
+}
+
+
+//! Bounding box of the preimage of the rectangle [0, w] x [0, h].
+void getInputWindow(
+  const double i_mat[9],
+  const size_t p_w,
+  const size_t p_h,
+  const int p_margin,
+  int &o_x0,
+  int &o_y0,
+  int &o_x1,
+  int &o_y1) {
+
+  //! Invert the homography
+  double matInv[9];
+  invert(i_mat, matInv);
+
+  //! Bounding box of the preimage of the 4 corners
+  double x1 = DBL_MAX, y1 = DBL_MAX, x2 = -DBL_MAX, y2 = -DBL_MAX;
+  const double corners[8] = {0, 0, double(p_w), 0,
+                             double(p_w), double(p_h), 0, double(p_h)};
+  for (size_t n = 0; n < 4; n++) {
+    double x = corners[2 * n], y = corners[2 * n + 1];
+    apply(matInv, x, y);
+    x1 = min(x1, x); x2 = max(x2, x);
+    y1 = min(y1, y); y2 = max(y2, y);
+  }
+
+  //! Integer window with its margin, clamped to avoid overflows
+  const double big = 1e9;
+  o_x0 = int(floor(max(x1, -big))) - p_margin;
+  o_y0 = int(floor(max(y1, -big))) - p_margin;
+  o_x1 = int(ceil (min(x2,  big))) + p_margin;
+  o_y1 = int(ceil (min(y2,  big))) + p_margin;
+}
+
+
 //! Apply the homography to the input image.
 void runHomography(
   const Image& i_im,
@@ -121,17 +264,32 @@ void mapImage(
   double matInv[9];
   invert(useZ ? matZ : i_mat, matInv);
 
-  //! Apply the homography
-  for (int i = 0; i < (int) o_im.height(); i++) {
-    for (int j = 0; j < (int) o_im.width(); j++) {
-
-      //! Get the inverse position of the current pixel
-      double x = j + offsetJ, y = i + offsetI;
-      apply(matInv, x, y);
+  //! Apply the homography, the rows are independent
+#pragma omp parallel
+  {
+    //! Positions and weights of the splines of a row
+    const size_t w = o_im.width();
+    float* buffer = (float*) memalloc(16, 16 * w * sizeof(float));
+    float* xRow = buffer;
+    float* yRow = buffer + w;
+
+#pragma omp for schedule(dynamic)
+    for (int i = 0; i < (int) o_im.height(); i++) {
+
+      //! Get the inverse position of the pixels of the row
+      for (int j = 0; j < (int) w; j++) {
+        double x = j + offsetJ, y = i + offsetI;
+        apply(matInv, x, y);
+        xRow[j] = x + 0.5;
+        yRow[j] = y + 0.5;
+      }
 
       //! Interpolate the pixels
-      interpolateSpline(imTmp, o_im, x + 0.5, y + 0.5, i, j);
+      interpolateSplineRow(imTmp, o_im, xRow, yRow, i, buffer + 2 * w);
     }
+
+    //! Release memory
+    memfree(buffer);
   }
   if (p_verbose) time.getTime(" - interpolateSpline");
 
@@ -147,10 +305,11 @@ void mapImage(
 
     //! Put the mask back
     for (size_t c = 0; c < o_im.channels(); c++) {
-      for (size_t i = 0; i < o_im.height(); i++) {
+#pragma omp parallel for schedule(dynamic)
+      for (int i = 0; i < (int) o_im.height(); i++) {
         float* oI = o_im.getPtr(c, i);
 
-        for (size_t j = 0; j < o_im.width(); j++) {
+        for (int j = 0; j < (int) o_im.width(); j++) {
 
           //! Get the inverse position of the current pixel
           double x = j + offsetJ, y = i + offsetI;
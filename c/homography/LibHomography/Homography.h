@@ -9,6 +9,34 @@
 #include "../Utilities/Parameters.h"
 #include "../LibImages/LibImages.h"
 
+/**
+ * @brief Read the part of the input image needed to compute the output image
+ *        of size oWidth x oHeight, and filter it by the MTF if one is given.
+ *        If a zoom out factor is given, read it from an overview of the image
+ *        when there is one, otherwise zoom it out in the Fourier domain. The
+ *        homography is updated accordingly.
+ **/
+void readInput(
+  const Parameters& p_params,
+  double io_mat[9],
+  Image& o_im);
+
+
+/**
+ * @brief Bounding box, in the input image, of the preimage by the homography
+ *        of the rectangle [0, w] x [0, h], enlarged by a margin.
+ **/
+void getInputWindow(
+  const double i_mat[9],
+  const size_t p_w,
+  const size_t p_h,
+  const int p_margin,
+  int &o_x0,
+  int &o_y0,
+  int &o_x1,
+  int &o_y1);
+
+
 /**
  * @brief new function.
  **/
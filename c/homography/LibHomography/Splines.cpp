@@ -10,6 +10,7 @@
 
 
 //! Global includes
+#include <algorithm>
 
 
 //! Local includes
@@ -33,7 +34,8 @@ void prepareSpline(
 
   //! Replace NaN with 0
   for (size_t c = 0; c < chnls; c++) {
-    for (size_t i = 0; i < height; i++) {
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < (int) height; i++) {
       float* iI = io_im.getPtr(c, i);
 
       for (size_t j = 0; j < width; j++) {
@@ -48,74 +50,155 @@ void prepareSpline(
   const double z[2] = {-0.430575, -0.0430963};
   const size_t nPoles = 2;
 
+  //! Number of groups of 4 lines and of 4 columns for the SSE version
+  const int nbI = height > 4 ? (height - 1) / 4 : 0;
+  const int nbJ = width  > 4 ? (width  - 1) / 4 : 0;
+
   //! For each channels
   for (size_t c = 0; c < chnls; c++) {
 
-    //! Allocation for SSE version
-    __m128* vecI = (__m128*) memalloc(16, width * sizeof(__m128));
-    size_t i = 0;
+    //! The lines, then the columns, are independent
+#pragma omp parallel
+    {
+      //! Allocation for SSE version
+      __m128* vec = (__m128*) memalloc(16, max(width, height) * sizeof(__m128));
+
+      //! Apply the interpolation over the lines - SSE version
+#pragma omp for schedule(dynamic)
+      for (int n = 0; n < nbI; n++) {
+        float* iI0 = io_im.getPtr(c, 4 * n + 0);
+        float* iI1 = io_im.getPtr(c, 4 * n + 1);
+        float* iI2 = io_im.getPtr(c, 4 * n + 2);
+        float* iI3 = io_im.getPtr(c, 4 * n + 3);
+
+        //! Copy data
+        for (size_t j = 0; j < width; j++) {
+          vec[j] = _mm_set_ps(iI0[j], iI1[j], iI2[j], iI3[j]);
+        }
 
-    //! Apply the interpolation over the lines - SSE version
-    for (; i < height - 4; i += 4) {
-      float* iI0 = io_im.getPtr(c, i + 0);
-      float* iI1 = io_im.getPtr(c, i + 1);
-      float* iI2 = io_im.getPtr(c, i + 2);
-      float* iI3 = io_im.getPtr(c, i + 3);
+        //! Apply the spline
+        applySpline(vec, 1, width, z, nPoles);
+
+        //! Copy data
+        for (size_t j = 0; j < width; j++) {
+          float value[4];
+          _mm_storeu_ps(value, vec[j]);
+          iI0[j] = value[3];
+          iI1[j] = value[2];
+          iI2[j] = value[1];
+          iI3[j] = value[0];
+        }
+      }
 
-      //! Copy data
-      for (size_t j = 0; j < width; j++) {
-        vecI[j] = _mm_set_ps(iI0[j], iI1[j], iI2[j], iI3[j]);
+      //! Apply the interpolation over the lines - normal version
+#pragma omp for schedule(static)
+      for (int i = 4 * nbI; i < (int) height; i++) {
+        applySpline(io_im.getPtr(c, i), 1, width, z, nPoles);
       }
 
-      //! Apply the spline
-      applySpline(vecI, 1, width, z, nPoles);
+      //! Apply the interpolation of the columns - SSE version
+#pragma omp for schedule(dynamic)
+      for (int n = 0; n < nbJ; n++) {
 
-      //! Copy data
-      for (size_t j = 0; j < width; j++) {
-        float value[4];
-        _mm_storeu_ps(value, vecI[j]);
-        iI0[j] = value[3];
-        iI1[j] = value[2];
-        iI2[j] = value[1];
-        iI3[j] = value[0];
+        //! Copy the data
+        for (size_t i = 0; i < height; i++) {
+          vec[i] = _mm_loadu_ps(io_im.getPtr(c, i) + 4 * n);
+        }
+
+        //! Apply the spline
+        applySpline(vec, 1, height, z, nPoles);
+
+        //! Copy the data
+        for (size_t i = 0; i < height; i++) {
+          _mm_storeu_ps(io_im.getPtr(c, i) + 4 * n, vec[i]);
+        }
       }
-    }
 
-    //! Release memory
-    memfree(vecI);
+      //! Apply the interpolation of the columns - normal version
+#pragma omp for schedule(static)
+      for (int j = 4 * nbJ; j < (int) width; j++) {
+        applySpline(io_im.getPtr(c, 0) + j, width, height, z, nPoles);
+      }
 
-    //! Apply the interpolation over the lines - normal version
-    for (; i < height; i++) {
-      applySpline(io_im.getPtr(c, i), 1, width, z, nPoles);
+      //! Release memory
+      memfree(vec);
     }
+  }
+}
 
-    //! Allocation for SSE version
-    __m128* vecJ = (__m128*) memalloc(16, height * sizeof(__m128));
-    size_t j = 0;
 
-    //! Apply the interpolation of the columns - SSE version
-    for (; j < width - 4; j += 4) {
+//! Spline interpolation with the weights of the spline already computed,
+//! cx[k * p_stride] and cy[k * p_stride] for k = 0..5.
+static inline void interpolateSpline(
+  const Image& i_im,
+  Image& o_im,
+  const float p_x,
+  const float p_y,
+  const size_t p_i,
+  const size_t p_j,
+  const float* cx,
+  const float* cy,
+  const size_t p_stride) {
 
-      //! Copy the data
-      for (size_t i = 0; i < height; i++) {
-        vecJ[i] = _mm_loadu_ps(io_im.getPtr(c, i) + j);
-      }
+  //! For convenience
+  const int w = i_im.width();
+  const int h = i_im.height();
+  const size_t chnls = i_im.channels();
+  const size_t s = p_stride;
 
-      //! Apply the spline
-      applySpline(vecJ, 1, height, z, nPoles);
+  //! Position of the top-left pixel of the neighbourhood
+  const float x  = p_x - 0.5f;
+  const float y  = p_y - 0.5f;
+  const int xi   = x < 0 ? -1 : int(x);
+  const int yi   = y < 0 ? -1 : int(y);
 
-      //! Copy the data
-      for (size_t i = 0; i < height; i++) {
-        _mm_storeu_ps(io_im.getPtr(c, i) + j, vecJ[i]);
-      }
-    }
+  //! This test saves computational time
+  if (xi >= 2 && xi < w - 3 && yi >= 2 && yi < h - 3) {
+    const __m128 xx = _mm_set_ps(cx[2 * s], cx[3 * s], cx[4 * s], cx[5 * s]);
+
+    for (size_t c = 0; c < chnls; c++) {
+
+      const float* iI0 = i_im.getPtr(c, yi - 2);
+      const float* iI1 = i_im.getPtr(c, yi - 1);
+      const float* iI2 = i_im.getPtr(c, yi    );
+      const float* iI3 = i_im.getPtr(c, yi + 1);
+      const float* iI4 = i_im.getPtr(c, yi + 2);
+      const float* iI5 = i_im.getPtr(c, yi + 3);
+
+      const __m128 xVal = xx * (_mm_set1_ps(cy[5 * s]) * _mm_loadu_ps(iI0 + xi - 2) +
+                                _mm_set1_ps(cy[4 * s]) * _mm_loadu_ps(iI1 + xi - 2) +
+                                _mm_set1_ps(cy[3 * s]) * _mm_loadu_ps(iI2 + xi - 2) +
+                                _mm_set1_ps(cy[2 * s]) * _mm_loadu_ps(iI3 + xi - 2) +
+                                _mm_set1_ps(cy[1 * s]) * _mm_loadu_ps(iI4 + xi - 2) +
+                                _mm_set1_ps(cy[0    ]) * _mm_loadu_ps(iI5 + xi - 2));
+
+      const float value = cy[5 * s] * (iI0[xi + 2] * cx[s] + iI0[xi + 3] * cx[0]) +
+                          cy[4 * s] * (iI1[xi + 2] * cx[s] + iI1[xi + 3] * cx[0]) +
+                          cy[3 * s] * (iI2[xi + 2] * cx[s] + iI2[xi + 3] * cx[0]) +
+                          cy[2 * s] * (iI3[xi + 2] * cx[s] + iI3[xi + 3] * cx[0]) +
+                          cy[1 * s] * (iI4[xi + 2] * cx[s] + iI4[xi + 3] * cx[0]) +
+                          cy[0    ] * (iI5[xi + 2] * cx[s] + iI5[xi + 3] * cx[0]);
 
-    //! Release memory
-    memfree(vecJ);
+      float tmp[4];
+      _mm_storeu_ps(tmp, xVal);
+      o_im.getPtr(c, p_i)[p_j] = value + tmp[0] + tmp[1] + tmp[2] + tmp[3];
+    }
+  }
+  else {
+    for (size_t c = 0; c < chnls; c++) {
+      float value = 0.f;
 
-    //! Apply the interpolation of the columns - normal version
-    for (; j < width; j++) {
-      applySpline(io_im.getPtr(c, 0) + j, width, height, z, nPoles);
+      for (int di = -2; di <= 3; di++) {
+        const float* iI = i_im.getPtr(c, yi + di <  0 ? -yi - di - 1 :
+                                         yi + di >= h ? 2 * h - yi - di - 1 : yi + di);
+        value += cy[(3 - di) * s] * (iI[symi(xi - 2, w)] * cx[5 * s] +
+                                     iI[symi(xi - 1, w)] * cx[4 * s] +
+                                     iI[symi(xi    , w)] * cx[3 * s] +
+                                     iI[symi(xi + 1, w)] * cx[2 * s] +
+                                     iI[symi(xi + 2, w)] * cx[1 * s] +
+                                     iI[symi(xi + 3, w)] * cx[0    ]);
+      }
+      o_im.getPtr(c, p_i)[p_j] = value;
     }
   }
 }
@@ -149,64 +232,68 @@ void interpolateSpline(
   //! Position initialization
   const float x  = p_x - 0.5f;
   const float y  = p_y - 0.5f;
-  const int xi   = x < 0 ? -1 : int(x);
-  const int yi   = y < 0 ? -1 : int(y);
-  const float ux = x - float(xi);
-  const float uy = y - float(yi);
+  const float ux = x - float(x < 0 ? -1 : int(x));
+  const float uy = y - float(y < 0 ? -1 : int(y));
 
   //! Precomputation of the spline of order 5
   float cx[6], cy[6];
   initSpline(cx, ux);
   initSpline(cy, uy);
-  const __m128 xx = _mm_set_ps(cx[2], cx[3], cx[4], cx[5]);
 
-  //! This test saves computational time
-  if (xi >= 2 && xi < w - 3 && yi >= 2 && yi < h - 3) {
+  //! Interpolate
+  interpolateSpline(i_im, o_im, p_x, p_y, p_i, p_j, cx, cy, 1);
+}
 
-    for (size_t c = 0; c < chnls; c++) {
 
-      const float* iI0 = i_im.getPtr(c, yi - 2);
-      const float* iI1 = i_im.getPtr(c, yi - 1);
-      const float* iI2 = i_im.getPtr(c, yi    );
-      const float* iI3 = i_im.getPtr(c, yi + 1);
-      const float* iI4 = i_im.getPtr(c, yi + 2);
-      const float* iI5 = i_im.getPtr(c, yi + 3);
+//! Spline interpolation of a row of the output image.
+void interpolateSplineRow(
+  const Image& i_im,
+  Image& o_im,
+  const float* p_x,
+  const float* p_y,
+  const size_t p_i,
+  float* p_buffer) {
 
-      const __m128 xVal = xx * (_mm_set1_ps(cy[5]) * _mm_loadu_ps(iI0 + xi - 2) +
-                                _mm_set1_ps(cy[4]) * _mm_loadu_ps(iI1 + xi - 2) +
-                                _mm_set1_ps(cy[3]) * _mm_loadu_ps(iI2 + xi - 2) +
-                                _mm_set1_ps(cy[2]) * _mm_loadu_ps(iI3 + xi - 2) +
-                                _mm_set1_ps(cy[1]) * _mm_loadu_ps(iI4 + xi - 2) +
-                                _mm_set1_ps(cy[0]) * _mm_loadu_ps(iI5 + xi - 2));
+  //! For convenience
+  const int w = i_im.width();
+  const int h = i_im.height();
+  const size_t n = o_im.width();
+  const size_t chnls = i_im.channels();
+  const float NaN = sqrtf(-1.f);
+  float* ux = p_buffer;
+  float* uy = p_buffer + n;
+  float* cx = p_buffer + 2 * n;
+  float* cy = p_buffer + 8 * n;
+
+  //! Fractional part of the positions
+  for (size_t j = 0; j < n; j++) {
+    const float x = p_x[j] - 0.5f;
+    const float y = p_y[j] - 0.5f;
+    const bool inside = p_x[j] >= 0.f && p_x[j] <= float(w) &&
+                        p_y[j] >= 0.f && p_y[j] <= float(h);
+    ux[j] = inside ? x - float(x < 0 ? -1 : int(x)) : 0.f;
+    uy[j] = inside ? y - float(y < 0 ? -1 : int(y)) : 0.f;
+  }
 
-      const float value = cy[5] * (iI0[xi + 2] * cx[1] + iI0[xi + 3] * cx[0]) +
-                          cy[4] * (iI1[xi + 2] * cx[1] + iI1[xi + 3] * cx[0]) +
-                          cy[3] * (iI2[xi + 2] * cx[1] + iI2[xi + 3] * cx[0]) +
-                          cy[2] * (iI3[xi + 2] * cx[1] + iI3[xi + 3] * cx[0]) +
-                          cy[1] * (iI4[xi + 2] * cx[1] + iI4[xi + 3] * cx[0]) +
-                          cy[0] * (iI5[xi + 2] * cx[1] + iI5[xi + 3] * cx[0]);
+  //! Precomputation of the splines of order 5 of the whole row, vectorized
+  //! across the columns
+  initSplines(cx, ux, n);
+  initSplines(cy, uy, n);
 
-      float tmp[4];
-      _mm_storeu_ps(tmp, xVal);
-      o_im.getPtr(c, p_i)[p_j] = value + tmp[0] + tmp[1] + tmp[2] + tmp[3];
-    }
-  }
-  else {
-    for (size_t c = 0; c < chnls; c++) {
-      float value = 0.f;
+  //! Interpolate the pixels
+  for (size_t j = 0; j < n; j++) {
 
-      for (int di = -2; di <= 3; di++) {
-        const float* iI = i_im.getPtr(c, yi + di <  0 ? -yi - di - 1 :
-                                         yi + di >= h ? 2 * h - yi - di - 1 : yi + di);
-        value += cy[3 - di] * (iI[symi(xi - 2, w)] * cx[5] +
-                               iI[symi(xi - 1, w)] * cx[4] +
-                               iI[symi(xi    , w)] * cx[3] +
-                               iI[symi(xi + 1, w)] * cx[2] +
-                               iI[symi(xi + 2, w)] * cx[1] +
-                               iI[symi(xi + 3, w)] * cx[0]);
+    //! Check if the pixel is inside
+    if (p_x[j] < 0.f || p_x[j] > float(w) || p_y[j] < 0.f || p_y[j] > float(h)) {
+      for (size_t c = 0; c < chnls; c++) {
+
+        //! Return NaN
+        o_im.getPtr(c, p_i)[j] = NaN;
       }
-      o_im.getPtr(c, p_i)[p_j] = value;
+      continue;
     }
+
+    interpolateSpline(i_im, o_im, p_x[j], p_y[j], p_i, j, cx + j, cy + j, n);
   }
 }
 
@@ -227,6 +314,33 @@ void initSpline(
 }
 
 
+//! Initialize the coefficients of the splines of order 5 of n positions.
+void initSplines(
+  float* o_w,
+  const float* i_val,
+  const size_t p_n) {
+
+  const float ak[6] = {1. / 120., -0.05, 0.125, -1. / 6., 0.125, -0.05};
+
+  //! Same computations as initSpline, in a loop that the compiler vectorizes
+  for (size_t j = 0; j < p_n; j++) {
+    const float p0 = pow5(i_val[j]    );
+    const float p1 = pow5(i_val[j] + 1);
+    const float p2 = pow5(i_val[j] + 2);
+    const float p3 = pow5(i_val[j] + 3);
+    const float p4 = pow5(i_val[j] + 4);
+    const float p5 = pow5(i_val[j] + 5);
+
+    o_w[0 * p_n + j] = p0 * ak[0];
+    o_w[1 * p_n + j] = p0 * ak[1] + p1 * ak[0];
+    o_w[2 * p_n + j] = p0 * ak[2] + p1 * ak[1] + p2 * ak[0];
+    o_w[3 * p_n + j] = p0 * ak[3] + p1 * ak[2] + p2 * ak[1] + p3 * ak[0];
+    o_w[4 * p_n + j] = p0 * ak[4] + p1 * ak[3] + p2 * ak[2] + p3 * ak[1] + p4 * ak[0];
+    o_w[5 * p_n + j] = p0 * ak[5] + p1 * ak[4] + p2 * ak[3] + p3 * ak[2] + p4 * ak[1] + p5 * ak[0];
+  }
+}
+
+
 /**
  * @brief Apply the 1D spline interpolation.
  *        normal version.
@@ -32,6 +32,22 @@ void interpolateSpline(
   const size_t p_j);
 
 
+/**
+ * @brief Spline interpolation of the row p_i of the output image, at the
+ *        positions (p_x[j], p_y[j]) for j < o_im.width(). The weights of the
+ *        splines of the whole row are computed at once.
+ *
+ * @param p_buffer: buffer of 14 * o_im.width() floats.
+ **/
+void interpolateSplineRow(
+  const Image& i_im,
+  Image& o_im,
+  const float* p_x,
+  const float* p_y,
+  const size_t p_i,
+  float* p_buffer);
+
+
 /**
  * @brief Init the forward recursion for spline application.
  *        normal version.
@@ -108,6 +124,16 @@ void initSpline(
   const float p_val);
 
 
+/**
+ * @brief Initialize the coefficients of the splines of order 5 of p_n values:
+ *        the coefficient k of the value j is o_w[k * p_n + j].
+ **/
+void initSplines(
+  float* o_w,
+  const float* i_val,
+  const size_t p_n);
+
+
 /**
  * @brief For convenience return x^5.
  **/
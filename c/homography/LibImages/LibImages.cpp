@@ -201,10 +201,14 @@ void Image::read(
 }
 
 
-//! Read a mono-channel uint16 tiff image.
-void Image::readTiff(
+//! Open a tiff file on the directory p_dir and check that its samples are
+//! uint8, uint16 or float32. Exit the main program in case of problem.
+static TIFF* openTiff(
   const char* p_name,
-  const size_t i_border) {
+  const int p_dir,
+  size_t& o_width,
+  size_t& o_height,
+  size_t& o_channels) {
 
   //! Open the tiff file
   TIFF *tif = TIFFOpen(p_name, "r");
@@ -215,6 +219,13 @@ void Image::readTiff(
     exit(EXIT_FAILURE);
   }
 
+  //! Go to the wanted directory
+  if (p_dir > 0 && !TIFFSetDirectory(tif, (tdir_t) p_dir)) {
+    cout << "readTiff: no directory " << p_dir << " in " << p_name
+         << ". Abort." << endl;
+    exit(EXIT_FAILURE);
+  }
+
   //! Initialization
   uint32 w = 0, h = 0;
   uint16 spp = 0, bps = 0, fmt = 0;
@@ -222,76 +233,265 @@ void Image::readTiff(
   //! Get the metadata
   TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
   TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
-  TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
-  TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bps);
-  TIFFGetField(tif, TIFFTAG_SAMPLEFORMAT, &fmt);
-
-  //! Check that the data type is 1 uint16 sample per pixel
-  if (spp != 1) {
-    cout << "readTiff: only 1 sample per pixel is supported. Abort." << endl;
+  TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+  TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+  TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &fmt);
+
+  //! Check the data type
+  if (!(fmt == SAMPLEFORMAT_UINT   && (bps == 8 || bps == 16)) &&
+      !(fmt == SAMPLEFORMAT_IEEEFP && bps == 32)) {
+    cout << "readTiff: only uint8, uint16 and float32 samples are supported. "
+         << "Abort." << endl;
     exit(EXIT_FAILURE);
   }
-  if (fmt != SAMPLEFORMAT_UINT) {
-    cout << "readTiff: only uint samples are supported. Abort." << endl;
-    exit(EXIT_FAILURE);
+
+  o_width    = w;
+  o_height   = h;
+  o_channels = spp;
+  return tif;
+}
+
+
+//! Cast p_n samples, taken every p_step samples, to float.
+template <class T>
+static void castSamples(
+  float* o_ptr,
+  const T* i_ptr,
+  const size_t p_step,
+  const int p_n) {
+
+  for (int j = 0; j < p_n; j++) {
+    o_ptr[j] = (float) i_ptr[j * p_step];
   }
-  if (bps != (uint16) sizeof(uint16_t) * CHAR_BIT) {
-    cout << "readTiff: only 16 bits samples are supported. Abort." << endl;
-    exit(EXIT_FAILURE);
+}
+
+
+//! Cast p_n samples of the given format, starting at the sample p_offset of
+//! i_buf and taken every p_step samples, to float.
+static void castSamples(
+  float* o_ptr,
+  const void* i_buf,
+  const size_t p_offset,
+  const size_t p_step,
+  const int p_n,
+  const uint16 p_bps,
+  const uint16 p_fmt) {
+
+  if (p_fmt == SAMPLEFORMAT_IEEEFP) {
+    castSamples(o_ptr, (const float*) i_buf + p_offset, p_step, p_n);
+  }
+  else if (p_bps == 16) {
+    castSamples(o_ptr, (const uint16_t*) i_buf + p_offset, p_step, p_n);
+  }
+  else {
+    castSamples(o_ptr, (const uint8_t*) i_buf + p_offset, p_step, p_n);
   }
+}
+
+
+//! Read a tiff image.
+void Image::readTiff(
+  const char* p_name,
+  const size_t i_border) {
+
+  //! Open the tiff file
+  size_t w, h, chnls;
+  TIFF *tif = openTiff(p_name, 0, w, h, chnls);
 
   //! Allocate the image
-  new (this) Image(w, h, 1, i_border);
+  new (this) Image(w, h, chnls, i_border);
+
+  //! Read the values
+  this->readTiffWindow(tif, p_name, 0, 0);
+
+  //! Close the file
+  TIFFClose(tif);
+}
+
+
+//! Read only a window of a tiff image.
+void Image::readWindow(
+  const char* p_name,
+  const int p_x0,
+  const int p_y0,
+  const size_t p_w,
+  const size_t p_h,
+  const int p_dir) {
+
+  //! Parameters check
+  if (NULL == p_name) {
+    cout << "Null name" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  //! Open the tiff file
+  size_t w, h, chnls;
+  TIFF *tif = openTiff(p_name, p_dir, w, h, chnls);
+
+  //! Allocate the image (full of zeros)
+  this->init(p_w, p_h, chnls);
 
   //! Read the values
+  this->readTiffWindow(tif, p_name, p_x0, p_y0);
+
+  //! Close the file
+  TIFFClose(tif);
+}
+
+
+//! Read a window of the current directory of a tiff image.
+void Image::readTiffWindow(
+  TIFF* p_tif,
+  const char* p_name,
+  const int p_x0,
+  const int p_y0) {
+
+  //! Size and data type of the image
+  uint32 w = 0, h = 0;
+  uint16 bps = 0, fmt = 0, planar = 0;
+  TIFFGetField(p_tif, TIFFTAG_IMAGEWIDTH, &w);
+  TIFFGetField(p_tif, TIFFTAG_IMAGELENGTH, &h);
+  TIFFGetFieldDefaulted(p_tif, TIFFTAG_BITSPERSAMPLE, &bps);
+  TIFFGetFieldDefaulted(p_tif, TIFFTAG_SAMPLEFORMAT, &fmt);
+  TIFFGetFieldDefaulted(p_tif, TIFFTAG_PLANARCONFIG, &planar);
+
+  //! The samples of a pixel are either interleaved, or in separate planes
+  const bool separate = planar == PLANARCONFIG_SEPARATE && m_channels > 1;
+  const size_t nPlanes = separate ? m_channels : 1;
+  const size_t step    = separate ? 1 : m_channels;
+
+  //! Intersection of the window with the image
+  const int x0 = max(p_x0, 0);
+  const int y0 = max(p_y0, 0);
+  const int x1 = min(p_x0 + (int) m_width , (int) w);
+  const int y1 = min(p_y0 + (int) m_height, (int) h);
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
 
   // use a particular reader for tiled tiff
-  if (TIFFIsTiled(tif)) {
-      uint16_t* buf = (uint16_t*) malloc(TIFFTileSize(tif));
-      uint32_t tilewidth, tilelength;
-      TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tilewidth);
-      TIFFGetField(tif, TIFFTAG_TILELENGTH, &tilelength);
-      for (uint32_t tx = 0; tx < m_width; tx += tilewidth)
-      for (uint32_t ty = 0; ty < m_height; ty += tilelength) {
-          if (TIFFReadTile(tif, buf, tx, ty, 0, 0) < 0) {
-              cout << "readTiff: error reading tile " << tx << ty << endl;
-              exit(EXIT_FAILURE);
+  if (TIFFIsTiled(p_tif)) {
+    uint32 tileW = 0, tileH = 0;
+    TIFFGetField(p_tif, TIFFTAG_TILEWIDTH, &tileW);
+    TIFFGetField(p_tif, TIFFTAG_TILELENGTH, &tileH);
+    const int tw = tileW, th = tileH;
+    void* buf = malloc(TIFFTileSize(p_tif));
+
+    //! Only decode the tiles which intersect the window
+    for (size_t p = 0; p < nPlanes; p++) {
+      for (int ty = y0 - y0 % th; ty < y1; ty += th) {
+        for (int tx = x0 - x0 % tw; tx < x1; tx += tw) {
+          if (TIFFReadTile(p_tif, buf, tx, ty, 0, (tsample_t) p) < 0) {
+            cout << "readTiff: error reading tile " << tx << " " << ty
+                 << " of " << p_name << endl;
+            exit(EXIT_FAILURE);
           }
-          for (uint32_t j = 0; j < tilelength; j++)
-          for (uint32_t i = 0; i < tilewidth; i++) {
-              uint32_t ii = i + tx;
-              uint32_t jj = j + ty;
-              if (ii < m_width && jj < m_height) {
-                  float* oI = this->getPtr(0, jj);
-                  oI[ii] = (float) buf[j*tilewidth + i];
-              }
+
+          //! Cast the samples to float
+          const int jBegin = max(tx, x0), jEnd = min(tx + tw, x1);
+          for (int i = max(ty, y0); i < min(ty + th, y1); i++) {
+            const size_t offset = ((i - ty) * tw + jBegin - tx) * step;
+            for (size_t c = 0; c < step; c++) {
+              castSamples(this->getPtr(p + c, i - p_y0) + jBegin - p_x0, buf,
+                          offset + c, step, jEnd - jBegin, bps, fmt);
+            }
           }
+        }
       }
-      free(buf);
-  } else {
-      uint16_t* buf = (uint16_t*) malloc(TIFFScanlineSize(tif));
-      for (size_t i = 0; i < m_height; i++) {
-          if (TIFFReadScanline(tif, buf, i, 0) < 0) {
-              cout << "readTiff: error reading row " << i << endl;
-              exit(EXIT_FAILURE);
+    }
+    free(buf);
+  }
+  else {
+    uint32 rowsPerStrip = 0;
+    TIFFGetFieldDefaulted(p_tif, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+    const int rps = min(rowsPerStrip, h);
+    void* buf = malloc(TIFFStripSize(p_tif));
+
+    //! Only decode the strips which intersect the window
+    for (size_t p = 0; p < nPlanes; p++) {
+      for (int sy = y0 - y0 % rps; sy < y1; sy += rps) {
+        if (TIFFReadEncodedStrip(p_tif, TIFFComputeStrip(p_tif, sy, p), buf,
+                                 (tsize_t) -1) < 0) {
+          cout << "readTiff: error reading strip at row " << sy << " of "
+               << p_name << endl;
+          exit(EXIT_FAILURE);
+        }
+
+        //! Cast the samples to float
+        for (int i = max(sy, y0); i < min(sy + rps, y1); i++) {
+          const size_t offset = ((size_t) (i - sy) * w + x0) * step;
+          for (size_t c = 0; c < step; c++) {
+            castSamples(this->getPtr(p + c, i - p_y0) + x0 - p_x0, buf,
+                        offset + c, step, x1 - x0, bps, fmt);
           }
-          //! Cast the uint16 samples to float
-          float* oI = this->getPtr(0, i);
-          for (size_t i = 0; i < m_width; i++)
-              oI[i] = (float) buf[i];
+        }
       }
-      free(buf);
+    }
+    free(buf);
+  }
+}
+
+
+//! Look for an overview of a tiff image.
+int Image::findOverview(
+  const char* p_name,
+  const size_t p_zoom) {
+
+  //! Open the tiff file
+  TIFF *tif = TIFFOpen(p_name, "r");
+  if (!tif) {
+    cout << "Unable to read TIFF file " << p_name << ". Abort." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  //! Size of the full resolution image
+  uint32 w = 0, h = 0;
+  TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+  TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+
+  //! The overviews made by gdaladdo have a size rounded up, accept both
+  const uint32 z = (uint32) p_zoom;
+  int dir = -1;
+  for (int n = 1; dir < 0 && TIFFReadDirectory(tif); n++) {
+    uint32 wn = 0, hn = 0, type = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &wn);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &hn);
+    TIFFGetField(tif, TIFFTAG_SUBFILETYPE, &type);
+
+    //! Skip the masks
+    if (type & FILETYPE_MASK) {
+      continue;
+    }
+    if ((wn == w / z || wn == (w + z - 1) / z) &&
+        (hn == h / z || hn == (h + z - 1) / z)) {
+      dir = n;
+    }
   }
 
   //! Close the file
   TIFFClose(tif);
+  return dir;
+}
+
+
+//! Get the size of a tiff image.
+void Image::sizeTiff(
+  const char* p_name,
+  const int p_dir,
+  size_t& o_width,
+  size_t& o_height) {
+
+  size_t chnls;
+  TIFF *tif = openTiff(p_name, p_dir, o_width, o_height, chnls);
+  TIFFClose(tif);
 }
 
 
 //! Generic write image.
 void Image::write(
   const char* p_name,
-  const bool p_quad) const {
+  const bool p_quad,
+  const bool p_uint16) const {
 
   //! parameters check
   if (0 >= m_width || 0 >= m_height || 0 >= m_channels) {
@@ -311,7 +511,7 @@ void Image::write(
 
   //! Call the right function
   if (ext == "tif" || ext == "tiff") {
-    this->writeTiff(p_name, p_quad);
+    this->writeTiff(p_name, p_quad, p_uint16);
   }
   else {
     cout << "Extension " << ext << " not known. Abort." << endl;
@@ -323,7 +523,8 @@ void Image::write(
 //! Write an image via the libtiff write function
 void Image::writeTiff(
   const std::string &p_name,
-  const bool p_quad) const {
+  const bool p_quad,
+  const bool p_uint16) const {
 
   //! Open the file
   TIFF *tif = TIFFOpen(p_name.c_str(), "w");
@@ -339,14 +540,22 @@ void Image::writeTiff(
   const size_t w = m_width  * (p_quad ? 2 : 1);
   uint32 rowsperstrip;
   float* line = (float*) memalloc(16, (p_quad ? w : m_width) * sizeof(float));
+  uint16_t* line16 = p_uint16 ? (uint16_t*) memalloc(16, w * sizeof(uint16_t))
+                              : NULL;
 
   //! Header of the tiff file
   TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, (uint32) w);
   TIFFSetField(tif, TIFFTAG_IMAGELENGTH, (uint32) h);
   TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_SEPARATE);
   TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, (uint16) m_channels);
-  TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, (uint16) sizeof(float) * 8);
-  TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+  if (p_uint16) {
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, (uint16) sizeof(uint16_t) * 8);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+  }
+  else {
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, (uint16) sizeof(float) * 8);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+  }
   rowsperstrip = TIFFDefaultStripSize(tif, (uint32) h);
   TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rowsperstrip);
   TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
@@ -369,8 +578,17 @@ void Image::writeTiff(
         }
       }
 
+      //! Round and clamp the values for uint16 (NaN are written as 0)
+      if (p_uint16) {
+        for (size_t j = 0; j < w; j++) {
+          const float v = line[j];
+          line16[j] = !(v > 0.f) ? 0 : v >= 65535.f ? 65535 : uint16_t(v + .5f);
+        }
+      }
+
       //! Write the line
-      if (TIFFWriteScanline(tif, line, (uint32) i, (tsample_t) c) < 0) {
+      if (TIFFWriteScanline(tif, p_uint16 ? (void*) line16 : (void*) line,
+                            (uint32) i, (tsample_t) c) < 0) {
         cout << "WriteTIFF: error writing row " << i << endl;
         ok = 0;
       }
@@ -379,11 +597,42 @@ void Image::writeTiff(
 
   //! Release memory
   memfree(line);
+  memfree(line16);
 
   //! Close the file
   TIFFClose(tif);
 }
 
+
+//! Replace the channels of the image by their mean.
+void Image::averageChannels() {
+
+  //! Nothing to do
+  if (m_channels < 2) {
+    return;
+  }
+
+  //! Image with one channel
+  Image tmp(m_width, m_height, 1, m_border);
+
+  //! The sum goes from the last channel to the first one, like plambda does
+  //! for "x[0] x[1] x[2] x[3] + + + 4 /"
+  for (size_t i = 0; i < m_height; i++) {
+    float* oI = tmp.getPtr(0, i);
+
+    for (size_t j = 0; j < m_width; j++) {
+      float sum = this->getPtr(m_channels - 1, i)[j];
+      for (int c = int(m_channels) - 2; c >= 0; c--) {
+        sum = this->getPtr(c, i)[j] + sum;
+      }
+      oI[j] = sum / float(m_channels);
+    }
+  }
+
+  //! Retrieve the gray image
+  *this = tmp;
+}
+
 //! Add a border to the current image.
 void Image::addBorder(
   const size_t i_border) {
@@ -534,152 +783,156 @@ void Image::convolveGaussian(
     kernel[i] /= sum;
   }
 
+  //! Number of groups of 4 columns for the SSE version
+  const int nbJ = w > 4 ? (w - 1) / 4 : 0;
+
   //! Loop over the channels
   for (size_t c = 0; c < m_channels; c++) {
 
-    //! Buffer allocation
-    float* line = (float*) memalloc(16, (2 * kHalf + w) * sizeof(float));
+    //! The lines, then the columns, are independent
+#pragma omp parallel
+    {
+      //! Buffer allocation
+      float* line = (float*) memalloc(16, (2 * kHalf + w) * sizeof(float));
 
-    //! Horizontal convolution
-    for (int i = 0; i < h; i++) {
-      float* iI = this->getPtr(c, i);
-
-      //! Copy the line into a buffer
-      for (int j = 0; j < kHalf; j++) {
-        line[j] = iI[0];
-        line[kHalf + w + j] = iI[w - 1];
-      }
-      for (int j = 0; j < w; j++) {
-        line[kHalf + j] = iI[j];
-      }
+      //! Horizontal convolution
+#pragma omp for schedule(dynamic)
+      for (int i = 0; i < h; i++) {
+        float* iI = this->getPtr(c, i);
 
-      //! Apply the convolution - SSE version
-      int j = 0;
-      for (; j < w - 4; j += 4) {
-        __m128 value = _mm_setzero_ps();
-
-        //! Unroll the loops
-        int k = 0;
-        while (k + 4 < kSize) {
-          value += _mm_set1_ps(kernel[k + 0]) * _mm_loadu_ps(line + j + k + 0) +
-                   _mm_set1_ps(kernel[k + 1]) * _mm_loadu_ps(line + j + k + 1) +
-                   _mm_set1_ps(kernel[k + 2]) * _mm_loadu_ps(line + j + k + 2) +
-                   _mm_set1_ps(kernel[k + 3]) * _mm_loadu_ps(line + j + k + 3);
-          k += 4;
+        //! Copy the line into a buffer
+        for (int j = 0; j < kHalf; j++) {
+          line[j] = iI[0];
+          line[kHalf + w + j] = iI[w - 1];
         }
-        for (; k < kSize; k++) {
-          value += _mm_set1_ps(kernel[k]) * _mm_loadu_ps(line + j + k);
+        for (int j = 0; j < w; j++) {
+          line[kHalf + j] = iI[j];
         }
-        _mm_storeu_ps(iI + j, value);
-      }
-
-      //! Normal version
-      for (; j < w; j++) {
-        float value = 0.f;
 
-        //! Apply the convolution
-        for (int k = 0; k < kSize; k++) {
-          value += kernel[k] * line[j + k];
+        //! Apply the convolution - SSE version
+        int j = 0;
+        for (; j < w - 4; j += 4) {
+          __m128 value = _mm_setzero_ps();
+
+          //! Unroll the loops
+          int k = 0;
+          while (k + 4 < kSize) {
+            value += _mm_set1_ps(kernel[k + 0]) * _mm_loadu_ps(line + j + k + 0) +
+                     _mm_set1_ps(kernel[k + 1]) * _mm_loadu_ps(line + j + k + 1) +
+                     _mm_set1_ps(kernel[k + 2]) * _mm_loadu_ps(line + j + k + 2) +
+                     _mm_set1_ps(kernel[k + 3]) * _mm_loadu_ps(line + j + k + 3);
+            k += 4;
+          }
+          for (; k < kSize; k++) {
+            value += _mm_set1_ps(kernel[k]) * _mm_loadu_ps(line + j + k);
+          }
+          _mm_storeu_ps(iI + j, value);
         }
 
-        iI[j] = value;
-      }
-    }
+        //! Normal version
+        for (; j < w; j++) {
+          float value = 0.f;
 
-    //! Release memory
-    memfree(line);
+          //! Apply the convolution
+          for (int k = 0; k < kSize; k++) {
+            value += kernel[k] * line[j + k];
+          }
 
-    //! Buffer allocation
-    __m128* xCol = (__m128*) memalloc(16, (2 * kHalf + h) * sizeof(__m128));
+          iI[j] = value;
+        }
+      }
 
-    //! Vertical convolution - SSE version
-    int j = 0;
-    for (; j < w - 4; j += 4) {
+      //! Release memory
+      memfree(line);
 
-      //! Copy the line into a buffer
-      for (int i = 0; i < kHalf; i++) {
-        xCol[i] = _mm_loadu_ps(this->getPtr(c, 0) + j);
-        xCol[kHalf + h + i] = _mm_loadu_ps(this->getPtr(c, h - 1) + j);
-      }
-      for (int i = 0; i < h; i++) {
-        xCol[kHalf + i] = _mm_loadu_ps(this->getPtr(c, i) + j);
-      }
+      //! Buffer allocation
+      __m128* xCol = (__m128*) memalloc(16, (2 * kHalf + h) * sizeof(__m128));
 
-      //! Apply the convolution
-      for (int i = 0; i < h; i++) {
-        __m128 value = _mm_setzero_ps();
-
-        //! Unroll the loop
-        int k = 0;
-        while (k + 4 < kSize) {
-          value += _mm_set1_ps(kernel[k + 0]) * xCol[i + k + 0] +
-                   _mm_set1_ps(kernel[k + 1]) * xCol[i + k + 1] +
-                   _mm_set1_ps(kernel[k + 2]) * xCol[i + k + 2] +
-                   _mm_set1_ps(kernel[k + 3]) * xCol[i + k + 3];
-          k += 4;
+      //! Vertical convolution - SSE version
+#pragma omp for schedule(dynamic)
+      for (int n = 0; n < nbJ; n++) {
+        const int j = 4 * n;
+
+        //! Copy the line into a buffer
+        for (int i = 0; i < kHalf; i++) {
+          xCol[i] = _mm_loadu_ps(this->getPtr(c, 0) + j);
+          xCol[kHalf + h + i] = _mm_loadu_ps(this->getPtr(c, h - 1) + j);
         }
-        for (; k < kSize; k++) {
-          value += _mm_set1_ps(kernel[k]) * xCol[i + k];
+        for (int i = 0; i < h; i++) {
+          xCol[kHalf + i] = _mm_loadu_ps(this->getPtr(c, i) + j);
         }
 
-        xCol[i] = value;
-      }
+        //! Apply the convolution
+        for (int i = 0; i < h; i++) {
+          __m128 value = _mm_setzero_ps();
+
+          //! Unroll the loop
+          int k = 0;
+          while (k + 4 < kSize) {
+            value += _mm_set1_ps(kernel[k + 0]) * xCol[i + k + 0] +
+                     _mm_set1_ps(kernel[k + 1]) * xCol[i + k + 1] +
+                     _mm_set1_ps(kernel[k + 2]) * xCol[i + k + 2] +
+                     _mm_set1_ps(kernel[k + 3]) * xCol[i + k + 3];
+            k += 4;
+          }
+          for (; k < kSize; k++) {
+            value += _mm_set1_ps(kernel[k]) * xCol[i + k];
+          }
 
-      //! Get the value
-      for (int i = 0; i < h; i++) {
-        _mm_storeu_ps(this->getPtr(c, i) + j, xCol[i]);
+          xCol[i] = value;
+        }
+
+        //! Get the value
+        for (int i = 0; i < h; i++) {
+          _mm_storeu_ps(this->getPtr(c, i) + j, xCol[i]);
+        }
       }
-    }
 
-    //! Release memory
-    memfree(xCol);
+      //! Release memory
+      memfree(xCol);
 
-    //! Buffer allocation
-    float* col = (float*) memalloc(16, (2 * kHalf + h) * sizeof(float));
+      //! Buffer allocation
+      float* col = (float*) memalloc(16, (2 * kHalf + h) * sizeof(float));
 
-    //! Vertical convolution - normal version
-    for (; j < w; j++) {
+      //! Vertical convolution - normal version
+#pragma omp for schedule(static)
+      for (int j = 4 * nbJ; j < w; j++) {
 
-      //! Copy the line into a buffer
-      for (int i = 0; i < kHalf; i++) {
-        col[i] = this->getPtr(c, 0)[j];
-        col[kHalf + h + i] = this->getPtr(c, h - 1)[j];
-      }
-      for (int i = 0; i < h; i++) {
-        col[kHalf + i] = this->getPtr(c, i)[j];
-      }
-
-      //! Apply the convolution
-      //ConvBufferFast(col, kernel, h, kSize);
-      for (int i = 0; i < h; i++) {
-        float value = 0.f;
-
-        //! Unroll the loop
-        int k = 0;
-        while (k + 4 < kSize) {
-          value += kernel[k + 0] * col[i + k + 0] +
-                   kernel[k + 1] * col[i + k + 1] +
-                   kernel[k + 2] * col[i + k + 2] +
-                   kernel[k + 3] * col[i + k + 3];
-          k += 4;
+        //! Copy the line into a buffer
+        for (int i = 0; i < kHalf; i++) {
+          col[i] = this->getPtr(c, 0)[j];
+          col[kHalf + h + i] = this->getPtr(c, h - 1)[j];
         }
-        for (; k < kSize; k++) {
-          value += kernel[k] * col[i + k];
+        for (int i = 0; i < h; i++) {
+          col[kHalf + i] = this->getPtr(c, i)[j];
         }
 
-        //col[i] = value;
-        //! Get the value
-        this->getPtr(c, i)[j] = col[i];
+        //! Apply the convolution
+        for (int i = 0; i < h; i++) {
+          float value = 0.f;
+
+          //! Unroll the loop
+          int k = 0;
+          while (k + 4 < kSize) {
+            value += kernel[k + 0] * col[i + k + 0] +
+                     kernel[k + 1] * col[i + k + 1] +
+                     kernel[k + 2] * col[i + k + 2] +
+                     kernel[k + 3] * col[i + k + 3];
+            k += 4;
+          }
+          for (; k < kSize; k++) {
+            value += kernel[k] * col[i + k];
+          }
+
+          //! Get the value (the buffer is not overwritten, it starts kHalf
+          //! lines above)
+          this->getPtr(c, i)[j] = value;
+        }
       }
 
-      //! Get the value
-      /*for (int i = 0; i < h; i++) {
-        this->getPtr(c, i)[j] = col[i];
-      }*/
+      //! Release memory
+      memfree(col);
     }
-
-    //! Release memory
-    memfree(col);
   }
 
   //! Release memory
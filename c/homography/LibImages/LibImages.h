@@ -7,6 +7,7 @@
 #include <vector>
 #include <xmmintrin.h>
 #include <x86intrin.h>
+#include <tiffio.h>
 
 //! Local includes
 
@@ -91,18 +92,73 @@ class Image {
       const size_t i_border = 0);
 
 
+    /**
+     * @brief Read only a window of a tiff image. Only the tiles or strips
+     *        which intersect the window are decoded.
+     *
+     * @param p_name : path to the image to read;
+     * @param p_x0, p_y0 : position of the top-left corner of the window (may
+     *                     be negative);
+     * @param p_w, p_h : size of the window. The pixels of the window which are
+     *                   outside of the image are set to 0;
+     * @param p_dir : index of the tiff directory to read (0 for the full
+     *                resolution image, see findOverview).
+     *
+     * @return none.
+     **/
+    void readWindow(
+      const char* p_name,
+      const int p_x0,
+      const int p_y0,
+      const size_t p_w,
+      const size_t p_h,
+      const int p_dir = 0);
+
+
+    /**
+     * @brief Look for an overview of a tiff image, i.e. a directory which
+     *        contains the image zoomed out by a factor p_zoom.
+     *
+     * @param p_name : path to the image;
+     * @param p_zoom : zoom out factor of the wanted overview.
+     *
+     * @return the index of the directory of the overview, -1 if not found.
+     **/
+    static int findOverview(
+      const char* p_name,
+      const size_t p_zoom);
+
+
+    /**
+     * @brief Get the size of a tiff image.
+     *
+     * @param p_name : path to the image;
+     * @param p_dir : index of the tiff directory;
+     * @param o_width, o_height : will receive the size of the image.
+     *
+     * @return none.
+     **/
+    static void sizeTiff(
+      const char* p_name,
+      const int p_dir,
+      size_t& o_width,
+      size_t& o_height);
+
+
     /**
      * @brief Generic write of an image. Call writePng or writeTiff according to
      *        the extension of the input name of the image to write.
      *
      * @param p_name : path to the image to save;
-     * @param p_quad: if true, apply a zoom-in by duplication of 1 pixel into 4.
+     * @param p_quad: if true, apply a zoom-in by duplication of 1 pixel into 4;
+     * @param p_uint16: if true, write rounded uint16 samples instead of float.
      *
      * @return none.
      **/
      void write(
       const char* p_name,
-      const bool p_quad = false) const;
+      const bool p_quad = false,
+      const bool p_uint16 = false) const;
 
 
     /**
@@ -142,6 +198,13 @@ class Image {
       const float p_value);
 
 
+    /**
+     * @brief Replace the channels of the image by their mean (conversion of a
+     *        pansharpened image to gray).
+     **/
+    void averageChannels();
+
+
     /**
      * @brief Convolve the image with a Gaussian of width sigma and store result
      *        back in the image. This routine creates the Gaussian kernel, and
@@ -167,8 +230,9 @@ class Image {
 
 
     /**
-     * @brief Read an image via the Libtiff library. Will exit the main program
-     *        in case of problem.
+     * @brief Read an image via the Libtiff library, with uint8, uint16 or
+     *        float32 samples and any number of channels. Will exit the main
+     *        program in case of problem.
      *
      * @param i_name : path to the image which will be filled into p_ptr;
      * @param i_border : size of the border to add around the image (will be
@@ -181,16 +245,30 @@ class Image {
       const size_t i_border = 0);
 
 
+    /**
+     * @brief Read a window of the directory p_dir of a tiff image in the
+     *        current image, which must be already allocated with the size of
+     *        the window. See readWindow.
+     **/
+    void readTiffWindow(
+      TIFF* p_tif,
+      const char* p_name,
+      const int p_x0,
+      const int p_y0);
+
+
     /**
      * @brief Write an image via the Libtiff library. Will exit the main problem
      *        in case of problem.
      *
      * @param i_name: path to the image to save;
-     * @param p_quad: if true, apply a zoom-in by duplication of 1 pixel into 4.
+     * @param p_quad: if true, apply a zoom-in by duplication of 1 pixel into 4;
+     * @param p_uint16: if true, write rounded uint16 samples instead of float.
      **/
     void writeTiff(
       const std::string &p_name,
-      const bool p_quad = false) const;
+      const bool p_quad = false,
+      const bool p_uint16 = false) const;
 
 
     /**
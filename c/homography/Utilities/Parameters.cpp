@@ -34,6 +34,10 @@ Parameters::Parameters(
   m_adjustSize   (false),      // Activate the automatic size        -a
   m_oWidth       (0),          // Wanted width of te output image    -c [%d]
   m_oHeight      (0),          // Wanted height of the output image  -l [%d]
+  m_zoom         (1),          // Zoom out factor of the input image -z [%d]
+  m_gray         (false),      // Average the channels of the input  -g
+  m_mtfName      (NULL),       // Path of the MTF to apply           -m [%s]
+  m_uint16       (false),      // Write the output as uint16         -u
   m_verbose      (false)       // Activate verbose mode              -v
   {
 
@@ -59,6 +63,10 @@ Parameters::Parameters(
   m_adjustSize   (i_params.adjustSize()),
   m_oWidth       (i_params.oWidth()),
   m_oHeight      (i_params.oHeight()),
+  m_zoom         (i_params.zoom()),
+  m_gray         (i_params.gray()),
+  m_mtfName      (i_params.mtfName()),
+  m_uint16       (i_params.uint16()),
   m_verbose      (i_params.verbose()) {
 
 }
@@ -147,6 +155,30 @@ int Parameters::checkArgs(
       }
     }
 
+    //! Zoom out factor
+    if (sarg.find("-z") == 0) {
+      if (n + 1 < i_argc) {
+        m_zoom = atoi(i_argv[n + 1]);
+      }
+    }
+
+    //! Gray input
+    if (sarg.find("-g") == 0) {
+      m_gray = true;
+    }
+
+    //! MTF
+    if (sarg.find("-m") == 0) {
+      if (n + 1 < i_argc) {
+        m_mtfName = i_argv[n + 1];
+      }
+    }
+
+    //! uint16 output
+    if (sarg.find("-u") == 0) {
+      m_uint16 = true;
+    }
+
     //! Verbose option
     if (sarg.find("-v") == 0) {
       m_verbose = true;
@@ -169,6 +201,11 @@ int Parameters::checkArgs(
     cout << "    -o path/image.ext" << endl;
     return EXIT_FAILURE;
   }
+  if (m_zoom < 1) {
+    cout << "The zoom out factor must be a positive integer. Use \n";
+    cout << "    -z 2" << endl;
+    return EXIT_FAILURE;
+  }
 
   return EXIT_SUCCESS;
 }
@@ -210,6 +247,10 @@ void Parameters::printSynopsis(
   sentence += " [-a adjust size]";
   sentence += " [-c output width]";
   sentence += " [-l output height]";
+  sentence += " [-z zoom out factor]";
+  sentence += " [-g gray]";
+  sentence += " [-m input MTF path]";
+  sentence += " [-u uint16 output]";
   sentence += " [-v verbose]";
 
   //! Print the synopsis
@@ -314,6 +355,27 @@ void Parameters::printOptional(
   this->printWord("-l (optional)", "0", s4);
   this->printLine("If > 0, will set the height to the output image.", s7);
 
+  //! Zoom out factor
+  this->printWord("-z (optional)", "1", s4);
+  this->printLine("Zoom out factor of the input image the homography applies "
+                  "to. Read from its overview if the tiff has one, otherwise "
+                  "zoomed out in the Fourier domain.", s7);
+
+  //! Gray input
+  this->printWord("-g (optional)", "False", s4);
+  this->printLine("Average the channels of the input image.", s7);
+
+  //! MTF
+  this->printWord("-m (optional)", "None", s4);
+  this->printLine("Path to a tiff image sampling a MTF centered on the "
+                  "frequency 0 (see fftconvolve), by which the input image is "
+                  "filtered before the zoom out and the homography.", s7);
+
+  //! uint16 output
+  this->printWord("-u (optional)", "False", s4);
+  this->printLine("Write the output image as rounded uint16 instead of float "
+                  "(NaN are written as 0).", s7);
+
   //! Verbose
   this->printWord("-v (optional)", "False", s4);
   this->printLine("Activate the verbose mode.", s7);
@@ -51,6 +51,10 @@ class Parameters {
     bool   adjustSize() const {return m_adjustSize;}
     size_t oWidth    () const {return m_oWidth    ;}
     size_t oHeight   () const {return m_oHeight   ;}
+    size_t zoom      () const {return m_zoom      ;}
+    bool   gray      () const {return m_gray      ;}
+    char*  mtfName   () const {return m_mtfName   ;}
+    bool   uint16    () const {return m_uint16    ;}
     bool   verbose   () const {return m_verbose   ;}
 
     /**
@@ -135,6 +139,10 @@ class Parameters {
     bool   m_adjustSize; // Activate the automatic size        -a
     size_t m_oWidth;     // Width of the output image          -c [%d]
     size_t m_oHeight;    // Height of the output image         -l [%d]
+    size_t m_zoom;       // Zoom out factor of the input image -z [%d]
+    bool   m_gray;       // Average the channels of the input  -g
+    char*  m_mtfName;    // Path of the MTF to apply           -m [%s]
+    bool   m_uint16;     // Write the output as uint16         -u
     bool   m_verbose;    // Activate the verbose mode          -v
 };
 #else
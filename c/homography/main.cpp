@@ -38,23 +38,23 @@ int main(
   //! Initialization of time
   Time time;
 
-  //! Read the input image
-  Image imI;
-  imI.read(params.inpName());
-  if (params.verbose()) time.getTime("Read image");
-
   //! Read the homography
   double mat[9];
   readHomography(params.inpHomo(), mat);
   if (params.verbose()) time.getTime("Read homography");
 
+  //! Read the part of the input image seen by the output
+  Image imI;
+  readInput(params, mat, imI);
+  if (params.verbose()) time.getTime("Read image");
+
   //! Call the mapping function
   Image imO;
   runHomography(imI, mat, imO, params);
   if (params.verbose()) time.getTime("Apply the homography");
 
   //! Write the image
-  imO.write(params.outName());
+  imO.write(params.outName(), false, params.uint16());
   if (params.verbose()) time.getTime("Write image");
 
   //! Exit the main function
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <math.h>
 
+#include "median_filter.c"
+
 static void *xmalloc(size_t size)
 {
 	void *new = malloc(size);
@@ -79,42 +81,23 @@ void morsi_dilation(float *y, float *x, int w, int h, int *e)
 	}
 }
 
-static int compare_floats(const void *aa, const void *bb)
-{
-	const float *a = (const float *)aa;
-	const float *b = (const float *)bb;
-	return (*a > *b) - (*a < *b);
-}
-
-static float median(float *a, int n)
-{
-	if (n < 1) return NAN;
-	if (n == 1) return *a;
-	if (n == 2) return (a[0] + a[1])/2;
-	qsort(a, n, sizeof*a, compare_floats);
-	if (0 == n%2)
-		return (a[n/2]+a[1+n/2])/2;
-	else
-		return a[n/2];
-}
-
+// median of the finite values (sliding window, see median_filter.c of mgm)
+// for an even number of values, the average of the two central ones
 void morsi_median(float *y, float *x, int w, int h, int *e)
 {
-	getpixel_operator p = getpixel_nan;
-
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
+	// offsets of the pixels of the element from its center
+	int n = e[0];
+	int *o = xmalloc((2*n+1)*sizeof*o);
+	for (int k = 0; k < n; k++)
 	{
-		float a[e[0]];
-		int cx = 0;
-		for (int k = 0; k < e[0]; k++)
-		{
-			float v = p(x,w,h, i-e[2]+e[2*k+4], j-e[3]+e[2*k+5]);
-			if (isfinite(v))
-				a[cx++] = v;
-		}
-		y[j*w+i] = median(a, cx);
+		o[2*k+0] = e[2*k+4] - e[2];
+		o[2*k+1] = e[2*k+5] - e[3];
 	}
+	struct median_run *r = xmalloc((n+1)*sizeof*r);
+	int nruns = median_runs_from_offsets(r, o, n);
+	median_filter_runs(y, x, w, h, r, nruns, MEDIAN_AVERAGE);
+	free(r);
+	free(o);
 }
 
 void morsi_opening(float *y, float *x, int w, int h, int *e)
@@ -359,9 +342,112 @@ static int *build_Drec(float radius)
 
 #ifdef MORSI_TEST_MAIN
 #include <string.h>
+#include <time.h>
 #include "iio.h"
+
+static int compare_floats(const void *aa, const void *bb)
+{
+	float a = *(const float *)aa;
+	float b = *(const float *)bb;
+	return (a > b) - (a < b);
+}
+
+// median of the finite values of each window by a full sort of the window,
+// as morsi_median was computed before median_filter.c (reference of the bench)
+static void median_by_sorting(float *y, float *x, int w, int h, int *e)
+{
+	float *t = xmalloc((e[0]+1)*sizeof*t);
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		int n = 0;
+		for (int k = 0; k < e[0]; k++)
+		{
+			int ii = i - e[2] + e[2*k+4];
+			int jj = j - e[3] + e[2*k+5];
+			if (ii >= 0 && jj >= 0 && ii < w && jj < h
+					&& isfinite(x[jj*w+ii]))
+				t[n++] = x[jj*w+ii];
+		}
+		qsort(t, n, sizeof*t, compare_floats);
+		y[j*w+i] = median_of_sorted(t, n, MEDIAN_AVERAGE);
+	}
+	free(t);
+}
+
+static int *build_square(int radius)
+{
+	int side = 2*radius+1;
+	int *e = xmalloc((2*side*side+4)*sizeof*e), cx = 0;
+	for (int i = -radius; i <= radius; i++)
+	for (int j = -radius; j <= radius; j++)
+	{
+		e[2*cx+4] = i;
+		e[2*cx+5] = j;
+		cx += 1;
+	}
+	e[0] = cx;
+	e[1] = e[2] = e[3] = 0;
+	return e;
+}
+
+// benchmark of the median filter on a smooth w x h image with 2% of NaN:
+// the sliding window median (median_filter.c) against a full sort of each
+// window, for the squares and the disks of radius 1 to 7
+// (use OMP_NUM_THREADS=1, the times are CPU times)
+static int main_bench(int c, char **v)
+{
+	int w = c > 1 ? atoi(v[1]) : 1000;
+	int h = c > 2 ? atoi(v[2]) : w;
+	float *x = xmalloc(3*w*h*sizeof*x), *y = x + w*h, *z = y + w*h;
+
+	printf("%dx%d, times in seconds\n", w, h);
+	printf(" r  element  values   sort     sliding  speedup  mismatches\n");
+	for (int integer = 0; integer < 2; integer++)
+	{
+	// smooth image with noise and 2% of NaN, the integer values (like
+	// disparities) go to the histograms of median_filter.c
+	srand(0);
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+		x[j*w+i] = rand() % 50 ?
+			0.05*i + 0.02*j + rand() / (RAND_MAX + 1.0) : NAN;
+	if (integer)
+		for (int i = 0; i < w*h; i++)
+			x[i] = floor(x[i] / 4);
+
+	for (int r = 1; r <= 7; r++)
+	for (int disk = 0; disk < 2; disk++)
+	{
+		int *e = disk ? build_disk(r + 0.5) : build_square(r);
+		clock_t t0 = clock();
+		median_by_sorting(y, x, w, h, e);
+		clock_t t1 = clock();
+		if (disk)
+			morsi_median(z, x, w, h, e);
+		else
+			median_filter_square(z, x, w, h, r, MEDIAN_AVERAGE);
+		clock_t t2 = clock();
+		int nbad = 0;
+		for (int i = 0; i < w*h; i++)
+			nbad += !(y[i] == z[i] || (isnan(y[i]) && isnan(z[i])));
+		double s = 1.0 / CLOCKS_PER_SEC;
+		printf("%2d  %-7s  %-7s  %-7.3f  %-7.3f  x%-6.1f  %d\n", r,
+				disk ? "disk" : "square",
+				integer ? "integer" : "float", (t1-t0)*s, (t2-t1)*s,
+				(t1-t0)/(double)(t2-t1 ? t2-t1 : 1), nbad);
+		free(e);
+	}
+	}
+	free(x);
+	return 0;
+}
+
 int main(int c, char **v)
 {
+	if (c > 1 && 0 == strcmp(v[1], "bench"))
+		return main_bench(c - 1, v + 1);
+
 	// data for available structuring elements
 	int cross[] = {5,0,  0,0, -1,0, 0,0, 1,0, 0,-1, 0,1 };
 	int square[] = {9,0, 0,0, -1,-1,-1,0,-1,1, 0,-1,0,0,0,1, 1,-1,1,0,1,1};
@@ -1,18 +1,37 @@
 // take a series of ply files and produce a digital elevation map
+//
+// The bounding box of each cloud gives the extent of the map.  It is read
+// from the header of the clouds written by colormesh ("comment bbox: xmin
+// xmax ymin ymax"), so that these clouds are read once, when their points
+// are accumulated in the map; the other clouds are read twice.  The map is
+// computed by n vertical strips, to bound the memory, and each strip only
+// reads the clouds whose bounding box intersects it.  The
+// strips are aligned on the tiles of the output GeoTIFF and their tiles are
+// written as soon as the strip is complete.
+//
+// The binary clouds are mapped in memory and their points are decoded with
+// the offsets of the needed properties.  The clouds of a strip are processed
+// in parallel, each one in its own accumulator that covers its footprint,
+// and the accumulators are added to the strip.
+//
+// Each band of the map is computed by a reducer (mean, count, min, max,
+// std, median, idw, see below) and all the bands are computed in the same
+// pass over the clouds.
 
+#define _POSIX_C_SOURCE 200809L // mmap, posix_madvise, fileno, ftello
 #include <assert.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include <geotiff/xtiffio.h>
 #include <geotiff/geotiffio.h>
 #include <geotiff/geo_tiffp.h>
 
-#include "iio.h"
-#include "lists.c"
 #include "fail.c"
 #include "xmalloc.c"
 
@@ -49,14 +68,41 @@ static int get_utm_zone_index_for_geotiff(char *utm_zone)
 	return out;
 }
 
-void set_geotif_header(char *tiff_fname, char *utm_zone, float xoff,
-		float yoff, float scale)
+// size of the tiles of the output GeoTIFF
+#define DSM_TILE 256
+
+// create a tiled float GeoTIFF of size w x h with pd bands, the tiles are
+// written later
+static TIFF *create_geotiff(char *tiff_fname, int w, int h, int pd,
+		char *utm_zone, float xoff, float yoff, float scale)
 {
+	// BigTIFF when the classic offsets may overflow
+	uint64_t ntiles = (uint64_t) ((w + DSM_TILE - 1) / DSM_TILE)
+		* ((h + DSM_TILE - 1) / DSM_TILE);
+	bool big = ntiles * DSM_TILE * DSM_TILE * pd * sizeof(float) > 0xf0000000;
+
 	// open tiff file
-	TIFF *tif = XTIFFOpen(tiff_fname, "r+");
+	TIFF *tif = XTIFFOpen(tiff_fname, big ? "w8" : "w");
 	if (!tif)
 		fail("failed in XTIFFOpen\n");
 
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, w);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, h);
+	TIFFSetField(tif, TIFFTAG_TILEWIDTH, DSM_TILE);
+	TIFFSetField(tif, TIFFTAG_TILELENGTH, DSM_TILE);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, pd);
+	if (pd > 1) {
+		uint16_t extra[pd - 1];
+		for (int i = 0; i < pd - 1; i++)
+			extra[i] = EXTRASAMPLE_UNSPECIFIED;
+		TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, pd - 1, extra);
+	}
+	TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+
 	GTIF *gtif = GTIFNew(tif);
 	if (!gtif)
 		fail("failed in GTIFNew\n");
@@ -72,10 +118,8 @@ void set_geotif_header(char *tiff_fname, char *utm_zone, float xoff,
 	int utm_ind = get_utm_zone_index_for_geotiff(utm_zone);
 	GTIFKeySet(gtif, ProjectedCSTypeGeoKey, TYPE_SHORT, 1, utm_ind);
 	GTIFWriteKeys(gtif);
-
-	// free and close
 	GTIFFree(gtif);
-	XTIFFClose(tif);
+	return tif;
 }
 
 
@@ -89,8 +133,9 @@ struct ply_property {
 static bool parse_property_line(struct ply_property *t, char *buf)
 {
 	char typename[0x100];
-	bool r = 2 == sscanf(buf, "property %s %s\n", typename, t->name);
+	bool r = 2 == sscanf(buf, "property %255s %255s\n", typename, t->name);
 	t->type = UNKNOWN;
+	t->len = 0;
 	if (0 == strcmp(typename, "uchar")) { t->type = UCHAR;  t->len = 1;}
 	if (0 == strcmp(typename, "float")) { t->type = FLOAT;  t->len = 4;}
 	if (0 == strcmp(typename, "double")){ t->type = DOUBLE; t->len = 8;}
@@ -100,12 +145,13 @@ static bool parse_property_line(struct ply_property *t, char *buf)
 
 
 // fast forward "f" until "end_header" is found
-// returns the number of 'properties' 
-// the array of structures *t, contains the names and sizes 
+// returns the number of 'properties' (at most nmax)
+// the array of structures *t, contains the names and sizes
 // the properties in bytes, isbin is set if binary encoded
-// and reads the utm zone
-static size_t header_get_record_length_and_utm_zone(FILE *f_in, char *utm, 
-		int *isbin, struct ply_property *t)
+// and reads the utm zone and the bounding box (if any, *hasbb is set)
+static size_t header_get_record_length_and_utm_zone(FILE *f_in, char *utm,
+		int *isbin, struct ply_property *t, size_t nmax,
+		double bb[4], bool *hasbb)
 {
 	size_t n = 0;
 	*isbin = 0;
@@ -115,11 +161,14 @@ static size_t header_get_record_length_and_utm_zone(FILE *f_in, char *utm,
 		if (0 == strcmp(buf, "format binary_little_endian 1.0\n")) *isbin=1;
 		else if (0 == strcmp(buf, "format ascii 1.0\n")) *isbin=0;
 		else {
-			if (parse_property_line(t+n, buf))
+			if (n < nmax && parse_property_line(t+n, buf))
 				n += 1;
 			else if (0 == strncmp(buf, "comment projection:", 19)) {
-				sscanf(buf, "comment projection: UTM %s", utm);
+				sscanf(buf, "comment projection: UTM %255s", utm);
 			}
+			else if (0 == strncmp(buf, "comment bbox:", 13))
+				*hasbb = 4 == sscanf(buf, "comment bbox: %lf %lf %lf %lf",
+						bb, bb + 1, bb + 2, bb + 3);
 		}
 		if (0 == strcmp(buf, "end_header\n"))
 			break;
@@ -127,6 +176,200 @@ static size_t header_get_record_length_and_utm_zone(FILE *f_in, char *utm,
 	return n;
 }
 
+// a property of the points, at a fixed offset in the binary records
+struct ply_field {
+	int type;
+	size_t offset;
+};
+
+static double get_field(const char *p, struct ply_field f)
+{
+	switch (f.type) {
+	case UCHAR:
+		return *(const unsigned char *) (p + f.offset);
+	case FLOAT: {
+		float x;
+		memcpy(&x, p + f.offset, sizeof x);
+		return x; }
+	default: {
+		double x;
+		memcpy(&x, p + f.offset, sizeof x);
+		return x; }
+	}
+}
+
+// a ply file, the layout of its points and their bounding box
+struct cloud {
+	char *fname;
+	bool ok;
+	int isbin;
+	char utm[0x100];
+	off_t header_size;       // offset of the first point
+	size_t record_size;      // size of a binary point, in bytes
+	int nprops;              // number of values of a point
+	int col_idx;             // index of the value of the map
+	struct ply_field x, y, v;
+	double xmin, xmax, ymin, ymax;
+	bool hasbb;              // the bounding box was in the header
+};
+
+// read the header of the cloud and the layout of its points
+static bool cloud_init(struct cloud *c, int col_idx)
+{
+	c->ok = false;
+	FILE *f = fopen(c->fname, "r");
+	if (!f) {
+		fprintf(stderr, "WARNING: can not open file \"%s\"\n", c->fname);
+		return false;
+	}
+
+	struct ply_property t[100];
+	double bb[4];
+	c->utm[0] = '\0';
+	c->hasbb = false;
+	c->nprops = header_get_record_length_and_utm_zone(f, c->utm, &c->isbin,
+			t, 100, bb, &c->hasbb);
+	c->header_size = ftello(f);
+	fclose(f);
+	if (c->nprops <= col_idx) {
+		fprintf(stderr, "WARNING: not enough properties in \"%s\"\n",
+				c->fname);
+		return false;
+	}
+
+	c->col_idx = col_idx;
+	c->record_size = 0;
+	for (int i = 0; i < c->nprops; i++) {
+		if (c->isbin && t[i].type == UNKNOWN) {
+			fprintf(stderr, "WARNING: unsupported property \"%s\" in "
+					"\"%s\"\n", t[i].name, c->fname);
+			return false;
+		}
+		struct ply_field p = {t[i].type, c->record_size};
+		if (i == 0) c->x = p;
+		if (i == 1) c->y = p;
+		if (i == col_idx) c->v = p;
+		c->record_size += t[i].len;
+	}
+	c->xmin = c->ymin = INFINITY;
+	c->xmax = c->ymax = -INFINITY;
+	if (c->hasbb) {
+		c->xmin = bb[0];
+		c->xmax = bb[1];
+		c->ymin = bb[2];
+		c->ymax = bb[3];
+	}
+	return c->ok = true;
+}
+
+// sequential access to the points of a cloud
+struct cloud_reader {
+	struct cloud *c;
+	FILE *f;             // ascii clouds
+	char *map;           // binary clouds, mapped in memory
+	size_t map_size;
+	size_t pos;          // offset of the next binary point
+};
+
+static bool cloud_open(struct cloud_reader *r, struct cloud *c)
+{
+	r->c = c;
+	r->map = NULL;
+	r->f = fopen(c->fname, "r");
+	if (!r->f) {
+		fprintf(stderr, "WARNING: can not open file \"%s\"\n", c->fname);
+		return false;
+	}
+	if (!c->isbin) {
+		fseeko(r->f, c->header_size, SEEK_SET);
+		return true;
+	}
+
+	fseeko(r->f, 0, SEEK_END);
+	r->map_size = ftello(r->f);
+	r->pos = c->header_size;
+	if (r->map_size <= r->pos)
+		return true;
+	void *p = mmap(NULL, r->map_size, PROT_READ, MAP_PRIVATE,
+			fileno(r->f), 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "WARNING: can not map file \"%s\"\n", c->fname);
+		fclose(r->f);
+		return false;
+	}
+	posix_madvise(p, r->map_size, POSIX_MADV_SEQUENTIAL);
+	r->map = p;
+	return true;
+}
+
+static void cloud_close(struct cloud_reader *r)
+{
+	if (r->map)
+		munmap(r->map, r->map_size);
+	fclose(r->f);
+}
+
+// decode the next (at most n) points of the cloud: their coordinates x, y
+// and the value v of the map, returns the number of points decoded
+static int cloud_read(struct cloud_reader *r, double *x, double *y, double *v,
+		int n)
+{
+	struct cloud *c = r->c;
+	if (c->isbin) {
+		if (!r->map)
+			return 0;
+		size_t avail = (r->map_size - r->pos) / c->record_size;
+		if ((size_t) n > avail)
+			n = avail;
+		const char *p = r->map + r->pos;
+		for (int k = 0; k < n; k++, p += c->record_size) {
+			x[k] = get_field(p, c->x);
+			y[k] = get_field(p, c->y);
+			v[k] = get_field(p, c->v);
+		}
+		r->pos += n * c->record_size;
+		return n;
+	}
+
+	double data[c->nprops];
+	int k = 0;
+	while (k < n) {
+		int i = 0;
+		while (i < c->nprops && 1 == fscanf(r->f, "%lf", data + i))
+			i++;
+		if (i < c->nprops)
+			break;
+		x[k] = data[0];
+		y[k] = data[1];
+		v[k] = data[c->col_idx];
+		k++;
+	}
+	return k;
+}
+
+// number of points decoded at a time
+#define PLY_BLOCK 1024
+
+// compute the bounding box of the points of the cloud
+static void cloud_bounding_box(struct cloud *c)
+{
+	struct cloud_reader r;
+	if (!cloud_open(&r, c)) {
+		c->ok = false;
+		return;
+	}
+	double x[PLY_BLOCK], y[PLY_BLOCK], v[PLY_BLOCK];
+	int n;
+	while ((n = cloud_read(&r, x, y, v, PLY_BLOCK)) > 0)
+		for (int k = 0; k < n; k++) {
+			if (x[k] < c->xmin) c->xmin = x[k];
+			if (x[k] > c->xmax) c->xmax = x[k];
+			if (y[k] < c->ymin) c->ymin = y[k];
+			if (y[k] > c->ymax) c->ymax = y[k];
+		}
+	cloud_close(&r);
+}
+
 static void update_min_max(float *min, float *max, float x)
 {
 	if (x < *min) *min = x;
@@ -142,177 +385,537 @@ static int rescale_float_to_int(double x, double min, double max, int w)
 	return r;
 }
 
-struct images {
-	float *cnt;
-	float *avg;
+// re-scale a float between 0 and w, without rounding nor clamping
+static double rescale_float(double x, double min, double max, int w)
+{
+	return w * (x - min)/(max - min);
+}
+
+// geometry of the output map
+struct dsm_grid {
+	float xmin, xmax, ymin, ymax;
 	int w, h;
 };
 
-// update the output images with a new height
-static void add_height_to_images(struct images *x, int i, int j, float v)
+
+
+// Reducers
+//
+// Each band of the output map is computed by a reducer from the points of
+// the cells.  A reducer keeps nvals floats of state per cell, and it is also
+// given the number n of points of the cell and the sum of their heights
+// (which are always accumulated).  The accumulators of the clouds are merged
+// in the order of the clouds, so the states only depend on that order.
+//
+// The splatting reducers receive the points within a radius of the center
+// of the cell, with a weight, instead of the points of the cell.
+
+struct band;
+
+struct reducer {
+	char *name;
+	bool splat;
+	int (*nvals)(const struct band *b);
+	void (*init)(const struct band *b, float *a);
+	// add the point v (the n-th of the cell) to the state a
+	void (*add)(const struct band *b, float *a, float n, float v, float wgt,
+			uint32_t seed);
+	// add to the state a (of na points) the state c (of nc points)
+	void (*merge)(const struct band *b, float *a, float na, const float *c,
+			float nc, uint32_t seed);
+	float (*value)(const struct band *b, const float *a, float n, double sum);
+};
+
+// a band of the output map: a reducer and its parameters
+struct band {
+	const struct reducer *r;
+	int offset;       // position of the state in the state of the cell
+	int nvals;        // size of the state
+	int k;            // size of the reservoirs (median)
+	float radius;     // splatting radius, in pixels (idw)
+};
+
+static uint32_t hash32(uint32_t x)
 {
-	uint64_t k = (uint64_t) x->w * j + i;
-	x->avg[k] = (v + x->cnt[k] * x->avg[k]) / (1 + x->cnt[k]);
-	x->cnt[k] += 1;
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
 }
 
-int get_record(FILE *f_in, int isbin, struct ply_property *t, int n, double *data){
-	int rec = 0;
-	if(isbin) {
-		for (int i = 0; i < n; i++) {
-			switch(t[i].type) {
-				case UCHAR: {
-						    unsigned char X;
-						    rec += fread(&X, 1, 1, f_in);
-						    data[i] = X;
-						    break; }
-				case FLOAT: {
-						    float X;
-						    rec += fread(&X, sizeof(float), 1, f_in);
-						    data[i] = X;
-						    break; }
-				case DOUBLE: {
-						     double X;
-						     rec += fread(&X, sizeof(double), 1, f_in);
-						     data[i] = X;
-						     break; }
-			}
-		}
-	} else {
-		int i=0;
-		while (i < n && !feof(f_in)) {
-			rec += fscanf(f_in,"%lf", &data[i]);  i++;
-		}
+static int nvals_0(const struct band *b) { (void) b; return 0; }
+static int nvals_1(const struct band *b) { (void) b; return 1; }
+static int nvals_2(const struct band *b) { (void) b; return 2; }
+static int nvals_k(const struct band *b) { return b->k; }
+
+static void init_zero(const struct band *b, float *a)
+{
+	for (int i = 0; i < b->nvals; i++)
+		a[i] = 0;
+}
+
+static void add_none(const struct band *b, float *a, float n, float v,
+		float wgt, uint32_t seed)
+{
+	(void) b; (void) a; (void) n; (void) v; (void) wgt; (void) seed;
+}
+
+static void merge_none(const struct band *b, float *a, float na,
+		const float *c, float nc, uint32_t seed)
+{
+	(void) b; (void) a; (void) na; (void) c; (void) nc; (void) seed;
+}
+
+// mean: from the sum
+static float value_mean(const struct band *b, const float *a, float n,
+		double sum)
+{
+	(void) b; (void) a;
+	return n ? sum / n : NAN;
+}
+
+// count: number of points of the cell
+static float value_count(const struct band *b, const float *a, float n,
+		double sum)
+{
+	(void) b; (void) a; (void) sum;
+	return n;
+}
+
+// min and max
+static void init_min(const struct band *b, float *a)
+{
+	(void) b;
+	a[0] = INFINITY;
+}
+
+static void init_max(const struct band *b, float *a)
+{
+	(void) b;
+	a[0] = -INFINITY;
+}
+
+static void add_min(const struct band *b, float *a, float n, float v,
+		float wgt, uint32_t seed)
+{
+	(void) b; (void) n; (void) wgt; (void) seed;
+	if (v < a[0]) a[0] = v;
+}
+
+static void add_max(const struct band *b, float *a, float n, float v,
+		float wgt, uint32_t seed)
+{
+	(void) b; (void) n; (void) wgt; (void) seed;
+	if (v > a[0]) a[0] = v;
+}
+
+static void merge_min(const struct band *b, float *a, float na,
+		const float *c, float nc, uint32_t seed)
+{
+	(void) b; (void) na; (void) nc; (void) seed;
+	if (c[0] < a[0]) a[0] = c[0];
+}
+
+static void merge_max(const struct band *b, float *a, float na,
+		const float *c, float nc, uint32_t seed)
+{
+	(void) b; (void) na; (void) nc; (void) seed;
+	if (c[0] > a[0]) a[0] = c[0];
+}
+
+static float value_first(const struct band *b, const float *a, float n,
+		double sum)
+{
+	(void) b; (void) sum;
+	return n ? a[0] : NAN;
+}
+
+// standard deviation: running mean and sum of squared deviations (Welford)
+static void add_std(const struct band *b, float *a, float n, float v,
+		float wgt, uint32_t seed)
+{
+	(void) b; (void) wgt; (void) seed;
+	float d = v - a[0];
+	a[0] += d / (n + 1);
+	a[1] += d * (v - a[0]);
+}
+
+static void merge_std(const struct band *b, float *a, float na,
+		const float *c, float nc, uint32_t seed)
+{
+	(void) b; (void) seed;
+	if (!nc) return;
+	float d = c[0] - a[0];
+	a[0] += d * nc / (na + nc);
+	a[1] += c[1] + d * d * na * nc / (na + nc);
+}
+
+static float value_std(const struct band *b, const float *a, float n,
+		double sum)
+{
+	(void) b; (void) sum;
+	return n ? sqrt(a[1] / n) : NAN;
+}
+
+// median: of a uniform sample of at most k points of the cell (reservoir
+// sampling), it is exact for the cells of at most k points
+static void add_median(const struct band *b, float *a, float n, float v,
+		float wgt, uint32_t seed)
+{
+	(void) wgt;
+	uint32_t m = n;
+	if (m < (uint32_t) b->k)
+		a[m] = v;
+	else {
+		uint32_t i = hash32(seed) % (m + 1);
+		if (i < (uint32_t) b->k)
+			a[i] = v;
 	}
-	return rec;
 }
 
-// open a ply file, read utm zone in the header, and update the known extrema
-static void parse_ply_points_for_extrema(float *xmin, float *xmax, float *ymin,
-		float *ymax, char *utm, char *fname)
+static void merge_median(const struct band *b, float *a, float na,
+		const float *c, float nc, uint32_t seed)
 {
-	FILE *f = fopen(fname, "r");
-	if (!f) {
-		fprintf(stderr, "WARNING: can not open file \"%s\"\n", fname);
+	int k = b->k;
+	int ka = na < k ? na : k;
+	int kc = nc < k ? nc : k;
+	if (ka + kc <= k) {
+		for (int i = 0; i < kc; i++)
+			a[ka + i] = c[i];
 		return;
 	}
 
-	int isbin=0;
-	struct ply_property t[100];
-	size_t n = header_get_record_length_and_utm_zone(f, utm, &isbin, t);
-	//fprintf(stderr, "%d\n", n);
-	//fprintf(stderr, "%s\n", utm);
-
-	double data[n];
-	while ( n == get_record(f, isbin, t, n, data) ) {
-		update_min_max(xmin, xmax, data[0]);
-		update_min_max(ymin, ymax, data[1]);
-	}
-	fclose(f);
+	// each value comes from a or c with a probability proportional to
+	// the number of points they represent
+	float t[k];
+	uint32_t m = na + nc;
+	int ia = 0, ic = 0;
+	for (int i = 0; i < k; i++)
+		if (ic == kc || (ia < ka && hash32(seed + i) % m < na))
+			t[i] = a[ia++];
+		else
+			t[i] = c[ic++];
+	for (int i = 0; i < k; i++)
+		a[i] = t[i];
 }
 
-// open a ply file, and accumulate its points to the image
-static void add_ply_points_to_images(struct images *x,
-		float xmin, float xmax, float ymin, float ymax,
-		int inf, int sup, float *newxmin, int w, int h,
-        char utm_zone[3], char *fname, int col_idx)
+static float value_median(const struct band *b, const float *a, float n,
+		double sum)
 {
-	FILE *f = fopen(fname, "r");
-	if (!f) {
-		fprintf(stderr, "WARNING: can not open file \"%s\"\n", fname);
-		return;
+	(void) sum;
+	int m = n < b->k ? n : b->k;
+	if (!m) return NAN;
+	float t[m];
+	for (int i = 0; i < m; i++) {
+		int j = i;
+		for (; j > 0 && t[j-1] > a[i]; j--)
+			t[j] = t[j-1];
+		t[j] = a[i];
 	}
+	return m % 2 ? t[m/2] : (t[m/2-1] + t[m/2]) / 2;
+}
 
-	// check that the utm zone is the same as the provided one
-	char utm[3];
-	int isbin=1;
-	struct ply_property t[100];
-	size_t n = header_get_record_length_and_utm_zone(f, utm, &isbin, t);
-	if (0 != strncmp(utm_zone, utm, 3))
-		fprintf(stderr, "error: different UTM zones among ply files\n");
+// idw: weighted mean of the points within the radius, the state is the
+// running mean and the sum of the weights
+static void add_idw(const struct band *b, float *a, float n, float v,
+		float wgt, uint32_t seed)
+{
+	(void) b; (void) n; (void) seed;
+	a[1] += wgt;
+	a[0] += wgt / a[1] * (v - a[0]);
+}
 
-	if (col_idx < 2 || col_idx > 5)
-		exit(fprintf(stderr, "error: bad col_idx %d\n", col_idx));
+static void merge_idw(const struct band *b, float *a, float na,
+		const float *c, float nc, uint32_t seed)
+{
+	(void) b; (void) na; (void) nc; (void) seed;
+	if (!c[1]) return;
+	a[1] += c[1];
+	a[0] += c[1] / a[1] * (c[0] - a[0]);
+}
 
+static float value_idw(const struct band *b, const float *a, float n,
+		double sum)
+{
+	(void) b; (void) n; (void) sum;
+	return a[1] ? a[0] : NAN;
+}
 
-	double data[n];
-	while ( n == get_record(f, isbin, t, n, data) ) {
-
-		int i = rescale_float_to_int(data[0], xmin, xmax, w);
-        int j = rescale_float_to_int(-data[1], -ymax, -ymin, h);
-        if (  (i>=inf) && (i<=sup) )
-            {
-               if (data[0] < *newxmin)
-                   *newxmin=data[0];
-            
-               if (col_idx == 2) {
-                add_height_to_images(x, i-inf, j, data[2]);
-                assert(isfinite(data[2]));
-                }
-               else
-                {
-                    unsigned int rgb = data[col_idx];
-                    add_height_to_images(x, i-inf, j, rgb);
-                }
-            }
+static const struct reducer reducers[] = {
+	{"mean", false, nvals_0, init_zero, add_none, merge_none, value_mean},
+	{"count", false, nvals_0, init_zero, add_none, merge_none, value_count},
+	{"min", false, nvals_1, init_min, add_min, merge_min, value_first},
+	{"max", false, nvals_1, init_max, add_max, merge_max, value_first},
+	{"std", false, nvals_2, init_zero, add_std, merge_std, value_std},
+	{"median", false, nvals_k, init_zero, add_median, merge_median,
+		value_median},
+	{"idw", true, nvals_2, init_zero, add_idw, merge_idw, value_idw},
+};
 
-	}
+// weight of a point at the distance sqrt(d2) of the center of a cell (idw)
+static float idw_weight(double d2)
+{
+	return 1 / (d2 > 0.25 ? d2 : 0.25);
+}
 
-	fclose(f);
+// the bands of the output map
+#define DSM_MAXBANDS 16
+struct dsm_bands {
+	struct band b[DSM_MAXBANDS];
+	int n;
+	int nvals;        // size of the state of a cell
+	float radius;     // largest splatting radius
+};
+
+// parse a list of reducers like "mean,median,count"
+static void parse_bands(struct dsm_bands *d, char *s, int k, float radius)
+{
+	d->n = d->nvals = 0;
+	d->radius = 0;
+	for (char *t = strtok(s, ","); t; t = strtok(NULL, ",")) {
+		const struct reducer *r = NULL;
+		for (size_t i = 0; i < sizeof reducers / sizeof*reducers; i++)
+			if (0 == strcmp(t, reducers[i].name))
+				r = reducers + i;
+		if (!r)
+			fail("unknown reducer \"%s\" (mean, count, min, max, std, "
+					"median, idw)\n", t);
+		if (d->n == DSM_MAXBANDS)
+			fail("too many bands\n");
+		struct band *b = d->b + d->n++;
+		b->r = r;
+		b->k = k;
+		b->radius = r->splat ? radius : 0;
+		b->offset = d->nvals;
+		b->nvals = r->nvals(b);
+		d->nvals += b->nvals;
+		if (b->radius > d->radius)
+			d->radius = b->radius;
+	}
+	if (!d->n)
+		fail("no reducer\n");
 }
 
 
-void help(char *s)
+
+// accumulators of a rectangle of the map: the number of points of each cell,
+// the sum of their heights and the states of the reducers
+struct images {
+	double *sum;
+	float *cnt;
+	float *acc;
+	struct dsm_bands *d;
+	int x0, y0, w, h;     // position and size in the map
+};
+
+static void images_alloc(struct images *x, struct dsm_bands *d)
 {
-	fprintf(stderr, "usage:\n\t"
-			"ls files | %s [-c column] [-bb \"xmin xmax ymin ymax\"] resolution n out_dir\n", s);
-	fprintf(stderr, "\t the resolution is in meters per pixel\n");
+	uint64_t n = (uint64_t) x->w * x->h;
+	x->d = d;
+	x->sum = xmalloc(n * sizeof*x->sum);
+	x->cnt = xmalloc(n * sizeof*x->cnt);
+	x->acc = d->nvals ? xmalloc(n * d->nvals * sizeof*x->acc) : NULL;
+	for (uint64_t i = 0; i < n; i++)
+	{
+		x->sum[i] = 0;
+		x->cnt[i] = 0;
+	}
+	for (int l = 0; l < d->n; l++)
+		if (d->b[l].nvals)
+			for (uint64_t i = 0; i < n; i++)
+				d->b[l].r->init(d->b + l,
+						x->acc + i * d->nvals + d->b[l].offset);
 }
 
-#include "pickopt.c"
+static void images_free(struct images *x)
+{
+	free(x->sum);
+	free(x->cnt);
+	free(x->acc);
+}
 
+// update the output images with a new height
+static void add_height_to_images(struct images *x, int i, int j, float v,
+		uint32_t seed)
+{
+	struct dsm_bands *d = x->d;
+	uint64_t k = (uint64_t) x->w * j + i;
+	for (int l = 0; l < d->n; l++)
+		if (d->b[l].nvals && !d->b[l].r->splat)
+			d->b[l].r->add(d->b + l, x->acc + k * d->nvals + d->b[l].offset,
+					x->cnt[k], v, 1, seed);
+	x->sum[k] += v;
+	x->cnt[k] += 1;
+}
 
-int * subdiv(int s, int e, int n)
+// splat a height at the position (u,t) (in pixels of x) to the cells whose
+// center is within the radius of the splatting reducers
+static void splat_height_to_images(struct images *x, double u, double t,
+		float v)
 {
- 
-    float coef=1/( (float) (n-1));
+	struct dsm_bands *d = x->d;
+	float r = d->radius;
+	int i0 = floor(u - r), i1 = floor(u + r);
+	int j0 = floor(t - r), j1 = floor(t + r);
+	if (i0 < 0) i0 = 0;
+	if (j0 < 0) j0 = 0;
+	if (i1 > x->w - 1) i1 = x->w - 1;
+	if (j1 > x->h - 1) j1 = x->h - 1;
+	for (int j = j0; j <= j1; j++)
+	for (int i = i0; i <= i1; i++)
+	{
+		double d2 = (i + 0.5 - u) * (i + 0.5 - u) + (j + 0.5 - t) * (j + 0.5 - t);
+		uint64_t k = (uint64_t) x->w * j + i;
+		for (int l = 0; l < d->n; l++)
+			if (d->b[l].r->splat && d2 <= d->b[l].radius * d->b[l].radius)
+				d->b[l].r->add(d->b + l, x->acc + k*d->nvals + d->b[l].offset,
+						x->cnt[k], v, idw_weight(d2), 0);
+	}
+}
 
-    int * res = malloc(n*sizeof(int));
-    
-    for(int i=0;i<n;i++)
-    {
-        res[i]=(int) (i*coef*e+s+0.5);
-    }
-        
-    return res;
+// add the accumulators of a to the ones of x, a is inside x
+static void images_merge(struct images *x, struct images *a,
+		struct dsm_grid *g)
+{
+	struct dsm_bands *d = x->d;
+	for (int j = 0; j < a->h; j++)
+	for (int i = 0; i < a->w; i++)
+	{
+		uint64_t k = (uint64_t) a->w * j + i;
+		uint64_t l = (uint64_t) x->w * (j + a->y0 - x->y0) + i + a->x0 - x->x0;
+		uint32_t seed = hash32((uint64_t) g->w * (j + a->y0) + i + a->x0);
+		for (int m = 0; m < d->n; m++)
+			if (d->b[m].nvals)
+				d->b[m].r->merge(d->b + m,
+						x->acc + l*d->nvals + d->b[m].offset, x->cnt[l],
+						a->acc + k*d->nvals + d->b[m].offset, a->cnt[k],
+						seed);
+		x->sum[l] += a->sum[k];
+		x->cnt[l] += a->cnt[k];
+	}
 }
 
-typedef struct  {
-	int inf, sup;
-} range;
+// rectangle of the map covered by the cloud (and the splatting radius),
+// inside the rectangle s
+static bool cloud_footprint(struct images *a, struct cloud *c,
+		struct dsm_grid *g, struct images *s, float radius)
+{
+	if (!c->ok || !(c->xmin <= c->xmax))
+		return false;
+	int r = ceil(radius);
+	int i0 = rescale_float_to_int(c->xmin, g->xmin, g->xmax, g->w) - r;
+	int i1 = rescale_float_to_int(c->xmax, g->xmin, g->xmax, g->w) + r;
+	int j0 = rescale_float_to_int(-c->ymax, -g->ymax, -g->ymin, g->h) - r;
+	int j1 = rescale_float_to_int(-c->ymin, -g->ymax, -g->ymin, g->h) + r;
+	if (i0 < s->x0) i0 = s->x0;
+	if (i1 > s->x0 + s->w - 1) i1 = s->x0 + s->w - 1;
+	if (j0 < s->y0) j0 = s->y0;
+	if (j1 > s->y0 + s->h - 1) j1 = s->y0 + s->h - 1;
+	if (i0 > i1 || j0 > j1)
+		return false;
+	a->x0 = i0;
+	a->y0 = j0;
+	a->w = i1 - i0 + 1;
+	a->h = j1 - j0 + 1;
+	return true;
+}
 
+// accumulate the points of the cloud that fall in the rectangle of x
+static void add_cloud_to_images(struct images *x, struct cloud *c,
+		struct dsm_grid *g)
+{
+	struct cloud_reader r;
+	if (!cloud_open(&r, c))
+		return;
+	double px[PLY_BLOCK], py[PLY_BLOCK], pv[PLY_BLOCK];
+	int n;
+	while ((n = cloud_read(&r, px, py, pv, PLY_BLOCK)) > 0)
+		for (int k = 0; k < n; k++) {
+			float v;
+			if (c->col_idx == 2) {
+				assert(isfinite(pv[k]));
+				v = pv[k];
+			} else {
+				unsigned int rgb = pv[k];
+				v = rgb;
+			}
+
+			double u = rescale_float(px[k], g->xmin, g->xmax, g->w);
+			double t = rescale_float(-py[k], -g->ymax, -g->ymin, g->h);
+			if (x->d->radius > 0)
+				splat_height_to_images(x, u - x->x0, t - x->y0, v);
+
+			int i = rescale_float_to_int(px[k], g->xmin, g->xmax, g->w);
+			int j = rescale_float_to_int(-py[k], -g->ymax, -g->ymin, g->h);
+			uint32_t seed = hash32((uint64_t) g->w * j + i);
+			i -= x->x0;
+			j -= x->y0;
+			if (i < 0 || i >= x->w || j < 0 || j >= x->h)
+				continue;
+			uint64_t l = (uint64_t) x->w * j + i;
+			add_height_to_images(x, i, j, v, hash32(seed + (uint32_t) x->cnt[l]));
+		}
+	cloud_close(&r);
+}
 
-range *computeRanges(int *subdiv,int n)
+// write the tiles of the strip x, its columns are aligned on the tiles
+static void write_strip_tiles(TIFF *tif, struct images *x)
 {
-    range * res = malloc(n*sizeof(range));
-    for(int i=0; i<n; i++)
-        {res[i].inf=0; res[i].sup=0;}
+	struct dsm_bands *d = x->d;
+	int nb = d->n;
+	float *t = xmalloc(DSM_TILE * DSM_TILE * nb * sizeof*t);
+	for (int ty = 0; ty < x->h; ty += DSM_TILE)
+	for (int tx = 0; tx < x->w; tx += DSM_TILE)
+	{
+		// set unknown values to NAN
+		for (int j = 0; j < DSM_TILE; j++)
+		for (int i = 0; i < DSM_TILE; i++)
+		for (int l = 0; l < nb; l++)
+		{
+			float z = NAN;
+			if (tx + i < x->w && ty + j < x->h) {
+				uint64_t k = (uint64_t) x->w * (ty + j) + tx + i;
+				z = d->b[l].r->value(d->b + l,
+						x->acc + k * d->nvals + d->b[l].offset,
+						x->cnt[k], x->sum[k]);
+			}
+			t[(j * DSM_TILE + i) * nb + l] = z;
+		}
+		ttile_t tile = TIFFComputeTile(tif, x->x0 + tx, x->y0 + ty, 0, 0);
+		if (TIFFWriteEncodedTile(tif, tile, t,
+					DSM_TILE * DSM_TILE * nb * sizeof*t) < 0)
+			fail("failed in TIFFWriteEncodedTile\n");
+	}
+	free(t);
+}
+
 
-    res[0].inf=subdiv[0]; res[0].sup=subdiv[1];
-    for(int i=1; i<n; i++)
-    {
-       res[i].inf=res[i-1].sup+1;
-       res[i].sup=subdiv[i+1];
-    }
-    
-    return res;
+void help(char *s)
+{
+	fprintf(stderr, "usage:\n\t"
+			"ls files | %s [-c column] [-bb \"xmin xmax ymin ymax\"] resolution n out_dir\n", s);
+	fprintf(stderr, "\t the resolution is in meters per pixel\n");
+	fprintf(stderr, "\t the map is computed by n vertical strips, and "
+			"saved in out_dir/dsm.tif\n");
+	fprintf(stderr, "\t -m \"r1,r2,...\": one band per reducer, among mean "
+			"(default), count, min, max, std, median, idw\n");
+	fprintf(stderr, "\t -k K: median of a sample of at most K points per "
+			"cell (default 15)\n");
+	fprintf(stderr, "\t -r R: radius of idw, in pixels (default 2)\n");
 }
 
+#include "pickopt.c"
+
 
 int main(int c, char *v[])
 {
 	int col_idx = atoi(pick_option(&c, &v, "c", "2"));
 	char *bbminmax = pick_option(&c, &v, "bb", "");
+	char *modes = pick_option(&c, &v, "m", "mean");
+	int reservoir = atoi(pick_option(&c, &v, "k", "15"));
+	float radius = atof(pick_option(&c, &v, "r", "2"));
 
 	// process input arguments
 	if (c != 4) {
@@ -322,80 +925,107 @@ int main(int c, char *v[])
 	float resolution = atof(v[1]);
 	int n = atof(v[2]);
 	char *out_dir = v[3];
+	if (col_idx < 2 || col_idx > 5)
+		exit(fprintf(stderr, "error: bad col_idx %d\n", col_idx));
+	if (n < 1) n = 1;
+	if (reservoir < 1) reservoir = 1;
+	struct dsm_bands bands;
+	parse_bands(&bands, modes, reservoir, radius);
 
-	// initialize x, y extrema values
-	float xmin = INFINITY;
-	float xmax = -INFINITY;
-	float ymin = INFINITY;
-	float ymax = -INFINITY;
-
-	// process each filename from stdin to determine x, y extremas and store the
-	// filenames in a list of strings, to be able to open the files again
-	char fname[FILENAME_MAX], utm[3];
-	struct list *l = NULL;
+	// read the filenames from stdin
+	char fname[FILENAME_MAX];
+	struct cloud *clouds = NULL;
+	int nclouds = 0;
 	while (fgets(fname, FILENAME_MAX, stdin))
 	{
 		strtok(fname, "\n");
-		l = push(l, fname);
-		parse_ply_points_for_extrema(&xmin, &xmax, &ymin, &ymax, utm, fname);
+		clouds = xrealloc(clouds, (nclouds + 1) * sizeof*clouds);
+		clouds[nclouds++].fname = strcpy(xmalloc(strlen(fname) + 1), fname);
+	}
+
+	// determine the bounding box of each cloud, from its header if possible
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < nclouds; i++)
+		if (cloud_init(clouds + i, col_idx) && !clouds[i].hasbb)
+			cloud_bounding_box(clouds + i);
+
+	// x, y extrema values and utm zone (the one of the first cloud)
+	struct dsm_grid g = {INFINITY, -INFINITY, INFINITY, -INFINITY, 0, 0};
+	char utm[0x100] = "";
+	for (int i = 0; i < nclouds; i++) {
+		struct cloud *p = clouds + i;
+		if (!p->ok)
+			continue;
+		if (!*utm)
+			strcpy(utm, p->utm);
+		else if (0 != strncmp(utm, p->utm, 3))
+			fprintf(stderr, "error: different UTM zones among ply files\n");
+		if (p->xmin <= p->xmax) {
+			update_min_max(&g.xmin, &g.xmax, p->xmin);
+			update_min_max(&g.xmin, &g.xmax, p->xmax);
+			update_min_max(&g.ymin, &g.ymax, p->ymin);
+			update_min_max(&g.ymin, &g.ymax, p->ymax);
+		}
 	}
 	if (0 != strcmp(bbminmax, "") ) {
-		sscanf(bbminmax, "%f %f %f %f", &xmin, &xmax, &ymin, &ymax);
+		sscanf(bbminmax, "%f %f %f %f", &g.xmin, &g.xmax, &g.ymin, &g.ymax);
 	}
-	fprintf(stderr, "xmin: %20f, xmax: %20f, ymin: %20f, ymax: %20f\n", xmin, xmax, ymin, ymax);
+	fprintf(stderr, "xmin: %20f, xmax: %20f, ymin: %20f, ymax: %20f\n",
+			g.xmin, g.xmax, g.ymin, g.ymax);
+	if (!(g.xmin <= g.xmax && g.ymin <= g.ymax))
+		fail("no points in the ply files\n");
 
 	// compute output image dimensions
-	int w = 1 + (xmax - xmin) / resolution;
-	int h = 1 + (ymax - ymin) / resolution;
-    
-    int *res_subdiv=subdiv(0, w-1, n+1);
-    range *res_ranges=computeRanges(res_subdiv,n);
-    
-    struct list *begin=l;
-    for(int k=0;k<n;k++)
-    {
-        // allocate and initialize output images
-        struct images x;
-        x.w = res_ranges[k].sup-res_ranges[k].inf+1;
-        x.h = h;
-        x.cnt = malloc(x.w*x.h*sizeof(float));
-        x.avg = malloc(x.w*x.h*sizeof(float));
-        for (uint64_t i = 0; i < (uint64_t) x.w*x.h; i++)
-        {
-            x.cnt[i] = 0;
-            x.avg[i] = 0;
-        }
-        
-        float newxmin=INFINITY;
-        char looputm[3];
-        strcpy(looputm,utm);
-        
-        // process each filename to accumulate points in the dem
-        l=begin;
-        while (l != NULL)
-        {
-            // printf("FILENAME: \"%s\"\n", l->current);
-            add_ply_points_to_images(&x, xmin, xmax, ymin, ymax, res_ranges[k].inf, res_ranges[k].sup, &newxmin, w, h, looputm, l->current, col_idx);
-            l = l->next;
-        }
-
-
-        // set unknown values to NAN
-        for (uint64_t i = 0; i < (uint64_t) x.w*x.h; i++)
-            if (!x.cnt[i])
-                x.avg[i] = NAN;
-
-        // save output image
-        char out[100];
-        sprintf(out, "%s/dsm_%d.tif",out_dir, k);
-        iio_save_image_float(out, x.avg, x.w, x.h);
-        set_geotif_header(out, looputm, newxmin, ymax, resolution);
-
-        // cleanup and exit
-        free(x.cnt);
-        free(x.avg);
-    }
-    free(res_subdiv);
-    free(res_ranges);
+	g.w = 1 + (g.xmax - g.xmin) / resolution;
+	g.h = 1 + (g.ymax - g.ymin) / resolution;
+
+	char out[FILENAME_MAX];
+	snprintf(out, FILENAME_MAX, "%s/dsm.tif", out_dir);
+	TIFF *tif = create_geotiff(out, g.w, g.h, bands.n, utm, g.xmin, g.ymax,
+			resolution);
+
+	// the strips are made of whole columns of tiles
+	int ntiles = (g.w + DSM_TILE - 1) / DSM_TILE;
+	for (int k = 0; k < n; k++)
+	{
+		int t0 = (int64_t) ntiles * k / n;
+		int t1 = (int64_t) ntiles * (k + 1) / n;
+		if (t0 == t1)
+			continue;
+
+		// allocate and initialize the strip
+		struct images x;
+		x.x0 = t0 * DSM_TILE;
+		x.y0 = 0;
+		x.w = (t1 * DSM_TILE < g.w ? t1 * DSM_TILE : g.w) - x.x0;
+		x.h = g.h;
+		images_alloc(&x, &bands);
+
+		// accumulate the clouds that intersect the strip, each one in the
+		// images of its footprint, and merge them in the order of the clouds
+#pragma omp parallel for ordered schedule(dynamic)
+		for (int i = 0; i < nclouds; i++)
+		{
+			struct images a;
+			bool in = cloud_footprint(&a, clouds + i, &g, &x, bands.radius);
+			if (in) {
+				images_alloc(&a, &bands);
+				add_cloud_to_images(&a, clouds + i, &g);
+			}
+#pragma omp ordered
+			if (in) {
+				images_merge(&x, &a, &g);
+				images_free(&a);
+			}
+		}
+
+		write_strip_tiles(tif, &x);
+		images_free(&x);
+	}
+	XTIFFClose(tif);
+
+	for (int i = 0; i < nclouds; i++)
+		free(clouds[i].fname);
+	free(clouds);
 	return 0;
 }
@@ -1,11 +1,18 @@
 // rational polynomial coefficient stuff
 
+#define _XOPEN_SOURCE 700 // realpath
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <float.h>
+#include <time.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "xfopen.c"
 
@@ -38,237 +45,329 @@ static void nan_rpc(struct rpc *p)
 		t[i] = NAN;
 }
 
-// set all the values of an array of doubles to NAN
-static void nan_array(double *x, int n)
+// fields of the rpc set by the tags of the rpc files
+enum rpc_field {
+	RPC_OFFSET, RPC_SCALE, RPC_IOFFSET, RPC_ISCALE, RPC_DMVAL, RPC_IMVAL,
+	// coefficients, of the direct or of the inverse model
+	RPC_NUMX, RPC_DENX, RPC_NUMY, RPC_DENY
+};
+
+struct rpc_tag {
+	const char *name;
+	int field, idx;
+};
+
+// hash of a tag name, it is perfect on the table of tags (the multiplier
+// 853 was searched for that), so a lookup is one hash and one comparison
+#define RPC_TAG_HASH_SIZE 128
+static unsigned rpc_tag_hash(const char *s, int n)
 {
+	uint32_t x = 0;
 	for (int i = 0; i < n; i++)
-		x[i] = NAN;
+		x = x * 853 + (unsigned char) s[i];
+	return (x >> 8) % RPC_TAG_HASH_SIZE;
 }
 
-// like strcmp, but finds a needle
-static int strhas(char *haystack, char *needle)
+// the names of the coefficients are followed by "_%d" (one coefficient),
+// or their value is a list of the 20 coefficients (worldview)
+static const struct rpc_tag rpc_tags[RPC_TAG_HASH_SIZE] = {
+	// pleiades and ikonos tags
+	[46]  = {"SAMP_OFF",       RPC_OFFSET,  0},
+	[22]  = {"SAMP_SCALE",     RPC_SCALE,   0},
+	[28]  = {"LINE_OFF",       RPC_OFFSET,  1},
+	[104] = {"LINE_SCALE",     RPC_SCALE,   1},
+	[75]  = {"HEIGHT_OFF",     RPC_OFFSET,  2},
+	[56]  = {"HEIGHT_SCALE",   RPC_SCALE,   2},
+	[102] = {"LONG_OFF",       RPC_IOFFSET, 0},
+	[73]  = {"LONG_SCALE",     RPC_ISCALE,  0},
+	[30]  = {"LAT_OFF",        RPC_IOFFSET, 1},
+	[11]  = {"LAT_SCALE",      RPC_ISCALE,  1},
+	[24]  = {"SAMP_NUM_COEFF", RPC_NUMX,    0},
+	[100] = {"SAMP_DEN_COEFF", RPC_DENX,    0},
+	[31]  = {"LINE_NUM_COEFF", RPC_NUMY,    0},
+	[106] = {"LINE_DEN_COEFF", RPC_DENY,    0},
+	[2]   = {"FIRST_ROW",      RPC_DMVAL,   1},
+	[121] = {"FIRST_COL",      RPC_DMVAL,   0},
+	[12]  = {"LAST_ROW",       RPC_DMVAL,   3},
+	[3]   = {"LAST_COL",       RPC_DMVAL,   2},
+	[101] = {"FIRST_LON",      RPC_IMVAL,   0},
+	[54]  = {"FIRST_LAT",      RPC_IMVAL,   1},
+	[111] = {"LAST_LON",       RPC_IMVAL,   2},
+	[65]  = {"LAST_LAT",       RPC_IMVAL,   3},
+	// worldview tags
+	[113] = {"SAMPOFFSET",     RPC_OFFSET,  0},
+	[108] = {"SAMPSCALE",      RPC_SCALE,   0},
+	[67]  = {"LINEOFFSET",     RPC_OFFSET,  1},
+	[116] = {"LINESCALE",      RPC_SCALE,   1},
+	[19]  = {"HEIGHTOFFSET",   RPC_OFFSET,  2},
+	[95]  = {"HEIGHTSCALE",    RPC_SCALE,   2},
+	[36]  = {"LONGOFFSET",     RPC_IOFFSET, 0},
+	[1]   = {"LONGSCALE",      RPC_ISCALE,  0},
+	[103] = {"LATOFFSET",      RPC_IOFFSET, 1},
+	[20]  = {"LATSCALE",       RPC_ISCALE,  1},
+	[33]  = {"SAMPNUMCOEF",    RPC_NUMX,    0},
+	[88]  = {"SAMPDENCOEF",    RPC_DENX,    0},
+	[35]  = {"LINENUMCOEF",    RPC_NUMY,    0},
+	[89]  = {"LINEDENCOEF",    RPC_DENY,    0},
+};
+
+// find the tag of name s (of length n), if it is of the form "%s_%d" the
+// number minus one, bounded on [0,19], is stored in *idx (-1 otherwise)
+static const struct rpc_tag *rpc_tag_lookup(const char *s, int n, int *idx)
 {
-	char *r = strstr(haystack, needle);
-	return r ? 0 : 1;
+	int m = n;
+	while (m > 0 && s[m-1] >= '0' && s[m-1] <= '9')
+		m--;
+	*idx = -1;
+	if (m < n && m > 1 && s[m-1] == '_') {
+		int r = atoi(s + m) - 1;
+		*idx = r < 0 ? 0 : r > 19 ? 19 : r;
+		n = m - 1;
+	}
+	const struct rpc_tag *t = rpc_tags + rpc_tag_hash(s, n);
+	if (t->name && (int) strlen(t->name) == n && !memcmp(t->name, s, n))
+		return t;
+	return NULL;
 }
 
-// returns the first character not in the prefix, or NULL if no prefix
-static char *prefix(char *s, char *p)
+// store the value x of the tag t (with the coefficient index i) in the rpc,
+// the coefficients are those of the direct model if direct is true
+static void rpc_set_tag(struct rpc *p, const struct rpc_tag *t, int i,
+		bool direct, double x)
 {
-	int i = 0;
-	while (s[i] && p[i] && s[i] == p[i])
-		i++;
-	if (!s[i] || p[i])
-		return NULL;
-	else
-		return s + i;
+	bool coeff = t->field >= RPC_NUMX;
+	if (coeff != (i >= 0))
+		return;
+	double *f = NULL;
+	switch (t->field) {
+	case RPC_OFFSET:  f = p->offset;  break;
+	case RPC_SCALE:   f = p->scale;   break;
+	case RPC_IOFFSET: f = p->ioffset; break;
+	case RPC_ISCALE:  f = p->iscale;  break;
+	case RPC_DMVAL:   f = p->dmval;   break;
+	case RPC_IMVAL:   f = p->imval;   break;
+	case RPC_NUMX:    f = direct ? p->numx : p->inumx; break;
+	case RPC_DENX:    f = direct ? p->denx : p->idenx; break;
+	case RPC_NUMY:    f = direct ? p->numy : p->inumy; break;
+	case RPC_DENY:    f = direct ? p->deny : p->ideny; break;
+	}
+	f[coeff ? i : t->idx] = x;
 }
 
-// if  s is the form "%s_%d"%(s,p), return %d bounded on [0,19]
-static int pix(char *s, char *p)
+// parse the tags "<TAG>x</TAG>" and "<TAG>x1 ... x20</TAG>" of an xml file
+// (pleiades and worldview format). The coefficients of pleiades files
+// before the tag <Inverse_Model> are those of the direct model.
+static void rpc_parse_xml(struct rpc *p, char *s, bool pleiades)
 {
-	char *idx = prefix(s, p);
-	if (!idx) return -1;
-	int r = atoi(idx) - 1;
-	if (r < 0) r = 0;
-	if (r > 19) r = 19;
-	return r;
+	bool direct = pleiades;
+	while ((s = strchr(s, '<')))
+	{
+		char *name = ++s;
+		while (*s && *s != '>' && *s != '<')
+			s++;
+		if (*s != '>')
+			continue;
+		int n = s++ - name, idx;
+		if (n == 13 && !memcmp(name, "Inverse_Model", 13))
+			direct = false;
+		const struct rpc_tag *t = rpc_tag_lookup(name, n, &idx);
+		if (!t)
+			continue;
+
+		double x[20];
+		int k = 0;
+		for (char *e; k < 20; k++, s = e)
+		{
+			x[k] = strtod(s, &e);
+			if (e == s) break;
+		}
+		while (isspace(*s))
+			s++;
+		if (s[0] != '<' || s[1] != '/')
+			continue;
+		if (k == 1 && isfinite(x[0]))
+			rpc_set_tag(p, t, idx, direct, x[0]);
+		if (k == 20 && idx < 0)
+			for (int i = 0; i < 20; i++)
+				rpc_set_tag(p, t, i, direct, x[i]);
+	}
 }
 
-// add a value to the rpc
-static void add_tag_to_rpc(struct rpc *p, char *tag, double x)
+// parse the lines "TAG: x" of a text file (ikonos format),
+// the coefficients are those of the inverse model
+static void rpc_parse_ikonos(struct rpc *p, char *s)
 {
-	int t;
-	if (false);
-    // pleiades tags
-	else if (0 == strhas(tag, "SAMP_OFF"))          p->offset [0] = x;
-	else if (0 == strhas(tag, "SAMP_SCALE"))        p->scale  [0] = x;
-	else if (0 == strhas(tag, "LINE_OFF"))          p->offset [1] = x;
-	else if (0 == strhas(tag, "LINE_SCALE"))        p->scale  [1] = x;
-	else if (0 == strhas(tag, "HEIGHT_OFF"))        p->offset [2] = x;
-	else if (0 == strhas(tag, "HEIGHT_SCALE"))      p->scale  [2] = x;
-	else if (0 == strhas(tag, "LONG_OFF"))          p->ioffset[0] = x;
-	else if (0 == strhas(tag, "LONG_SCALE"))        p->iscale [0] = x;
-	else if (0 == strhas(tag, "LAT_OFF"))           p->ioffset[1] = x;
-	else if (0 == strhas(tag, "LAT_SCALE"))         p->iscale [1] = x;
-	else if (0 == strhas(tag, "HEIGHT_OFF"))        p->ioffset[2] = x;
-	else if (0 == strhas(tag, "HEIGHT_SCALE"))      p->iscale [2] = x;
-	else if (0 <= (t=pix(tag, "SAMP_NUM_COEFF_")))  p->numx   [t] = x;
-	else if (0 <= (t=pix(tag, "SAMP_DEN_COEFF_")))  p->denx   [t] = x;
-	else if (0 <= (t=pix(tag, "LINE_NUM_COEFF_")))  p->numy   [t] = x;
-	else if (0 <= (t=pix(tag, "LINE_DEN_COEFF_")))  p->deny   [t] = x;
-	else if (0 <= (t=pix(tag, "iSAMP_NUM_COEFF_"))) p->inumx  [t] = x;
-	else if (0 <= (t=pix(tag, "iSAMP_DEN_COEFF_"))) p->idenx  [t] = x;
-	else if (0 <= (t=pix(tag, "iLINE_NUM_COEFF_"))) p->inumy  [t] = x;
-	else if (0 <= (t=pix(tag, "iLINE_DEN_COEFF_"))) p->ideny  [t] = x;
-	else if (0 == strhas(tag, "FIRST_ROW"))         p->dmval  [1] = x;
-	else if (0 == strhas(tag, "FIRST_COL"))         p->dmval  [0] = x;
-	else if (0 == strhas(tag, "LAST_ROW"))          p->dmval  [3] = x;
-	else if (0 == strhas(tag, "LAST_COL"))          p->dmval  [2] = x;
-	else if (0 == strhas(tag, "FIRST_LON"))         p->imval  [0] = x;
-	else if (0 == strhas(tag, "FIRST_LAT"))         p->imval  [1] = x;
-	else if (0 == strhas(tag, "LAST_LON"))          p->imval  [2] = x;
-	else if (0 == strhas(tag, "LAST_LAT"))          p->imval  [3] = x;
-	// worldview tags
-	else if (0 == strhas(tag, "SAMPOFFSET"))        p->offset [0] = x;
-	else if (0 == strhas(tag, "SAMPSCALE"))         p->scale  [0] = x;
-	else if (0 == strhas(tag, "LINEOFFSET"))        p->offset [1] = x;
-	else if (0 == strhas(tag, "LINESCALE"))         p->scale  [1] = x;
-	else if (0 == strhas(tag, "HEIGHTOFFSET"))      p->offset [2] = x;
-	else if (0 == strhas(tag, "HEIGHTSCALE"))       p->scale  [2] = x;
-	else if (0 == strhas(tag, "LONGOFFSET"))        p->ioffset[0] = x;
-	else if (0 == strhas(tag, "LONGSCALE"))         p->iscale [0] = x;
-	else if (0 == strhas(tag, "LATOFFSET"))         p->ioffset[1] = x;
-	else if (0 == strhas(tag, "LATSCALE"))          p->iscale [1] = x;
-	else if (0 <= (t=pix(tag, "SAMPNUMCOEF_")))     p->inumx  [t] = x;
-	else if (0 <= (t=pix(tag, "SAMPDENCOEF_")))     p->idenx  [t] = x;
-	else if (0 <= (t=pix(tag, "LINENUMCOEF_")))     p->inumy  [t] = x;
-	else if (0 <= (t=pix(tag, "LINEDENCOEF_")))     p->ideny  [t] = x;
-}
-
-// process an input line
-static double get_tagged_number(char *tag, char *line)
-{
-	char buf[0x100];
-	double x;
-	int r = sscanf(line, "%[^:]: %lf", buf, &x);
-	strcpy(tag, buf);
-	if (r == 2) {
-		return x;
-	} else return NAN;
-}
-
-// process an input line (pleiades and worldview format)
-static double get_xml_tagged_number(char *tag, char *line)
-{
-	char buf[0x100], buf2[0x100];
-	double x;
-	int r = sscanf(line, " <%[^>]>%lf</%[^>]>", buf, &x, buf2);
-	strcpy(tag, buf);
-	if (r == 3) {
-		return x;
-	} else return NAN;
-}
-
-// process an input line (worldview rpc coefficients format)
-static int get_xml_tagged_list(double *x, char *tag, char *line)
-{
-	char buf[0x100], buf2[0x100];
-	nan_array(x, 20);
-	// read 20 float values with sscanf
-	int r = sscanf(line, " <%[^>]>%lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf"
-			"%lf %lf %lf %lf %lf %lf %lf %lf %lf</%[^>]>", buf, x, x+1, x+2,
-			x+3, x+4, x+5, x+6, x+7, x+8, x+9, x+10, x+11, x+12, x+13, x+14,
-			x+15, x+16, x+17, x+18, x+19, buf2);
-	strcpy(tag, buf);
-	return r;
+	while (*s)
+	{
+		char *eol = strchr(s, '\n');
+		if (!eol) eol = s + strlen(s);
+		char *c = memchr(s, ':', eol - s);
+		int idx;
+		const struct rpc_tag *t = c ? rpc_tag_lookup(s, c - s, &idx) : NULL;
+		if (t) {
+			char *e;
+			double x = strtod(c + 1, &e);
+			if (e != c + 1 && isfinite(x))
+				rpc_set_tag(p, t, idx, false, x);
+		}
+		s = *eol ? eol + 1 : eol;
+	}
 }
 
-void read_rpc_file_ikonos(struct rpc *p, char *filename)
+enum rpc_format { RPC_UNKNOWN, RPC_IKONOS, RPC_WORLDVIEW, RPC_PLEIADES };
+
+// the format is given by the first line that identifies it
+static int rpc_file_format(char *s)
 {
-	FILE *f = xfopen(filename, "r");
-	int n = 0x100;
-	while (1) {
-		char line[n], tag[n], *sl = fgets(line, n, f);;
-		if (!sl) break;
-        tag[0] = 'i';
-		double x = get_tagged_number(tag+1, line);
-		if (isfinite(x)) {
-			//fprintf(stderr, "%s [%d]: %g\n", tag+o, o, x);
-			add_tag_to_rpc(p, tag, x);
-		}
+	int r = RPC_UNKNOWN;
+	while (*s && r == RPC_UNKNOWN)
+	{
+		char *eol = strchr(s, '\n');
+		if (!eol) eol = s + strlen(s);
+		char tmp = *eol;
+		*eol = '\0';
+		if (strstr(s, "LINE_OFF:"))
+			r = RPC_IKONOS;
+		else if (strstr(s, "<SATID>") && strstr(s, "WV0"))
+			r = RPC_WORLDVIEW;
+		else if (strstr(s, "<METADATA_PROFILE>") && (strstr(s, "PHR_SENSOR")
+					|| strstr(s, "S6_SENSOR")))
+			r = RPC_PLEIADES;
+		*eol = tmp;
+		s = tmp ? eol + 1 : eol;
 	}
-	xfclose(f);
-	p->ioffset[2] = p->offset[2];
-	p->iscale[2] = p->scale[2];
+	return r;
 }
 
-void read_rpc_file_xml_pleiades(struct rpc *p, char *filename)
+// read a whole file (or stdin) into a null-terminated string
+static char *rpc_slurp(char *filename)
 {
 	FILE *f = xfopen(filename, "r");
-	int n = 0x100, o = 1;
+	size_t n = 0, cap = 0x4000;
+	char *s = malloc(cap);
 	while (1) {
-		char line[n], tag[n], *sl = fgets(line, n, f);;
-		if (!sl) break;
-		if (o && 0 == strhas(line, "<Inverse_Model>")) o = 0;
-		tag[0] = 'i';
-		double x = get_xml_tagged_number(tag+1, line);
-		if (isfinite(x)) {
-			//fprintf(stderr, "%s [%d]: %g\n", tag+o, o, x);
-			add_tag_to_rpc(p, tag+o, x);
-		}
+		n += fread(s + n, 1, cap - n - 1, f);
+		if (n < cap - 1) break;
+		s = realloc(s, cap *= 2);
 	}
+	s[n] = '\0';
 	xfclose(f);
+	return s;
+}
 
-    // pleiades rpcs use the convention that the top-left pixel is (1, 1) our
-    // convention is that the top left pixel is (0, 0). Thus here the line and
-    // columns offsets are decreased by one.
-    p->offset[0] -= 1;
-    p->offset[1] -= 1;
-	p->ioffset[2] = p->offset[2];
-	p->iscale[2] = p->scale[2];
+// FNV-1a hash
+static uint64_t rpc_fnv(const void *x, size_t n, uint64_t h)
+{
+	const unsigned char *c = x;
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ c[i]) * 0x100000001b3;
+	return h;
 }
+#define RPC_FNV_SEED 0xcbf29ce484222325
+
+// Binary cache of the parsed files, enabled by setting the environment
+// variable RPC_CACHE to a directory.  The entry of a file is named after
+// the hash of its canonical path (realpath) and holds the modification time,
+// the size and the checksum of the bytes of the file, that must match those
+// of the file being read, and the checksum of the parsed rpc.
+// The entries are written to a temporary file and renamed, so that
+// concurrent processes never read a partial entry.
+struct rpc_cache_header {
+	char magic[8];
+	uint64_t path;       // hash of the canonical path of the file
+	int64_t mtime, size; // of the file
+	uint64_t xml;        // checksum of the contents of the file
+	uint64_t checksum;   // of the rpc
+};
 
-void read_rpc_file_xml_worldview(struct rpc *p, char *filename)
+// fill the name of the entry of the file and the fields of its header that
+// depend on the file (s holds the contents of the file)
+static bool rpc_cache_entry(char *out, struct rpc_cache_header *c,
+		char *filename, char *s)
 {
-	FILE *f = xfopen(filename, "r");
-	int n = 0x400;
-	while (1) {
-		char line[n], tag[n], *sl = fgets(line, n, f);
-		if (!sl) break;
-		double x = get_xml_tagged_number(tag, line);
-		if (isfinite(x)) {
-			add_tag_to_rpc(p, tag, x);
-			continue;
-		}
-		if (0 == strhas(tag, "COEF")) {
-			double y[20];
-			int r = get_xml_tagged_list(y, tag, line);
-			if (r == 22)
-				for (int i = 0; i < 20; i++) {
-					char tmp[4]; sprintf(tmp, "_%d", i+1);
-					char tag_i[16]; strcpy(tag_i, tag);
-					add_tag_to_rpc(p, strcat(tag_i, tmp), y[i]);
-				}
-		}
+	char *dir = getenv("RPC_CACHE");
+	if (!dir || !*dir || 0 == strcmp(filename, "-"))
+		return false;
+	char *path = realpath(filename, NULL);
+	struct stat st;
+	if (!path || stat(path, &st)) {
+		free(path);
+		return false;
 	}
-	xfclose(f);
-	p->ioffset[2] = p->offset[2];
-	p->iscale[2] = p->scale[2];
+	memcpy(c->magic, "RPCB0002", 8);
+	c->path = rpc_fnv(path, strlen(path), RPC_FNV_SEED);
+	c->mtime = st.st_mtime;
+	c->size = st.st_size;
+	c->xml = rpc_fnv(s, strlen(s), RPC_FNV_SEED);
+	free(path);
+	snprintf(out, FILENAME_MAX, "%s/%016llx.rpcb", dir,
+			(unsigned long long) c->path);
+	return true;
 }
 
+static bool rpc_cache_load(struct rpc *p, char *filename, char *s)
+{
+	char name[FILENAME_MAX];
+	struct rpc_cache_header c, e;
+	if (!rpc_cache_entry(name, &e, filename, s))
+		return false;
+	FILE *f = fopen(name, "r");
+	if (!f)
+		return false;
+	bool r = 1 == fread(&c, sizeof c, 1, f) && 1 == fread(p, sizeof*p, 1, f)
+		&& !memcmp(c.magic, e.magic, 8) && c.path == e.path
+		&& c.mtime == e.mtime && c.size == e.size && c.xml == e.xml
+		&& c.checksum == rpc_fnv(p, sizeof*p, RPC_FNV_SEED);
+	fclose(f);
+	return r;
+}
+
+static void rpc_cache_save(struct rpc *p, char *filename, char *s)
+{
+	char name[FILENAME_MAX], tmp[FILENAME_MAX + 32];
+	struct rpc_cache_header c;
+	if (!rpc_cache_entry(name, &c, filename, s))
+		return;
+	c.checksum = rpc_fnv(p, sizeof*p, RPC_FNV_SEED);
+	mkdir(getenv("RPC_CACHE"), 0777);
+	snprintf(tmp, sizeof tmp, "%s.%ld.tmp", name, (long) getpid());
+	FILE *f = fopen(tmp, "w");
+	if (!f)
+		return;
+	bool ok = 1 == fwrite(&c, sizeof c, 1, f) && 1 == fwrite(p, sizeof*p, 1, f);
+	if (fclose(f) || !ok || rename(tmp, name))
+		remove(tmp);
+}
 
 // read a file specifying an RPC model
 void read_rpc_file_xml(struct rpc *p, char *filename)
 {
+	char *s = rpc_slurp(filename);
+	if (rpc_cache_load(p, filename, s)) {
+		free(s);
+		return;
+	}
+
 	nan_rpc(p);
-	FILE *f = xfopen(filename, "r");
-	int n = 0x100, found = 0;
-	while (!found) {
-		char line[n], *sl = fgets(line, n, f);;
-		if (!sl) break;
-        if (0 == strhas(line, "LINE_OFF:")) {
-            found = 1; char tag[n];
-		    double x = get_tagged_number(tag, line);
-			if (isfinite(x)) add_tag_to_rpc(p, tag, x);
-            read_rpc_file_ikonos(p, filename);
-        }
-		if (0 == strhas(line, "<SATID>") && 0 == strhas(line, "WV0")) {
-			found = 1;
-			read_rpc_file_xml_worldview(p, filename);
-		}
-		if (0 == strhas(line, "<METADATA_PROFILE>") && 0 == strhas(line,
-					"PHR_SENSOR")) {
-			found = 1;
-			read_rpc_file_xml_pleiades(p, filename);
-		}
-		if (0 == strhas(line, "<METADATA_PROFILE>") && 0 == strhas(line,
-					"S6_SENSOR")) {
-			found = 1;
-			read_rpc_file_xml_pleiades(p, filename);
-		}
+	int format = rpc_file_format(s);
+	if (format == RPC_IKONOS)
+		rpc_parse_ikonos(p, s);
+	if (format == RPC_WORLDVIEW || format == RPC_PLEIADES)
+		rpc_parse_xml(p, s, format == RPC_PLEIADES);
+
+	if (format == RPC_PLEIADES) {
+		// pleiades rpcs use the convention that the top-left pixel is (1, 1)
+		// our convention is that the top left pixel is (0, 0). Thus here the
+		// line and columns offsets are decreased by one.
+		p->offset[0] -= 1;
+		p->offset[1] -= 1;
 	}
-	xfclose(f);
+	if (format != RPC_UNKNOWN) {
+		p->ioffset[2] = p->offset[2];
+		p->iscale[2] = p->scale[2];
+		rpc_cache_save(p, filename, s);
+	}
+	free(s);
 }
 
 #define FORI(n) for (int i = 0; i < (n); i++)
@@ -325,7 +424,7 @@ double eval_pol20_dx(double c[20], double x, double y, double z)
 
 double eval_pol20_dy(double c[20], double x, double y, double z)
 {
-	double m[20] = {0, 0, y, 0, x,
+	double m[20] = {0, 0, 1, 0, x,
 		0, z, 0, 2*y, 0,
 		x*z, 0, x*2*y, 0, x*x,
 		3*y*y, z*z, 0, 2*y*z, 0};
@@ -337,7 +436,7 @@ double eval_pol20_dy(double c[20], double x, double y, double z)
 
 double eval_pol20_dz(double c[20], double x, double y, double z)
 {
-	double m[20] = {0, 0, 0, z, 0,
+	double m[20] = {0, 0, 0, 1, 0,
 		x, y, 0, 0, 2*z,
 		x*y, 0, 0, x*2*z, 0,
 		0, y*2*z, x*x, y*y, 3*z*z};
@@ -423,7 +522,7 @@ static void eval_nrpc_iterative(double *result,
 static void eval_nrpc(double *result,
 		struct rpc *p, double x, double y, double z)
 {
-	if isfinite(p->numx[0]) {
+	if (isfinite(p->numx[0])) {
 		double numx = eval_pol20(p->numx, x, y, z);
 		double denx = eval_pol20(p->denx, x, y, z);
 		double numy = eval_pol20(p->numy, x, y, z);
@@ -471,6 +570,295 @@ void eval_rpc_pair(double xprime[2],
 }
 
 
+// number of points evaluated together by the batch functions
+#define RPC_BLOCK 64
+
+// evaluate four polynomials of degree 3 on n <= RPC_BLOCK points given as
+// arrays (normalized coordinates). The monomials of the points are computed
+// once and shared by the four polynomials. The innermost loops run over the
+// points, so they are vectorized by the compiler (e.g. 4 points per
+// instruction with -mavx2). The operations are those of eval_pol20 in the
+// same order, so the results are the same.
+static void eval_pol20_four(double *restrict r0, double *restrict r1,
+		double *restrict r2, double *restrict r3,
+		double c0[20], double c1[20], double c2[20], double c3[20],
+		const double *restrict x, const double *restrict y,
+		const double *restrict z, int n)
+{
+	double m[20][RPC_BLOCK];
+	for (int i = 0; i < n; i++)
+	{
+		// XXX WARNING: inversion here! (see eval_pol20)
+		double col = y[i];
+		double lig = x[i];
+		double alt = z[i];
+		m[0][i]  = 1;           m[1][i]  = lig;         m[2][i]  = col;
+		m[3][i]  = alt;         m[4][i]  = lig*col;     m[5][i]  = lig*alt;
+		m[6][i]  = col*alt;     m[7][i]  = lig*lig;     m[8][i]  = col*col;
+		m[9][i]  = alt*alt;     m[10][i] = col*lig*alt; m[11][i] = lig*lig*lig;
+		m[12][i] = lig*col*col; m[13][i] = lig*alt*alt; m[14][i] = lig*lig*col;
+		m[15][i] = col*col*col; m[16][i] = col*alt*alt; m[17][i] = lig*lig*alt;
+		m[18][i] = col*col*alt; m[19][i] = alt*alt*alt;
+		r0[i] = r1[i] = r2[i] = r3[i] = 0;
+	}
+	for (int k = 0; k < 20; k++)
+	for (int i = 0; i < n; i++)
+	{
+		r0[i] += c0[k]*m[k][i];
+		r1[i] += c1[k]*m[k][i];
+		r2[i] += c2[k]*m[k][i];
+		r3[i] += c3[k]*m[k][i];
+	}
+}
+
+// evaluate the normalized rational functions num0/den0 and num1/den1 on the
+// block of n <= RPC_BLOCK points (x[i], y[i], z[i]). The inputs are
+// normalized with (in_offset, in_scale) and the outputs denormalized with
+// (out_offset, out_scale), as in eval_rpc and eval_rpci
+static void eval_rpc_block(double *out0, double *out1,
+		double num0[20], double den0[20], double num1[20], double den1[20],
+		double in_scale[3], double in_offset[3],
+		double out_scale[3], double out_offset[3],
+		const double *x, const double *y, const double *z, int n)
+{
+	double nx[RPC_BLOCK], ny[RPC_BLOCK], nz[RPC_BLOCK];
+	double a[RPC_BLOCK], b[RPC_BLOCK], c[RPC_BLOCK], d[RPC_BLOCK];
+	for (int i = 0; i < n; i++)
+	{
+		nx[i] = (x[i] - in_offset[0])/in_scale[0];
+		ny[i] = (y[i] - in_offset[1])/in_scale[1];
+		nz[i] = (z[i] - in_offset[2])/in_scale[2];
+	}
+	eval_pol20_four(a, b, c, d, num0, den0, num1, den1, nx, ny, nz, n);
+	for (int i = 0; i < n; i++)
+	{
+		out0[i] = a[i]/b[i] * out_scale[0] + out_offset[0];
+		out1[i] = c[i]/d[i] * out_scale[1] + out_offset[1];
+	}
+}
+
+// evaluate the direct rpc model on n points (x[i], y[i], z[i])
+// the outputs can be the same arrays as the inputs
+void eval_rpc_batch(struct rpc *p,
+		const double *x, const double *y, const double *z,
+		double *lon, double *lat, size_t n)
+{
+	if (!isfinite(p->numx[0])) {
+		// no direct model, it is inverted point by point
+		for (size_t i = 0; i < n; i++) {
+			double r[2];
+			eval_rpc(r, p, x[i], y[i], z[i]);
+			lon[i] = r[0];
+			lat[i] = r[1];
+		}
+		return;
+	}
+	for (size_t i = 0; i < n; i += RPC_BLOCK)
+	{
+		int b = n - i < RPC_BLOCK ? n - i : RPC_BLOCK;
+		double r0[RPC_BLOCK], r1[RPC_BLOCK];
+		eval_rpc_block(r0, r1, p->numx, p->denx, p->numy, p->deny,
+				p->scale, p->offset, p->iscale, p->ioffset,
+				x + i, y + i, z + i, b);
+		memcpy(lon + i, r0, b * sizeof*r0);
+		memcpy(lat + i, r1, b * sizeof*r1);
+	}
+}
+
+// evaluate the inverse rpc model on n points (lon[i], lat[i], z[i])
+// the outputs can be the same arrays as the inputs
+void eval_rpci_batch(struct rpc *p,
+		const double *lon, const double *lat, const double *z,
+		double *x, double *y, size_t n)
+{
+	for (size_t i = 0; i < n; i += RPC_BLOCK)
+	{
+		int b = n - i < RPC_BLOCK ? n - i : RPC_BLOCK;
+		double r0[RPC_BLOCK], r1[RPC_BLOCK];
+		eval_rpc_block(r0, r1, p->inumx, p->idenx, p->inumy, p->ideny,
+				p->iscale, p->ioffset, p->scale, p->offset,
+				lon + i, lat + i, z + i, b);
+		memcpy(x + i, r0, b * sizeof*r0);
+		memcpy(y + i, r1, b * sizeof*r1);
+	}
+}
+
+
+// approximation of the direct (or inverse) rpc model by trilinear
+// interpolation on a lattice of exact evaluations
+struct rpc_grid {
+	struct rpc *p;
+	bool inverse;     // lattice of the inverse model
+	double o[3];      // first node
+	double d[3];      // spacing of the nodes
+	int n[3];         // number of nodes along each axis
+	double *v;        // values, v[2*(k + n[2]*(i + n[0]*j)) + l]
+	double err;       // estimated maximum interpolation error
+};
+
+// maximum number of nodes of an rpc_grid
+#define RPC_GRID_MAXNODES (1 << 22)
+
+// strides of the values of an rpc_grid along each axis (0 on flat axes)
+static void rpc_grid_strides(int s[3], struct rpc_grid *g)
+{
+	s[2] = g->n[2] > 1 ? 2 : 0;
+	s[0] = g->n[0] > 1 ? 2 * g->n[2] : 0;
+	s[1] = g->n[1] > 1 ? 2 * g->n[2] * g->n[0] : 0;
+}
+
+// evaluate the model at all the nodes of the lattice
+static void rpc_grid_fill(struct rpc_grid *g)
+{
+	size_t n = (size_t) g->n[0] * g->n[1] * g->n[2];
+	double *x = malloc(3 * n * sizeof*x), *y = x + n, *z = y + n;
+	size_t t = 0;
+	for (int j = 0; j < g->n[1]; j++)
+	for (int i = 0; i < g->n[0]; i++)
+	for (int k = 0; k < g->n[2]; k++)
+	{
+		x[t] = g->o[0] + i * g->d[0];
+		y[t] = g->o[1] + j * g->d[1];
+		z[t] = g->o[2] + k * g->d[2];
+		t += 1;
+	}
+	double *out0 = malloc(2 * n * sizeof*out0), *out1 = out0 + n;
+	if (g->inverse)
+		eval_rpci_batch(g->p, x, y, z, out0, out1, n);
+	else
+		eval_rpc_batch(g->p, x, y, z, out0, out1, n);
+	for (size_t t = 0; t < n; t++)
+	{
+		g->v[2*t+0] = out0[t];
+		g->v[2*t+1] = out1[t];
+	}
+	free(out0);
+	free(x);
+}
+
+// a-priori bound of the interpolation error along each axis: the error of
+// the linear interpolation of f with step d is at most d^2 max|f''| / 8,
+// and d^2 f'' is estimated by the second differences of the nodes
+static void rpc_grid_estimate(double e[3], struct rpc_grid *g)
+{
+	int s[3];
+	rpc_grid_strides(s, g);
+	e[0] = e[1] = e[2] = 0;
+	for (int j = 0; j < g->n[1]; j++)
+	for (int i = 0; i < g->n[0]; i++)
+	for (int k = 0; k < g->n[2]; k++)
+	{
+		int c[3] = {i, j, k};
+		double *v = g->v + 2 * (k + g->n[2] * (i + g->n[0] * j));
+		for (int a = 0; a < 3; a++)
+		if (c[a] > 0 && c[a] < g->n[a] - 1)
+		for (int l = 0; l < 2; l++)
+		{
+			double dd = fabs(v[l - s[a]] - 2 * v[l] + v[l + s[a]]) / 8;
+			if (dd > e[a]) e[a] = dd;
+		}
+	}
+}
+
+// build an approximation of the direct model (or of the inverse model if
+// inverse is true) over the box [x0,x1]x[y0,y1]x[z0,z1], the initial
+// spacing of the nodes is step along x and y, and 3 nodes along z.
+// The spacing is halved along the axes whose estimated error is too large,
+// until the estimate is below maxerr (in the units of the output of the
+// model).  Returns the estimated error, or NAN if the bound can not be met
+// with RPC_GRID_MAXNODES nodes, in which case rpc_grid_eval uses the exact
+// model.
+double rpc_grid_init(struct rpc_grid *g, struct rpc *p, bool inverse,
+		double x0, double x1, double y0, double y1, double z0, double z1,
+		double step, double maxerr)
+{
+	double lo[3] = {x0, y0, z0}, hi[3] = {x1, y1, z1};
+	double d[3] = {step, step, (z1 - z0) / 2};
+	g->p = p;
+	g->inverse = inverse;
+	g->v = NULL;
+	g->err = NAN;
+	while (1)
+	{
+		size_t nn = 1;
+		for (int a = 0; a < 3; a++)
+		{
+			g->o[a] = lo[a];
+			g->n[a] = 1;
+			g->d[a] = 1;
+			if (hi[a] > lo[a] && d[a] > 0) {
+				g->n[a] = 1 + ceil((hi[a] - lo[a]) / d[a]);
+				if (g->n[a] < 3) g->n[a] = 3;
+				g->d[a] = (hi[a] - lo[a]) / (g->n[a] - 1);
+			}
+			nn *= g->n[a];
+		}
+		if (nn > RPC_GRID_MAXNODES)
+			break;
+
+		free(g->v);
+		g->v = malloc(2 * nn * sizeof*g->v);
+		rpc_grid_fill(g);
+
+		double e[3];
+		rpc_grid_estimate(e, g);
+		if (e[0] + e[1] + e[2] <= maxerr)
+			return g->err = e[0] + e[1] + e[2];
+		for (int a = 0; a < 3; a++)
+			if (e[a] > maxerr / 3)
+				d[a] = g->d[a] / 2;
+	}
+	free(g->v);
+	g->v = NULL;
+	return NAN;
+}
+
+// evaluate the model approximated by the lattice, by trilinear interpolation
+// of the nodes. The points outside of the lattice are evaluated exactly.
+void rpc_grid_eval(double *result, struct rpc_grid *g,
+		double x, double y, double z)
+{
+	double t[3] = {x, y, z}, f[3];
+	int c[3], s[3], inside = g->v != NULL;
+	for (int a = 0; inside && a < 3; a++)
+	{
+		double u = (t[a] - g->o[a]) / g->d[a];
+		if (g->n[a] == 1)
+			inside = u == 0;
+		else
+			inside = u >= 0 && u <= g->n[a] - 1;
+		c[a] = u < g->n[a] - 2 ? (int) u : (g->n[a] > 1 ? g->n[a] - 2 : 0);
+		f[a] = u - c[a];
+	}
+	if (!inside) {
+		if (g->inverse)
+			eval_rpci(result, g->p, x, y, z);
+		else
+			eval_rpc(result, g->p, x, y, z);
+		return;
+	}
+
+	rpc_grid_strides(s, g);
+	double *v = g->v + 2 * (c[2] + g->n[2] * (c[0] + g->n[0] * c[1]));
+	for (int l = 0; l < 2; l++)
+	{
+		double v00 = v[l]           + f[2] * (v[l+s[2]]           - v[l]);
+		double v10 = v[l+s[0]]      + f[2] * (v[l+s[0]+s[2]]      - v[l+s[0]]);
+		double v01 = v[l+s[1]]      + f[2] * (v[l+s[1]+s[2]]      - v[l+s[1]]);
+		double v11 = v[l+s[0]+s[1]] + f[2] * (v[l+s[0]+s[1]+s[2]] - v[l+s[0]+s[1]]);
+		double v0 = v00 + f[0] * (v10 - v00);
+		double v1 = v01 + f[0] * (v11 - v01);
+		result[l] = v0 + f[1] * (v1 - v0);
+	}
+}
+
+void rpc_grid_free(struct rpc_grid *g)
+{
+	free(g->v);
+	g->v = NULL;
+}
+
+
 #define RPCH_MAXIT 100
 #define RPCH_HSTEP 1
 #define RPCH_LAMBDA_STOP 0.00001
@@ -512,6 +900,143 @@ double rpc_height(struct rpc *rpca, struct rpc *rpcb,
 }
 
 
+// evaluate the polynomial (see eval_pol20) and its gradient at (x, y, z),
+// the products are shared by the value and the three derivatives
+static double eval_pol20_grad(double g[3], double c[20],
+		double x, double y, double z)
+{
+	double xx = x*x, yy = y*y, zz = z*z, xy = x*y, xz = x*z, yz = y*z;
+	g[0] = c[1] + c[4]*y + c[5]*z + 2*c[7]*x + c[10]*yz + 3*c[11]*xx
+		+ c[12]*yy + c[13]*zz + 2*c[14]*xy + 2*c[17]*xz;
+	g[1] = c[2] + c[4]*x + c[6]*z + 2*c[8]*y + c[10]*xz + 2*c[12]*xy
+		+ c[14]*xx + 3*c[15]*yy + c[16]*zz + 2*c[18]*yz;
+	g[2] = c[3] + c[5]*x + c[6]*y + 2*c[9]*z + c[10]*xy + 2*c[13]*xz
+		+ 2*c[16]*yz + c[17]*xx + c[18]*yy + 3*c[19]*zz;
+	return c[0] + c[1]*x + c[2]*y + c[3]*z + c[4]*xy + c[5]*xz + c[6]*yz
+		+ c[7]*xx + c[8]*yy + c[9]*zz + c[10]*xy*z + c[11]*xx*x
+		+ c[12]*x*yy + c[13]*x*zz + c[14]*xx*y + c[15]*yy*y
+		+ c[16]*y*zz + c[17]*xx*z + c[18]*yy*z + c[19]*zz*z;
+}
+
+// evaluate the rational function num/den and its gradient at (x, y, z)
+static double eval_ratio_grad(double g[3], double num[20], double den[20],
+		double x, double y, double z)
+{
+	double dn[3], dd[3];
+	double n = eval_pol20_grad(dn, num, x, y, z);
+	double d = eval_pol20_grad(dd, den, x, y, z);
+	for (int i = 0; i < 3; i++)
+		g[i] = (dn[i]*d - n*dd[i]) / (d*d);
+	return n/d;
+}
+
+// evaluate the rational function num/den and its derivative along z
+static double eval_ratio_dz(double *gz, double num[20], double den[20],
+		double x, double y, double z)
+{
+	double n = eval_pol20(num, x, y, z);
+	double d = eval_pol20(den, x, y, z);
+	double dn = eval_pol20_dz(num, x, y, z);
+	double dd = eval_pol20_dz(den, x, y, z);
+	*gz = (dn*d - n*dd) / (d*d);
+	return n/d;
+}
+
+// evaluate the inverse rpc model and its jacobian J[i][j] = d result[i] / d v[j]
+// where v = (lon, lat, z)
+static void eval_rpci_jacobian(double result[2], double J[2][3],
+		struct rpc *p, double lon, double lat, double z)
+{
+	double nx = (lon - p->ioffset[0])/p->iscale[0];
+	double ny = (lat - p->ioffset[1])/p->iscale[1];
+	double nz = (z   - p->ioffset[2])/p->iscale[2];
+	double g[2][3];
+	double tmp[2] = {eval_ratio_grad(g[0], p->inumx, p->idenx, nx, ny, nz),
+	                 eval_ratio_grad(g[1], p->inumy, p->ideny, nx, ny, nz)};
+	for (int i = 0; i < 2; i++) {
+		result[i] = tmp[i] * p->scale[i] + p->offset[i];
+		for (int j = 0; j < 3; j++)
+			J[i][j] = p->scale[i] * g[i][j] / p->iscale[j];
+	}
+}
+
+// evaluate the direct rpc model and its derivative with respect to z
+static void eval_rpc_dz(double result[2], double dresult[2],
+		struct rpc *p, double x, double y, double z)
+{
+	if (isfinite(p->numx[0])) {
+		double nx = (x - p->offset[0])/p->scale[0];
+		double ny = (y - p->offset[1])/p->scale[1];
+		double nz = (z - p->offset[2])/p->scale[2];
+		double g[2];
+		double tmp[2] = {eval_ratio_dz(g + 0, p->numx, p->denx, nx, ny, nz),
+		                 eval_ratio_dz(g + 1, p->numy, p->deny, nx, ny, nz)};
+		for (int i = 0; i < 2; i++) {
+			result[i] = tmp[i] * p->iscale[i] + p->ioffset[i];
+			dresult[i] = p->iscale[i] * g[i] / p->scale[2];
+		}
+	} else {
+		// the direct model is the inverse of eval_rpci at fixed z, so
+		// d(lon,lat)/dz = - (d(x,y)/d(lon,lat))^-1 d(x,y)/dz
+		double J[2][3], tmp[2];
+		eval_rpc(result, p, x, y, z);
+		eval_rpci_jacobian(tmp, J, p, result[0], result[1], z);
+		double det = J[0][0]*J[1][1] - J[0][1]*J[1][0];
+		dresult[0] = -( J[1][1]*J[0][2] - J[0][1]*J[1][2]) / det;
+		dresult[1] = -(-J[1][0]*J[0][2] + J[0][0]*J[1][2]) / det;
+	}
+}
+
+// evaluate an epipolar correspondence (see eval_rpc_pair) and its
+// derivative with respect to z
+static void eval_rpc_pair_dz(double xprime[2], double dxprime[2],
+		struct rpc *pa, struct rpc *pb,
+		double x, double y, double z)
+{
+	double tmp[2], dtmp[2], J[2][3];
+	eval_rpc_dz(tmp, dtmp, pa, x, y, z);
+	eval_rpci_jacobian(xprime, J, pb, tmp[0], tmp[1], z);
+	for (int i = 0; i < 2; i++)
+		dxprime[i] = J[i][0]*dtmp[0] + J[i][1]*dtmp[1] + J[i][2];
+}
+
+// compute the height of a point given its location inside two images
+// like rpc_height, but by Gauss-Newton iterations with the analytic
+// derivative of the epipolar curve: the height h minimizes the distance
+// between the projection into the image b of the point (xa, ya, h) and
+// (xb, yb). The iterations start at h0 (e.g. the height of a neighboring
+// pixel, or 0), and their number is stored in *outit.
+double rpc_height_gn(struct rpc *rpca, struct rpc *rpcb,
+		double xa, double ya, double xb, double yb, double h0,
+		double *outerr, int *outit)
+{
+	double y[2] = {xb, yb};
+	double h = isfinite(h0) ? h0 : 0;
+	int t;
+	for (t = 0; t < RPCH_MAXIT; t++) {
+		double p[2], a[2];
+		eval_rpc_pair_dz(p, a, rpca, rpcb, xa, ya, h);
+
+		double b[2] = {y[0] - p[0], y[1] - p[1]};
+		double a2 = a[0]*a[0] + a[1]*a[1];
+		double lambda = (a[0]*b[0] + a[1]*b[1])/a2;
+
+		// projection of (xb, yb) to the tangent of the epipolar curve
+		double z[2] = {p[0] + lambda*a[0], p[1] + lambda*a[1]};
+
+		double err = hypot(z[0] - y[0], z[1] - y[1]);
+		if (outerr) *outerr=err;
+
+		h += lambda;
+
+		if (fabs(lambda) < RPCH_LAMBDA_STOP)
+			break;
+	}
+	if (outit) *outit = t < RPCH_MAXIT ? t + 1 : RPCH_MAXIT;
+	return h;
+}
+
+
 
 static double random_uniform(void)
 {
@@ -644,9 +1169,75 @@ static int main_rpcpair(int c, char *v[])
 	return 0;
 }
 
+// microbenchmark of the batch evaluation: n random points in the domain of
+// the model are mapped by eval_rpc/eval_rpci and by eval_rpc_batch/eval_rpci_batch
+static int main_bench(int c, char *v[])
+{
+	if (c != 2 && c != 3) {
+		fprintf(stderr, "usage:\n\t%s rpc.xml [npoints]\n", *v);
+		//                          0 1       2
+		return EXIT_FAILURE;
+	}
+	struct rpc p[1];
+	read_rpc_file_xml(p, v[1]);
+	size_t n = c > 2 ? atol(v[2]) : 1000000;
+
+	double *x = malloc(7 * n * sizeof*x);
+	double *y = x + n, *z = y + n, *lon = z + n, *lat = lon + n;
+	double *xx = lat + n, *yy = xx + n;
+	for (size_t i = 0; i < n; i++) {
+		x[i] = p->offset[0] + p->scale[0] * (2*random_uniform() - 1);
+		y[i] = p->offset[1] + p->scale[1] * (2*random_uniform() - 1);
+		z[i] = p->offset[2] + p->scale[2] * (2*random_uniform() - 1);
+	}
+
+	// one point at a time
+	double e[2] = {0, 0};
+	clock_t t0 = clock();
+	for (size_t i = 0; i < n; i++) {
+		double r[2];
+		eval_rpc(r, p, x[i], y[i], z[i]);
+		lon[i] = r[0];
+		lat[i] = r[1];
+	}
+	clock_t t1 = clock();
+	for (size_t i = 0; i < n; i++) {
+		double r[2];
+		eval_rpci(r, p, lon[i], lat[i], z[i]);
+		xx[i] = r[0];
+		yy[i] = r[1];
+	}
+	clock_t t2 = clock();
+
+	// batches
+	double *blon = malloc(4 * n * sizeof*blon);
+	double *blat = blon + n, *bx = blat + n, *by = bx + n;
+	clock_t t3 = clock();
+	eval_rpc_batch(p, x, y, z, blon, blat, n);
+	clock_t t4 = clock();
+	eval_rpci_batch(p, blon, blat, z, bx, by, n);
+	clock_t t5 = clock();
+
+	for (size_t i = 0; i < n; i++) {
+		e[0] = fmax(e[0], fmax(fabs(blon[i] - lon[i]), fabs(blat[i] - lat[i])));
+		e[1] = fmax(e[1], fmax(fabs(bx[i] - xx[i]), fabs(by[i] - yy[i])));
+	}
+	double s = 1.0 / CLOCKS_PER_SEC;
+	printf("%zu points\n", n);
+	printf("eval_rpc  %.3fs  eval_rpc_batch  %.3fs  (x%.1f)  max diff %g\n",
+			(t1-t0)*s, (t4-t3)*s, (t1-t0)/(double)(t4-t3), e[0]);
+	printf("eval_rpci %.3fs  eval_rpci_batch %.3fs  (x%.1f)  max diff %g\n",
+			(t2-t1)*s, (t5-t4)*s, (t2-t1)/(double)(t5-t4), e[1]);
+	free(blon);
+	free(x);
+	return 0;
+}
+
 #ifndef DONT_USE_TEST_MAIN
 int main(int c, char *v[])
 {
+	if (c > 1 && 0 == strcmp(v[1], "bench"))
+		return main_bench(c - 1, v + 1);
 	return main_trial(c, v);
 	return main_trial2(c, v);
 //	return main_rpcline(c, v);
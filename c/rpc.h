@@ -39,6 +39,16 @@ void eval_rpc(double *result,
 void eval_rpci(double *result,
 		struct rpc *p, double x, double y, double z);
 
+// evaluate the direct rpc model on n points (structure of arrays)
+void eval_rpc_batch(struct rpc *p,
+		const double *x, const double *y, const double *z,
+		double *lon, double *lat, size_t n);
+
+// evaluate the inverse rpc model on n points (structure of arrays)
+void eval_rpci_batch(struct rpc *p,
+		const double *lon, const double *lat, const double *z,
+		double *x, double *y, size_t n);
+
 // evaluate an epipolar correspondence
 static void eval_rpc_pair(double xprime[2],
 		struct rpc *a, struct rpc *b,
@@ -47,3 +57,33 @@ static void eval_rpc_pair(double xprime[2],
 // compute the height of a point given its location inside two images
 double rpc_height(struct rpc *rpca, struct rpc *rpcb,
 		double x, double y, double xp, double yp, double *outerr);
+
+// same, by Gauss-Newton iterations started at the height h0,
+// the number of iterations is stored in *outit
+double rpc_height_gn(struct rpc *rpca, struct rpc *rpcb,
+		double x, double y, double xp, double yp, double h0,
+		double *outerr, int *outit);
+
+// approximation of the direct (or inverse) rpc model by trilinear
+// interpolation on a lattice of exact evaluations
+struct rpc_grid {
+	struct rpc *p;
+	bool inverse;     // lattice of the inverse model
+	double o[3];      // first node
+	double d[3];      // spacing of the nodes
+	int n[3];         // number of nodes along each axis
+	double *v;        // values, v[2*(k + n[2]*(i + n[0]*j)) + l]
+	double err;       // estimated maximum interpolation error
+};
+
+// build a lattice over [x0,x1]x[y0,y1]x[z0,z1] with an estimated error
+// below maxerr, returns the estimated error (NAN if it is not reachable)
+double rpc_grid_init(struct rpc_grid *g, struct rpc *p, bool inverse,
+		double x0, double x1, double y0, double y1, double z0, double z1,
+		double step, double maxerr);
+
+// evaluate the approximated model (the exact one outside of the lattice)
+void rpc_grid_eval(double *result, struct rpc_grid *g,
+		double x, double y, double z);
+
+void rpc_grid_free(struct rpc_grid *g);
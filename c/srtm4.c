@@ -1,4 +1,12 @@
 // SRTM4 files are of size 6000x6000 pixels and cover an area of 5x5 degrees
+//
+// The tiles are kept as int16 heights.  The first time a tile is used, its
+// TIF (or ASC) file is decoded and saved in the cache directory as a raw
+// file (srtm_XX_YY.i16), which is then mapped in memory by all the processes
+// that use the tile: they share the pages of the page cache and do not
+// decode the TIF again.  The loaded tiles are bounded by a budget, given in
+// MB by the environment variable SRTM4_MAX_MB (default 512, about 7 tiles),
+// and the least recently used tiles are unloaded first.
 
 #include <assert.h>
 #include <stdbool.h>
@@ -9,12 +17,18 @@
 #include <tiffio.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #define NO_DATA NAN
 #define SRTM4_ASC "%s/srtm_%02d_%02d.asc"
 #define SRTM4_TIF "%s/srtm_%02d_%02d.tif"
+#define SRTM4_RAW "%s/srtm_%02d_%02d.i16"
+#define SRTM4_RAW_MAGIC "SRTM4I16"
+#define SRTM4_NODATA -32768
 //#define SRTM4_URL_TIF "http://138.231.80.250:443/srtm/tiff/srtm_%02d_%02d.zip"
 //#define SRTM4_URL_ASC "http://138.231.80.250:443/srtm/asc/srtm_%02d_%02d.zip"
 #define SRTM4_URL_ASC "ftp://xftp.jrc.it/pub/srtmV4/arcasci/srtm_%02d_%02d.zip"
@@ -249,9 +263,9 @@ static char *my_strtok(char *str)
 	return begin;
 }
 
-// parse a tile file into memory
+// parse a tile file into memory, the heights below -1000 are no data
 // (this function is ugly due to the error checking)
-static float *malloc_tile_data(char *tile_filename)
+static int16_t *malloc_tile_data(char *tile_filename)
 {
 	int fsize;
 	char *f = malloc_file_contents(tile_filename, &fsize);
@@ -275,7 +289,7 @@ static float *malloc_tile_data(char *tile_filename)
 		exit(2);
 	}
 	int n = 6000*6000;
-	float *t = malloc(n*sizeof*t);
+	int16_t *t = malloc(n*sizeof*t);
 	if (!t) {
 		fprintf(stderr, "out of memory!\n");
 		exit(2);
@@ -285,7 +299,7 @@ static float *malloc_tile_data(char *tile_filename)
 	char *tok = my_strtok(fp);
 	while (tok && cx < n) {
 		int x = my_atoi(tok);
-		t[cx++] = x > -1000 ? x : NAN;
+		t[cx++] = x > -1000 ? x : SRTM4_NODATA;
 		tok = my_strtok(NULL);
 	}
 	free(f);
@@ -296,46 +310,157 @@ static float *malloc_tile_data(char *tile_filename)
 	return t;
 }
 
-static void cast_int16_to_float(float *out, int16_t *in, int n)
+// a tile of int16 heights, mapped from its raw cache file (or allocated, when
+// the raw file can not be written)
+struct srtm4_tile {
+	int16_t *data;
+	void *base;              // the mapping, or the allocation
+	size_t size;             // size of the mapping, 0 for an allocation
+	unsigned long last_use;  // for the LRU eviction
+};
+
+static struct srtm4_tile global_table_of_tiles[360][180];
+static unsigned long srtm4_clock;
+static size_t srtm4_loaded_bytes;
+
+#define SRTM4_TILE_BYTES (6000*6000*sizeof(int16_t))
+#define SRTM4_RAW_HEADER 16 // magic (8 bytes), width and height (int32)
+
+// budget of the loaded tiles, in bytes
+static size_t srtm4_budget(void)
 {
-    for (int i = 0; i < n; i++)
-        out[i] = (float) in[i];
+	char *env_budget = getenv("SRTM4_MAX_MB");
+	double mb = env_budget ? atof(env_budget) : 512;
+	return mb > 0 ? mb * 1024 * 1024 : 0;
 }
 
-static float *global_table_of_tiles[360][180] = {{0}};
+static void unload_tile(struct srtm4_tile *t)
+{
+	if (t->size)
+		munmap(t->base, t->size);
+	else
+		free(t->base);
+	t->data = NULL;
+	t->base = NULL;
+	t->size = 0;
+	srtm4_loaded_bytes -= SRTM4_TILE_BYTES;
+}
 
-static float *produce_tile(int tlon, int tlat, bool tif)
+// unload the least recently used tiles until n more bytes fit in the budget
+static void make_room_for_tile(size_t n)
 {
-	float *t = global_table_of_tiles[tlon][tlat];
-	if (!t) {
-		char *fname = get_tile_filename(tlon, tlat, tif);
-		if (!file_exists(fname))
-			download_tile_file(tlon, tlat, tif);
-		if (!file_exists(fname)) {
-            fprintf(stderr, "WARNING: this srtm tile is not available\n");
-            return NULL;
-        }
-        if (tif) {
-            int w, h;
-            int16_t *tmp = read_tiff_int16_gray(fname, &w, &h);
-            if (NULL == tmp) {
-                fprintf(stderr, "failed to read the tif file\n");
-                abort();
-            }
-            if ((w != 6000) || (h != 6000)) {
-                fprintf(stderr, "produce_tile: tif srtm file isn't 6000x6000\n");
-                abort();
-            }
-            t = malloc(w*h*sizeof*t);
-            cast_int16_to_float(t, tmp, w*h);
-        }
-        else
-		    t = malloc_tile_data(fname);
-		global_table_of_tiles[tlon][tlat] = t;
+	size_t budget = srtm4_budget();
+	while (srtm4_loaded_bytes && srtm4_loaded_bytes + n > budget) {
+		struct srtm4_tile *lru = NULL;
+		for (int j = 0; j < 360; j++)
+		for (int i = 0; i < 180; i++) {
+			struct srtm4_tile *t = &global_table_of_tiles[j][i];
+			if (t->data && (!lru || t->last_use < lru->last_use))
+				lru = t;
+		}
+		unload_tile(lru);
+	}
+}
+
+// map a raw tile file, returns false if it is not a valid raw tile
+static bool map_raw_tile(struct srtm4_tile *t, const char *fname)
+{
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return false;
+	size_t size = SRTM4_RAW_HEADER + SRTM4_TILE_BYTES;
+	struct stat st;
+	if (fstat(fd, &st) || (size_t) st.st_size != size) {
+		close(fd);
+		return false;
+	}
+	void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	int32_t dims[2];
+	memcpy(dims, (char *) p + 8, sizeof dims);
+	if (memcmp(p, SRTM4_RAW_MAGIC, 8) || dims[0] != 6000 || dims[1] != 6000) {
+		munmap(p, size);
+		return false;
+	}
+	t->base = p;
+	t->size = size;
+	t->data = (int16_t *) ((char *) p + SRTM4_RAW_HEADER);
+	return true;
+}
+
+// save a raw tile file, through a temporary file so that the concurrent
+// processes never see a partial file
+static bool save_raw_tile(const char *fname, const int16_t *data)
+{
+	char tmp[FILENAME_MAX];
+	snprintf(tmp, FILENAME_MAX, "%s.%d.tmp", fname, (int) getpid());
+	FILE *f = fopen(tmp, "w");
+	if (!f)
+		return false;
+	int32_t dims[2] = {6000, 6000};
+	bool ok = 1 == fwrite(SRTM4_RAW_MAGIC, 8, 1, f)
+		&& 1 == fwrite(dims, sizeof dims, 1, f)
+		&& 1 == fwrite(data, SRTM4_TILE_BYTES, 1, f);
+	ok = 0 == fclose(f) && ok;
+	if (ok)
+		ok = 0 == rename(tmp, fname);
+	if (!ok)
+		remove(tmp);
+	return ok;
+}
+
+// decode the TIF or ASC file of a tile, downloading it if needed
+static int16_t *malloc_tile_from_file(int tlon, int tlat, bool tif)
+{
+	char *fname = get_tile_filename(tlon, tlat, tif);
+	if (!file_exists(fname))
+		download_tile_file(tlon, tlat, tif);
+	if (!file_exists(fname)) {
+		fprintf(stderr, "WARNING: this srtm tile is not available\n");
+		return NULL;
+	}
+	if (!tif)
+		return malloc_tile_data(fname);
+
+	int w, h;
+	int16_t *t = read_tiff_int16_gray(fname, &w, &h);
+	if (NULL == t) {
+		fprintf(stderr, "failed to read the tif file\n");
+		abort();
+	}
+	if ((w != 6000) || (h != 6000)) {
+		fprintf(stderr, "produce_tile: tif srtm file isn't 6000x6000\n");
+		abort();
 	}
 	return t;
 }
 
+static int16_t *produce_tile(int tlon, int tlat, bool tif)
+{
+	struct srtm4_tile *t = &global_table_of_tiles[tlon][tlat];
+	if (!t->data) {
+		make_room_for_tile(SRTM4_TILE_BYTES);
+		char raw[FILENAME_MAX];
+		snprintf(raw, FILENAME_MAX, SRTM4_RAW, cachedir(), tlon, tlat);
+		if (!map_raw_tile(t, raw)) {
+			int16_t *data = malloc_tile_from_file(tlon, tlat, tif);
+			if (!data)
+				return NULL;
+			if (save_raw_tile(raw, data) && map_raw_tile(t, raw))
+				free(data);
+			else {
+				t->data = t->base = data;
+				t->size = 0;
+			}
+		}
+		srtm4_loaded_bytes += SRTM4_TILE_BYTES;
+	}
+	t->last_use = ++srtm4_clock;
+	return t->data;
+}
+
 static float evaluate_bilinear_cell(float a, float b, float c, float d,
 							float x, float y)
 {
@@ -347,7 +472,7 @@ static float evaluate_bilinear_cell(float a, float b, float c, float d,
 	return r;
 }
 
-static float getpixel_1(float *x, int w, int h, int i, int j)
+static float getpixel_1(const int16_t *x, int w, int h, int i, int j)
 {
 	if (i < 0) i = 0;
 	if (j < 0) j = 0;
@@ -356,7 +481,7 @@ static float getpixel_1(float *x, int w, int h, int i, int j)
 	return x[j*w+i];
 }
 
-static float bilinear_interpolation_at(float *x, int w, int h, float p, float q)
+static float bilinear_interpolation_at(const int16_t *x, int w, int h, float p, float q)
 {
 	int ip = p;
 	int iq = q;
@@ -368,7 +493,7 @@ static float bilinear_interpolation_at(float *x, int w, int h, float p, float q)
 	return r;
 }
 
-static float nearest_neighbor_interpolation_at(float *x,
+static float nearest_neighbor_interpolation_at(const int16_t *x,
         int w, int h, float p, float q)
 {
 	int ip = rintf(p);
@@ -387,7 +512,7 @@ double srtm4(double lon, double lat)
 	int tlon, tlat;
 	float xlon, xlat;
 	get_tile_index_and_position(&tlon, &tlat, &xlon, &xlat, lon, lat);
-	float *t = produce_tile(tlon, tlat, true);
+	int16_t *t = produce_tile(tlon, tlat, true);
     if (t == NULL)
         return NO_DATA;
     else
@@ -401,7 +526,7 @@ double srtm4_nn(double lon, double lat)
 	int tlon, tlat;
 	float xlon, xlat;
 	get_tile_index_and_position(&tlon, &tlat, &xlon, &xlat, lon, lat);
-	float *t = produce_tile(tlon, tlat, true);
+	int16_t *t = produce_tile(tlon, tlat, true);
     if (t == NULL)
         return NO_DATA;
     else
@@ -415,7 +540,7 @@ double srtm4_wrt_ellipsoid(double lon, double lat)
 	int tlon, tlat;
 	float xlon, xlat;
 	get_tile_index_and_position(&tlon, &tlat, &xlon, &xlat, lon, lat);
-	float *t = produce_tile(tlon, tlat, true);
+	int16_t *t = produce_tile(tlon, tlat, true);
     if (t == NULL)
         return NO_DATA;
     double srtm = bilinear_interpolation_at(t, 6000, 6000, xlon, xlat);
@@ -431,7 +556,7 @@ double srtm4_nn_wrt_ellipsoid(double lon, double lat)
 	int tlon, tlat;
 	float xlon, xlat;
 	get_tile_index_and_position(&tlon, &tlat, &xlon, &xlat, lon, lat);
-	float *t = produce_tile(tlon, tlat, true);
+	int16_t *t = produce_tile(tlon, tlat, true);
     if (t == NULL)
         return NO_DATA;
 	double srtm = nearest_neighbor_interpolation_at(t, 6000, 6000, xlon, xlat);
@@ -444,8 +569,8 @@ void srtm4_free_tiles(void)
 {
 	for (int j = 0; j < 360; j++)
 	for (int i = 0; i < 180; i++)
-		if (global_table_of_tiles[j][i])
-			free(global_table_of_tiles[j][i]);
+		if (global_table_of_tiles[j][i].data)
+			unload_tile(&global_table_of_tiles[j][i]);
 }
 
 #ifdef MAIN_SRTM4
@@ -1,3 +1,5 @@
+#define _XOPEN_SOURCE 700 // realpath (rpc.c)
+
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -39,10 +41,35 @@ static double invert_homography(double out[9], double h[9])
     return det;
 }
 
-void water_mask_fill(int *x, int w, int h, double H[9], struct rpc *r)
+// if step > 0 the rpc is approximated by a lattice with nodes spaced by step
+// pixels and an interpolation error below maxerr meters (see rpc_grid_init)
+void water_mask_fill(int *x, int w, int h, double H[9], struct rpc *r,
+        double step, double maxerr)
 {
     double inv_H[9];
     invert_homography(inv_H, H);
+
+    // TODO: this should be the geoid height with respect to the ellipsoid
+    double geoid_alt = 0.0;
+
+    // the lattice covers the footprint of the rectified image
+    struct rpc_grid grid[1] = {{0}};
+    grid->p = r;
+    if (step > 0) {
+        double bb[4] = {INFINITY, -INFINITY, INFINITY, -INFINITY};
+        for (int k = 0; k < 4; k++) {
+            double p[2] = {(k % 2) * (w - 1), (k / 2) * (h - 1)}, q[2];
+            apply_homography(q, inv_H, p);
+            bb[0] = fmin(bb[0], q[0]);
+            bb[1] = fmax(bb[1], q[0]);
+            bb[2] = fmin(bb[2], q[1]);
+            bb[3] = fmax(bb[3], q[1]);
+        }
+        // 111320 meters per degree
+        rpc_grid_init(grid, r, false, bb[0], bb[1], bb[2], bb[3],
+                geoid_alt, geoid_alt, step, maxerr / 111320);
+    }
+
     for (int row = 0; row < h; row++) {
         for (int col = 0; col < w; col++) {
             // apply inverse homography H to (col, row) to get the coordinates
@@ -50,21 +77,21 @@ void water_mask_fill(int *x, int w, int h, double H[9], struct rpc *r)
             double p[2] = {(double) col, (double) row};
             double q[2];
             apply_homography(q, inv_H, p);
-            // TODO: this should be the geoid height with respect to the ellipsoid
-            double geoid_alt = 0.0;
             double geo[2];
-            eval_rpc(geo, r, q[0], q[1], geoid_alt);
+            rpc_grid_eval(geo, grid, q[0], q[1], geoid_alt);
             double alt = srtm4(geo[0], geo[1]);
             if (alt + 32768.0 < 1) // -32768 is the flag for water
                 x[w*row + col] = 0;
         }
     }
+    rpc_grid_free(grid);
 }
 
 void print_help(char *v)
 {
     fprintf(stderr, "usage:\n\t%s "
-        "width height -h \"h1 ... h9\" [rpc.xml [out.png]]\n", v);
+        "width height -h \"h1 ... h9\" [rpc.xml [out.png]] "
+        "[--rpc-grid STEP [--rpc-grid-err E]]\n", v);
         //   1 2                          3           4
 }
 
@@ -77,6 +104,8 @@ int main(int c, char *v[])
 {
     // read input arguments
     char *Hstring = pick_option(&c, &v, "h", "");
+    double grid_step = atof(pick_option(&c, &v, "-rpc-grid", "0"));
+    double grid_err = atof(pick_option(&c, &v, "-rpc-grid-err", "0.001"));
     if (c != 5 && c!= 4 && c != 3) {
         print_help(v[0]);
         return 1;
@@ -105,7 +134,7 @@ int main(int c, char *v[])
         fail("can not read 3x3 matrix from \"%s\"", Hstring);
 
     // draw mask over output image
-    water_mask_fill(x, w, h, H, r);
+    water_mask_fill(x, w, h, H, r, grid_step, grid_err);
 
     // save output image
     iio_save_image_int(filename_out, x, w, h);
@@ -4,6 +4,7 @@
 #include <complex.h>
 #include <fftw3.h>
 #include "iio.h"
+#include "fftwisdom.c"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846264338327
@@ -78,62 +79,64 @@ void image_zoom_1d(float *in, float *out, int w_in, int w_out, int h)
     int n_in = 2*w_in;
     int n_out = 2*w_out;
 
-    // Memory allocation
-    double *line_in = fftw_malloc(sizeof(double) * n_in);
-    double *line_out = fftw_malloc(sizeof(double) * n_out);
-    fftw_complex *dft_in = fftw_malloc(sizeof(fftw_complex) * (w_in+1));
-    fftw_complex *dft_out = fftw_malloc(sizeof(fftw_complex) * (w_out+1));
+    // Plans computation, the plans are shared by the threads
+    fftw_plan p_fwd = fftwisdom_plan_r2c_1d(n_in);
+    fftw_plan p_back = fftwisdom_plan_c2r_1d(n_out);
 
-    // Plans computation
-    fftw_plan p_fwd = fftw_plan_dft_r2c_1d(n_in, line_in, dft_in, FFTW_ESTIMATE);
-    fftw_plan p_back = fftw_plan_dft_c2r_1d(n_out, dft_out, line_out, FFTW_ESTIMATE);
-
-    // Compute the output image row by row :
-    for (int row = 0; row < h; row++)
+#pragma omp parallel
     {
-        // Copy and duplicate the current row, with symmetry towards the last term
-        for (int i=0; i<w_in; i++)
-        {
-            const double x = in[row*w_in+i];
-            line_in[i] = isfinite(x) ? x : 0;
-            line_in[n_in-1-i] = isfinite(x) ? x : 0;
-        }
-
-        // Compute the DFT
-        fftw_execute(p_fwd);
-
-        if (filter_needed)
+        // Memory allocation
+        double *line_in = fftw_malloc(sizeof(double) * n_in);
+        double *line_out = fftw_malloc(sizeof(double) * n_out);
+        fftw_complex *dft_in = fftw_malloc(sizeof(fftw_complex) * (w_in+1));
+        fftw_complex *dft_out = fftw_malloc(sizeof(fftw_complex) * (w_out+1));
+
+        // Compute the output image row by row :
+#pragma omp for schedule(static)
+        for (int row = 0; row < h; row++)
         {
-            // Filter the signal : each coefficient of the DFT is multiplied by
-            // exp(-(1/2)*s*s*omega*omega) where omega is the pulsation
-            // This is equivalent to convolve the trigonometric polynomial
-            // with a gaussian of parameter s
-            for (int k=1; k<=w_in; k++)
-                dft_in[k] *= exp(-0.5*s*s*(k*2.0*M_PI/n_in)*(k*2.0*M_PI/n_in));
+            // Copy and duplicate the current row, with symmetry towards the last term
+            for (int i=0; i<w_in; i++)
+            {
+                const double x = in[row*w_in+i];
+                line_in[i] = isfinite(x) ? x : 0;
+                line_in[n_in-1-i] = isfinite(x) ? x : 0;
+            }
+
+            // Compute the DFT
+            fftw_execute_dft_r2c(p_fwd, line_in, dft_in);
+
+            if (filter_needed)
+            {
+                // Filter the signal : each coefficient of the DFT is multiplied by
+                // exp(-(1/2)*s*s*omega*omega) where omega is the pulsation
+                // This is equivalent to convolve the trigonometric polynomial
+                // with a gaussian of parameter s
+                for (int k=1; k<=w_in; k++)
+                    dft_in[k] *= exp(-0.5*s*s*(k*2.0*M_PI/n_in)*(k*2.0*M_PI/n_in));
+            }
+
+            // Normalize the DFT
+            for (int i=0; i<=w_in; i++)
+                dft_in[i] /= n_in;
+
+            // Frequency modification
+            cut_or_add_freq(dft_in, dft_out, w_in+1, w_out+1);
+
+            // Compute the iDFT to get the signal zoomed
+            fftw_execute_dft_c2r(p_back, dft_out, line_out);
+
+            // Copy zoomed row in the output image (just the half that we need)
+            for (int i=0; i<w_out; i++)
+                out[row*w_out+i] = line_out[i];
         }
 
-        // Normalize the DFT
-        for (int i=0; i<=w_in; i++)
-            dft_in[i] /= n_in;
-
-        // Frequency modification
-        cut_or_add_freq(dft_in, dft_out, w_in+1, w_out+1);
-
-        // Compute the iDFT to get the signal zoomed
-        fftw_execute(p_back);
-
-        // Copy zoomed row in the output image (just the half that we need)
-        for (int i=0; i<w_out; i++)
-            out[row*w_out+i] = line_out[i];
+        // Free memory
+        fftw_free(line_in);
+        fftw_free(dft_in);
+        fftw_free(dft_out);
+        fftw_free(line_out);
     }
-
-    // Free memory
-    fftw_destroy_plan(p_fwd);
-    fftw_destroy_plan(p_back);
-    fftw_free(line_in);
-    fftw_free(dft_in);
-    fftw_free(dft_out);
-    fftw_free(line_out);
 }
 
 
@@ -7,52 +7,7 @@
 #include <fftw3.h>
 #include "iio.h"
 
-#define FORI(n) for(int i=0; i<(n); i++)
-
-// wrapper around FFTW3 that computes the complex-valued Fourier transform
-// of a real-valued image
-static void fft_2dfloat(float complex *fx,
-        const float *x, const int w, const int h)
-{
-    float complex *a = fftwf_malloc(w*h*sizeof*a);
-
-    fftwf_plan p = fftwf_plan_dft_2d(h, w, a, fx,
-            FFTW_FORWARD, FFTW_ESTIMATE);
-
-    FORI(w*h) a[i] = x[i]; // complex assignment!
-    fftwf_execute(p);
-
-    fftwf_destroy_plan(p);
-    fftwf_free(a);
-    fftwf_cleanup();
-}
-
-// Wrapper around FFTW3 that computes the real-valued inverse Fourier transform
-// of a complex-valued frequantial image.
-// The input data must be hermitic.
-static void ifft_2dfloat(float *ifx,
-        const float complex *fx, const int w, const int h)
-{
-    float complex *a = fftwf_malloc(w*h*sizeof*a);
-    float complex *b = fftwf_malloc(w*h*sizeof*b);
-
-    fftwf_plan p = fftwf_plan_dft_2d(h, w, a, b,
-            FFTW_BACKWARD, FFTW_ESTIMATE);
-
-    FORI(w*h) a[i] = fx[i];
-    fftwf_execute(p);
-    float scale = 1.0/(w*h);
-    FORI(w*h) {
-        float complex z = b[i] * scale;
-        ifx[i] = crealf(z);
-        if (cimagf(z) > 0.001) printf("inverse %d %f\n", i, cimagf(z));
-        //assert(cimagf(z) < 0.001);
-    }
-    fftwf_destroy_plan(p);
-    fftwf_free(a);
-    fftwf_free(b);
-    fftwf_cleanup();
-}
+#include "fftwisdom.c"
 
 
 static int idx2freq(const int N, const int i)
@@ -172,24 +127,33 @@ void zoom_zeropadding(const float* in, const int w, const int h,
         float* out, const int ow, const int oh)
 {
     // alloc temporary storage for the fft's
+    const int wc = w/2 + 1, owc = ow/2 + 1;
+    float complex *hin  = fftwf_malloc(wc*h*sizeof*hin);
     float complex *fin  = fftwf_malloc(w*h*sizeof*fin);
     float complex *fout = fftwf_malloc(ow*oh*sizeof*fout);
 
-    // fft
-    fft_2dfloat(fin,in,w,h);
+    // fft, completed by hermitian symmetry
+    fft_r2c_2dfloat(hin, (float *) in, w, h);
+    for (int j=0; j<h; j++)
+        for (int i=0; i<w; i++)
+            fin[i+j*w] = i < wc ? hin[i+j*wc] : conjf(hin[w-i+((h-j)%h)*wc]);
     //   show(fin,w,h,2);
 
     // zeropadding
     zeropadding_fourier_safe(fin, w, h, fout, ow, oh);
     //   show(fout,ow,oh,2);
 
-    // ifft
-    ifft_2dfloat(out,fout,ow,oh);
+    // ifft of the half of the output spectrum, which is hermitian
+    for (int j=0; j<oh; j++)
+        for (int i=0; i<owc; i++)
+            fout[i+j*owc] = fout[i+j*ow];
+    ifft_c2r_2dfloat(out,fout,ow,oh);
 
     // scale values
     double scale= ((double) ow*oh)/((double) w*h);
     for (int i=0; i<ow*oh; i++) out[i]*=scale;
 
+    fftwf_free(hin);
     fftwf_free(fin);
     fftwf_free(fout);
 }
@@ -57,6 +57,17 @@ def tmpfile(ext=''):
     return out
 
 
+def fftw_env():
+    """
+    returns a copy of the environment in which the fft tools save the fftw
+    wisdom of each image size in the temporary directory, to reuse it across
+    tiles
+    """
+    env = os.environ.copy()
+    env['FFTW_CACHE'] = os.path.join(cfg['temporary_dir'], 'fftw')
+    return env
+
+
 class RunFailure(Exception):
     pass
 
@@ -316,7 +327,7 @@ def image_fftconvolve(im, mtf):
     mtf and im must be the same size
     """
     out = tmpfile('.tif')
-    run('fftconvolve %s %s %s' % (mtf, im, out))
+    run('fftconvolve %s %s %s' % (mtf, im, out), fftw_env())
     return out
 
 
@@ -328,7 +339,8 @@ def image_zeropadding_from_image_with_target_size(im, image_with_target_size):
     No control of Gibbs artifacts
     """
     out = tmpfile('.tif')
-    run('zoom_zeropadding %s %s %s' % (image_with_target_size, im, out))
+    run('zoom_zeropadding %s %s %s' % (image_with_target_size, im, out),
+        fftw_env())
     return out
 
 def image_safe_zoom_fft(im, f, out=None):
@@ -350,7 +362,7 @@ def image_safe_zoom_fft(im, f, out=None):
 
     sz = image_size(im)
     # FFT doesn't play nice with infinite values, so we remove them
-    run('zoom_2d %s %s %d %d' % (im, out, sz[0]/f, sz[1]/f))
+    run('zoom_2d %s %s %d %d' % (im, out, sz[0]/f, sz[1]/f), fftw_env())
     return out
 
 def image_zoom_gdal(im, f, out=None, w=None, h=None):
@@ -459,7 +471,8 @@ def image_zoom_out_morpho(im, f):
     return out
 
 
-def image_apply_homography(out, im, H, w, h):
+def image_apply_homography(out, im, H, w, h, zoom=1, gray=False,
+                           uint16=False, mtf=None):
     """
     Applies an homography to an image.
 
@@ -468,9 +481,22 @@ def image_apply_homography(out, im, H, w, h):
         im: path to the input image file
         H: numpy array containing the 3x3 homography matrix
         w, h: dimensions (width and height) of the output image
+        zoom (optional, default 1): integer zoom out factor. When > 1, H
+            applies to the input image zoomed out by this factor. Its tiff
+            overview is used if there is one, otherwise it is zoomed out in
+            the Fourier domain as image_safe_zoom_fft does.
+        gray (optional, default False): if True, the channels of the input
+            image are averaged before applying the homography
+        uint16 (optional, default False): if True, the output is written as
+            rounded uint16 values (NaN are written as 0) instead of float
+        mtf (optional, default None): path to a MTF (see image_fftconvolve)
+            by which the input image is filtered before the homography. The
+            MTF zoomed to the size of the window and the FFTW plans are cached
+            in the temporary directory.
 
     The output image is defined on the domain [0, w] x [0, h]. Its pixels
-    intensities are defined by out(x) = im(H^{-1}(x)). 
+    intensities are defined by out(x) = im(H^{-1}(x)). Only the part of the
+    input image seen by the output is read.
     
     This function calls the homography binary, rewritten by Marc Lebrun based on
     a code of Pascal Monasse refactored by Gabriele Facciolo.
@@ -480,7 +506,15 @@ def image_apply_homography(out, im, H, w, h):
     np.savetxt(hom_file, H)
 
     # apply the homography
-    run("homography -i %s -t %s -o %s -c %d -l %d" % (im, hom_file, out, w, h))
+    cmd = "homography -i %s -t %s -o %s -c %d -l %d -z %d" % (im, hom_file, out,
+                                                              w, h, zoom)
+    if gray:
+        cmd += " -g"
+    if uint16:
+        cmd += " -u"
+    if mtf is not None:
+        cmd += " -m %s" % mtf
+    run(cmd, fftw_env())
     return
 
 
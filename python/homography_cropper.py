@@ -44,6 +44,26 @@ def crop_and_apply_homography(im_out, im_in, H, w, h, subsampling_factor=1,
     output image corresponds to coord_out in [0, w] x [0, h]. The warp is made
     by Pascal Monasse's binary named 'homography'.
     """
+    # the homography binary reads directly the window of the full image seen
+    # by the output, and its overview when subsampling (or zooms it out in the
+    # Fourier domain). It also does the conversion to gray and the
+    # unsharpening filter, so that a crop is needed only for non tif inputs
+    pix_dim = common.image_pix_dim(im_in) if im_in.lower().endswith('.tif') else 0
+    if pix_dim > 0 and int(subsampling_factor) == subsampling_factor:
+        z = int(subsampling_factor)
+        if z > 1:
+            # H becomes Z*H*Z^{-1}, and w and h are updated accordingly
+            Z = np.diag([1 / float(z), 1 / float(z), 1])
+            H = np.dot(np.dot(Z, H), np.linalg.inv(Z))
+            w = int(w / z)
+            h = int(h / z)
+        mtf = None
+        if pix_dim == 1 and z == 1 and cfg['use_pleiades_unsharpening']:
+            mtf = common.image_pleiades_unsharpening_mtf()
+        common.image_apply_homography(im_out, im_in, H, w, h, z,
+                                      gray=(pix_dim == 4 and convert_to_gray),
+                                      mtf=mtf)
+        return
 
     # crop a piece of the big input image, to which the homography will be
     # applied